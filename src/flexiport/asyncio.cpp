@@ -0,0 +1,505 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncio.h"
+#include "flexiport.h"
+#include "portset.h"
+
+#include <errno.h>
+#include <sys/time.h>
+#include <cstring>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+namespace flexiport
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reactor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// An asynchronous operation waiting to be performed, or that has completed
+typedef struct
+{
+	Port *port;
+	uint8_t *buffer;
+	size_t count;
+	size_t done;            // Bytes written so far (writes only)
+	bool write;
+	AsyncCallback *callback;
+	AsyncQueue *queue;
+	ssize_t result;
+	string error;
+} Operation;
+
+// The reactor owns a PortSet and a thread that waits on it, performing operations as their ports
+// become ready. The PortSet is only touched by the reactor thread. Operation queues are protected
+// by _mutex, which is also held while performing I/O on a port so that CancelAsync can guarantee
+// the reactor is no longer using the port when it returns.
+class Reactor
+{
+	public:
+		static Reactor* Instance ();
+
+		void Submit (Operation *op);
+		void Cancel (Port *port);
+
+	private:
+		typedef struct
+		{
+			deque<Operation*> reads;
+			deque<Operation*> writes;
+		} PortOperations;
+
+		PortSet _set;
+		pthread_t _thread;
+		pthread_mutex_t _mutex;
+		pthread_cond_t _changesApplied;
+		map<Port*, PortOperations> _operations;
+		map<Port*, unsigned int> _interest;     // Events each port is registered in the set for
+		set<Port*> _changed;                    // Ports whose registration needs updating
+		bool _waiting;                          // True while the thread is in _set.Wait ()
+
+		static Reactor *_instance;
+		static pthread_once_t _once;
+
+		Reactor ();
+		static void Create ();
+		static void* ThreadMain (void *reactor);
+
+		void Run ();
+		void ApplyChanges (list<Operation*> &completed);
+		void Perform (Port *port, unsigned int flags, list<Operation*> &completed);
+		void Fail (deque<Operation*> &ops, ssize_t result, const string &error,
+				list<Operation*> &completed);
+		void Deliver (list<Operation*> &completed);
+};
+
+Reactor *Reactor::_instance = NULL;
+pthread_once_t Reactor::_once = PTHREAD_ONCE_INIT;
+
+Reactor* Reactor::Instance ()
+{
+	pthread_once (&_once, Create);
+	if (_instance == NULL)
+		throw PortException ("Failed to start the asynchronous I/O reactor thread.");
+	return _instance;
+}
+
+void Reactor::Create ()
+{
+	// The reactor lives for the rest of the process
+	Reactor *reactor = new Reactor;
+	if (pthread_create (&reactor->_thread, NULL, ThreadMain, reactor) != 0)
+	{
+		delete reactor;
+		return;
+	}
+	pthread_detach (reactor->_thread);
+	_instance = reactor;
+}
+
+Reactor::Reactor ()
+	: _waiting (false)
+{
+	pthread_mutex_init (&_mutex, NULL);
+	pthread_cond_init (&_changesApplied, NULL);
+}
+
+void* Reactor::ThreadMain (void *reactor)
+{
+	reinterpret_cast<Reactor*> (reactor)->Run ();
+	return NULL;
+}
+
+void Reactor::Submit (Operation *op)
+{
+	pthread_mutex_lock (&_mutex);
+	PortOperations &ops = _operations[op->port];
+	if (op->write)
+		ops.writes.push_back (op);
+	else
+		ops.reads.push_back (op);
+	_changed.insert (op->port);
+	bool wake = _waiting;
+	pthread_mutex_unlock (&_mutex);
+
+	if (wake)
+		_set.Interrupt ();
+}
+
+void Reactor::Cancel (Port *port)
+{
+	pthread_mutex_lock (&_mutex);
+	map<Port*, PortOperations>::iterator ops = _operations.find (port);
+	if (ops != _operations.end ())
+	{
+		for (unsigned int ii = 0; ii < ops->second.reads.size (); ii++)
+			delete ops->second.reads[ii];
+		for (unsigned int ii = 0; ii < ops->second.writes.size (); ii++)
+			delete ops->second.writes[ii];
+		_operations.erase (ops);
+	}
+	_changed.insert (port);
+
+	if (pthread_equal (pthread_self (), _thread))
+	{
+		// Called from a callback, so the set is not being waited on
+		list<Operation*> completed;
+		ApplyChanges (completed);
+		pthread_mutex_unlock (&_mutex);
+		Deliver (completed);
+		return;
+	}
+
+	// Wait for the reactor thread to remove the port from the set, after which it will no longer
+	// touch the port
+	while (_interest.find (port) != _interest.end () || _changed.find (port) != _changed.end ())
+	{
+		if (_waiting)
+			_set.Interrupt ();
+		pthread_cond_wait (&_changesApplied, &_mutex);
+	}
+	pthread_mutex_unlock (&_mutex);
+}
+
+void Reactor::Run ()
+{
+	vector<PortSet::Ready> ready;
+	list<Operation*> completed;
+
+	pthread_mutex_lock (&_mutex);
+	while (true)
+	{
+		ApplyChanges (completed);
+		if (!completed.empty ())
+		{
+			pthread_mutex_unlock (&_mutex);
+			Deliver (completed);
+			pthread_mutex_lock (&_mutex);
+			continue;
+		}
+
+		_waiting = true;
+		pthread_mutex_unlock (&_mutex);
+		try
+		{
+			_set.Wait (ready);
+		}
+		catch (PortException &e)
+		{
+			cerr << "Reactor::" << __func__ << "() Error waiting for ports: " << e.what () << endl;
+			ready.clear ();
+		}
+		pthread_mutex_lock (&_mutex);
+		_waiting = false;
+
+		for (unsigned int ii = 0; ii < ready.size (); ii++)
+			Perform (ready[ii].port, ready[ii].flags, completed);
+
+		// Run callbacks without the lock so that they can start new operations
+		if (!completed.empty ())
+		{
+			pthread_mutex_unlock (&_mutex);
+			Deliver (completed);
+			pthread_mutex_lock (&_mutex);
+		}
+	}
+}
+
+void Reactor::ApplyChanges (list<Operation*> &completed)
+{
+	for (set<Port*>::iterator ii = _changed.begin (); ii != _changed.end (); ii++)
+	{
+		Port *port = *ii;
+		unsigned int events = 0;
+		map<Port*, PortOperations>::iterator ops = _operations.find (port);
+		if (ops != _operations.end ())
+		{
+			if (!ops->second.reads.empty ())
+				events |= PortSet::READABLE;
+			if (!ops->second.writes.empty ())
+				events |= PortSet::WRITABLE;
+			if (events == 0)
+				_operations.erase (ops);
+		}
+
+		map<Port*, unsigned int>::iterator interest = _interest.find (port);
+		try
+		{
+			if (events == 0)
+			{
+				if (interest != _interest.end ())
+				{
+					_set.Remove (port);
+					_interest.erase (interest);
+				}
+			}
+			else if (interest == _interest.end ())
+			{
+				_set.Add (port, events);
+				_interest[port] = events;
+			}
+			else if (interest->second != events)
+			{
+				_set.Modify (port, events);
+				interest->second = events;
+			}
+		}
+		catch (PortException &e)
+		{
+			// Could not register the port, so fail its operations
+			Fail (ops->second.reads, 0, e.what (), completed);
+			Fail (ops->second.writes, 0, e.what (), completed);
+			_operations.erase (ops);
+			_set.Remove (port);
+			_interest.erase (port);
+		}
+	}
+	_changed.clear ();
+	pthread_cond_broadcast (&_changesApplied);
+}
+
+void Reactor::Perform (Port *port, unsigned int flags, list<Operation*> &completed)
+{
+	map<Port*, PortOperations>::iterator ops = _operations.find (port);
+	if (ops == _operations.end ())
+		return; // Cancelled while waiting
+	_changed.insert (port);
+
+	if (flags & PortSet::CLOSED)
+	{
+		Fail (ops->second.reads, 0, "", completed);
+		Fail (ops->second.writes, 0, "", completed);
+		return;
+	}
+	if (flags & PortSet::TIMED_OUT)
+	{
+		Fail (ops->second.reads, -1, "", completed);
+		Fail (ops->second.writes, -1, "", completed);
+		return;
+	}
+
+	if ((flags & PortSet::READABLE) && !ops->second.reads.empty ())
+	{
+		Operation *op = ops->second.reads.front ();
+		ops->second.reads.pop_front ();
+		try
+		{
+			op->result = port->Read (op->buffer, op->count);
+		}
+		catch (PortException &e)
+		{
+			op->result = 0;
+			op->error = e.what ();
+		}
+		completed.push_back (op);
+	}
+
+	if ((flags & PortSet::WRITABLE) && !ops->second.writes.empty ())
+	{
+		Operation *op = ops->second.writes.front ();
+		ssize_t result = 0;
+		try
+		{
+			result = port->Write (&op->buffer[op->done], op->count - op->done);
+		}
+		catch (PortException &e)
+		{
+			op->error = e.what ();
+		}
+		if (result > 0)
+			op->done += result;
+		// Writes stay queued until all data is written or something goes wrong
+		if (op->done == op->count || result <= 0)
+		{
+			ops->second.writes.pop_front ();
+			op->result = (result < 0 && op->done == 0) ? -1 : op->done;
+			completed.push_back (op);
+		}
+	}
+}
+
+void Reactor::Fail (deque<Operation*> &ops, ssize_t result, const string &error,
+		list<Operation*> &completed)
+{
+	while (!ops.empty ())
+	{
+		Operation *op = ops.front ();
+		ops.pop_front ();
+		op->result = (op->write && op->done > 0) ? op->done : result;
+		op->error = error;
+		completed.push_back (op);
+	}
+}
+
+void Reactor::Deliver (list<Operation*> &completed)
+{
+	while (!completed.empty ())
+	{
+		Operation *op = completed.front ();
+		completed.pop_front ();
+		if (op->queue != NULL)
+			op->queue->Post (op->callback, op->port, op->buffer, op->result, op->error);
+		else
+		{
+			try
+			{
+				op->callback->Complete (op->port, op->buffer, op->result, op->error);
+			}
+			catch (std::exception &e)
+			{
+				cerr << "Reactor::" << __func__ << "() Exception from completion callback: " <<
+					e.what () << endl;
+			}
+		}
+		delete op;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// AsyncQueue
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncQueue::AsyncQueue ()
+{
+	pthread_mutex_init (&_mutex, NULL);
+	pthread_cond_init (&_posted, NULL);
+}
+
+AsyncQueue::~AsyncQueue ()
+{
+	pthread_cond_destroy (&_posted);
+	pthread_mutex_destroy (&_mutex);
+}
+
+unsigned int AsyncQueue::Dispatch (Timeout timeout)
+{
+	deque<Completion> completions;
+
+	pthread_mutex_lock (&_mutex);
+	if (_completions.empty () && !(timeout._sec == 0 && timeout._usec == 0))
+	{
+		if (timeout._sec < 0)
+		{
+			while (_completions.empty ())
+				pthread_cond_wait (&_posted, &_mutex);
+		}
+		else
+		{
+			struct timeval now;
+			struct timespec until;
+			gettimeofday (&now, NULL);
+			until.tv_sec = now.tv_sec + timeout._sec + (now.tv_usec + timeout._usec) / 1000000;
+			until.tv_nsec = ((now.tv_usec + timeout._usec) % 1000000) * 1000;
+			while (_completions.empty ())
+			{
+				if (pthread_cond_timedwait (&_posted, &_mutex, &until) == ETIMEDOUT)
+					break;
+			}
+		}
+	}
+	completions.swap (_completions);
+	pthread_mutex_unlock (&_mutex);
+
+	for (unsigned int ii = 0; ii < completions.size (); ii++)
+	{
+		completions[ii].callback->Complete (completions[ii].port, completions[ii].buffer,
+				completions[ii].result, completions[ii].error);
+	}
+	return completions.size ();
+}
+
+size_t AsyncQueue::Size () const
+{
+	pthread_mutex_lock (&_mutex);
+	size_t size = _completions.size ();
+	pthread_mutex_unlock (&_mutex);
+	return size;
+}
+
+void AsyncQueue::Post (AsyncCallback *callback, Port *port, void *buffer, ssize_t result,
+		const string &error)
+{
+	Completion completion = {callback, port, buffer, result, error};
+	pthread_mutex_lock (&_mutex);
+	_completions.push_back (completion);
+	pthread_cond_signal (&_posted);
+	pthread_mutex_unlock (&_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Port API
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Port::AsyncRead (void * const buffer, size_t count, AsyncCallback *callback,
+		AsyncQueue *queue)
+{
+	CheckPort (true);
+
+	Operation *op = new Operation;
+	op->port = this;
+	op->buffer = reinterpret_cast<uint8_t*> (buffer);
+	op->count = count;
+	op->done = 0;
+	op->write = false;
+	op->callback = callback;
+	op->queue = queue;
+	op->result = 0;
+	_asyncUsed = true;
+	Reactor::Instance ()->Submit (op);
+}
+
+void Port::AsyncWrite (const void * const buffer, size_t count, AsyncCallback *callback,
+		AsyncQueue *queue)
+{
+	CheckPort (false);
+
+	Operation *op = new Operation;
+	op->port = this;
+	op->buffer = const_cast<uint8_t*> (reinterpret_cast<const uint8_t*> (buffer));
+	op->count = count;
+	op->done = 0;
+	op->write = true;
+	op->callback = callback;
+	op->queue = queue;
+	op->result = 0;
+	_asyncUsed = true;
+	Reactor::Instance ()->Submit (op);
+}
+
+void Port::CancelAsync ()
+{
+	if (_asyncUsed)
+		Reactor::Instance ()->Cancel (this);
+}
+
+} // namespace flexiport
@@ -0,0 +1,117 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ASYNCIO_H
+#define __ASYNCIO_H
+
+#include "port.h"
+
+#include <deque>
+#include <string>
+#include <pthread.h>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief Receives the result of an asynchronous operation started with @ref Port::AsyncRead or
+@ref Port::AsyncWrite.
+
+Derive from this class and implement @ref Complete. The same object may be used for any number of
+operations. It must remain valid until all operations using it have completed or been cancelled. */
+class FLEXIPORT_EXPORT AsyncCallback
+{
+	public:
+		virtual ~AsyncCallback () {}
+
+		/** @brief Called when an operation completes.
+
+		@param port The port the operation was performed on.
+		@param buffer The buffer passed when the operation was started.
+		@param result The number of bytes read or written, -1 if the port's timeout passed before
+		the operation could complete, or 0 if the port closed. For writes, this is less than the
+		requested count only if a timeout or error occurred part-way through.
+		@param error Empty, unless an exception was thrown while performing the operation, in
+		which case it contains the exception's message and @ref result is 0. */
+		virtual void Complete (Port *port, void *buffer, ssize_t result,
+				const std::string &error) = 0;
+};
+
+/** @brief A queue of completed asynchronous operations, for running callbacks in a thread of the
+caller's choosing.
+
+Pass a queue when starting an operation and its callback will be posted to the queue when the
+operation completes, rather than called in the reactor thread. Call @ref Dispatch from the thread
+that should run the callbacks. Queues are thread safe. */
+class FLEXIPORT_EXPORT AsyncQueue
+{
+	public:
+		AsyncQueue ();
+		~AsyncQueue ();
+
+		/** @brief Run the callbacks of completed operations.
+
+		Waits up to @ref timeout for at least one operation to complete, then runs the callbacks of
+		all completed operations in the calling thread. A timeout of -1 waits forever.
+
+		@return The number of callbacks run. */
+		unsigned int Dispatch (Timeout timeout = Timeout (-1, 0));
+
+		/// @brief Get the number of completed operations waiting to be dispatched.
+		size_t Size () const;
+
+		/// @brief Add a completed operation to the queue. Used by the reactor.
+		void Post (AsyncCallback *callback, Port *port, void *buffer, ssize_t result,
+				const std::string &error);
+
+	private:
+		typedef struct
+		{
+			AsyncCallback *callback;
+			Port *port;
+			void *buffer;
+			ssize_t result;
+			std::string error;
+		} Completion;
+
+		std::deque<Completion> _completions;
+		mutable pthread_mutex_t _mutex;
+		pthread_cond_t _posted;
+
+		// Private copy constructor to prevent unintended copying.
+		AsyncQueue (const AsyncQueue&);
+		void operator= (const AsyncQueue&);
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __ASYNCIO_H
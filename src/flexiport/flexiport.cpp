@@ -29,9 +29,12 @@
 #include "port.h"
 #include "serialport.h"
 #include "tcpport.h"
+#include "tcpserverport.h"
 #include "udpport.h"
 #include "logwriterport.h"
 #include "logreaderport.h"
+#include "shmport.h"
+#include "ptyport.h"
 #include "flexiport_config.h"
 
 #include <errno.h>
@@ -110,10 +113,22 @@ Port* CreatePort (map<string, string> options)
 	if (type == "tcp")
 		return new TCPPort (options);
 #endif // FLEXIPORT_INCLUDE_TCP
+#ifdef FLEXIPORT_INCLUDE_TCPSERVER
+	if (type == "tcpserver")
+		return new TCPServerPort (options);
+#endif // FLEXIPORT_INCLUDE_TCPSERVER
 #ifdef FLEXIPORT_INCLUDE_UDP
 	if (type == "udp")
 		return new UDPPort (options);
 #endif // FLEXIPORT_INCLUDE_UDP
+#ifdef FLEXIPORT_INCLUDE_SHM
+	if (type == "shm")
+		return new ShmPort (options);
+#endif // FLEXIPORT_INCLUDE_SHM
+#ifdef FLEXIPORT_INCLUDE_PTY
+	if (type == "pty")
+		return new PTYPort (options);
+#endif // FLEXIPORT_INCLUDE_PTY
 
 #ifdef FLEXIPORT_INCLUDE_LOGGING
 	if (type == "logreader")
@@ -31,13 +31,23 @@
 #if defined (WIN32)
 	typedef unsigned char           uint8_t;
 	typedef unsigned int            uint32_t;
+	typedef int                     int32_t;
+	typedef __int64                 int64_t;
+	typedef unsigned __int64        uint64_t;
 	#if defined (_WIN64)
 		typedef __int64                 ssize_t;
 	#else
 		typedef _W64 int                ssize_t;
 	#endif
+	// Scatter/gather buffer descriptor, as used by readv () and writev ()
+	struct iovec
+	{
+		void *iov_base;
+		size_t iov_len;
+	};
 #else
 	#include <stdint.h>
+	#include <sys/uio.h>
 #endif
 
 #endif // __FLEXIPORT_TYPES_H
@@ -35,17 +35,28 @@
 	#include <unistd.h>
 #endif
 #include <stdio.h>
+#if !defined (WIN32)
+	#include <sys/mman.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <iomanip>
+#include <new>
 #include <sstream>
 #include <iostream>
 using namespace std;
 
+#if defined (FLEXIPORT_HAVE_ZLIB)
+	#include <zlib.h>
+#endif
+
 #if defined (WIN32)
 	#define __func__        __FUNCTION__
 	#define timeradd(a, b, result)                           \
@@ -99,22 +110,116 @@ inline string StrError (int errNo)
 // the data length.
 const size_t CHUNK_HEADER_SIZE = (sizeof (uint32_t) * 2) + sizeof (uint32_t);
 
+// Compressed log files start with a header: "FPLG", the format version and the compression used.
+// The chunks follow in blocks, each with a header giving the size of the block's chunks and the
+// size of the compressed data. Files without the header are a plain sequence of chunks.
+const char LOG_MAGIC[4] = {'F', 'P', 'L', 'G'};
+const uint32_t LOG_FORMAT_VERSION = 2;
+const size_t FILE_HEADER_SIZE = sizeof (LOG_MAGIC) + (sizeof (uint32_t) * 2);
+const uint32_t COMPRESSION_NONE = 0;
+const uint32_t COMPRESSION_ZLIB = 1;
+const size_t BLOCK_HEADER_SIZE = sizeof (uint32_t) * 2;
+// Amount of data collected into each block when not writing in the background
+const size_t COMPRESSED_BLOCK_SIZE = 65536;
+
+// zlib can't compress data to less than about a thousandth of its size, so a block header claiming
+// more than that is damaged
+const size_t MAX_COMPRESSION_RATIO = 1032;
+
+// Index files hold the block and chunk headers of one segment, so that it can be read without
+// walking through it. They start with "FPIX", the index format version, and the size,
+// modification time (seconds and nanoseconds) and compression of the segment they were made from.
+// A segment rewritten within the same second as its index was made is only told apart by the
+// nanoseconds, so both are checked along with the size. The block table follows
+// (offset, size, uncompressed size and number of chunks of each block), then the chunk table (time
+// stamp and size of each chunk). Chunk offsets aren't stored: the chunks follow each other through
+// the segment, or through each block.
+const char INDEX_MAGIC[4] = {'F', 'P', 'I', 'X'};
+const uint32_t INDEX_FORMAT_VERSION = 2;
+const size_t INDEX_HEADER_SIZE = sizeof (INDEX_MAGIC) + (sizeof (uint32_t) * 4) +
+		(sizeof (uint64_t) * 3);
+const size_t INDEX_BLOCK_SIZE = sizeof (uint64_t) + (sizeof (uint32_t) * 3);
+const size_t INDEX_CHUNK_SIZE = sizeof (uint32_t) * 3;
+// Problems recorded for each segment when indexing; any more are only counted
+const size_t MAX_PROBLEMS = 20;
+
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+// Longest time logged data waits in memory before the writer thread writes it
+const struct timeval WRITER_INTERVAL = {0, 100000};
+#endif
+
+// Fixed size values in log and index files are stored in network byte order, and may not be aligned
+inline uint32_t GetUint32 (const uint8_t *source)
+{
+	uint32_t value;
+	memcpy (&value, source, sizeof (value));
+	return ntohl (value);
+}
+
+inline uint64_t GetUint64 (const uint8_t *source)
+{
+	return (static_cast<uint64_t> (GetUint32 (source)) << 32) |
+		GetUint32 (&source[sizeof (uint32_t)]);
+}
+
+inline void PutUint32 (vector<uint8_t> &dest, uint32_t value)
+{
+	value = htonl (value);
+	const uint8_t *bytes = reinterpret_cast<const uint8_t*> (&value);
+	dest.insert (dest.end (), bytes, bytes + sizeof (value));
+}
+
+inline void PutUint64 (vector<uint8_t> &dest, uint64_t value)
+{
+	PutUint32 (dest, static_cast<uint32_t> (value >> 32));
+	PutUint32 (dest, static_cast<uint32_t> (value));
+}
+
+// Multiply a time by factor, for changing between real time and file time
+inline void ScaleTime (const struct timeval &time, double factor, struct timeval &dest)
+{
+	if (factor == 1.0)
+	{
+		dest = time;
+		return;
+	}
+	double usecs = (static_cast<double> (time.tv_sec) * 1000000.0 + time.tv_usec) * factor;
+	double secs = floor (usecs / 1000000.0);
+	dest.tv_sec = static_cast<long> (secs);
+	dest.tv_usec = static_cast<long> (usecs - secs * 1000000.0);
+	if (dest.tv_usec >= 1000000)
+	{
+		dest.tv_sec++;
+		dest.tv_usec -= 1000000;
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Constructor/destructor
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 LogFile::LogFile (unsigned int debug)
-	: _read (false), _readFile (NULL), _writeFile (NULL), _readFileSize (0), _writeFileSize (0),
-	_debug (debug), _readUsage (0), _writeUsage (0), _readSize (0), _writeSize (0),
-	_readBuffer (NULL), _writeBuffer (NULL), _ignoreTimes (false)
+	: _read (false), _segmentSize (0), _debug (debug), _ignoreTimes (false), _rate (1.0),
+	_lockStep (false), _compress (false), _writeBufferSize (0), _dropWhenFull (false),
+	_droppedChunks (0)
 {
 	timerclear (&_openTime);
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	_writerRunning = false;
+	_stopWriter = false;
+	_flushWriter = false;
+	pthread_mutex_init (&_queueMutex, NULL);
+	pthread_cond_init (&_queueChanged, NULL);
+#endif
 }
 
 LogFile::~LogFile ()
 {
 	Close ();
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	pthread_cond_destroy (&_queueChanged);
+	pthread_mutex_destroy (&_queueMutex);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -137,40 +242,25 @@ void LogFile::Open (string fileName, bool read, bool ignoreTimes)
 
 	if (_read)
 	{
-		if ((_readFile = fopen ((fileName + "r").c_str (), "rb")) == NULL)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fopen(_readFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		if ((_writeFile = fopen ((fileName + "w").c_str (), "rb")) == NULL)
+		// Map both files and index their chunks; from here on reading is done from memory
+		MapLog (fileName + "r", _readLog);
+		MapLog (fileName + "w", _writeLog);
+		if (_debug >= 2)
 		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fopen(_writeFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
+			cerr << "LogFile::" << __func__ << "() Found " << _readLog.chunks.size () <<
+				" read chunks and " << _writeLog.chunks.size () << " write chunks." << endl;
 		}
-		// Get the file sizes for open checks
-		_readFileSize = GetFileSize (_readFile);
-		_writeFileSize = GetFileSize (_writeFile);
 	}
 	else
 	{
-		if ((_readFile = fopen ((fileName + "r").c_str (), "wb")) == NULL)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fopen(_readFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		if ((_writeFile = fopen ((fileName + "w").c_str (), "wb")) == NULL)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fopen(_writeFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
+		OpenOutput (_readOutput, fileName + "r");
+		OpenOutput (_writeOutput, fileName + "w");
+		// Chunk time stamps are relative to now, until the file is reset
+		GetWallTime (_openTime);
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		if (_writeBufferSize > 0)
+			StartWriter ();
+#endif
 	}
 
 	if (_debug >= 1)
@@ -182,115 +272,153 @@ void LogFile::Open (string fileName, bool read, bool ignoreTimes)
 
 void LogFile::Close ()
 {
-	if (_readFile != NULL)
-	{
-		if (fclose (_readFile) == EOF)
-		{
-			_readFile = NULL;
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fclose(_readFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		_readFile = NULL;
-	}
-	if (_writeFile != NULL)
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	// Finish writing everything queued before closing the files
+	StopWriter ();
+#endif
+	WritePendingBlocks ();
+	CloseOutput (_readOutput);
+	CloseOutput (_writeOutput);
+	UnmapLog (_readLog);
+	UnmapLog (_writeLog);
+
+	FreeOverflow (_readOverflow);
+	FreeOverflow (_writeOverflow);
+	vector<uint8_t> ().swap (_checkData);
+
+	if (_debug >= 1)
+		cerr << "LogFile::" << __func__ << "() Closed file." << endl;
+}
+
+bool LogFile::IsOpen () const
+{
+	if (_read)
 	{
-		if (fclose (_writeFile) == EOF)
-		{
-			_writeFile = NULL;
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fclose(_writeFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		_writeFile = NULL;
+		// A log being read is open until all of its read data has been used. Running out of write
+		// chunks is left to the write checks to catch.
+		return _readLog.next < _readLog.chunks.size () || _readOverflow.used > 0;
 	}
 
-	if (_readBuffer != NULL)
+	return _readOutput.file != NULL && _writeOutput.file != NULL;
+}
+
+void LogFile::ResetFile ()
+{
+	if (_read)
 	{
-		free (_readBuffer);
-		_readBuffer = NULL;
+		// Rewind to the first chunks
+		_readLog.next = 0;
+		_writeLog.next = 0;
 	}
-	if (_writeBuffer != NULL)
+	else
 	{
-		free (_writeBuffer);
-		_writeBuffer = NULL;
+		// Start the files again from their first segments, once everything queued has been
+		// written
+		WaitForWriter ();
+		WritePendingBlocks ();
+		CloseOutput (_readOutput);
+		CloseOutput (_writeOutput);
+		OpenOutput (_readOutput, _fileName + "r");
+		OpenOutput (_writeOutput, _fileName + "w");
 	}
 
+	// Free buffers
+	ClearOverflow (_readOverflow);
+	ClearOverflow (_writeOverflow);
+
+	// Reset file open time
+	GetWallTime (_openTime);
+
 	if (_debug >= 1)
-		cerr << "LogFile::" << __func__ << "() Closed file." << endl;
+		cerr << "LogFile::" << __func__ << "() Reset file." << endl;
 }
 
-bool LogFile::IsOpen () const
+void LogFile::SeekToTime (const struct timeval &fileTime)
 {
-	if (_readFile == NULL || _writeFile == NULL)
-		return false;
-
-	long pos;
-	if ((pos = ftell (_readFile)) < 0)
+	if (!_read)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		throw PortException (string ("LogFile::") + __func__ +
+				string ("() Cannot seek in write log file."));
 	}
-	if (pos == _readFileSize)
-		return false;
 
-	if ((pos = ftell (_writeFile)) < 0)
+	// Move both files to the first chunk at or after the time, and make it the current file time
+	_readLog.next = FindChunk (_readLog, fileTime);
+	_writeLog.next = FindChunk (_writeLog, fileTime);
+	ClearOverflow (_readOverflow);
+	ClearOverflow (_writeOverflow);
+	SetFileTime (fileTime);
+
+	if (_debug >= 1)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		cerr << "LogFile::" << __func__ << "() Moved to " << fileTime.tv_sec << "s " <<
+			fileTime.tv_usec << "us: read chunk " << _readLog.next << ", write chunk " <<
+			_writeLog.next << "." << endl;
 	}
-	if (pos == _writeFileSize)
-		return false;
+}
 
-	return true;
+const uint8_t* LogFile::GetReadChunk (size_t chunk, struct timeval &timeStamp, size_t &size)
+{
+	return GetChunk (_readLog, chunk, timeStamp, size);
 }
 
-void LogFile::ResetFile ()
+const uint8_t* LogFile::GetWriteChunk (size_t chunk, struct timeval &timeStamp, size_t &size)
+{
+	return GetChunk (_writeLog, chunk, timeStamp, size);
+}
+
+void LogFile::SeekToChunk (size_t chunk)
 {
-	// Rewind file positions
-	if (fseek (_readFile, 0, SEEK_SET) < 0)
+	if (!_read)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek(_readFile) error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		throw PortException (string ("LogFile::") + __func__ +
+				string ("() Cannot seek in write log file."));
 	}
-	if (fseek (_writeFile, 0, SEEK_SET) < 0)
+	if (chunk >= _readLog.chunks.size ())
 	{
 		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek(_writeFile) error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
+		ss << "LogFile::" << __func__ << "() Chunk " << chunk << " is past the end of the file (" <<
+			_readLog.chunks.size () << " chunks).";
 		throw PortException (ss.str ());
 	}
 
-	// Free buffers
-	DeallocateReadBuffer ();
-	DeallocateWriteBuffer ();
+	// The write file goes to the first write after the chunk's time
+	const struct timeval &fileTime = _readLog.chunks[chunk].timeStamp;
+	_readLog.next = chunk;
+	_writeLog.next = FindChunk (_writeLog, fileTime);
+	ClearOverflow (_readOverflow);
+	ClearOverflow (_writeOverflow);
+	SetFileTime (fileTime);
 
-	// Reset file open time
-#if defined (WIN32)
-	SYSTEMTIME sysTime;
-	GetSystemTime (&sysTime);
-	_openTime.tv_sec = sysTime.wSecond;
-	_openTime.tv_usec = sysTime.wMilliseconds * 1000;
-#else
-	if (gettimeofday (&_openTime, NULL) < 0)
+	if (_debug >= 1)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() gettimeofday() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		cerr << "LogFile::" << __func__ << "() Moved to read chunk " << _readLog.next <<
+			", write chunk " << _writeLog.next << " at " << fileTime.tv_sec << "s " <<
+			fileTime.tv_usec << "us." << endl;
 	}
-#endif
+}
 
-	if (_debug >= 1)
-		cerr << "LogFile::" << __func__ << "() Reset file." << endl;
+void LogFile::SetRate (double rate)
+{
+	if (rate <= 0.0)
+		throw PortException (string ("LogFile::") + __func__ + string ("() Bad replay rate."));
+
+	// Carry on from the same file time at the new rate
+	struct timeval now;
+	GetCurrentFileTime (now);
+	_rate = rate;
+	SetFileTime (now);
+}
+
+void LogFile::SetLockStep (bool lockStep)
+{
+	if (lockStep == _lockStep)
+		return;
+
+	// Carry on from the same file time; lock-step mode has a time of its own
+	struct timeval now;
+	GetCurrentFileTime (now);
+	_lockStep = lockStep;
+	SetFileTime (now);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -301,60 +429,40 @@ ssize_t LogFile::Read (void *data, size_t count, Timeout &timeout)
 {
 	size_t totalRead = 0;
 
-	// Get the current file time
-	struct timeval now;
-	GetCurrentFileTime (now);
-
 	if (_debug >= 2)
 		cerr << "LogFile::" << __func__ << "() Reading up to " << count << " bytes." << endl;
 
 	// First copy any data in the overflow buffer
-	if (_readUsage > 0)
+	if (_readOverflow.used > 0)
 	{
 		if (_debug >= 2)
 		{
-			cerr << "LogFile::" << __func__ << "() Getting " << _readUsage <<
+			cerr << "LogFile::" << __func__ << "() Getting " << _readOverflow.used <<
 				" bytes from overflow buffer." << endl;
 		}
 
-		size_t toCopy = (count < _readUsage) ? count : _readUsage;
-		memcpy (data, _readBuffer, toCopy);
-		totalRead += toCopy;
-		// Check if we've used up the stuff in the buffer
-		if (count < _readUsage)
-		{
-			// Shift the remaining data in the overflow buffer to the beginning
-			memmove (_readBuffer, &(reinterpret_cast<uint8_t*> (_readBuffer)[count]),
-					_readUsage - count);
-			_readUsage -= count;
-			// Have all the data we need, return
-			return count;
-		}
-		else if (count == _readUsage)
-		{
-			DeallocateReadBuffer ();
-			// Have all the data we need, return
+		totalRead = PopOverflow (_readOverflow, data, count);
+		// Have all the data we need, return
+		if (totalRead == count)
 			return count;
-		}
-		else // count > _readUsage
-		{
-			DeallocateReadBuffer ();
-			// We haven't met count yet
-			count -= _readUsage;
-			data = reinterpret_cast<uint8_t*> (data) + _readUsage;
-		}
+		// We haven't met count yet
+		count -= totalRead;
+		data = reinterpret_cast<uint8_t*> (data) + totalRead;
 	}
 
+	// Get the current file time
+	struct timeval now;
+	GetCurrentFileTime (now);
+
 	// Now get data from the file
 	if (_ignoreTimes)
 	{
 		// Read chunks until we have enough data
-		while (count > 0 && IsOpen ())
+		while (count > 0 && _readLog.next < _readLog.chunks.size ())
 		{
 			struct timeval timestamp;
 			size_t size, read;
-			read = GetSingleChunk (_readFile, &(reinterpret_cast<uint8_t*> (data)[count]), count,
-									timestamp, size);
+			read = GetSingleChunk (_readLog, data, count, timestamp, size);
 			count -= read;
 			data = reinterpret_cast<uint8_t*> (data) + read;
 			totalRead += read;
@@ -364,15 +472,28 @@ ssize_t LogFile::Read (void *data, size_t count, Timeout &timeout)
 	else
 	{
 		// Have to pay attention to time stamps (annoying and messy)
-		if (DataAvailableWithinLimit (_readFile, now))
+		if (DataAvailableWithinLimit (_readLog, now))
 		{
 			if (_debug >= 2)
 				cerr << "LogFile::" << __func__ << "() Data available in file now." << endl;
 
 			// Get all the data that is immediatly available and return it
-			totalRead += GetChunksToTimeLimit (_readFile, data, count, now);
+			totalRead += GetChunksToTimeLimit (_readLog, data, count, now);
+			return totalRead;
+		}
+		else if (totalRead > 0)
+		{
+			// Don't wait for more when the overflow buffer had some
 			return totalRead;
 		}
+		else if (_lockStep)
+		{
+			// Nothing more will be available until the next write has been made, so waiting
+			// would be forever
+			if (_debug >= 2)
+				cerr << "LogFile::" << __func__ << "() Waiting for a write." << endl;
+			return (_readLog.next < _readLog.chunks.size ()) ? -1 : 0;
+		}
 
 		// There was no data instantly, so now the timeout gets involved
 		if (timeout._sec == -1)
@@ -381,37 +502,11 @@ ssize_t LogFile::Read (void *data, size_t count, Timeout &timeout)
 			if (_debug >= 2)
 				cerr << "LogFile::" << __func__ << "() Getting next chunk, no timeout." << endl;
 
-			// Get the next available chunk from the file
+			// Get the next available chunk from the file and wait until its time stamp
 			struct timeval timestamp;
 			size_t size;
-			totalRead += GetSingleChunk (_readFile, data, count, timestamp, size);
-
-			// Calculate the time difference between now and this chunk's timestamp
-			struct timeval diff;
-			GetCurrentFileTime (now);
-			timersub (&timestamp, &now, &diff);
-			if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-			{
-				// Sleep for this period of time
-				struct timespec diff2;
-				diff2.tv_sec = diff.tv_sec;
-				diff2.tv_nsec = diff.tv_usec * 1000;
-				if (_debug >= 2)
-				{
-					cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
-						diff2.tv_nsec << "ns." << endl;
-				}
-#if defined (WIN32)
-				DWORD sleepTime = 0;
-				if (diff2.tv_sec > 0)
-					sleepTime += diff2.tv_sec * 1000;
-				if (diff2.tv_nsec > 0)
-					sleepTime += diff2.tv_nsec / 1000000;
-				Sleep (sleepTime);
-#else
-				nanosleep (&diff2, NULL);
-#endif
-			}
+			totalRead += GetSingleChunk (_readLog, data, count, timestamp, size);
+			SleepUntilFileTime (timestamp);
 			return totalRead;
 		}
 		else if (timeout._sec > 0 || timeout._usec > 0)
@@ -421,43 +516,15 @@ ssize_t LogFile::Read (void *data, size_t count, Timeout &timeout)
 				cerr << "LogFile::" << __func__ << "() Getting next chunk with timeout." << endl;
 
 			// Check if there is actually data available within this time limit
-			struct timeval timeoutVal, limit;
-			timeout.AsTimeval (timeoutVal);
-			GetCurrentFileTime (now);
-			timeradd (&now, &timeoutVal, &limit);
-			if (DataAvailableWithinLimit (_readFile, limit))
+			struct timeval limit;
+			GetTimeLimit (timeout, limit);
+			if (DataAvailableWithinLimit (_readLog, limit))
 			{
 				// There is so get it
 				struct timeval timestamp;
 				size_t size;
-				totalRead += GetSingleChunk (_readFile, data, count, timestamp, size);
-
-				// Calculate the time difference between now and this chunk's timestamp
-				struct timeval diff;
-				GetCurrentFileTime (now);
-				timersub (&timestamp, &now, &diff);
-				if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-				{
-					// Sleep for this period of time
-					struct timespec diff2;
-					diff2.tv_sec = diff.tv_sec;
-					diff2.tv_nsec = diff.tv_usec * 1000;
-					if (_debug >= 2)
-					{
-						cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
-							diff2.tv_nsec << "ns." << endl;
-					}
-#if defined (WIN32)
-					DWORD sleepTime = 0;
-					if (diff2.tv_sec > 0)
-						sleepTime += diff2.tv_sec * 1000;
-					if (diff2.tv_nsec > 0)
-						sleepTime += diff2.tv_nsec / 1000000;
-					Sleep (sleepTime);
-#else
-					nanosleep (&diff2, NULL);
-#endif
-				}
+				totalRead += GetSingleChunk (_readLog, data, count, timestamp, size);
+				SleepUntilFileTime (timestamp);
 				return totalRead;
 			}
 			else
@@ -482,8 +549,13 @@ ssize_t LogFile::BytesAvailable (const Timeout &timeout)
 {
 	if (_ignoreTimes)
 	{
-		// Don't care about times, so just get the file size.
-		return GetFileSize (_readFile);
+		// Don't care about times, so everything left in the file is available
+		size_t remaining = _readLog.dataSize;
+		if (_readLog.next < _readLog.chunks.size ())
+			remaining -= _readLog.chunks[_readLog.next].dataBefore;
+		else
+			remaining = 0;
+		return _readOverflow.used + remaining;
 	}
 	else
 	{
@@ -492,19 +564,26 @@ ssize_t LogFile::BytesAvailable (const Timeout &timeout)
 		GetCurrentFileTime (now);
 
 		// Now count data from the file
-		if (DataAvailableWithinLimit (_readFile, now))
+		if (DataAvailableWithinLimit (_readLog, now))
 		{
 			if (_debug >= 2)
 				cerr << "LogFile::" << __func__ << "() Enough data available in file now." << endl;
 			// Data available immediately, return its size plus the size of the overflow buffer
-			return _readUsage + GetChunkSizesToTimeLimit (_readFile, now);
+			return _readOverflow.used + GetChunkSizesToTimeLimit (_readLog, now);
 		}
-		else if (_readUsage > 0)
+		else if (_readOverflow.used > 0)
 		{
 			if (_debug >= 2)
 				cerr << "LogFile::" << __func__ << "() Only data in overflow buffer." << endl;
 			// No data from file, but there is data in the overflow buffer, so that will do
-			return _readUsage;
+			return _readOverflow.used;
+		}
+		else if (_lockStep)
+		{
+			// Nothing more will be available until the next write has been made
+			if (_debug >= 2)
+				cerr << "LogFile::" << __func__ << "() Waiting for a write." << endl;
+			return -1;
 		}
 
 		// There was no data instantly, so now the timeout gets involved
@@ -514,37 +593,12 @@ ssize_t LogFile::BytesAvailable (const Timeout &timeout)
 			if (_debug >= 2)
 				cerr << "LogFile::" << __func__ << "() Getting next chunk, no timeout." << endl;
 
-			// Get the next available chunk from the file
+			// Wait until the next chunk's time stamp
 			struct timeval timeStamp;
 			size_t size;
-			GetNextChunkInfo (_readFile, timeStamp, size);
-
-			// Calculate the time difference between now and this chunk's timestamp
-			struct timeval diff;
-			GetCurrentFileTime (now);
-			timersub (&timeStamp, &now, &diff);
-			if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-			{
-				// Sleep for this period of time
-				struct timespec diff2;
-				diff2.tv_sec = diff.tv_sec;
-				diff2.tv_nsec = diff.tv_usec * 1000;
-				if (_debug >= 2)
-				{
-					cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
-						diff2.tv_nsec << "ns." << endl;
-				}
-#if defined (WIN32)
-				DWORD sleepTime = 0;
-				if (diff2.tv_sec > 0)
-					sleepTime += diff2.tv_sec * 1000;
-				if (diff2.tv_nsec > 0)
-					sleepTime += diff2.tv_nsec / 1000000;
-				Sleep (sleepTime);
-#else
-				nanosleep (&diff2, NULL);
-#endif
-			}
+			if (!GetNextChunkInfo (_readLog, timeStamp, size))
+				return 0;
+			SleepUntilFileTime (timeStamp);
 			return size;
 		}
 		else if (timeout._sec > 0 || timeout._usec > 0)
@@ -554,43 +608,15 @@ ssize_t LogFile::BytesAvailable (const Timeout &timeout)
 				cerr << "LogFile::" << __func__ << "() Getting next chunk with timeout." << endl;
 
 			// Check if there is actually data available within this time limit
-			struct timeval timeoutVal, limit;
-			timeout.AsTimeval (timeoutVal);
-			GetCurrentFileTime (now);
-			timeradd (&now, &timeoutVal, &limit);
-			if (DataAvailableWithinLimit (_readFile, limit))
+			struct timeval limit;
+			GetTimeLimit (timeout, limit);
+			if (DataAvailableWithinLimit (_readLog, limit))
 			{
-				// There is so get it
+				// There is so wait for it
 				struct timeval timeStamp;
 				size_t size;
-				GetNextChunkInfo (_readFile, timeStamp, size);
-
-				// Calculate the time difference between now and this chunk's timestamp
-				struct timeval diff;
-				GetCurrentFileTime (now);
-				timersub (&timeStamp, &now, &diff);
-				if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-				{
-					// Sleep for this period of time
-					struct timespec diff2;
-					diff2.tv_sec = diff.tv_sec;
-					diff2.tv_nsec = diff.tv_usec * 1000;
-					if (_debug >= 2)
-					{
-						cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
-							diff2.tv_nsec << "ns." << endl;
-					}
-#if defined (WIN32)
-					DWORD sleepTime = 0;
-					if (diff2.tv_sec > 0)
-						sleepTime += diff2.tv_sec * 1000;
-					if (diff2.tv_nsec > 0)
-						sleepTime += diff2.tv_nsec / 1000000;
-					Sleep (sleepTime);
-#else
-					nanosleep (&diff2, NULL);
-#endif
-				}
+				GetNextChunkInfo (_readLog, timeStamp, size);
+				SleepUntilFileTime (timeStamp);
 				return size;
 			}
 			else
@@ -615,15 +641,6 @@ bool LogFile::CheckWrite (const void * const data, const size_t count, size_t *
 				const Timeout * const timeout)
 {
 	size_t totalRead = 0;
-	long readFileOffset;
-	// Get the current read file offset (see comment at function end)
-	if ((readFileOffset = ftell (_readFile)) < 0)
-	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
-	}
 
 	if (_debug >= 2)
 	{
@@ -632,56 +649,34 @@ bool LogFile::CheckWrite (const void * const data, const size_t count, size_t *
 			"be used." << endl;
 	}
 
-	// Allocate space to store the data to compare with
-	uint8_t *fileData;
-	fileData = new uint8_t[count];
+	// Space to store the data to compare with, kept between checks
+	if (_checkData.size () < count)
+		_checkData.resize (count);
+	uint8_t *fileData = _checkData.empty () ? NULL : &_checkData[0];
 
 	// Pull any data out of the overflow first
-	bool needMore = true;
-	if (_writeUsage > 0)
+	if (_writeOverflow.used > 0)
 	{
 		if (_debug >= 2)
 		{
-			cerr << "LogFile::" << __func__ << "() Getting " << _writeUsage <<
+			cerr << "LogFile::" << __func__ << "() Getting " << _writeOverflow.used <<
 				" bytes from overflow buffer." << endl;
 		}
 
-		size_t toCopy = (count < _writeUsage) ? count : _writeUsage;
-		memcpy (fileData, _writeBuffer, toCopy);
-		totalRead += toCopy;
-		// Check if we've used up the stuff in the buffer
-		if (count < _writeUsage)
-		{
-			// Shift the remaining data in the buffer to the beginning
-			memmove (_writeBuffer, &(reinterpret_cast<uint8_t*> (_writeBuffer)[count]),
-					_writeUsage - count);
-			_writeUsage -= count;
-			// Have all the data we need
-			needMore = false;
-		}
-		else if (count == _writeUsage)
-		{
-			DeallocateWriteBuffer ();
-			// Have all the data we need
-			needMore = false;
-		}
-		else // count > _writeUsage
-		{
-			DeallocateWriteBuffer ();
-			// We haven't met count yet so get the rest from the file
-		}
+		totalRead = PopOverflow (_writeOverflow, fileData, count);
 	}
 
-	if (needMore)
+	// If we haven't met count yet, get the rest from the file
+	if (totalRead < count)
 	{
-		if (timeout == NULL || _ignoreTimes)
+		if (timeout == NULL || _ignoreTimes || _lockStep)
 		{
 			// Don't care about times, so just get data and compare
-			while (totalRead < count && IsOpen ())
+			while (totalRead < count && _writeLog.next < _writeLog.chunks.size ())
 			{
 				struct timeval timestamp;
 				size_t size, read;
-				read = GetSingleChunk (_writeFile, &fileData[totalRead], count - totalRead,
+				read = GetSingleChunk (_writeLog, &fileData[totalRead], count - totalRead,
 										timestamp, size);
 				totalRead += read;
 			}
@@ -696,81 +691,27 @@ bool LogFile::CheckWrite (const void * const data, const size_t count, size_t *
 				// Get the next available chunk from the file
 				struct timeval timestamp;
 				size_t size, read;
-				read = GetSingleChunk (_writeFile, &fileData[totalRead], count - totalRead,
+				read = GetSingleChunk (_writeLog, &fileData[totalRead], count - totalRead,
 										timestamp, size);
 				totalRead += read;
-
-				// Calculate the time difference between now and this chunk's timestamp
-				struct timeval diff, now;
-				GetCurrentFileTime (now);
-				timersub (&timestamp, &now, &diff);
-				if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-				{
-					// Sleep for this period of time
-					struct timespec diff2;
-					diff2.tv_sec = diff.tv_sec;
-					diff2.tv_nsec = diff.tv_usec * 1000;
-					if (_debug >= 2)
-					{
-						cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
-							diff2.tv_nsec << "ns." << endl;
-					}
-#if defined (WIN32)
-					DWORD sleepTime = 0;
-					if (diff2.tv_sec > 0)
-						sleepTime += diff2.tv_sec * 1000;
-					if (diff2.tv_nsec > 0)
-						sleepTime += diff2.tv_nsec / 1000000;
-					Sleep (sleepTime);
-#else
-					nanosleep (&diff2, NULL);
-#endif
-				}
+				SleepUntilFileTime (timestamp);
 			}
 			else if (timeout->_sec > 0 || timeout->_usec > 0)
 			{
 				// Limited timeout
 
 				// Check if there is actually data available within this time limit
-				struct timeval now, timeoutVal, limit;
-				timeout->AsTimeval (timeoutVal);
-				GetCurrentFileTime (now);
-				timeradd (&now, &timeoutVal, &limit);
-				if (DataAvailableWithinLimit (_writeFile, limit))
+				struct timeval limit;
+				GetTimeLimit (*timeout, limit);
+				if (DataAvailableWithinLimit (_writeLog, limit))
 				{
 					// There is so get it
 					struct timeval timestamp;
 					size_t size, read;
-					read = GetSingleChunk (_writeFile, &fileData[totalRead], count - totalRead,
+					read = GetSingleChunk (_writeLog, &fileData[totalRead], count - totalRead,
 											timestamp, size);
 					totalRead += read;
-
-					// Calculate the time difference between now and this chunk's timestamp
-					struct timeval diff;
-					GetCurrentFileTime (now);
-					timersub (&timestamp, &now, &diff);
-					if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
-					{
-						// Sleep for this period of time
-						struct timespec diff2;
-						diff2.tv_sec = diff.tv_sec;
-						diff2.tv_nsec = diff.tv_usec * 1000;
-						if (_debug >= 2)
-						{
-							cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec <<
-								"s " << diff2.tv_nsec << "ns." << endl;
-						}
-#if defined (WIN32)
-						DWORD sleepTime = 0;
-						if (diff2.tv_sec > 0)
-							sleepTime += diff2.tv_sec * 1000;
-						if (diff2.tv_nsec > 0)
-							sleepTime += diff2.tv_nsec / 1000000;
-						Sleep (sleepTime);
-#else
-						nanosleep (&diff2, NULL);
-#endif
-					}
+					SleepUntilFileTime (timestamp);
 				}
 				// else no data available
 			}
@@ -788,32 +729,6 @@ bool LogFile::CheckWrite (const void * const data, const size_t count, size_t *
 	else
 		result = true;
 
-	// One final thing to do: it's possible that the write file has reached its end and so been
-	// closed. This means that any attempts to read the response to the write will now fail. To
-	// prevent this, reopen the files and re-position the read file's offset to where it was. Any
-	// writes after this would have choked anyway since the file is at an end so moving the write
-	// file to 1 byte before the end is unlikely to cause any problems, while still registering as
-	// an open file.
-	if (!IsOpen ())
-	{
-		Open (_fileName, _read, _ignoreTimes);
-		if (fseek (_readFile, readFileOffset, SEEK_SET) < 0)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fseek(_readFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		if (fseek (_writeFile, -1, SEEK_END) < 0)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fseek(_writeFile) error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-	}
-
-	delete[] fileData;
 	*numWritten = totalRead;
 	return result;
 }
@@ -821,32 +736,19 @@ bool LogFile::CheckWrite (const void * const data, const size_t count, size_t *
 void LogFile::Flush ()
 {
 	// Dump the read overflow buffer
-	DeallocateWriteBuffer();
+	ClearOverflow (_readOverflow);
 
 	// If there is data available in the read file, skip passed it
-	struct timeval now, timeStamp;
-	size_t size;
+	struct timeval now;
 	GetCurrentFileTime (now);
-	if (DataAvailableWithinLimit (_readFile, now))
+	while (DataAvailableWithinLimit (_readLog, now))
 	{
-		GetNextChunkInfo (_readFile, timeStamp, size);
-		do
+		if (_debug >= 2)
 		{
-			if (_debug >= 2)
-			{
-				cerr << "LogFile::" << __func__ << "() Skipping " << CHUNK_HEADER_SIZE + size <<
-					"bytes in _readFile." << endl;
-			}
-			if (fseek (_readFile, CHUNK_HEADER_SIZE + size, SEEK_CUR) < 0)
-			{
-				stringstream ss;
-				ss << "LogFile::" << __func__ << "() fseek(_readFile) error: (" << ErrNo () <<
-					") " << StrError (ErrNo ());
-				throw PortException (ss.str ());
-			}
-			GetNextChunkInfo (_readFile, timeStamp, size);
+			cerr << "LogFile::" << __func__ << "() Skipping " <<
+				_readLog.chunks[_readLog.next].size << " bytes in the read file." << endl;
 		}
-		while (!(timercmp (&timeStamp, &now, >)) && IsOpen ());
+		_readLog.next++;
 	}
 
 	// Call Drain to do the same on the write file
@@ -855,33 +757,30 @@ void LogFile::Flush ()
 
 void LogFile::Drain ()
 {
+	if (!_read)
+	{
+		// Wait for everything logged so far to be written to the disk
+		WaitForWriter ();
+		WritePendingBlocks ();
+		SyncFile (_readOutput.file);
+		SyncFile (_writeOutput.file);
+		return;
+	}
+
 	// Dump the write overflow buffer
-	DeallocateWriteBuffer();
+	ClearOverflow (_writeOverflow);
 
 	// If there is data available in the write file, skip passed it
-	struct timeval now, timeStamp;
-	size_t size;
+	struct timeval now;
 	GetCurrentFileTime (now);
-	if (DataAvailableWithinLimit (_readFile, now))
+	while (DataAvailableWithinLimit (_writeLog, now))
 	{
-		GetNextChunkInfo (_writeFile, timeStamp, size);
-		do
+		if (_debug >= 2)
 		{
-			if (_debug >= 2)
-			{
-				cerr << "LogFile::" << __func__ << "() Skipping " << CHUNK_HEADER_SIZE + size <<
-					"bytes in _writeFile." << endl;
-			}
-			if (fseek (_writeFile, CHUNK_HEADER_SIZE + size, SEEK_CUR) < 0)
-			{
-				stringstream ss;
-				ss << "LogFile::" << __func__ << "() fseek(_writeFile) error: (" << ErrNo () <<
-					") " << StrError (ErrNo ());
-				throw PortException (ss.str ());
-			}
-			GetNextChunkInfo (_writeFile, timeStamp, size);
+			cerr << "LogFile::" << __func__ << "() Skipping " <<
+				_writeLog.chunks[_writeLog.next].size << " bytes in the write file." << endl;
 		}
-		while (!(timercmp (&timeStamp, &now, >)) && IsOpen ());
+		_writeLog.next++;
 	}
 }
 
@@ -889,176 +788,1306 @@ void LogFile::Drain ()
 // File writing (this stuff is easy)
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void LogFile::WriteRead (const void * const data, size_t count)
+void LogFile::WriteRead (const void * const data, size_t count,
+						const struct timeval * const timeStamp)
 {
 	if (_debug >= 1)
 	{
 		cerr << "LogFile::" << __func__ << "() Writing read chunk of size " << count <<
 			" bytes." << endl;
 	}
-	WriteTimeStamp (_readFile);
-	uint32_t temp = htonl (static_cast<uint32_t> (count));
-	WriteToFile (_readFile, &temp, sizeof (temp));
-	WriteToFile (_readFile, data, count);
+	struct iovec iov;
+	iov.iov_base = const_cast<void*> (data);
+	iov.iov_len = count;
+	WriteChunk (_readOutput, &iov, 1, count, timeStamp);
 }
 
-void LogFile::WriteWrite (const void * const data, size_t count)
+void LogFile::WriteWrite (const void * const data, size_t count,
+						const struct timeval * const timeStamp)
 {
 	if (_debug >= 1)
 	{
 		cerr << "LogFile::" << __func__ << "() Writing write chunk of size " << count <<
 			" bytes." << endl;
 	}
-	WriteTimeStamp (_writeFile);
-	uint32_t temp = htonl (static_cast<uint32_t> (count));
-	WriteToFile (_writeFile, &temp, sizeof (temp));
-	WriteToFile (_writeFile, data, count);
+	struct iovec iov;
+	iov.iov_base = const_cast<void*> (data);
+	iov.iov_len = count;
+	WriteChunk (_writeOutput, &iov, 1, count, timeStamp);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
-// Internal functions
-////////////////////////////////////////////////////////////////////////////////////////////////////
-
-void LogFile::AllocateReadBuffer (unsigned int size)
+void LogFile::WriteRead (const struct iovec *iov, int iovcnt, size_t count)
 {
-	// Allocate based on size
-	if (_readBuffer == NULL && size > 0)
+	if (_debug >= 1)
 	{
-		// Allocate a new buffer
-		if ((_readBuffer = reinterpret_cast<uint8_t*> (malloc (sizeof (uint8_t) * size))) ==
-			NULL)
-		{
-			throw PortException (string ("LogFile::") + __func__ +
-					string ("() Failed to allocate memory for read buffer."));
-		}
-		_readUsage = 0;
+		cerr << "LogFile::" << __func__ << "() Writing read chunk of size " << count <<
+			" bytes from " << iovcnt << " buffers." << endl;
 	}
-	else if (_readBuffer != NULL && size > 0)
+	WriteChunk (_readOutput, iov, iovcnt, count);
+}
+
+void LogFile::WriteWrite (const struct iovec *iov, int iovcnt, size_t count)
+{
+	if (_debug >= 1)
 	{
-		// Reallocate
-		uint8_t *newBuffer;
-		if ((newBuffer = reinterpret_cast<uint8_t*> (realloc (_readBuffer, sizeof (uint8_t) *
-				size))) == NULL)
+		cerr << "LogFile::" << __func__ << "() Writing write chunk of size " << count <<
+			" bytes from " << iovcnt << " buffers." << endl;
+	}
+	WriteChunk (_writeOutput, iov, iovcnt, count);
+}
+
+void LogFile::SetWriteBuffer (size_t size, bool dropWhenFull)
+{
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	_writeBufferSize = size;
+#else
+	// No threads to write in the background with
+	_writeBufferSize = 0;
+#endif
+	_dropWhenFull = dropWhenFull;
+}
+
+size_t LogFile::GetDroppedChunks () const
+{
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	pthread_mutex_lock (&_queueMutex);
+	size_t result = _droppedChunks;
+	pthread_mutex_unlock (&_queueMutex);
+	return result;
+#else
+	return _droppedChunks;
+#endif
+}
+
+void LogFile::SetCompression (bool compress)
+{
+#if !defined (FLEXIPORT_HAVE_ZLIB)
+	if (compress)
+	{
+		throw PortException (string ("LogFile::") + __func__ +
+				string ("() Compressed logs are not supported (built without zlib)."));
+	}
+#endif
+	_compress = compress;
+}
+
+void LogFile::SetSegmentSize (uint64_t size)
+{
+	_segmentSize = size;
+}
+
+string LogFile::GetSegmentName (const string &fileName, unsigned int segment)
+{
+	if (segment == 0)
+		return fileName;
+
+	stringstream ss;
+	ss << fileName << "." << segment;
+	return ss.str ();
+}
+
+string LogFile::GetIndexName (const string &segmentName)
+{
+	return segmentName + ".idx";
+}
+
+bool LogFile::IndexLogs (const vector<string> &fileNames, bool writeIndexes,
+						vector<string> &problems, unsigned int threads, unsigned int debug)
+{
+	LogFile indexer (debug);
+	size_t oldProblems = problems.size ();
+
+	// Map every segment of every file first, so that they can all be indexed at once
+	vector<string> names;
+	for (size_t ii = 0; ii < fileNames.size (); ii++)
+	{
+		names.push_back (fileNames[ii] + "r");
+		names.push_back (fileNames[ii] + "w");
+	}
+	vector<MappedLog> files (names.size ());
+	vector<IndexJob> jobs;
+	for (size_t ii = 0; ii < files.size (); ii++)
+	{
+		try
+		{
+			indexer.MapSegments (names[ii], files[ii]);
+		}
+		catch (PortException &e)
+		{
+			problems.push_back (e.what ());
+			continue;
+		}
+		for (size_t jj = 0; jj < files[ii].segments.size (); jj++)
+		{
+			IndexJob job;
+			job.fileName = GetSegmentName (names[ii], jj);
+			job.segment = &files[ii].segments[jj];
+			job.number = jj;
+			job.readIndexFile = false;
+			job.writeIndexFile = writeIndexes;
+			jobs.push_back (job);
+		}
+	}
+	indexer.RunIndexJobs (jobs, threads);
+
+	for (size_t ii = 0; ii < jobs.size (); ii++)
+	{
+		const SegmentIndex &index = jobs[ii].index;
+		for (size_t jj = 0; jj < index.problems.size (); jj++)
+			problems.push_back (jobs[ii].fileName + ": " + index.problems[jj]);
+		if (index.hiddenProblems > 0)
+		{
+			stringstream ss;
+			ss << jobs[ii].fileName << ": " << index.hiddenProblems << " more problems.";
+			problems.push_back (ss.str ());
+		}
+		// Segments must also be in order
+		if (jobs[ii].number > 0 && !index.chunks.empty () &&
+				!jobs[ii - 1].index.chunks.empty () &&
+				timercmp (&index.chunks.front ().timeStamp,
+					&jobs[ii - 1].index.chunks.back ().timeStamp, <))
+		{
+			problems.push_back (jobs[ii].fileName +
+					": Starts earlier than the end of the segment before it.");
+		}
+	}
+
+	for (size_t ii = 0; ii < files.size (); ii++)
+	{
+		try
+		{
+			indexer.UnmapLog (files[ii]);
+		}
+		catch (PortException &e)
+		{
+			problems.push_back (e.what ());
+		}
+	}
+	return problems.size () == oldProblems;
+}
+
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Background writing
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void LogFile::StartWriter ()
+{
+	WriteQueue *queues[2] = {&_readQueue, &_writeQueue};
+	LogOutput *outputs[2] = {&_readOutput, &_writeOutput};
+	for (int ii = 0; ii < 2; ii++)
+	{
+		queues[ii]->output = outputs[ii];
+		for (int jj = 0; jj < 2; jj++)
 		{
-			free (_readBuffer);
-			_readBuffer = NULL;
+			if ((queues[ii]->buffers[jj] = reinterpret_cast<uint8_t*> (malloc (_writeBufferSize)))
+					== NULL)
+			{
+				StopWriter ();
+				throw PortException (string ("LogFile::") + __func__ +
+						string ("() Failed to allocate memory for write buffer."));
+			}
+			queues[ii]->sizes[jj] = _writeBufferSize;
+			queues[ii]->used[jj] = 0;
+		}
+		queues[ii]->filling = 0;
+		queues[ii]->writing = false;
+		queues[ii]->swapWanted = false;
+	}
+	_droppedChunks = 0;
+	_writerError.clear ();
+	_stopWriter = false;
+	_flushWriter = false;
+
+	int result;
+	if ((result = pthread_create (&_writerThread, NULL, WriterMain, this)) != 0)
+	{
+		StopWriter ();
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() pthread_create() error: (" << result << ") " <<
+			StrError (result);
+		throw PortException (ss.str ());
+	}
+	_writerRunning = true;
+
+	if (_debug >= 2)
+	{
+		cerr << "LogFile::" << __func__ << "() Writing in the background with " <<
+			_writeBufferSize << " byte buffers." << endl;
+	}
+}
+
+void LogFile::StopWriter ()
+{
+	if (_writerRunning)
+	{
+		// The writer thread writes out everything queued before stopping
+		pthread_mutex_lock (&_queueMutex);
+		_stopWriter = true;
+		pthread_cond_broadcast (&_queueChanged);
+		pthread_mutex_unlock (&_queueMutex);
+		pthread_join (_writerThread, NULL);
+		_writerRunning = false;
+
+		if (!_writerError.empty ())
+			cerr << "LogFile::" << __func__ << "() " << _writerError << endl;
+		if (_droppedChunks > 0 && _debug >= 1)
+		{
+			cerr << "LogFile::" << __func__ << "() Dropped " << _droppedChunks <<
+				" chunks with full write buffers." << endl;
+		}
+	}
+
+	WriteQueue *queues[2] = {&_readQueue, &_writeQueue};
+	for (int ii = 0; ii < 2; ii++)
+	{
+		for (int jj = 0; jj < 2; jj++)
+		{
+			free (queues[ii]->buffers[jj]);
+			queues[ii]->buffers[jj] = NULL;
+			queues[ii]->sizes[jj] = 0;
+			queues[ii]->used[jj] = 0;
+		}
+		queues[ii]->output = NULL;
+	}
+}
+
+void* LogFile::WriterMain (void *logFile)
+{
+	reinterpret_cast<LogFile*> (logFile)->RunWriter ();
+	return NULL;
+}
+
+void LogFile::RunWriter ()
+{
+	WriteQueue *queues[2] = {&_readQueue, &_writeQueue};
+	unsigned int nextQueue = 0;
+	bool timedOut = false;
+
+	pthread_mutex_lock (&_queueMutex);
+	while (true)
+	{
+		// Find a file with chunks to write, taking turns between them. Buffers are written when
+		// half full, so writes are large, but nothing waits in memory for longer than
+		// WRITER_INTERVAL. A buffer is also written straight away if a chunk doesn't fit in it.
+		WriteQueue *queue = NULL;
+		bool pending = false;
+		for (int ii = 0; ii < 2 && queue == NULL; ii++)
+		{
+			WriteQueue *candidate = queues[(nextQueue + ii) % 2];
+			size_t used = candidate->used[candidate->filling];
+			if (used > 0)
+			{
+				pending = true;
+				if (used >= _writeBufferSize / 2 || candidate->swapWanted || _flushWriter ||
+						_stopWriter || timedOut)
+					queue = candidate;
+			}
+		}
+		if (queue == NULL)
+		{
+			if (!pending)
+			{
+				// Only stop once everything has been written
+				if (_stopWriter)
+					break;
+				timedOut = false;
+				pthread_cond_wait (&_queueChanged, &_queueMutex);
+			}
+			else
+			{
+				struct timeval now, limit;
+				GetWallTime (now);
+				timeradd (&now, &WRITER_INTERVAL, &limit);
+				struct timespec deadline;
+				deadline.tv_sec = limit.tv_sec;
+				deadline.tv_nsec = limit.tv_usec * 1000;
+				timedOut = (pthread_cond_timedwait (&_queueChanged, &_queueMutex, &deadline) ==
+						ETIMEDOUT);
+			}
+			continue;
+		}
+		nextQueue = (queue == queues[0]) ? 1 : 0;
+
+		// Swap the buffers so new chunks go into the empty one while the full one is written
+		unsigned int full = queue->filling;
+		queue->filling = 1 - full;
+		queue->writing = true;
+		queue->swapWanted = false;
+		// Let a waiting chunk into the empty buffer
+		pthread_cond_broadcast (&_queueChanged);
+		pthread_mutex_unlock (&_queueMutex);
+
+		// When compressing, each buffer becomes a block
+		string error;
+		bool written = WriteBlock (*queue->output, queue->buffers[full], queue->used[full], error);
+
+		pthread_mutex_lock (&_queueMutex);
+		if (!written && _writerError.empty ())
+			_writerError = error;
+		queue->used[full] = 0;
+		queue->writing = false;
+		pthread_cond_broadcast (&_queueChanged);
+	}
+	pthread_mutex_unlock (&_queueMutex);
+}
+
+void LogFile::QueueChunk (WriteQueue &queue, const uint8_t *header, const struct iovec *iov,
+						int iovcnt, size_t count)
+{
+	size_t total = CHUNK_HEADER_SIZE + count;
+
+	pthread_mutex_lock (&_queueMutex);
+	if (!_writerError.empty ())
+	{
+		pthread_mutex_unlock (&_queueMutex);
+		CheckWriterError ();
+	}
+
+	// Wait for room in the filling buffer. A chunk always goes into an empty buffer, which grows
+	// to fit it if necessary, so chunks larger than the buffers can still be logged. If the other
+	// buffer is free, the writer thread swaps them straight away; only when it is still being
+	// written are both buffers full.
+	while (queue.used[queue.filling] > 0 && queue.used[queue.filling] + total > _writeBufferSize)
+	{
+		if (!queue.writing)
+		{
+			queue.swapWanted = true;
+			pthread_cond_broadcast (&_queueChanged);
+		}
+		else if (_dropWhenFull)
+		{
+			_droppedChunks++;
+			pthread_mutex_unlock (&_queueMutex);
+			if (_debug >= 1)
+			{
+				cerr << "LogFile::" << __func__ << "() Write buffers full, dropped chunk of " <<
+					count << " bytes." << endl;
+			}
+			return;
+		}
+		else if (_debug >= 2)
+			cerr << "LogFile::" << __func__ << "() Write buffers full, waiting." << endl;
+		pthread_cond_wait (&_queueChanged, &_queueMutex);
+	}
+
+	unsigned int filling = queue.filling;
+	if (total > queue.sizes[filling])
+	{
+		uint8_t *newBuffer;
+		if ((newBuffer = reinterpret_cast<uint8_t*> (realloc (queue.buffers[filling], total))) ==
+				NULL)
+		{
+			pthread_mutex_unlock (&_queueMutex);
 			throw PortException (string ("LogFile::") + __func__ +
-					string ("() Failed to allocate memory for read buffer."));
+					string ("() Failed to allocate memory for write buffer."));
 		}
-		_readBuffer = newBuffer;
-		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Read overflow buffer was reallocated." << endl;
+		queue.buffers[filling] = newBuffer;
+		queue.sizes[filling] = total;
 	}
-	else if (_readBuffer != NULL && size == 0)
+
+	uint8_t *dest = &queue.buffers[filling][queue.used[filling]];
+	memcpy (dest, header, CHUNK_HEADER_SIZE);
+	dest += CHUNK_HEADER_SIZE;
+	for (int ii = 0; ii < iovcnt && count > 0; ii++)
 	{
-		// Free
-		free (_readBuffer);
-		_readBuffer = NULL;
-		_readUsage = 0;
+		size_t length = iov[ii].iov_len < count ? iov[ii].iov_len : count;
+		memcpy (dest, iov[ii].iov_base, length);
+		dest += length;
+		count -= length;
+	}
+	queue.used[filling] += total;
+	// Wake the writer thread once there's enough to be worth writing, and when the buffer was
+	// empty so it starts timing how long the chunks have waited
+	if (queue.used[filling] == total || queue.used[filling] >= _writeBufferSize / 2)
+		pthread_cond_broadcast (&_queueChanged);
+	pthread_mutex_unlock (&_queueMutex);
+}
+
+void LogFile::CheckWriterError () const
+{
+	pthread_mutex_lock (&_queueMutex);
+	string error = _writerError;
+	pthread_mutex_unlock (&_queueMutex);
+	if (!error.empty ())
+		throw PortException (error);
+}
+#endif // defined (FLEXIPORT_HAVE_PTHREADS)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Adds data to the end of an overflow buffer, growing it if it's too small. The buffer is kept
+// between chunks, so it only grows to fit the largest chunk read.
+void LogFile::PushOverflow (OverflowBuffer &buffer, const uint8_t *data, size_t count)
+{
+	if (buffer.used + count > buffer.size)
+	{
+		size_t newSize = (buffer.size > 0) ? buffer.size : 256;
+		while (newSize < buffer.used + count)
+			newSize *= 2;
+		uint8_t *newData;
+		if ((newData = reinterpret_cast<uint8_t*> (malloc (newSize))) == NULL)
+		{
+			throw PortException (string ("LogFile::") + __func__ +
+					string ("() Failed to allocate memory for overflow buffer."));
+		}
+		// Unwrap the waiting data into the start of the new buffer
+		size_t firstPart = buffer.size - buffer.start;
+		if (firstPart > buffer.used)
+			firstPart = buffer.used;
+		if (buffer.used > 0)
+		{
+			memcpy (newData, &buffer.data[buffer.start], firstPart);
+			memcpy (&newData[firstPart], buffer.data, buffer.used - firstPart);
+		}
+		free (buffer.data);
+		buffer.data = newData;
+		buffer.size = newSize;
+		buffer.start = 0;
 		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Read overflow buffer was freed." << endl;
+		{
+			cerr << "LogFile::" << __func__ << "() Overflow buffer grown to " << newSize <<
+				" bytes." << endl;
+		}
 	}
-	_readSize = size;
+
+	size_t end = (buffer.start + buffer.used) % buffer.size;
+	size_t firstPart = buffer.size - end;
+	if (firstPart > count)
+		firstPart = count;
+	memcpy (&buffer.data[end], data, firstPart);
+	memcpy (buffer.data, &data[firstPart], count - firstPart);
+	buffer.used += count;
+}
+
+// Takes up to count bytes from the start of an overflow buffer. Returns the number taken.
+size_t LogFile::PopOverflow (OverflowBuffer &buffer, void *dest, size_t count)
+{
+	if (count > buffer.used)
+		count = buffer.used;
+
+	size_t firstPart = buffer.size - buffer.start;
+	if (firstPart > count)
+		firstPart = count;
+	memcpy (dest, &buffer.data[buffer.start], firstPart);
+	memcpy (reinterpret_cast<uint8_t*> (dest) + firstPart, buffer.data, count - firstPart);
+	buffer.used -= count;
+	// Start again at the beginning when empty, so the next chunk doesn't have to wrap
+	buffer.start = (buffer.used == 0) ? 0 : (buffer.start + count) % buffer.size;
+	return count;
+}
+
+void LogFile::ClearOverflow (OverflowBuffer &buffer)
+{
+	buffer.start = 0;
+	buffer.used = 0;
+}
+
+void LogFile::FreeOverflow (OverflowBuffer &buffer)
+{
+	free (buffer.data);
+	buffer.data = NULL;
+	buffer.size = 0;
+	ClearOverflow (buffer);
+}
+
+void LogFile::MapLog (const string &fileName, MappedLog &log)
+{
+	log.chunks.clear ();
+	log.blocks.clear ();
+	log.blockData.clear ();
+	log.loadedBlock = MappedLog::NO_BLOCK;
+	log.dataSize = 0;
+	log.next = 0;
+
+	// A file written in segments continues in files named after the first one. Each segment is
+	// mapped and indexed separately, then its chunks are added to the one index.
+	MapSegments (fileName, log);
+	vector<IndexJob> jobs (log.segments.size ());
+	for (size_t ii = 0; ii < jobs.size (); ii++)
+	{
+		jobs[ii].fileName = GetSegmentName (fileName, ii);
+		jobs[ii].segment = &log.segments[ii];
+		jobs[ii].number = ii;
+		jobs[ii].readIndexFile = true;
+		jobs[ii].writeIndexFile = false;
+	}
+	RunIndexJobs (jobs, 0);
+
+	for (size_t ii = 0; ii < jobs.size (); ii++)
+	{
+		SegmentIndex &index = jobs[ii].index;
+		if (index.failed)
+			throw PortException (index.problems.back ());
+		if (_debug >= 1)
+		{
+			for (size_t jj = 0; jj < index.problems.size (); jj++)
+			{
+				cerr << "LogFile::" << __func__ << "() " << jobs[ii].fileName << ": " <<
+					index.problems[jj] << endl;
+			}
+		}
+
+		size_t firstBlock = log.blocks.size ();
+		log.blocks.insert (log.blocks.end (), index.blocks.begin (), index.blocks.end ());
+		log.chunks.reserve (log.chunks.size () + index.chunks.size ());
+		for (size_t jj = 0; jj < index.chunks.size (); jj++)
+		{
+			LogChunk chunk = index.chunks[jj];
+			if (chunk.block != MappedLog::NO_BLOCK)
+				chunk.block += firstBlock;
+			chunk.dataBefore += log.dataSize;
+			log.chunks.push_back (chunk);
+		}
+		log.dataSize += index.dataSize;
+	}
+
 	if (_debug >= 3)
 	{
-		cerr << "LogFile::" << __func__ << "() Allocated read overflow buffer of size " <<
-			_readSize << "bytes." << endl;
+		cerr << "LogFile::" << __func__ << "() Indexed " << log.chunks.size () << " chunks in " <<
+			log.blocks.size () << " blocks and " << log.segments.size () << " segments with " <<
+			log.dataSize << " bytes of data." << endl;
 	}
 }
 
-void LogFile::AllocateWriteBuffer (unsigned int size)
+// Maps every segment of a file into memory and reads their headers.
+void LogFile::MapSegments (const string &fileName, MappedLog &log)
 {
-	// Allocate based on size
-	if (_writeBuffer == NULL && size > 0)
+	LogSegment segment;
+	MapSegment (fileName, segment, false);
+	log.segments.push_back (segment);
+	while (MapSegment (GetSegmentName (fileName, log.segments.size ()), segment, true))
+		log.segments.push_back (segment);
+
+	for (size_t ii = 0; ii < log.segments.size (); ii++)
 	{
-		// Allocate a new buffer
-		if ((_writeBuffer = reinterpret_cast<uint8_t*> (malloc (sizeof (uint8_t) * size))) ==
-			NULL)
+		LogSegment &info = log.segments[ii];
+		if (info.size < FILE_HEADER_SIZE || memcmp (info.data, LOG_MAGIC, sizeof (LOG_MAGIC)) != 0)
+			continue;	// Original format, with the chunks one after the other
+
+		uint32_t version = GetUint32 (&info.data[sizeof (LOG_MAGIC)]);
+		uint32_t compression = GetUint32 (&info.data[sizeof (LOG_MAGIC) + sizeof (version)]);
+		if (version != LOG_FORMAT_VERSION)
+		{
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() Unsupported log file format version in " <<
+				GetSegmentName (fileName, ii) << ": " << version;
+			throw PortException (ss.str ());
+		}
+#if defined (FLEXIPORT_HAVE_ZLIB)
+		if (compression != COMPRESSION_NONE && compression != COMPRESSION_ZLIB)
+#else
+		if (compression != COMPRESSION_NONE)
+#endif
 		{
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() Unsupported log file compression in " <<
+				GetSegmentName (fileName, ii) << ": " << compression;
+			throw PortException (ss.str ());
+		}
+		info.inBlocks = true;
+		info.compression = compression;
+	}
+}
+
+// Maps one segment into memory. Returns false if the file doesn't exist and is optional.
+bool LogFile::MapSegment (const string &fileName, LogSegment &segment, bool optional)
+{
+	segment = LogSegment ();
+#if defined (WIN32)
+	// No mmap(), so read the whole file into memory instead
+	FILE *file;
+	if ((file = fopen (fileName.c_str (), "rb")) == NULL)
+	{
+		if (optional && ErrNo () == ENOENT)
+			return false;
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fopen(" << fileName << ") error: (" << ErrNo () <<
+			") " << StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	struct _stati64 st;
+	if (_fstati64 (_fileno (file), &st) < 0)
+	{
+		fclose (file);
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() Failed to get the size of " << fileName;
+		throw PortException (ss.str ());
+	}
+	if (static_cast<uint64_t> (st.st_size) > static_cast<size_t> (-1))
+	{
+		fclose (file);
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() " << fileName << " is too large to read into memory.";
+		throw PortException (ss.str ());
+	}
+	segment.size = static_cast<size_t> (st.st_size);
+	segment.modified = st.st_mtime;
+	segment.modifiedNsec = 0;
+	if (segment.size > 0)
+	{
+		if ((segment.data = reinterpret_cast<uint8_t*> (malloc (segment.size))) == NULL)
+		{
+			fclose (file);
 			throw PortException (string ("LogFile::") + __func__ +
-					string ("() Failed to allocate memory for read buffer."));
+					string ("() Failed to allocate memory for log file."));
+		}
+		if (fread (segment.data, 1, segment.size, file) < segment.size)
+		{
+			fclose (file);
+			free (segment.data);
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() Failed to read " << fileName;
+			throw PortException (ss.str ());
 		}
-		_writeUsage = 0;
 	}
-	else if (_readBuffer != NULL && size > 0)
+	fclose (file);
+#else
+	int fd;
+	if ((fd = open (fileName.c_str (), O_RDONLY)) < 0)
 	{
-		// Reallocate
-		uint8_t *newBuffer;
-		if ((newBuffer = reinterpret_cast<uint8_t*> (realloc (_writeBuffer, sizeof (uint8_t) *
-				size))) == NULL)
+		if (optional && ErrNo () == ENOENT)
+			return false;
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() open(" << fileName << ") error: (" << ErrNo () <<
+			") " << StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	struct stat st;
+	if (fstat (fd, &st) < 0)
+	{
+		int errNo = ErrNo ();
+		close (fd);
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fstat() error: (" << errNo << ") " <<
+			StrError (errNo);
+		throw PortException (ss.str ());
+	}
+	// Files are opened with 64-bit offsets, but a 32-bit process can only map so much
+	if (static_cast<uint64_t> (st.st_size) > static_cast<size_t> (-1))
+	{
+		close (fd);
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() " << fileName << " is too large to map into memory.";
+		throw PortException (ss.str ());
+	}
+	segment.size = static_cast<size_t> (st.st_size);
+	segment.modified = st.st_mtime;
+#if defined (__APPLE__)
+	segment.modifiedNsec = st.st_mtimespec.tv_nsec;
+#else
+	segment.modifiedNsec = st.st_mtim.tv_nsec;
+#endif
+	// An empty file can't be mapped, but then there's nothing to index either
+	if (segment.size > 0)
+	{
+		void *mapping = mmap (NULL, segment.size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			int errNo = ErrNo ();
+			close (fd);
+			segment.size = 0;
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() mmap(" << fileName << ") error: (" << errNo <<
+				") " << StrError (errNo);
+			throw PortException (ss.str ());
+		}
+		segment.data = reinterpret_cast<uint8_t*> (mapping);
+#if defined (MADV_SEQUENTIAL)
+		// Replay mostly walks through the file from start to end
+		madvise (mapping, segment.size, MADV_SEQUENTIAL);
+#endif
+	}
+	// The mapping holds its own reference to the file
+	close (fd);
+#endif
+
+	return true;
+}
+
+void LogFile::UnmapLog (MappedLog &log)
+{
+	for (size_t ii = 0; ii < log.segments.size (); ii++)
+	{
+		LogSegment &segment = log.segments[ii];
+		if (segment.data == NULL)
+			continue;
+#if defined (WIN32)
+		free (segment.data);
+#else
+		if (munmap (segment.data, segment.size) < 0)
+		{
+			log.segments.erase (log.segments.begin (), log.segments.begin () + ii + 1);
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() munmap() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			throw PortException (ss.str ());
+		}
+#endif
+	}
+	log.segments.clear ();
+	log.chunks.clear ();
+	log.blocks.clear ();
+	log.blockData.clear ();
+	log.loadedBlock = MappedLog::NO_BLOCK;
+	log.dataSize = 0;
+	log.next = 0;
+}
+
+// Indexes segments, with threads each taking the next segment waiting until all are done.
+void LogFile::RunIndexJobs (vector<IndexJob> &jobs, unsigned int threads)
+{
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	if (threads == 0)
+	{
+		long processors = sysconf (_SC_NPROCESSORS_ONLN);
+		threads = processors > 0 ? processors : 1;
+	}
+	if (threads > jobs.size ())
+		threads = jobs.size ();
+	if (threads > 1)
+	{
+		IndexerContext context;
+		context.logFile = this;
+		context.jobs = &jobs;
+		context.next = 0;
+		pthread_mutex_init (&context.mutex, NULL);
+
+		// This thread indexes segments as well, so if a thread can't be started the rest still get
+		// indexed
+		vector<pthread_t> indexers;
+		for (unsigned int ii = 1; ii < threads; ii++)
+		{
+			pthread_t indexer;
+			if (pthread_create (&indexer, NULL, IndexerMain, &context) != 0)
+			{
+				if (_debug >= 1)
+				{
+					cerr << "LogFile::" << __func__ << "() Failed to start indexer thread: (" <<
+						ErrNo () << ") " << StrError (ErrNo ()) << endl;
+				}
+				break;
+			}
+			indexers.push_back (indexer);
+		}
+		IndexerMain (&context);
+		for (size_t ii = 0; ii < indexers.size (); ii++)
+			pthread_join (indexers[ii], NULL);
+
+		pthread_mutex_destroy (&context.mutex);
+		return;
+	}
+#endif
+	for (size_t ii = 0; ii < jobs.size (); ii++)
+		IndexSegment (jobs[ii]);
+}
+
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+void* LogFile::IndexerMain (void *context)
+{
+	IndexerContext *indexer = reinterpret_cast<IndexerContext*> (context);
+	while (true)
+	{
+		pthread_mutex_lock (&indexer->mutex);
+		size_t job = indexer->next++;
+		pthread_mutex_unlock (&indexer->mutex);
+		if (job >= indexer->jobs->size ())
+			return NULL;
+		indexer->logFile->IndexSegment ((*indexer->jobs)[job]);
+	}
+}
+#endif
+
+// Indexes one segment, from its index file if it has an up to date one. Only touches the job and
+// the mapped segment, so segments can be indexed by several threads at once. Problems are
+// recorded in the job's index rather than thrown.
+void LogFile::IndexSegment (IndexJob &job)
+{
+	const LogSegment &segment = *job.segment;
+	SegmentIndex &index = job.index;
+
+	try
+	{
+		if (job.readIndexFile && ReadIndexFile (job))
+			return;
+
+		if (segment.inBlocks)
+			IndexBlocks (index, segment, job.number, FILE_HEADER_SIZE);
+		else
+			IndexChunks (index, segment.data, segment.size, job.number, MappedLog::NO_BLOCK);
+		if (job.writeIndexFile)
+			WriteIndexFile (job);
+	}
+	// The reason the segment couldn't be indexed is always kept
+	catch (PortException &e)
+	{
+		index.failed = true;
+		index.problems.push_back (e.what ());
+	}
+	catch (bad_alloc &e)
+	{
+		index.failed = true;
+		index.problems.push_back ("Out of memory while indexing.");
+	}
+
+	if (_debug >= 3)
+	{
+		cerr << "LogFile::" << __func__ << "() Indexed " << job.fileName << ": " <<
+			index.chunks.size () << " chunks in " << index.blocks.size () << " blocks." << endl;
+	}
+}
+
+void LogFile::IndexChunks (SegmentIndex &index, const uint8_t *data, size_t size, size_t segment,
+						size_t block)
+{
+	size_t offset = 0;
+
+	while (size - offset >= CHUNK_HEADER_SIZE)
+	{
+		// The chunk header may not be aligned in the file
+		LogChunk chunk;
+		chunk.segment = segment;
+		chunk.block = block;
+		chunk.offset = offset + CHUNK_HEADER_SIZE;
+		chunk.timeStamp.tv_sec = GetUint32 (&data[offset]);
+		chunk.timeStamp.tv_usec = GetUint32 (&data[offset + sizeof (uint32_t)]);
+		chunk.size = GetUint32 (&data[offset + sizeof (uint32_t) * 2]);
+		chunk.dataBefore = index.dataSize;
+		// A chunk cut short by the end of the file (e.g. the logger was killed) is left out
+		if (chunk.size > size - chunk.offset)
+			break;
+
+		// Replay finds chunks by time, so they must be in order
+		if (chunk.timeStamp.tv_usec >= 1000000)
+		{
+			stringstream ss;
+			ss << "Chunk " << index.chunks.size () << " has a bad time stamp (" <<
+				chunk.timeStamp.tv_usec << " microseconds).";
+			AddProblem (index, ss.str ());
+		}
+		else if (!index.chunks.empty () && index.chunks.back ().timeStamp.tv_usec < 1000000 &&
+				timercmp (&chunk.timeStamp, &index.chunks.back ().timeStamp, <))
+		{
+			stringstream ss;
+			ss << "Chunk " << index.chunks.size () << " at " << chunk.timeStamp.tv_sec << "." <<
+				setfill ('0') << setw (6) << chunk.timeStamp.tv_usec <<
+				"s is earlier than the chunk before it.";
+			AddProblem (index, ss.str ());
+		}
+
+		index.chunks.push_back (chunk);
+		index.dataSize += chunk.size;
+		offset = chunk.offset + chunk.size;
+	}
+
+	if (offset < size)
+	{
+		stringstream ss;
+		ss << "Ignoring " << size - offset << " bytes of incomplete chunk at the end of the ";
+		if (block == MappedLog::NO_BLOCK)
+			ss << "file.";
+		else
+			ss << "block " << block << ".";
+		AddProblem (index, ss.str ());
+	}
+}
+
+void LogFile::IndexBlocks (SegmentIndex &index, const LogSegment &segment, size_t number,
+						size_t offset)
+{
+	vector<uint8_t> blockData;
+
+	while (segment.size - offset >= BLOCK_HEADER_SIZE)
+	{
+		LogBlock block;
+		block.segment = number;
+		block.offset = offset + BLOCK_HEADER_SIZE;
+		block.rawSize = GetUint32 (&segment.data[offset]);
+		block.size = GetUint32 (&segment.data[offset + sizeof (uint32_t)]);
+		// As with chunks, a block cut short by the end of the file is left out
+		if (block.size > segment.size - block.offset)
+			break;
+
+		// The block has to be uncompressed to index its chunks. A damaged block ends the index, as
+		// the blocks after it can't be trusted either.
+		try
+		{
+			UncompressBlock (segment, block, blockData);
+		}
+		catch (PortException &e)
+		{
+			stringstream ss;
+			ss << "Ignoring the file from block " << index.blocks.size () << ": " << e.what ();
+			AddProblem (index, ss.str ());
+			return;
+		}
+		index.blocks.push_back (block);
+		offset = block.offset + block.size;
+		if (!blockData.empty ())
+		{
+			IndexChunks (index, &blockData[0], blockData.size (), number,
+					index.blocks.size () - 1);
+		}
+	}
+
+	if (offset < segment.size)
+	{
+		stringstream ss;
+		ss << "Ignoring " << segment.size - offset <<
+			" bytes of incomplete block at the end of the file.";
+		AddProblem (index, ss.str ());
+	}
+}
+
+void LogFile::UncompressBlock (const LogSegment &segment, const LogBlock &block,
+							vector<uint8_t> &dest)
+{
+	dest.clear ();
+	if (block.rawSize == 0)
+		return;		// Nothing to uncompress
+
+	if (segment.compression == COMPRESSION_NONE)
+	{
+		if (block.size != block.rawSize)
 		{
-			free (_writeBuffer);
-			_writeBuffer = NULL;
 			throw PortException (string ("LogFile::") + __func__ +
-					string ("() Failed to allocate memory for read buffer."));
+					string ("() Block has the wrong size."));
 		}
-		_writeBuffer = newBuffer;
-		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Write overflow buffer was reallocated." << endl;
+		dest.assign (&segment.data[block.offset], &segment.data[block.offset] + block.rawSize);
+	}
+#if defined (FLEXIPORT_HAVE_ZLIB)
+	else
+	{
+		// Don't trust a damaged header with allocating the memory
+		if (block.rawSize / MAX_COMPRESSION_RATIO > block.size)
+		{
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() Block claims to hold " << block.rawSize <<
+				" bytes in " << block.size << " bytes of compressed data.";
+			throw PortException (ss.str ());
+		}
+		dest.resize (block.rawSize);
+		uLongf rawSize = block.rawSize;
+		int result = uncompress (&dest[0], &rawSize, &segment.data[block.offset], block.size);
+		if (result != Z_OK || rawSize != block.rawSize)
+		{
+			dest.clear ();
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() uncompress() error: (" << result << ") " <<
+				zError (result);
+			throw PortException (ss.str ());
+		}
+	}
+#endif
+}
+
+// Reads the index of a segment from its index file. Returns false if there is no index file, or it
+// doesn't match the segment (e.g. the segment was written again after the index was made).
+bool LogFile::ReadIndexFile (IndexJob &job)
+{
+	string indexName = GetIndexName (job.fileName);
+	FILE *file;
+	if ((file = fopen (indexName.c_str (), "rb")) == NULL)
+		return false;
+	vector<uint8_t> data;
+	uint8_t buffer[65536];
+	size_t numRead;
+	while ((numRead = fread (buffer, 1, sizeof (buffer), file)) > 0)
+		data.insert (data.end (), buffer, buffer + numRead);
+	bool readError = ferror (file) != 0;
+	fclose (file);
+
+	const LogSegment &segment = *job.segment;
+	if (readError || data.size () < INDEX_HEADER_SIZE ||
+			memcmp (&data[0], INDEX_MAGIC, sizeof (INDEX_MAGIC)) != 0 ||
+			GetUint32 (&data[4]) != INDEX_FORMAT_VERSION ||
+			GetUint64 (&data[8]) != segment.size || GetUint64 (&data[16]) != segment.modified ||
+			GetUint32 (&data[24]) != segment.modifiedNsec ||
+			GetUint32 (&data[28]) != segment.compression)
+	{
+		if (_debug >= 1)
+		{
+			cerr << "LogFile::" << __func__ << "() Ignoring out of date index file " <<
+				indexName << endl;
+		}
+		return false;
+	}
+	size_t numBlocks = GetUint32 (&data[32]);
+	uint64_t numChunks = GetUint64 (&data[36]);
+	if ((numBlocks > 0 && !segment.inBlocks) || numChunks > data.size () ||
+			data.size () != INDEX_HEADER_SIZE + numBlocks * INDEX_BLOCK_SIZE +
+			numChunks * INDEX_CHUNK_SIZE)
+	{
+		if (_debug >= 1)
+			cerr << "LogFile::" << __func__ << "() Ignoring bad index file " << indexName << endl;
+		return false;
+	}
+
+	SegmentIndex &index = job.index;
+	const uint8_t *entry = &data[INDEX_HEADER_SIZE];
+	vector<size_t> blockChunks (numBlocks);
+	index.blocks.resize (numBlocks);
+	for (size_t ii = 0; ii < numBlocks; ii++, entry += INDEX_BLOCK_SIZE)
+	{
+		LogBlock &block = index.blocks[ii];
+		block.segment = job.number;
+		block.offset = GetUint64 (entry);
+		block.size = GetUint32 (&entry[8]);
+		block.rawSize = GetUint32 (&entry[12]);
+		blockChunks[ii] = GetUint32 (&entry[16]);
+		if (block.offset > segment.size || block.size > segment.size - block.offset)
+		{
+			index = SegmentIndex ();
+			return false;
+		}
+	}
+
+	// Chunks follow each other through the segment, or through each block
+	// In a segment of blocks, the first chunk moves block from NO_BLOCK on to block 0
+	size_t block = MappedLog::NO_BLOCK, left = numChunks, limit = segment.size, offset = 0;
+	if (segment.inBlocks)
+	{
+		left = 0;
+		limit = 0;
+	}
+	index.chunks.resize (numChunks);
+	for (size_t ii = 0; ii < numChunks; ii++, entry += INDEX_CHUNK_SIZE)
+	{
+		while (left == 0 && block + 1 < numBlocks)
+		{
+			block++;
+			left = blockChunks[block];
+			limit = index.blocks[block].rawSize;
+			offset = 0;
+		}
+		LogChunk &chunk = index.chunks[ii];
+		chunk.segment = job.number;
+		chunk.block = block;
+		chunk.offset = offset + CHUNK_HEADER_SIZE;
+		chunk.timeStamp.tv_sec = GetUint32 (entry);
+		chunk.timeStamp.tv_usec = GetUint32 (&entry[4]);
+		chunk.size = GetUint32 (&entry[8]);
+		chunk.dataBefore = index.dataSize;
+		if (left == 0 || chunk.offset > limit || chunk.size > limit - chunk.offset)
+		{
+			if (_debug >= 1)
+			{
+				cerr << "LogFile::" << __func__ << "() Ignoring bad index file " << indexName <<
+					endl;
+			}
+			index = SegmentIndex ();
+			return false;
+		}
+		index.dataSize += chunk.size;
+		offset = chunk.offset + chunk.size;
+		left--;
+	}
+
+	if (_debug >= 2)
+		cerr << "LogFile::" << __func__ << "() Read index file " << indexName << endl;
+	return true;
+}
+
+// Writes the index of a segment to its index file. The file is written under a temporary name
+// and then renamed, so a reader never sees part of an index.
+void LogFile::WriteIndexFile (IndexJob &job)
+{
+	const LogSegment &segment = *job.segment;
+	SegmentIndex &index = job.index;
+
+	vector<uint8_t> data;
+	data.reserve (INDEX_HEADER_SIZE + index.blocks.size () * INDEX_BLOCK_SIZE +
+			index.chunks.size () * INDEX_CHUNK_SIZE);
+	data.insert (data.end (), INDEX_MAGIC, INDEX_MAGIC + sizeof (INDEX_MAGIC));
+	PutUint32 (data, INDEX_FORMAT_VERSION);
+	PutUint64 (data, segment.size);
+	PutUint64 (data, segment.modified);
+	PutUint32 (data, segment.modifiedNsec);
+	PutUint32 (data, segment.compression);
+	PutUint32 (data, index.blocks.size ());
+	PutUint64 (data, index.chunks.size ());
+	vector<uint32_t> blockChunks (index.blocks.size (), 0);
+	for (size_t ii = 0; ii < index.chunks.size (); ii++)
+	{
+		if (index.chunks[ii].block != MappedLog::NO_BLOCK)
+			blockChunks[index.chunks[ii].block]++;
+	}
+	for (size_t ii = 0; ii < index.blocks.size (); ii++)
+	{
+		PutUint64 (data, index.blocks[ii].offset);
+		PutUint32 (data, index.blocks[ii].size);
+		PutUint32 (data, index.blocks[ii].rawSize);
+		PutUint32 (data, blockChunks[ii]);
+	}
+	for (size_t ii = 0; ii < index.chunks.size (); ii++)
+	{
+		PutUint32 (data, index.chunks[ii].timeStamp.tv_sec);
+		PutUint32 (data, index.chunks[ii].timeStamp.tv_usec);
+		PutUint32 (data, index.chunks[ii].size);
+	}
+
+	string indexName = GetIndexName (job.fileName);
+	string tempName = indexName + ".tmp";
+	FILE *file;
+	if ((file = fopen (tempName.c_str (), "wb")) == NULL)
+	{
+		stringstream ss;
+		ss << "Failed to write index file: fopen(" << tempName << ") error: (" << ErrNo () <<
+			") " << StrError (ErrNo ());
+		AddProblem (index, ss.str ());
+		return;
+	}
+	bool written = fwrite (&data[0], 1, data.size (), file) == data.size ();
+	int errNo = ErrNo ();
+	if (fclose (file) != 0 && written)
+	{
+		written = false;
+		errNo = ErrNo ();
+	}
+#if defined (WIN32)
+	// rename() won't replace an existing file
+	if (written)
+		remove (indexName.c_str ());
+#endif
+	if (!written || rename (tempName.c_str (), indexName.c_str ()) != 0)
+	{
+		if (written)
+			errNo = ErrNo ();
+		remove (tempName.c_str ());
+		stringstream ss;
+		ss << "Failed to write index file " << indexName << ": (" << errNo << ") " <<
+			StrError (errNo);
+		AddProblem (index, ss.str ());
+		return;
+	}
+
+	if (_debug >= 2)
+		cerr << "LogFile::" << __func__ << "() Wrote index file " << indexName << endl;
+}
+
+void LogFile::AddProblem (SegmentIndex &index, const string &problem)
+{
+	// A badly damaged file could have a problem with every chunk
+	if (index.problems.size () < MAX_PROBLEMS)
+		index.problems.push_back (problem);
+	else
+		index.hiddenProblems++;
+}
+
+void LogFile::LoadBlock (MappedLog &log, size_t block)
+{
+	if (log.loadedBlock == block)
+		return;
+
+	const LogBlock &info = log.blocks[block];
+	log.loadedBlock = MappedLog::NO_BLOCK;
+	try
+	{
+		UncompressBlock (log.segments[info.segment], info, log.blockData);
 	}
-	else if (_writeBuffer != NULL && size == 0)
+	catch (PortException &e)
 	{
-		// Free
-		free (_writeBuffer);
-		_writeBuffer = NULL;
-		_writeUsage = 0;
-		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Write overflow buffer was freed." << endl;
+		stringstream ss;
+		ss << e.what () << " (block " << block << ")";
+		throw PortException (ss.str ());
 	}
-	_writeSize = size;
+	log.loadedBlock = block;
+
 	if (_debug >= 3)
 	{
-		cerr << "LogFile::" << __func__ << "() Allocated write overflow buffer of size " <<
-			_writeSize << "bytes." << endl;
+		cerr << "LogFile::" << __func__ << "() Loaded block " << block << " of " <<
+			info.rawSize << " bytes." << endl;
 	}
 }
 
-void LogFile::DeallocateReadBuffer ()
+const uint8_t* LogFile::GetChunkData (MappedLog &log, const LogChunk &chunk)
 {
-	if (_readBuffer != NULL)
-	{
-		free (_readBuffer);
-		_readBuffer = NULL;
-		_readSize = 0;
-		_readUsage = 0;
-		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Deallocated read overflow buffer." << endl;
-	}
+	if (chunk.block == MappedLog::NO_BLOCK)
+		return log.segments[chunk.segment].data + chunk.offset;
+
+	LoadBlock (log, chunk.block);
+	return &log.blockData[0] + chunk.offset;
 }
 
-void LogFile::DeallocateWriteBuffer ()
+const uint8_t* LogFile::GetChunk (MappedLog &log, size_t chunk, struct timeval &timeStamp,
+								size_t &size)
 {
-	if (_writeBuffer != NULL)
+	if (chunk >= log.chunks.size ())
 	{
-		free (_writeBuffer);
-		_writeBuffer = NULL;
-		_writeSize = 0;
-		_writeUsage = 0;
-		if (_debug >= 3)
-			cerr << "LogFile::" << __func__ << "() Deallocated write overflow buffer." << endl;
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() Chunk " << chunk << " is past the end of the file (" <<
+			log.chunks.size () << " chunks).";
+		throw PortException (ss.str ());
 	}
+
+	timeStamp = log.chunks[chunk].timeStamp;
+	size = log.chunks[chunk].size;
+	return GetChunkData (log, log.chunks[chunk]);
 }
 
-void LogFile::GetCurrentFileTime (struct timeval &dest)
+bool LogFile::ChunkIsBefore (const LogChunk &chunk, const struct timeval &fileTime)
 {
-	struct timeval now;
+	return timercmp (&chunk.timeStamp, &fileTime, <);
+}
+
+size_t LogFile::FindChunk (const MappedLog &log, const struct timeval &fileTime) const
+{
+	// Time stamps only go forward, so the index can be searched
+	return lower_bound (log.chunks.begin (), log.chunks.end (), fileTime, ChunkIsBefore) -
+		log.chunks.begin ();
+}
 
+void LogFile::SetFileTime (const struct timeval &fileTime)
+{
+	// Move the open time so that the current file time becomes fileTime
+	struct timeval now, elapsed;
+	GetWallTime (now);
+	ScaleTime (fileTime, 1.0 / _rate, elapsed);
+	timersub (&now, &elapsed, &_openTime);
+}
+
+void LogFile::GetWallTime (struct timeval &dest)
+{
 #if defined (WIN32)
 	SYSTEMTIME sysTime;
 	GetSystemTime (&sysTime);
-	now.tv_sec = sysTime.wSecond;
-	now.tv_usec = sysTime.wMilliseconds * 1000;
+	dest.tv_sec = sysTime.wSecond;
+	dest.tv_usec = sysTime.wMilliseconds * 1000;
 #else
-	if (gettimeofday (&now, NULL) < 0)
+	if (gettimeofday (&dest, NULL) < 0)
 	{
 		stringstream ss;
-		ss << "LogReaderPort::" << __func__ << "() gettimeofday() error: (" << ErrNo () << ") " <<
+		ss << "LogFile::" << __func__ << "() gettimeofday() error: (" << ErrNo () << ") " <<
 			StrError (ErrNo ());
 		throw PortException (ss.str ());
 	}
 #endif
+}
+
+void LogFile::GetCurrentFileTime (struct timeval &dest)
+{
+	if (_lockStep && _read)
+	{
+		// The replay has reached the write being waited for, or the end if there are none left
+		if (_writeOverflow.used > 0)
+			dest = _writeLog.chunks[_writeLog.next - 1].timeStamp;
+		else if (_writeLog.next < _writeLog.chunks.size ())
+			dest = _writeLog.chunks[_writeLog.next].timeStamp;
+		else if (!_readLog.chunks.empty ())
+			dest = _readLog.chunks.back ().timeStamp;
+		else
+			timerclear (&dest);
+	}
+	else
+	{
+		struct timeval now, elapsed;
+		GetWallTime (now);
+		timersub (&now, &_openTime, &elapsed);
+		ScaleTime (elapsed, _rate, dest);
+	}
 
-	timersub (&now, &_openTime, &dest);
 	if (_debug >= 3)
 	{
 		cerr << "LogFile::" << __func__ << "() Current file time is " << dest.tv_sec << "s " <<
@@ -1066,45 +2095,81 @@ void LogFile::GetCurrentFileTime (struct timeval &dest)
 	}
 }
 
-bool LogFile::DataAvailableWithinLimit (FILE * const file, const struct timeval &limit)
+void LogFile::GetTimeLimit (const Timeout &timeout, struct timeval &limit)
+{
+	// Timeouts are in real time, so scale them into file time
+	struct timeval now, timeoutVal, scaled;
+	GetCurrentFileTime (now);
+	timeout.AsTimeval (timeoutVal);
+	ScaleTime (timeoutVal, _rate, scaled);
+	timeradd (&now, &scaled, &limit);
+}
+
+void LogFile::SleepUntilFileTime (const struct timeval &fileTime)
 {
-	struct timeval chunkTime;
-	size_t chunkSize;
+	// In lock-step mode there is nothing to wait for
+	if (_lockStep)
+		return;
 
-	GetNextChunkInfo (file, chunkTime, chunkSize);
-	if (!(timercmp (&chunkTime, &limit, >)))
-		return true;
-	return false;
+	// Calculate the time difference between now and the given file time
+	struct timeval now, diff, scaled;
+	GetCurrentFileTime (now);
+	timersub (&fileTime, &now, &diff);
+	if (diff.tv_sec >= 0 && diff.tv_usec >= 0)
+	{
+		// Sleep for this period of time, in real time
+		ScaleTime (diff, 1.0 / _rate, scaled);
+		struct timespec diff2;
+		diff2.tv_sec = scaled.tv_sec;
+		diff2.tv_nsec = scaled.tv_usec * 1000;
+		if (_debug >= 2)
+		{
+			cerr << "LogFile::" << __func__ << "() Sleeping for " << diff2.tv_sec << "s " <<
+				diff2.tv_nsec << "ns." << endl;
+		}
+#if defined (WIN32)
+		DWORD sleepTime = 0;
+		if (diff2.tv_sec > 0)
+			sleepTime += diff2.tv_sec * 1000;
+		if (diff2.tv_nsec > 0)
+			sleepTime += diff2.tv_nsec / 1000000;
+		Sleep (sleepTime);
+#else
+		nanosleep (&diff2, NULL);
+#endif
+	}
 }
 
-void LogFile::GetNextChunkInfo (FILE * const file, struct timeval &timeStamp, size_t &size)
+bool LogFile::DataAvailableWithinLimit (const MappedLog &log, const struct timeval &limit) const
 {
-	// Read the chunk info
-	uint32_t secs, usecs, tempSize;
-	ReadFromFile (file, &secs, sizeof (secs));
-	ReadFromFile (file, &usecs, sizeof (usecs));
-	timeStamp.tv_sec = ntohl (secs);
-	timeStamp.tv_usec = ntohl (usecs);
-	ReadFromFile (file, &tempSize, sizeof (tempSize));
-	size = ntohl (tempSize);
+	if (log.next >= log.chunks.size ())
+		return false;
+	return !(timercmp (&log.chunks[log.next].timeStamp, &limit, >));
+}
 
-	// Rewind the file back to the beginning of the chunk header
-	if (fseek (file, -1 * static_cast<int> (CHUNK_HEADER_SIZE), SEEK_CUR) < 0)
+bool LogFile::GetNextChunkInfo (const MappedLog &log, struct timeval &timeStamp,
+								size_t &size) const
+{
+	if (log.next >= log.chunks.size ())
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		if (_debug >= 3)
+			cerr << "LogFile::" << __func__ << "() No chunks left." << endl;
+		return false;
 	}
+
+	const LogChunk &chunk = log.chunks[log.next];
+	timeStamp = chunk.timeStamp;
+	size = chunk.size;
 	if (_debug >= 3)
 	{
 		cerr << "LogFile::" << __func__ << "() Next chunk has size " << size <<
 			" bytes and time stamp " << timeStamp.tv_sec << "s " << timeStamp.tv_usec <<
 			"us." << endl;
 	}
+	return true;
 }
 
-size_t LogFile::GetChunksToTimeLimit (FILE * const file, void *data, size_t count,
+size_t LogFile::GetChunksToTimeLimit (MappedLog &log, void *data, size_t count,
 									const struct timeval &limit)
 {
 	if (_debug >= 3)
@@ -1114,20 +2179,15 @@ size_t LogFile::GetChunksToTimeLimit (FILE * const file, void *data, size_t coun
 	}
 
 	// Keep reading chunks from the file until the limit is passed or count bytes have been read.
-	struct timeval chunkTime;
-	size_t chunkSize, totalRead = 0;
-	GetNextChunkInfo (file, chunkTime, chunkSize);
-	while (!(timercmp (&chunkTime, &limit, >)) && count > 0 && IsOpen ())
+	size_t totalRead = 0;
+	while (count > 0 && DataAvailableWithinLimit (log, limit))
 	{
-		size_t numSaved = GetSingleChunk (file, data, count, chunkTime, chunkSize);
+		struct timeval chunkTime;
+		size_t chunkSize;
+		size_t numSaved = GetSingleChunk (log, data, count, chunkTime, chunkSize);
 		data = reinterpret_cast<uint8_t*> (data) + numSaved;
 		count -= numSaved;
 		totalRead += numSaved;
-		// Safety check
-		if (!IsOpen ())
-			break;
-		// Next chunk
-		GetNextChunkInfo (file, chunkTime, chunkSize);
 	}
 
 	if (_debug >= 3)
@@ -1135,7 +2195,7 @@ size_t LogFile::GetChunksToTimeLimit (FILE * const file, void *data, size_t coun
 	return totalRead;
 }
 
-size_t LogFile::GetChunkSizesToTimeLimit (FILE * const file, const struct timeval &limit)
+size_t LogFile::GetChunkSizesToTimeLimit (const MappedLog &log, const struct timeval &limit) const
 {
 	if (_debug >= 3)
 	{
@@ -1143,41 +2203,14 @@ size_t LogFile::GetChunkSizesToTimeLimit (FILE * const file, const struct timeva
 			"s " << limit.tv_usec << "us." << endl;
 	}
 
-	struct timeval chunkTime;
-	size_t chunkSize, totalSize = 0;
-
-	// Store the current file position
-	long currentPos;
-	if ((currentPos = ftell (file)) < 0)
-	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
-	}
-
-	GetNextChunkInfo (file, chunkTime, chunkSize);
-	while (!(timercmp (&chunkTime, &limit, >)) && IsOpen ())
-	{
-		totalSize += chunkSize;
-		// Safety check
-		if (!IsOpen ())
-			break;
-		// Next chunk
-		GetNextChunkInfo (file, chunkTime, chunkSize);
-	}
-	// Reopen if necessary
-	if (!IsOpen ())
-		Open (_fileName, _read, _ignoreTimes);
-
-	// Go back to the start position
-	if (fseek (file, currentPos, SEEK_SET) < 0)
-	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
-	}
+	// Find the first chunk past the limit; the data before it is the data before that chunk
+	size_t end = log.next;
+	while (end < log.chunks.size () && !(timercmp (&log.chunks[end].timeStamp, &limit, >)))
+		end++;
+	if (end == log.next)
+		return 0;
+	size_t totalSize = (end < log.chunks.size () ? log.chunks[end].dataBefore : log.dataSize) -
+		log.chunks[log.next].dataBefore;
 
 	if (_debug >= 3)
 		cerr << "LogFile::" << __func__ << "() Found a total of " << totalSize << " bytes." << endl;
@@ -1186,35 +2219,24 @@ size_t LogFile::GetChunkSizesToTimeLimit (FILE * const file, const struct timeva
 
 // This function returns the number of bytes put into data. This may be less than the number of
 // bytes actually read from the chunk, as some might go into an overflow buffer.
-size_t LogFile::GetSingleChunk (FILE * const file, void *data, size_t count,
+size_t LogFile::GetSingleChunk (MappedLog &log, void *data, size_t count,
 								struct timeval &timeStamp, size_t &size)
 {
-	if (_debug >= 3)
+	if (!GetNextChunkInfo (log, timeStamp, size))
 	{
-		long pos;
-		if ((pos = ftell (file)) < 0)
-		{
-			stringstream ss;
-			ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		cerr << "LogFile::" << __func__ << "() Reading a single chunk from " <<
-			((file == _readFile) ? "read file" : "write file") << " at position " << pos << endl;
+		// End of the file
+		timerclear (&timeStamp);
+		size = 0;
+		return 0;
 	}
 
-	// Read the chunk info
-	uint32_t secs, usecs, tempSize;
-	ReadFromFile (file, &secs, sizeof (secs));
-	ReadFromFile (file, &usecs, sizeof (usecs));
-	timeStamp.tv_sec = ntohl (secs);
-	timeStamp.tv_usec = ntohl (usecs);
-	ReadFromFile (file, &tempSize, sizeof (tempSize));
-	size = ntohl (tempSize);
+	const uint8_t *chunkData = GetChunkData (log, log.chunks[log.next]);
+	log.next++;
 	if (_debug >= 3)
 	{
-		cerr << "LogFile::" << __func__ << "() Chunk has time " << timeStamp.tv_sec << "s " <<
-			timeStamp.tv_usec << "us and is " << size << " bytes." << endl;
+		cerr << "LogFile::" << __func__ << "() Reading chunk " << log.next - 1 << " from " <<
+			((&log == &_readLog) ? "read file" : "write file") << ": time " << timeStamp.tv_sec <<
+			"s " << timeStamp.tv_usec << "us and " << size << " bytes." << endl;
 	}
 
 	// Check if this chunk will fit in data
@@ -1223,198 +2245,369 @@ size_t LogFile::GetSingleChunk (FILE * const file, void *data, size_t count,
 		if (_debug >= 3)
 			cerr << "LogFile::" << __func__ << "() Chunk is too big for destination." << endl;
 
-		// Need to allocate an overflow buffer
-		uint8_t *overFlow;
-		if (file == _readFile)
-		{
-			AllocateReadBuffer (size - count);
-			overFlow = _readBuffer;
-			_readUsage = size - count;
-		}
-		else
-		{
-			AllocateWriteBuffer (size - count);
-			overFlow = _writeBuffer;
-			_writeUsage = size - count;
-		}
-
-		// Read as much as can fit into data
-		ReadFromFile (file, data, sizeof (uint8_t) * count);
+		// Copy as much as can fit into data and the rest into the overflow buffer
+		memcpy (data, chunkData, count);
+		PushOverflow ((&log == &_readLog) ? _readOverflow : _writeOverflow, &chunkData[count],
+				size - count);
 		if (_debug >= 3)
 		{
-			cerr << "LogFile::" << __func__ << "() Read " <<
-				sizeof (*reinterpret_cast<uint8_t*> (data)) * count << " bytes into destination." <<
+			cerr << "LogFile::" << __func__ << "() Copied " << count <<
+				" bytes into destination and " << size - count << " bytes into overflow buffer." <<
 				endl;
 		}
-		// Read the rest into the overflow buffer
-		ReadFromFile (file, overFlow, sizeof (uint8_t) * (size - count));
-		if (_debug >= 3)
-		{
-			cerr << "LogFile::" << __func__ << "() Read " << sizeof (uint8_t) * (size - count) <<
-				" bytes into overflow buffer." << endl;
-		}
 
 		return count;
 	}
 	else
 	{
-		// It'll fit so read straight into data
-		ReadFromFile (file, data, sizeof (uint8_t) * size);
+		// It'll fit so copy straight into data
+		memcpy (data, chunkData, size);
 		if (_debug >= 3)
 		{
-			cerr << "LogFile::" << __func__ << "() Read " <<
-				sizeof (*reinterpret_cast<uint8_t*> (data)) * size << " bytes into destination." <<
+			cerr << "LogFile::" << __func__ << "() Copied " << size << " bytes into destination." <<
 				endl;
 		}
 		return size;
 	}
 }
 
-size_t LogFile::GetFileSize (FILE * const file)
+void LogFile::WriteToFile (FILE * const file, const void * const data, size_t count)
 {
-	// Store the current position
-	long currentPos;
-	if ((currentPos = ftell (file)) < 0)
+	size_t totalWritten = 0;
+
+	if (_read)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		throw PortException (string ("LogFile::") + __func__ +
+				string ("() Cannot write to read log file."));
 	}
+	if (file == NULL)
+		throw PortException (string ("LogFile::") + __func__ + string ("() Log file is not open."));
+	if (data == NULL)
+		throw PortException (string ("LogFile::") + __func__ + string ("() No data to write."));
 
-	// Seek to the end of the file and find its position
-	if (fseek (file, 0, SEEK_END) < 0)
+	while (totalWritten < count)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		ssize_t numWritten;
+		if ((numWritten = fwrite (&(reinterpret_cast<const uint8_t*> (data)[totalWritten]),
+								sizeof (uint8_t), count - totalWritten, file)) < 0)
+		{
+			stringstream ss;
+			ss << "LogFile::" << __func__ << "() fwrite() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			throw PortException (ss.str ());
+		}
+		totalWritten += numWritten;
 	}
-	long fileSize;
-	if ((fileSize = ftell (file)) < 0)
+	if (_debug >= 3)
+		cerr << "LogFile::" << __func__ << "() Wrote " << totalWritten << " bytes." << endl;
+}
+
+void LogFile::WriteToFile (FILE * const file, const struct iovec *iov, int iovcnt, size_t count)
+{
+	// Write the first count bytes of the buffers, in order
+	for (int ii = 0; ii < iovcnt && count > 0; ii++)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() ftell() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		size_t length = iov[ii].iov_len < count ? iov[ii].iov_len : count;
+		if (length > 0)
+			WriteToFile (file, iov[ii].iov_base, length);
+		count -= length;
+	}
+}
+
+void LogFile::WriteChunk (LogOutput &output, const struct iovec *iov, int iovcnt, size_t count,
+						const struct timeval * const timeStamp)
+{
+	if (_read)
+	{
+		throw PortException (string ("LogFile::") + __func__ +
+				string ("() Cannot write to read log file."));
+	}
+
+	uint8_t header[CHUNK_HEADER_SIZE];
+	MakeChunkHeader (header, count, timeStamp);
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	if (_writerRunning)
+	{
+		QueueChunk ((&output == &_readOutput) ? _readQueue : _writeQueue, header, iov, iovcnt,
+				count);
+		return;
+	}
+#endif
+	if (_compress)
+	{
+		// Collect chunks until there are enough for a block
+		vector<uint8_t> &block = (&output == &_readOutput) ? _readBlock : _writeBlock;
+		block.insert (block.end (), header, header + CHUNK_HEADER_SIZE);
+		for (int ii = 0; ii < iovcnt && count > 0; ii++)
+		{
+			size_t length = iov[ii].iov_len < count ? iov[ii].iov_len : count;
+			const uint8_t *data = reinterpret_cast<const uint8_t*> (iov[ii].iov_base);
+			block.insert (block.end (), data, data + length);
+			count -= length;
+		}
+		if (block.size () >= COMPRESSED_BLOCK_SIZE)
+		{
+			string error;
+			if (!WriteBlock (output, &block[0], block.size (), error))
+				throw PortException (error);
+			block.clear ();
+		}
+		return;
+	}
+	string error;
+	if (!RollOver (output, CHUNK_HEADER_SIZE + count, error))
+		throw PortException (error);
+	WriteToFile (output.file, header, CHUNK_HEADER_SIZE);
+	WriteToFile (output.file, iov, iovcnt, count);
+	output.size += CHUNK_HEADER_SIZE + count;
+}
+
+void LogFile::OpenOutput (LogOutput &output, const string &fileName)
+{
+	output.fileName = fileName;
+	output.segment = 0;
+	string error;
+	if (!OpenSegment (output, error))
+		throw PortException (error);
+
+	// Remove any later segments left by an earlier log with the same name, so that they are not
+	// read as part of this one
+	unsigned int stale = 1;
+	while (remove (GetSegmentName (fileName, stale).c_str ()) == 0)
+	{
+		remove (GetIndexName (GetSegmentName (fileName, stale)).c_str ());
+		stale++;
 	}
+}
+
+void LogFile::CloseOutput (LogOutput &output)
+{
+	if (output.file == NULL)
+		return;
 
-	// Go back to the original position
-	if (fseek (file, currentPos, SEEK_SET) < 0)
+	FILE *file = output.file;
+	output.file = NULL;
+	if (fclose (file) == EOF)
 	{
 		stringstream ss;
-		ss << "LogFile::" << __func__ << "() fseek() error: (" << ErrNo () << ") " <<
+		ss << "LogFile::" << __func__ << "() fclose(" <<
+			GetSegmentName (output.fileName, output.segment) << ") error: (" << ErrNo () << ") " <<
 			StrError (ErrNo ());
 		throw PortException (ss.str ());
 	}
-
-	return fileSize;
 }
 
-void LogFile::ReadFromFile (FILE * const file, void * const dest, size_t count)
+// Opens the segment numbered output.segment, replacing any existing file. This is used by the
+// writer thread, so errors are returned rather than thrown.
+bool LogFile::OpenSegment (LogOutput &output, string &error)
 {
-	if (!_read)
+	string segmentName = GetSegmentName (output.fileName, output.segment);
+	if ((output.file = fopen (segmentName.c_str (), "wb")) == NULL)
 	{
-		throw PortException (string ("LogFile::") + __func__ +
-				string ("() Cannot read from write log file."));
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fopen(" << segmentName << ") error: (" << ErrNo () <<
+			") " << StrError (ErrNo ());
+		error = ss.str ();
+		return false;
 	}
+	output.size = 0;
+	// An index of the segment's old contents would no longer match it
+	remove (GetIndexName (segmentName).c_str ());
 
-	// Test if this file is actually open
-	if (file == NULL)
-		throw PortException (string ("LogFile::") + __func__ + string ("() Log file is not open."));
-	else if (ftell (file) < 0)
-		throw PortException (string ("LogFile::") + __func__ + string ("() Log file is not open."));
-
-	if (dest == NULL)
-		throw PortException (string ("LogFile::") + __func__ + string ("() No destination."));
-
-	size_t numRead;
-	if ((numRead = fread (dest, 1, count, file)) < count)
+	if (_compress)
 	{
-		cerr << "LogFile::" << __func__ << "() Only read " << numRead << " of " << count <<
-			" bytes" << endl;
-		if (feof (file))
-		{
-			// Close the files
-			Close ();
-		}
-		else if (ferror (file))
+		// Every segment has a header, so each can be read on its own
+		uint8_t header[FILE_HEADER_SIZE];
+		uint32_t version = htonl (LOG_FORMAT_VERSION);
+		uint32_t compression = htonl (COMPRESSION_ZLIB);
+		memcpy (header, LOG_MAGIC, sizeof (LOG_MAGIC));
+		memcpy (&header[sizeof (LOG_MAGIC)], &version, sizeof (version));
+		memcpy (&header[sizeof (LOG_MAGIC) + sizeof (version)], &compression,
+				sizeof (compression));
+		if (fwrite (header, 1, FILE_HEADER_SIZE, output.file) < FILE_HEADER_SIZE)
 		{
 			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fread() error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-		else
-		{
-			throw PortException (string ("LogFile::") + __func__ +
-					string ("() Didn't get enough data from fread()."));
+			ss << "LogFile::" << __func__ << "() fwrite(" << segmentName << ") error: (" <<
+				ErrNo () << ") " << StrError (ErrNo ());
+			error = ss.str ();
+			return false;
 		}
+		output.size = FILE_HEADER_SIZE;
 	}
+
+	if (_debug >= 2)
+		cerr << "LogFile::" << __func__ << "() Writing to " << segmentName << endl;
+	return true;
 }
 
-void LogFile::WriteToFile (FILE * const file, const void * const data, size_t count)
+// Moves on to the next segment if writing length bytes would take the current one past the segment
+// size. Chunks and blocks are never split, so a segment may go past the size when it has only one.
+bool LogFile::RollOver (LogOutput &output, size_t length, string &error)
 {
-	size_t totalWritten = 0;
+	if (output.file == NULL)
+	{
+		error = string ("LogFile::") + __func__ + string ("() File is not open.");
+		return false;
+	}
 
-	if (_read)
+	uint64_t emptySize = _compress ? FILE_HEADER_SIZE : 0;
+	if (_segmentSize == 0 || output.size <= emptySize || output.size + length <= _segmentSize)
+		return true;
+
+	FILE *file = output.file;
+	output.file = NULL;
+	if (fclose (file) == EOF)
 	{
-		throw PortException (string ("LogFile::") + __func__ +
-				string ("() Cannot write to read log file."));
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fclose(" <<
+			GetSegmentName (output.fileName, output.segment) << ") error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		error = ss.str ();
+		return false;
 	}
-	if (file == NULL)
-		throw PortException (string ("LogFile::") + __func__ + string ("() Log file is not open."));
-	if (data == NULL)
-		throw PortException (string ("LogFile::") + __func__ + string ("() No data to write."));
+	output.segment++;
+	return OpenSegment (output, error);
+}
 
-	while (totalWritten < count)
+// Writes a buffer of whole chunks to a file, compressing it into a block if necessary. This is used
+// by the writer thread, so errors are returned rather than thrown.
+bool LogFile::WriteBlock (LogOutput &output, const uint8_t *data, size_t length, string &error)
+{
+	const uint8_t *toWrite = data;
+	size_t toWriteLength = length;
+
+#if defined (FLEXIPORT_HAVE_ZLIB)
+	if (_compress)
 	{
-		ssize_t numWritten;
-		if ((numWritten = fwrite (&(reinterpret_cast<const uint8_t*> (data)[totalWritten]),
-								sizeof (uint8_t), count - totalWritten, file)) < 0)
+		uLongf size = compressBound (length);
+		_compressBuffer.resize (BLOCK_HEADER_SIZE + size);
+		int result = compress2 (&_compressBuffer[BLOCK_HEADER_SIZE], &size, data, length,
+				Z_BEST_SPEED);
+		if (result != Z_OK)
 		{
 			stringstream ss;
-			ss << "LogFile::" << __func__ << "() fwrite() error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
+			ss << "LogFile::" << __func__ << "() compress2() error: (" << result << ") " <<
+				zError (result);
+			error = ss.str ();
+			return false;
 		}
-		totalWritten += numWritten;
+		uint32_t rawSize = htonl (static_cast<uint32_t> (length));
+		uint32_t compressedSize = htonl (static_cast<uint32_t> (size));
+		memcpy (&_compressBuffer[0], &rawSize, sizeof (rawSize));
+		memcpy (&_compressBuffer[sizeof (rawSize)], &compressedSize, sizeof (compressedSize));
+		toWrite = &_compressBuffer[0];
+		toWriteLength = BLOCK_HEADER_SIZE + size;
+	}
+#endif
+
+	if (!RollOver (output, toWriteLength, error))
+		return false;
+	size_t written = fwrite (toWrite, 1, toWriteLength, output.file);
+	output.size += written;
+	if (written < toWriteLength)
+	{
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fwrite() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		error = ss.str ();
+		return false;
 	}
 	if (_debug >= 3)
-		cerr << "LogFile::" << __func__ << "() Wrote " << totalWritten << " bytes." << endl;
+	{
+		cerr << "LogFile::" << __func__ << "() Wrote " << length << " bytes of chunks as " <<
+			toWriteLength << " bytes." << endl;
+	}
+	return true;
+}
+
+void LogFile::WritePendingBlocks ()
+{
+	LogOutput *outputs[2] = {&_readOutput, &_writeOutput};
+	vector<uint8_t> *blocks[2] = {&_readBlock, &_writeBlock};
+	for (int ii = 0; ii < 2; ii++)
+	{
+		if (outputs[ii]->file != NULL && !blocks[ii]->empty ())
+		{
+			string error;
+			bool written = WriteBlock (*outputs[ii], &(*blocks[ii])[0], blocks[ii]->size (), error);
+			blocks[ii]->clear ();
+			if (!written)
+				throw PortException (error);
+		}
+	}
 }
 
-void LogFile::WriteTimeStamp (FILE * const file)
+void LogFile::MakeChunkHeader (uint8_t *header, size_t count,
+							const struct timeval * const timeStamp)
 {
 	// Calculate the time difference between now and the time the file was opened
 	struct timeval now, diff;
-#if defined (WIN32)
-	SYSTEMTIME sysTime;
-	GetSystemTime (&sysTime);
-	now.tv_sec = sysTime.wSecond;
-	now.tv_usec = sysTime.wMilliseconds * 1000;
-#else
-	if (gettimeofday (&now, NULL) < 0)
+	if (timeStamp != NULL)
 	{
-		stringstream ss;
-		ss << "LogFile::" << __func__ << "() gettimeofday() error: (" << ErrNo () << ") " <<
-			StrError (ErrNo ());
-		throw PortException (ss.str ());
+		now = *timeStamp;
+		diff = *timeStamp;
 	}
-#endif
-	timersub (&now, &_openTime, &diff);
-	uint32_t secs, usecs;
+	else
+	{
+		GetWallTime (now);
+		timersub (&now, &_openTime, &diff);
+	}
+	uint32_t secs, usecs, size;
 	secs = htonl (static_cast<uint32_t> (diff.tv_sec));
 	usecs = htonl (static_cast<uint32_t> (diff.tv_usec));
-	// Write the time stamp to the file
-	WriteToFile (file, &secs, sizeof (secs));
-	WriteToFile (file, &usecs, sizeof (usecs));
+	size = htonl (static_cast<uint32_t> (count));
+	memcpy (header, &secs, sizeof (secs));
+	memcpy (&header[sizeof (secs)], &usecs, sizeof (usecs));
+	memcpy (&header[sizeof (secs) + sizeof (usecs)], &size, sizeof (size));
 	if (_debug >= 3)
 	{
-		cerr << "LogFile::" << __func__ << "() Wrote time stamp: " << diff.tv_sec << "s " <<
+		cerr << "LogFile::" << __func__ << "() Time stamp: " << diff.tv_sec << "s " <<
 			diff.tv_usec << "us (time of write is " << now.tv_sec << "s " << now.tv_usec << "us)."
 			<< endl;
 	}
 }
 
+void LogFile::SyncFile (FILE * const file)
+{
+	if (file == NULL)
+		return;
+
+	if (fflush (file) == EOF)
+	{
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fflush() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+#if !defined (WIN32)
+	if (fsync (fileno (file)) < 0)
+	{
+		stringstream ss;
+		ss << "LogFile::" << __func__ << "() fsync() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+#endif
+}
+
+void LogFile::WaitForWriter ()
+{
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	if (!_writerRunning)
+		return;
+
+	pthread_mutex_lock (&_queueMutex);
+	_flushWriter = true;
+	pthread_cond_broadcast (&_queueChanged);
+	while (_readQueue.used[_readQueue.filling] > 0 || _readQueue.writing ||
+			_writeQueue.used[_writeQueue.filling] > 0 || _writeQueue.writing)
+	{
+		pthread_cond_wait (&_queueChanged, &_queueMutex);
+	}
+	_flushWriter = false;
+	pthread_mutex_unlock (&_queueMutex);
+	CheckWriterError ();
+#endif
+}
+
 } // namespace flexiport
@@ -33,17 +33,29 @@
 #else
 	#include <sys/time.h>
 #endif
+#include <stdio.h>
 #include <string>
 #include <vector>
 
+#include "flexiport.h"
+#include "flexiport_config.h"
 #include "timeout.h"
 #include "flexiport_types.h"
 
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+	#include <pthread.h>
+#endif
+
 namespace flexiport
 {
 
-// Class for managing a log file pair
-class LogFile
+/** @brief A log file pair, as written by @ref LogWriterPort and read by @ref LogReaderPort.
+
+The log ports use this class to record and replay data. It can also be used directly by tools
+that inspect or convert logs, through the chunk access functions: every chunk of a log opened for
+reading can be fetched by index, and chunks can be written with a given time stamp. Time stamps are
+relative to when the log was opened for writing. */
+class FLEXIPORT_EXPORT LogFile
 {
 	public:
 		LogFile (unsigned int debug);
@@ -53,6 +65,16 @@ class LogFile
 		void Close ();
 		bool IsOpen () const;
 		void ResetFile ();
+		void SeekToTime (const struct timeval &fileTime);
+		void SeekToChunk (size_t chunk);
+		size_t GetNumChunks () const                { return _readLog.chunks.size (); }
+		size_t GetNumWriteChunks () const           { return _writeLog.chunks.size (); }
+		// Get a chunk of a log being read, without affecting replay. The data is valid until the
+		// next chunk is fetched from the same file.
+		const uint8_t* GetReadChunk (size_t chunk, struct timeval &timeStamp, size_t &size);
+		const uint8_t* GetWriteChunk (size_t chunk, struct timeval &timeStamp, size_t &size);
+		void SetRate (double rate);
+		void SetLockStep (bool lockStep);
 
 		// File reading
 		ssize_t Read (void *data, size_t count, Timeout &timeout);
@@ -62,41 +84,263 @@ class LogFile
 		void Flush ();
 		void Drain ();
 
-		// File writing
-		void WriteRead (const void * const data, size_t count);
-		void WriteWrite (const void * const data, size_t count);
+		// File writing. Chunks are stamped with the current time unless a time stamp is given.
+		void WriteRead (const void * const data, size_t count,
+				const struct timeval * const timeStamp = NULL);
+		void WriteRead (const struct iovec *iov, int iovcnt, size_t count);
+		void WriteWrite (const void * const data, size_t count,
+				const struct timeval * const timeStamp = NULL);
+		void WriteWrite (const struct iovec *iov, int iovcnt, size_t count);
+		// Set the size of the buffers used to write in the background (0 to write directly) and
+		// whether to drop chunks or wait when they are full. Takes effect when the file is opened.
+		void SetWriteBuffer (size_t size, bool dropWhenFull);
+		size_t GetDroppedChunks () const;
+		// Write the log in compressed blocks. Takes effect when the file is opened.
+		void SetCompression (bool compress);
+		bool GetCompression () const                { return _compress; }
+		// Start a new segment of a file when it would grow beyond size bytes (0 for no limit).
+		// Takes effect when the file is opened.
+		void SetSegmentSize (uint64_t size);
+		uint64_t GetSegmentSize () const            { return _segmentSize; }
+
+		// Name of a segment of one of the files in a pair. The first segment has the file's name.
+		static std::string GetSegmentName (const std::string &fileName, unsigned int segment);
+		// Name of the index file of a segment
+		static std::string GetIndexName (const std::string &segmentName);
+		// Index and check every segment of the given logs, spread over threads (0 for one per
+		// processor). Chunks with bad time stamps or out of order, and incomplete or damaged data
+		// at the ends of files, are added to problems. Returns true if there were none. With
+		// writeIndexes, each segment gets an index file, which is used to open the log for reading
+		// instead of walking through the segment.
+		static bool IndexLogs (const std::vector<std::string> &fileNames, bool writeIndexes,
+				std::vector<std::string> &problems, unsigned int threads = 0,
+				unsigned int debug = 0);
 
 	private:
+		// A chunk in a log file being read, found when the file is opened
+		struct LogChunk
+		{
+			size_t segment;				// Segment of the file holding the chunk
+			size_t block;				// Block holding the chunk, in a compressed segment
+			size_t offset;				// Offset of the chunk's data in the segment or block
+			struct timeval timeStamp;
+			size_t size;
+			size_t dataBefore;			// Total size of the data in the chunks before this one
+		};
+		// A block of chunks in a compressed file
+		struct LogBlock
+		{
+			size_t segment;
+			size_t offset;				// Offset of the compressed data in the segment
+			size_t size;				// Size of the compressed data
+			size_t rawSize;				// Size of the chunks once uncompressed
+		};
+		// One segment of a log file, mapped into memory
+		struct LogSegment
+		{
+			LogSegment ()
+				: data (NULL), size (0), modified (0), modifiedNsec (0), inBlocks (false),
+				compression (0) {}
+
+			uint8_t *data;
+			size_t size;
+			uint64_t modified;			// Modification time of the file
+			uint32_t modifiedNsec;		// Nanoseconds of the modification time, where recorded
+			bool inBlocks;				// Has a file header, and the chunks are in blocks
+			uint32_t compression;
+		};
+		// A log file mapped into memory for reading, and its chunk index
+		struct MappedLog
+		{
+			MappedLog () : dataSize (0), next (0), loadedBlock (NO_BLOCK) {}
+
+			static const size_t NO_BLOCK = static_cast<size_t> (-1);
+
+			std::vector<LogSegment> segments;
+			std::vector<LogChunk> chunks;
+			size_t dataSize;			// Total size of the data in all chunks
+			size_t next;				// Index of the next chunk to read
+			// Compressed segments only
+			std::vector<LogBlock> blocks;
+			std::vector<uint8_t> blockData;	// The uncompressed chunks of one block
+			size_t loadedBlock;			// The block in blockData
+		};
+		// The chunks and blocks of one segment. Block numbers and data totals count from the start
+		// of the segment until it is added to a log's index.
+		struct SegmentIndex
+		{
+			SegmentIndex () : dataSize (0), hiddenProblems (0), failed (false) {}
+
+			std::vector<LogChunk> chunks;
+			std::vector<LogBlock> blocks;
+			size_t dataSize;
+			std::vector<std::string> problems;
+			size_t hiddenProblems;		// Problems found after the first MAX_PROBLEMS
+			bool failed;				// The segment couldn't be indexed at all
+		};
+		// A segment to be indexed, possibly by another thread
+		struct IndexJob
+		{
+			std::string fileName;
+			const LogSegment *segment;
+			size_t number;				// Number of the segment in its file
+			bool readIndexFile;			// Use the segment's index file if it is up to date
+			bool writeIndexFile;
+			SegmentIndex index;
+		};
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		// Shared by the threads indexing a set of segments
+		struct IndexerContext
+		{
+			LogFile *logFile;
+			std::vector<IndexJob> *jobs;
+			size_t next;				// Index of the next job to be taken
+			pthread_mutex_t mutex;
+		};
+#endif
+
+		// A file being written, which may be split into segments
+		struct LogOutput
+		{
+			LogOutput () : file (NULL), segment (0), size (0) {}
+
+			FILE *file;
+			std::string fileName;		// Name of the first segment
+			unsigned int segment;		// Number of the segment being written
+			uint64_t size;				// Bytes written to the segment
+		};
+
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		// Double buffer for a file written in the background. Chunks are added to the filling
+		// buffer while the writer thread writes the other one to the file.
+		struct WriteQueue
+		{
+			WriteQueue () : output (NULL), filling (0), writing (false), swapWanted (false)
+				{ buffers[0] = buffers[1] = NULL; sizes[0] = sizes[1] = used[0] = used[1] = 0; }
+
+			LogOutput *output;
+			uint8_t *buffers[2];
+			size_t sizes[2];
+			size_t used[2];
+			unsigned int filling;		// Index of the buffer being filled
+			bool writing;				// The other buffer is being written
+			bool swapWanted;			// A chunk is waiting for the buffers to be swapped
+		};
+#endif
+
+		// Holds the rest of a chunk that didn't fit in a read, until it's used. It only ever grows,
+		// and data is taken from the front without moving the rest.
+		struct OverflowBuffer
+		{
+			OverflowBuffer () : data (NULL), size (0), start (0), used (0) {}
+
+			uint8_t *data;
+			size_t size;
+			size_t start;				// Index of the first byte waiting to be used
+			size_t used;				// Number of bytes waiting, which may wrap to the start
+		};
+
 		std::string _fileName;
 		bool _read;
-		FILE *_readFile, *_writeFile;
-		long _readFileSize, _writeFileSize;
+		// Used when writing
+		LogOutput _readOutput, _writeOutput;
+		uint64_t _segmentSize;
+		// Used when reading
+		MappedLog _readLog, _writeLog;
 		// When writing, this is the time the file was opened. When reading, it's the reset time.
 		struct timeval _openTime;
 		unsigned int _debug;
-		size_t _readUsage, _writeUsage;
-		size_t _readSize, _writeSize;
-		uint8_t *_readBuffer, *_writeBuffer;
+		OverflowBuffer _readOverflow, _writeOverflow;
+		std::vector<uint8_t> _checkData;	// Logged data that writes are compared with
 		bool _ignoreTimes;
+		// Speed of replay, as a multiple of the logged speed
+		double _rate;
+		// Replay time follows the logged writes instead of the clock
+		bool _lockStep;
+		// Writing in compressed blocks
+		bool _compress;
+		std::vector<uint8_t> _readBlock, _writeBlock;	// Chunks waiting to be compressed
+		std::vector<uint8_t> _compressBuffer;
+		// Writing in the background
+		size_t _writeBufferSize;
+		bool _dropWhenFull;
+		size_t _droppedChunks;
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		WriteQueue _readQueue, _writeQueue;
+		pthread_t _writerThread;
+		mutable pthread_mutex_t _queueMutex;
+		pthread_cond_t _queueChanged;
+		bool _writerRunning, _stopWriter, _flushWriter;
+		std::string _writerError;
+#endif
 
-		void AllocateReadBuffer (unsigned int size = 0);
-		void AllocateWriteBuffer (unsigned int size = 0);
-		void DeallocateReadBuffer ();
-		void DeallocateWriteBuffer ();
+		void PushOverflow (OverflowBuffer &buffer, const uint8_t *data, size_t count);
+		size_t PopOverflow (OverflowBuffer &buffer, void *dest, size_t count);
+		void ClearOverflow (OverflowBuffer &buffer);
+		void FreeOverflow (OverflowBuffer &buffer);
 
+		void MapLog (const std::string &fileName, MappedLog &log);
+		void MapSegments (const std::string &fileName, MappedLog &log);
+		bool MapSegment (const std::string &fileName, LogSegment &segment, bool optional);
+		void UnmapLog (MappedLog &log);
+		void RunIndexJobs (std::vector<IndexJob> &jobs, unsigned int threads);
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		static void* IndexerMain (void *context);
+#endif
+		void IndexSegment (IndexJob &job);
+		void IndexChunks (SegmentIndex &index, const uint8_t *data, size_t size, size_t segment,
+				size_t block);
+		void IndexBlocks (SegmentIndex &index, const LogSegment &segment, size_t number,
+				size_t offset);
+		void UncompressBlock (const LogSegment &segment, const LogBlock &block,
+				std::vector<uint8_t> &dest);
+		bool ReadIndexFile (IndexJob &job);
+		void WriteIndexFile (IndexJob &job);
+		static void AddProblem (SegmentIndex &index, const std::string &problem);
+		void LoadBlock (MappedLog &log, size_t block);
+		const uint8_t* GetChunkData (MappedLog &log, const LogChunk &chunk);
+		static bool ChunkIsBefore (const LogChunk &chunk, const struct timeval &fileTime);
+		size_t FindChunk (const MappedLog &log, const struct timeval &fileTime) const;
+		void SetFileTime (const struct timeval &fileTime);
+
+		void GetWallTime (struct timeval &dest);
 		void GetCurrentFileTime (struct timeval &dest);
-		bool DataAvailableWithinLimit (FILE * const file, const struct timeval &limit);
-		void GetNextChunkInfo (FILE * const file, struct timeval &timeStamp, size_t &size);
-		size_t GetChunksToTimeLimit (FILE * const file, void *data, size_t count,
+		void GetTimeLimit (const Timeout &timeout, struct timeval &limit);
+		void SleepUntilFileTime (const struct timeval &fileTime);
+		bool DataAvailableWithinLimit (const MappedLog &log, const struct timeval &limit) const;
+		bool GetNextChunkInfo (const MappedLog &log, struct timeval &timeStamp, size_t &size) const;
+		size_t GetChunksToTimeLimit (MappedLog &log, void *data, size_t count,
 								const struct timeval &limit);
-		size_t GetChunkSizesToTimeLimit (FILE * const file, const struct timeval &limit);
-		size_t GetSingleChunk (FILE * const file, void *data, size_t count,
+		size_t GetChunkSizesToTimeLimit (const MappedLog &log, const struct timeval &limit) const;
+		size_t GetSingleChunk (MappedLog &log, void *data, size_t count,
 								struct timeval &timeStamp, size_t &size);
-		size_t GetFileSize (FILE * const file);
 
-		void ReadFromFile (FILE * const file, void * const dest, size_t count);
 		void WriteToFile (FILE * const file, const void * const data, size_t count);
-		void WriteTimeStamp (FILE * const file);
+		void WriteToFile (FILE * const file, const struct iovec *iov, int iovcnt, size_t count);
+		void WriteChunk (LogOutput &output, const struct iovec *iov, int iovcnt, size_t count,
+				const struct timeval * const timeStamp = NULL);
+		void MakeChunkHeader (uint8_t *header, size_t count,
+				const struct timeval * const timeStamp);
+		const uint8_t* GetChunk (MappedLog &log, size_t chunk, struct timeval &timeStamp,
+				size_t &size);
+		void OpenOutput (LogOutput &output, const std::string &fileName);
+		void CloseOutput (LogOutput &output);
+		bool OpenSegment (LogOutput &output, std::string &error);
+		bool RollOver (LogOutput &output, size_t length, std::string &error);
+		bool WriteBlock (LogOutput &output, const uint8_t *data, size_t length,
+				std::string &error);
+		void WritePendingBlocks ();
+		void SyncFile (FILE * const file);
+		void WaitForWriter ();
+#if defined (FLEXIPORT_HAVE_PTHREADS)
+		void StartWriter ();
+		void StopWriter ();
+		static void* WriterMain (void *logFile);
+		void RunWriter ();
+		void QueueChunk (WriteQueue &queue, const uint8_t *header, const struct iovec *iov,
+				int iovcnt, size_t count);
+		void CheckWriterError () const;
+#endif
 };
 
 } // namespace flexiport
@@ -46,14 +46,17 @@ namespace flexiport
 
 LogReaderPort::LogReaderPort (map<string, string> options)
 	: Port (), _logFileName ("port.log"), _strictness (0),
-	_jitter (100), _ignoreTimes (false), _open (false)
+	_jitter (100), _ignoreTimes (false), _rate (1.0), _lockStep (false), _open (false)
 {
 	_type = "logreader";
+	timerclear (&_start);
 	ProcessOptions (options);
 
 	// Initialise the log file
 	_logFile = new LogFile (_debug);
 	_logFile->Open (_logFileName, true, _ignoreTimes);
+	_logFile->SetRate (_rate);
+	_logFile->SetLockStep (_lockStep);
 
 	if (_alwaysOpen)
 		Open ();
@@ -75,6 +78,8 @@ void LogReaderPort::Open ()
 
 	// Store the open time for timing purposes
 	_logFile->ResetFile ();
+	if (timerisset (&_start))
+		_logFile->SeekToTime (_start);
 	_open = true;
 
 	if (_debug >= 2)
@@ -87,6 +92,7 @@ void LogReaderPort::Close ()
 		cerr << "LogReaderPort::" << __func__ << "() Closing port" << endl;
 
 	_open = false;
+	ClearReadBuffer ();
 
 	if (_debug >= 2)
 		cerr << "LogReaderPort::" << __func__ << "() Port closed" << endl;
@@ -103,6 +109,10 @@ ssize_t LogReaderPort::Read (void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "LogReaderPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
 
+	// Data already in the input buffer is returned before reading from the log
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
 	// Ask the log file to give us as much data as it has available up to now (but <=count). If
 	// there isn't data available immediately then have it sleep until some is, within the timeout.
 	ssize_t receivedBytes;
@@ -111,12 +121,13 @@ ssize_t LogReaderPort::Read (void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "LogReaderPort::" << __func__ << "() Read " << receivedBytes << " bytes" << endl;
 
+	CountRead (receivedBytes);
 	return receivedBytes;
 }
 
 ssize_t LogReaderPort::ReadFull (void * const buffer, size_t count)
 {
-	size_t receivedBytes = 0;
+	size_t receivedBytes = 0, bufferedBytes = 0;
 	Timeout oldTimeout = _timeout;
 
 	CheckPort (true);
@@ -127,6 +138,11 @@ ssize_t LogReaderPort::ReadFull (void * const buffer, size_t count)
 			" bytes" << endl;
 	}
 
+	// Data already in the input buffer is used first. It was counted when it was read into the
+	// buffer.
+	if (ReadBufferUsage () > 0)
+		receivedBytes = bufferedBytes = TakeFromReadBuffer (buffer, count);
+
 	// Set the timeout to infinite blocking
 	SetTimeout (Timeout (-1, 0));
 	// Keep calling _logFile->Read() until count bytes have been received
@@ -163,6 +179,7 @@ ssize_t LogReaderPort::ReadFull (void * const buffer, size_t count)
 
 	// Restore the timeout
 	SetTimeout (oldTimeout);
+	CountRead (receivedBytes - bufferedBytes);
 	return receivedBytes;
 }
 
@@ -170,7 +187,7 @@ ssize_t LogReaderPort::BytesAvailable ()
 {
 	// Use a zero timeout.
 	Timeout timeout (0, 0);
-	ssize_t bytesAvailable = _logFile->BytesAvailable (timeout);
+	ssize_t bytesAvailable = _logFile->BytesAvailable (timeout) + ReadBufferUsage ();
 	if (_debug >= 2)
 	{
 		cerr << "LogReaderPort::" << __func__ << "() Found " << bytesAvailable <<
@@ -181,6 +198,10 @@ ssize_t LogReaderPort::BytesAvailable ()
 
 ssize_t LogReaderPort::BytesAvailableWait ()
 {
+	// Buffered data is available without waiting
+	if (ReadBufferUsage () > 0)
+		return BytesAvailable ();
+
 	// The time limit is now + the timeout
 	ssize_t bytesAvailable = _logFile->BytesAvailable (_timeout);
 	if (_debug >= 2)
@@ -204,7 +225,9 @@ ssize_t LogReaderPort::Write (const void * const buffer, size_t count)
 	size_t numWritten;
 	if (_strictness == 0)
 	{
-		// No checking
+		// No checking, but in lock-step mode the write still moves the replay on
+		if (_lockStep)
+			_logFile->CheckWrite (buffer, count, &numWritten);
 		numWritten = count;
 	}
 	else if (_strictness == 1)
@@ -236,11 +259,13 @@ ssize_t LogReaderPort::Write (const void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "LogReaderPort::" << __func__ << "() Wrote " << numWritten << " bytes" << endl;
 
+	CountWrite (numWritten);
 	return numWritten;
 }
 
 void LogReaderPort::Flush ()
 {
+	ClearReadBuffer ();
 //	_logFile->Flush ();
 	// Actually shouldn't do anything here because any calls to flush on LogWriterPort didn't write
 	// anything to the file. The alternative is to have LogWriterPort perform reads, write to the
@@ -265,8 +290,15 @@ std::string LogReaderPort::GetStatus () const
 	status << "LogReader-specific status:" << endl;
 	status << "Reading from " << _logFileName << endl;
 	status << ((_open && _logFile->IsOpen ()) ? "Port is open" : "Port is closed") << endl;
-	status << (_ignoreTimes ? "Ignoring file time stamps." : "Using file time stamps.") << endl;
+	if (_lockStep)
+		status << "Replaying in lock-step with writes." << endl;
+	else if (_ignoreTimes)
+		status << "Ignoring file time stamps." << endl;
+	else
+		status << "Using file time stamps at " << _rate << " times speed." << endl;
 	status << "Strictness is " << _strictness << ", with a jitter of " << _jitter << "ms" << endl;
+	if (timerisset (&_start))
+		status << "Replay starts at " << _start.tv_sec << "s " << _start.tv_usec << "us" << endl;
 
 	return Port::GetStatus () + status.str ();
 }
@@ -291,6 +323,36 @@ bool LogReaderPort::IsOpen () const
 	return _open;
 }
 
+void LogReaderPort::SeekToTime (const struct timeval &time)
+{
+	if (!_open)
+		throw PortException ("Port is not open.");
+
+	ClearReadBuffer ();
+	_logFile->SeekToTime (time);
+	if (_debug >= 2)
+	{
+		cerr << "LogReaderPort::" << __func__ << "() Moved to " << time.tv_sec << "s " <<
+			time.tv_usec << "us" << endl;
+	}
+}
+
+void LogReaderPort::SeekToChunk (unsigned int chunk)
+{
+	if (!_open)
+		throw PortException ("Port is not open.");
+
+	ClearReadBuffer ();
+	_logFile->SeekToChunk (chunk);
+	if (_debug >= 2)
+		cerr << "LogReaderPort::" << __func__ << "() Moved to chunk " << chunk << endl;
+}
+
+unsigned int LogReaderPort::GetNumChunks () const
+{
+	return _logFile->GetNumChunks ();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Internal functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -327,6 +389,33 @@ bool LogReaderPort::ProcessOption (const std::string &option, const std::string
 			throw PortException ("Bad jitter: " + value);
 		return true;
 	}
+	else if (option == "rate")
+	{
+		istringstream is (value);
+		if (!(is >> _rate) || is.get (c) || _rate <= 0.0)
+			throw PortException ("Bad rate: " + value);
+		return true;
+	}
+	else if (option == "lockstep")
+	{
+		_lockStep = true;
+		return true;
+	}
+	else if (option == "start")
+	{
+		istringstream is (value);
+		double start;
+		if (!(is >> start) || is.get (c) || start < 0)
+			throw PortException ("Bad start: " + value);
+		_start.tv_sec = static_cast<long> (start);
+		_start.tv_usec = static_cast<long> ((start - _start.tv_sec) * 1000000.0 + 0.5);
+		if (_start.tv_usec >= 1000000)
+		{
+			_start.tv_sec++;
+			_start.tv_usec -= 1000000;
+		}
+		return true;
+	}
 
 	return false;
 }
@@ -30,6 +30,11 @@
 
 #include "port.h"
 
+#if defined (WIN32)
+	#include <winsock2.h> // For timeval
+#else
+	#include <sys/time.h>
+#endif
 #include <map>
 #include <string>
 
@@ -45,9 +50,17 @@ class LogFile;
 /** @brief Simulated port using a log file.
 
 Uses a log file created by the @ref LogWriterPort port type to simulate the data transfer over a
-@ref Port object.
+@ref Port object. Logs written with the compress option are uncompressed as they are read, one
+block at a time, so they replay exactly like uncompressed logs. Logs written in segments are read
+as a single log when given the name of the first segment.
 
-@note Log files greater than 2GB in size are not supported.
+Opening the port finds every chunk in the log, with the segments of a file indexed in parallel.
+When a segment has an index file next to it (written by LogFile::IndexLogs or the portlog utility's
+index command) that is up to date, it is read instead, so that the segment doesn't have to be read
+through (or uncompressed) before replay can start.
+
+@note The log is mapped into memory, so on 32-bit systems its total size is limited by the
+address space available.
 
 @note The timer resolution under Windows is milliseconds, not microseconds. This may result in
 inaccurate replay when using a log file created on a POSIX-compatible operating system.
@@ -71,7 +84,23 @@ See the @ref Port class documentation for how to use the common API.
    - Default: 0
  - jitter <integer>
    - Margin of error (in milliseconds) to allow for write checking with strictness = 2.
-   - Default: 100 */
+   - Default: 100
+ - rate <double>
+   - Speed to replay the log file at, as a multiple of the speed it was recorded at. For example,
+     10 replays it ten times faster and 0.1 ten times slower. Timeouts and the jitter are still in
+     real time.
+   - Default: 1
+ - lockstep
+   - Replay the log file as fast as the port is used, ignoring the time stamps. Data read after
+     a write in the log file becomes available as soon as that write is made, and data read
+     before it is available straight away. A read that can only be satisfied by data after the
+     next write times out without waiting, because that data will not arrive until the write is
+     made. Writes move the replay on at every strictness level; strictness 2 becomes strictness 1.
+   - Default: false
+ - start <double>
+   - Time in the log file, in seconds from its start, to begin replaying from when the port is
+     opened. See @ref SeekToTime.
+   - Default: 0 */
 class FLEXIPORT_EXPORT LogReaderPort : public Port
 {
 	public:
@@ -107,12 +136,29 @@ class FLEXIPORT_EXPORT LogReaderPort : public Port
 		/// @brief Check if the port is open
 		bool IsOpen () const;
 
+		/** @brief Move the replay to a time in the log file.
+
+		Replay continues from the first data logged at or after @ref time, measured from the start
+		of the log file, as though the log had been replayed up to that point. Any data waiting to
+		be read is discarded. The port must be open. */
+		void SeekToTime (const struct timeval &time);
+		/** @brief Move the replay to a chunk of read data in the log file.
+
+		Chunks are the blocks of data returned by each read of the logged port, numbered from zero.
+		The replay time becomes the time the chunk was logged. The port must be open. */
+		void SeekToChunk (unsigned int chunk);
+		/// @brief Get the number of chunks of read data in the log file.
+		unsigned int GetNumChunks () const;
+
 	private:
 		LogFile *_logFile;
 		std::string _logFileName;
 		unsigned int _strictness;
 		int _jitter;
 		bool _ignoreTimes;
+		double _rate;
+		bool _lockStep;
+		struct timeval _start;
 		bool _open;
 
 		bool ProcessOption (const std::string &option, const std::string &value);
@@ -49,20 +49,70 @@ LogWriterPort::LogWriterPort (map<string, string> options)
 {
 	_type = "logwriter";
 
-	// Look for options that we're interested in locally (file and debug)
+	// Look for options that we're interested in locally (file, readbuffer, logbuffer,
+	// logoverflow, compress, logsegment and debug)
 	char c = '\0';
-	for (map<string, string>::const_iterator ii = options.begin (); ii != options.end (); ii++)
+	size_t logBufferSize = 0;
+	bool dropWhenFull = false;
+	bool compress = false;
+	uint64_t segmentSize = 0;
+	map<string, string>::iterator ii = options.begin ();
+	while (ii != options.end ())
 	{
 		if (ii->first == "file")
 		{
 			_logFileName = ii->second;
-			options.erase ("file");     // Don't pass this one on to the underlying port
+			options.erase (ii++);       // Don't pass this one on to the underlying port
 		}
-		else if (ii->first == "debug")
+		else if (ii->first == "readbuffer")
 		{
+			// Buffer at this level rather than in the underlying port so that each fill of the
+			// buffer is logged as a single chunk
+			size_t size = 0;
 			istringstream is (ii->second);
-			if (!(is >> _debug) || is.get (c))
-				throw PortException ("Bad debug level: " + ii->second);
+			if (!(is >> size) || is.get (c))
+				throw PortException ("Bad read buffer size: " + ii->second);
+			SetReadBufferSize (size);
+			options.erase (ii++);
+		}
+		else if (ii->first == "logbuffer")
+		{
+			istringstream is (ii->second);
+			if (!(is >> logBufferSize) || is.get (c))
+				throw PortException ("Bad log buffer size: " + ii->second);
+			options.erase (ii++);
+		}
+		else if (ii->first == "logoverflow")
+		{
+			if (ii->second == "block")
+				dropWhenFull = false;
+			else if (ii->second == "drop")
+				dropWhenFull = true;
+			else
+				throw PortException ("Bad log overflow policy: " + ii->second);
+			options.erase (ii++);
+		}
+		else if (ii->first == "compress")
+		{
+			compress = true;
+			options.erase (ii++);
+		}
+		else if (ii->first == "logsegment")
+		{
+			istringstream is (ii->second);
+			if (!(is >> segmentSize) || is.get (c))
+				throw PortException ("Bad log segment size: " + ii->second);
+			options.erase (ii++);
+		}
+		else
+		{
+			if (ii->first == "debug")
+			{
+				istringstream is (ii->second);
+				if (!(is >> _debug) || is.get (c))
+					throw PortException ("Bad debug level: " + ii->second);
+			}
+			ii++;
 		}
 	}
 	// The rest of the options go on to the underlying Port object
@@ -72,6 +122,9 @@ LogWriterPort::LogWriterPort (map<string, string> options)
 
 	// Initialise the log file
 	_logFile = new LogFile (_debug);
+	_logFile->SetWriteBuffer (logBufferSize, dropWhenFull);
+	_logFile->SetCompression (compress);
+	_logFile->SetSegmentSize (segmentSize);
 	_logFile->Open (_logFileName, false);
 }
 
@@ -107,6 +160,7 @@ void LogWriterPort::Close ()
 		cerr << "LogWriterPort::" << __func__ << "() Closing port" << endl;
 
 	_port->Close ();
+	ClearReadBuffer ();
 
 	if (_debug >= 2)
 		cerr << "LogWriterPort::" << __func__ << "() Port closed" << endl;
@@ -120,6 +174,10 @@ ssize_t LogWriterPort::Read (void * const buffer, size_t count)
 {
 	ssize_t receivedBytes;
 
+	// Data in the input buffer was logged when it was read into the buffer
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
 	// Read from the underlying port
 	receivedBytes = _port->Read (buffer, count);
 	if (receivedBytes > 0)
@@ -131,19 +189,60 @@ ssize_t LogWriterPort::Read (void * const buffer, size_t count)
 	return receivedBytes;
 }
 
+ssize_t LogWriterPort::ReadV (const struct iovec *iov, int iovcnt)
+{
+	ssize_t receivedBytes;
+
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBufferV (iov, iovcnt);
+
+	receivedBytes = _port->ReadV (iov, iovcnt);
+	if (receivedBytes > 0)
+		_logFile->WriteRead (iov, iovcnt, receivedBytes);
+
+	return receivedBytes;
+}
+
+ssize_t LogWriterPort::ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp)
+{
+	ssize_t receivedBytes;
+
+	if (ReadBufferUsage () > 0)
+	{
+		timestamp = _readBufferTimestamp;
+		return TakeFromReadBuffer (buffer, count);
+	}
+
+	receivedBytes = _port->ReadTimestamped (buffer, count, timestamp);
+	if (receivedBytes > 0)
+		_logFile->WriteRead (buffer, receivedBytes);
+
+	return receivedBytes;
+}
+
 ssize_t LogWriterPort::ReadFull (void * const buffer, size_t count)
 {
 	ssize_t receivedBytes;
+	size_t numBuffered = 0;
+
+	// Data in the input buffer was logged when it was read into the buffer
+	if (ReadBufferUsage () > 0)
+	{
+		numBuffered = TakeFromReadBuffer (buffer, count);
+		if (numBuffered == count)
+			return numBuffered;
+	}
 
 	// Read from the underlying port
-	receivedBytes = _port->ReadFull (buffer, count);
+	uint8_t *start = &(reinterpret_cast<uint8_t*> (buffer)[numBuffered]);
+	receivedBytes = _port->ReadFull (start, count - numBuffered);
 	if (receivedBytes > 0)
 	{
 		// Write a chunk representing this read
-		_logFile->WriteRead (buffer, receivedBytes);
+		_logFile->WriteRead (start, receivedBytes);
 	}
 
-	return receivedBytes;
+	return receivedBytes + numBuffered;
 }
 
 ssize_t LogWriterPort::Skip (size_t count)
@@ -151,7 +250,11 @@ ssize_t LogWriterPort::Skip (size_t count)
 	size_t numRead = 0, numToRead = 0;
 	uint8_t bytes[32];
 
+	if (_readBufferSize > 0)
+		return Port::Skip (count);
+
 	CheckPort (true);
+	_statistics._skipCalls++;
 
 	if (_debug >= 2)
 	{
@@ -169,6 +272,7 @@ ssize_t LogWriterPort::Skip (size_t count)
 			if (_debug >= 2)
 				cerr << "LogWriterPort::" << __func__ << "() Read " << numRead << " bytes." << endl;
 			numRead += result;
+			_statistics._skipBytes += result;
 		}
 		else
 		{
@@ -191,7 +295,11 @@ ssize_t LogWriterPort::SkipUntil (uint8_t terminator, unsigned int count)
 	unsigned int terminatorCount = 0;
 	uint8_t byte;
 
+	if (_readBufferSize > 0)
+		return Port::SkipUntil (terminator, count);
+
 	CheckPort (true);
+	_statistics._skipCalls++;
 
 	if (_debug >= 2)
 	{
@@ -209,6 +317,7 @@ ssize_t LogWriterPort::SkipUntil (uint8_t terminator, unsigned int count)
 			if (_debug >= 2)
 				cerr << "LogWriterPort::" << __func__ << "() Read " << result << " bytes." << endl;
 			numRead++;
+			_statistics._skipBytes++;
 			if (byte == terminator)
 			{
 				if (_debug >= 2)
@@ -235,11 +344,14 @@ ssize_t LogWriterPort::SkipUntil (uint8_t terminator, unsigned int count)
 
 ssize_t LogWriterPort::BytesAvailable ()
 {
-	return _port->BytesAvailable ();
+	return _port->BytesAvailable () + ReadBufferUsage ();
 }
 
 ssize_t LogWriterPort::BytesAvailableWait ()
 {
+	// Buffered data is available without waiting
+	if (ReadBufferUsage () > 0)
+		return BytesAvailable ();
 	return _port->BytesAvailableWait ();
 }
 
@@ -262,14 +374,38 @@ ssize_t LogWriterPort::Write (const void * const buffer, size_t count)
 	return numSent;
 }
 
+ssize_t LogWriterPort::WriteV (const struct iovec *iov, int iovcnt)
+{
+	ssize_t numSent = 0;
+
+	numSent = _port->WriteV (iov, iovcnt);
+	if (numSent > 0)
+		_logFile->WriteWrite (iov, iovcnt, numSent);
+
+	return numSent;
+}
+
+ssize_t LogWriterPort::WriteBatch (const struct iovec *messages, int count)
+{
+	ssize_t numSent = 0;
+
+	numSent = _port->WriteBatch (messages, count);
+	for (ssize_t ii = 0; ii < numSent; ii++)
+		_logFile->WriteWrite (messages[ii].iov_base, messages[ii].iov_len);
+
+	return numSent;
+}
+
 void LogWriterPort::Flush ()
 {
+	ClearReadBuffer ();
 	_port->Flush ();
 }
 
 void LogWriterPort::Drain ()
 {
 	_port->Drain ();
+	_logFile->Drain ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -282,10 +418,34 @@ std::string LogWriterPort::GetStatus () const
 
 	status << "LogWriter-specific status:" << endl;
 	status << "Writing to " << _logFileName << endl;
+	if (_logFile->GetCompression ())
+		status << "Log is compressed" << endl;
+	if (_logFile->GetSegmentSize () > 0)
+	{
+		status << "Log is split into segments of up to " << _logFile->GetSegmentSize () <<
+			" bytes" << endl;
+	}
+	size_t dropped = _logFile->GetDroppedChunks ();
+	if (dropped > 0)
+		status << "Dropped " << dropped << " chunks with full log buffers" << endl;
 
 	return _port->GetStatus () + status.str ();
 }
 
+PortStatistics LogWriterPort::GetStatistics () const
+{
+	// Reads and writes are counted by the underlying port; only skips are counted here
+	PortStatistics result = _port->GetStatistics ();
+	result.Add (_statistics);
+	return result;
+}
+
+void LogWriterPort::ResetStatistics ()
+{
+	_statistics.Reset ();
+	_port->ResetStatistics ();
+}
+
 void LogWriterPort::SetTimeout (Timeout timeout)
 {
 	_port->SetTimeout (timeout);
@@ -51,7 +51,11 @@ To create a LogWriterPort, append "log" to the port type in the port options pas
 @ref CreatePort. For example, a log writer that uses a serial port would be specified as the type
 "seriallog". Similarly, for a TCP port, use "tcplog". 
 
-@note Log files greater than 2GB in size are not supported.
+Each log is a pair of files, named by adding "r" (data read) and "w" (data written) to the file
+name. Logs can grow without limit, but long recordings may be easier to handle when split into
+segments with the logsegment option: when a file would grow beyond the segment size, it is
+continued in a new file with ".1", ".2" and so on added to its name. A @ref LogReaderPort given
+the original file name reads all the segments as one log.
 
 @note The timer resolution under Windows is milliseconds, not microseconds. This may result in
 inaccurate replay when using a log file created on a POSIX-compatible operating system.
@@ -62,6 +66,41 @@ See the @ref Port class documentation for how to use the common API.
  - file <string>
    - File name to save the log to.
    - Default: port.log
+ - readbuffer <integer>
+   - Handled by the log writer rather than the underlying port, so that each read that fills the
+     buffer is logged as a single chunk. See @ref Port.
+   - Default: 0
+ - logbuffer <integer>
+   - Size in bytes of the buffers used to write the log in the background. Each log file has two:
+     one is written to the disk by a separate thread while the other collects new data, so a
+     slow disk does not hold up reads and writes on the port. A buffer is written when it is half
+     full, or a tenth of a second after data was added to it; @ref Drain waits until everything
+     logged has been written. Set to 0 to write the log directly. Only available where POSIX
+     threads are; elsewhere the log is always written directly.
+   - Writing in the background has costs, which is why it is off by default:
+     - Data reaches the file up to a tenth of a second after it passed through the port, so a
+       crash can lose the last part of the log.
+     - With logoverflow=drop, data is left out of the log whenever the disk falls behind.
+     - An error writing the file is only reported by the next read, write or @ref Drain on the
+       port, not by the call whose data failed to be written.
+   - Default: 0 (write directly)
+ - logoverflow <string>
+   - What to do when data is logged faster than it can be written and both buffers are full:
+     - block: Wait for the disk to catch up. Nothing is lost.
+     - drop: Leave the data out of the log, so the port never waits for the disk. The number of
+       reads and writes left out is shown in the status.
+   - Default: block
+ - compress
+   - Compress the log with zlib. Chunks are collected into blocks of about 64kB (or one log buffer
+     when writing in the background) and each block is compressed as a whole. Timing is not
+     affected: chunks keep their time stamps. Log readers detect compressed logs automatically.
+     Only available when flexiport is built with zlib.
+   - Default: off
+ - logsegment <integer>
+   - Size in bytes at which each log file is continued in a new segment. Chunks (and compressed
+     blocks) are never split between segments, so a segment may be slightly larger than this when
+     writing in the background or compressing. Set to 0 to write each log to a single file.
+   - Default: 0
 
 All unused options will be passed on to the underlying port used.
 */
@@ -77,6 +116,10 @@ class FLEXIPORT_EXPORT LogWriterPort : public Port
 		void Close ();
 		/// @brief Read from the port.
 		ssize_t Read (void * const buffer, size_t count);
+		/// @brief Read from the port into several buffers.
+		ssize_t ReadV (const struct iovec *iov, int iovcnt);
+		/// @brief Read from the port and get the time the data arrived.
+		ssize_t ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp);
 		/// @brief Read the requested quantity of data from the port.
 		ssize_t ReadFull (void * const buffer, size_t count);
 		/// @brief Dump data until the specified number of bytes have been read.
@@ -90,20 +133,40 @@ class FLEXIPORT_EXPORT LogWriterPort : public Port
 		ssize_t BytesAvailableWait ();
 		/// @brief Write data to the port.
 		ssize_t Write (const void * const buffer, size_t count);
+		/** @brief Write data from several buffers to the port. The data written is logged as a
+		single chunk. */
+		ssize_t WriteV (const struct iovec *iov, int iovcnt);
+		/// @brief Write several messages to the port. Each message written is logged as a chunk.
+		ssize_t WriteBatch (const struct iovec *messages, int count);
 		/// @brief Flush the port's input and output buffers, discarding all data.
 		void Flush ();
-		/// @brief Drain the port's input and output buffers.
+		/// @brief Drain the port's input and output buffers, and wait for the log to be written.
 		void Drain ();
 		/// @brief Get the status of the port (type, device, etc).
 		std::string GetStatus () const;
 		/// @brief Set the timeout value in milliseconds.
 		void SetTimeout (Timeout timeout);
+		/// @brief Get the timeout of the underlying port.
+		Timeout GetTimeout () const                 { return _port->GetTimeout (); }
+		/// @brief Get the blocking property of the underlying port.
+		bool IsBlocking () const                    { return _port->IsBlocking (); }
 		/// @brief Set the read permissions of the port.
 		void SetCanRead (bool canRead);
 		/// @brief Set the write permissions of the port.
 		void SetCanWrite (bool canWrite);
 		/// @brief Check if the port is open
 		bool IsOpen () const;
+		/// @brief Get the read descriptor of the underlying port.
+		int GetReadDescriptor () const              { return _port->GetReadDescriptor (); }
+		/// @brief Get the write descriptor of the underlying port.
+		int GetWriteDescriptor () const             { return _port->GetWriteDescriptor (); }
+		/// @brief Get the statistics of the underlying port, plus skips made through this port.
+		PortStatistics GetStatistics () const;
+		/// @brief Reset the statistics of this port and the underlying port.
+		void ResetStatistics ();
+		/// @brief Get the number of bytes buffered by this port and the underlying port.
+		size_t GetReadBufferUsage () const
+			{ return ReadBufferUsage () + _port->GetReadBufferUsage (); }
 
 	private:
 		Port *_port;
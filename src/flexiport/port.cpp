@@ -27,6 +27,7 @@
 
 #include "port.h"
 #include "flexiport.h"
+#include "flexiport_config.h"
 
 #include <cstring>
 #include <assert.h>
@@ -41,6 +42,9 @@ using namespace std;
 	#define __func__    __FUNCTION__
 #endif
 
+// Size of the input buffer created when a view-based read is used without the readbuffer option
+const size_t DEFAULT_READ_BUFFER_SIZE = 4096;
+
 namespace flexiport
 {
 
@@ -50,19 +54,25 @@ namespace flexiport
 
 Port::Port ()
 	: _type ("none"), _debug (0), _timeout (-1, 0), _canRead (true),
-	_canWrite (true), _alwaysOpen (false)
+	_canWrite (true), _alwaysOpen (false), _readBuffer (NULL), _readBufferSize (0),
+	_readBufferStart (0), _readBufferEnd (0), _fillingReadBuffer (false),
+	_readBufferImplicit (false), _asyncUsed (false)
 {
 }
 
 Port::Port (unsigned int debug, Timeout timeout,
 			bool canRead, bool canWrite, bool alwaysOpen)
 	: _type ("none"), _debug (debug), _timeout (timeout), _canRead (canRead),
-	_canWrite (canWrite), _alwaysOpen (alwaysOpen)
+	_canWrite (canWrite), _alwaysOpen (alwaysOpen), _readBuffer (NULL), _readBufferSize (0),
+	_readBufferStart (0), _readBufferEnd (0), _fillingReadBuffer (false),
+	_readBufferImplicit (false), _asyncUsed (false)
 {
 }
 
 Port::~Port ()
 {
+	if (_readBuffer != NULL)
+		delete[] _readBuffer;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -112,6 +122,47 @@ ssize_t Port::ReadString (std::string &buffer)
 	return buffer.size ();
 }
 
+ssize_t Port::ReadV (const struct iovec *iov, int iovcnt)
+{
+	// Ports that cannot scatter data natively read into a temporary buffer, so that the port sees
+	// a single read
+	size_t count = IOVecLength (iov, iovcnt);
+	uint8_t *buffer = new uint8_t[count];
+	ssize_t result = 0;
+	try
+	{
+		result = Read (buffer, count);
+	}
+	catch (...)
+	{
+		delete[] buffer;
+		throw;
+	}
+	size_t offset = 0;
+	for (int ii = 0; ii < iovcnt && result > 0 && offset < static_cast<size_t> (result); ii++)
+	{
+		size_t numToCopy = iov[ii].iov_len;
+		if (numToCopy > result - offset)
+			numToCopy = result - offset;
+		memcpy (iov[ii].iov_base, &buffer[offset], numToCopy);
+		offset += numToCopy;
+	}
+	delete[] buffer;
+	return result;
+}
+
+ssize_t Port::ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp)
+{
+	if (ReadBufferUsage () > 0)
+	{
+		timestamp = _readBufferTimestamp;
+		return TakeFromReadBuffer (buffer, count);
+	}
+	ssize_t result = Read (buffer, count);
+	timestamp = Timestamp::Now (Timestamp::REALTIME);
+	return result;
+}
+
 ssize_t Port::ReadUntil (void * const buffer, size_t count, uint8_t terminator)
 {
 	size_t numRead = 0;
@@ -124,6 +175,31 @@ ssize_t Port::ReadUntil (void * const buffer, size_t count, uint8_t terminator)
 		cerr << "Port::" << __func__ << "() Reading until '" << terminator << "' or " <<
 			count << " bytes." << endl;
 	}
+	if (_readBufferSize > 0)
+	{
+		// Scan the input buffer for the terminator, refilling it with large reads as necessary
+		while (numRead < count)
+		{
+			ssize_t result = 0;
+			if (ReadBufferUsage () == 0 && (result = FillReadBuffer ()) <= 0)
+				return result; // Timeout or no data
+			uint8_t *start = &_readBuffer[_readBufferStart];
+			size_t available = ReadBufferUsage ();
+			if (available > count - numRead)
+				available = count - numRead;
+			uint8_t *end = reinterpret_cast<uint8_t*> (memchr (start, terminator, available));
+			size_t numToCopy = (end == NULL) ? available : end - start + 1;
+			numRead += TakeFromReadBuffer (&(reinterpret_cast<uint8_t*> (buffer)[numRead]),
+					numToCopy);
+			if (end != NULL)
+			{
+				if (_debug >= 2)
+					cerr << "Port::" << __func__ << "() Got terminator character." << endl;
+				break;
+			}
+		}
+		return numRead;
+	}
 	// Read bytes one at a time until either a timeout occurs, we hit the terminator byte, or
 	// we exhaust the buffer
 	while (numRead < count)
@@ -169,6 +245,29 @@ ssize_t Port::ReadStringUntil (std::string &buffer, char terminator)
 		cerr << "Port::" << __func__ << "() Reading string until receive '" << terminator <<
 			"'" << endl;
 	}
+	if (_readBufferSize > 0)
+	{
+		// Scan the input buffer for the terminator, refilling it with large reads as necessary
+		while (true)
+		{
+			ssize_t result = 0;
+			if (ReadBufferUsage () == 0 && (result = FillReadBuffer ()) <= 0)
+				return result; // Timeout or no data
+			char *start = reinterpret_cast<char*> (&_readBuffer[_readBufferStart]);
+			size_t available = ReadBufferUsage ();
+			char *end = reinterpret_cast<char*> (memchr (start, terminator, available));
+			size_t numToCopy = (end == NULL) ? available : end - start + 1;
+			buffer.append (start, numToCopy);
+			_readBufferStart += numToCopy;
+			if (end != NULL)
+			{
+				if (_debug >= 2)
+					cerr << "Port::" << __func__ << "() Got terminator char" << endl;
+				break;
+			}
+		}
+		return buffer.size ();
+	}
 	// Read bytes one at a time until either a timeout occurs or we hit the terminator byte
 	while (true)
 	{
@@ -206,17 +305,92 @@ ssize_t Port::ReadLine (char * const buffer, size_t count)
 	return numRead;
 }
 
+ssize_t Port::ReadFrameView (const uint8_t *&frame, uint8_t terminator)
+{
+	size_t numScanned = 0;
+	uint8_t *end = NULL;
+
+	CheckPort (true);
+	EnsureReadBuffer (0);
+
+	if (_debug >= 2)
+		cerr << "Port::" << __func__ << "() Reading frame until '" << terminator << "'" << endl;
+
+	// Scan the input buffer for the terminator, only looking at newly-received data each time
+	while ((end = reinterpret_cast<uint8_t*> (memchr (&_readBuffer[_readBufferStart + numScanned],
+				terminator, ReadBufferUsage () - numScanned))) == NULL)
+	{
+		numScanned = ReadBufferUsage ();
+		if (_readBufferStart == 0 && _readBufferEnd == _readBufferSize)
+		{
+			stringstream ss;
+			ss << "Port::" << __func__ << "() Frame is larger than the read buffer (" <<
+				_readBufferSize << " bytes).";
+			throw PortException (ss.str ());
+		}
+		ssize_t result = 0;
+		if ((result = FillReadBuffer ()) <= 0)
+			return result; // Timeout or no data; anything received stays in the buffer
+	}
+
+	frame = &_readBuffer[_readBufferStart];
+	size_t length = end - frame + 1;
+	_readBufferStart += length;
+	if (_debug >= 2)
+		cerr << "Port::" << __func__ << "() Got frame of " << length << " bytes." << endl;
+	return length;
+}
+
+ssize_t Port::ReadExactView (const uint8_t *&data, size_t count)
+{
+	CheckPort (true);
+	EnsureReadBuffer (count);
+
+	if (_debug >= 2)
+		cerr << "Port::" << __func__ << "() Reading " << count << " bytes." << endl;
+
+	// FillReadBuffer moves unread data to the front, so there is always room for count bytes
+	while (ReadBufferUsage () < count)
+	{
+		ssize_t result = 0;
+		if ((result = FillReadBuffer ()) <= 0)
+			return result; // Timeout or no data; anything received stays in the buffer
+	}
+
+	data = &_readBuffer[_readBufferStart];
+	_readBufferStart += count;
+	return count;
+}
+
 ssize_t Port::Skip (size_t count)
 {
 	size_t numRead = 0, numToRead = 0;
 	uint8_t bytes[32];
 
 	CheckPort (true);
+	_statistics._skipCalls++;
 
 	if (_debug >= 2)
 	{
 		cerr << "Port::" << __func__ << "() Skipping " << count << " bytes." << endl;
 	}
+	if (_readBufferSize > 0)
+	{
+		// Discard data from the input buffer, refilling it as necessary
+		while (numRead < count)
+		{
+			ssize_t result = 0;
+			if (ReadBufferUsage () == 0 && (result = FillReadBuffer ()) <= 0)
+				return result; // Timeout or no data
+			numToRead = ReadBufferUsage ();
+			if (numToRead > count - numRead)
+				numToRead = count - numRead;
+			_readBufferStart += numToRead;
+			numRead += numToRead;
+			_statistics._skipBytes += numToRead;
+		}
+		return numRead;
+	}
 	// Read up to 32 bytes at a time until either a timeout occurs or we hit the terminator byte
 	while (numRead < count)
 	{
@@ -229,6 +403,7 @@ ssize_t Port::Skip (size_t count)
 			if (_debug >= 2)
 				cerr << "Port::" << __func__ << "() Read " << numRead << " bytes." << endl;
 			numRead += result;
+			_statistics._skipBytes += result;
 		}
 		else
 		{
@@ -249,12 +424,40 @@ ssize_t Port::SkipUntil (uint8_t terminator, unsigned int count)
 	uint8_t byte;
 
 	CheckPort (true);
+	_statistics._skipCalls++;
 
 	if (_debug >= 2)
 	{
 		cerr << "Port::" << __func__ << "() Skipping until '" << terminator << "' is seen " <<
 			count << " times." << endl;
 	}
+	if (_readBufferSize > 0)
+	{
+		// Scan the input buffer for terminators, refilling it as necessary
+		while (terminatorCount < count)
+		{
+			ssize_t result = 0;
+			if (ReadBufferUsage () == 0 && (result = FillReadBuffer ()) <= 0)
+				return result; // Timeout or no data
+			uint8_t *start = &_readBuffer[_readBufferStart];
+			size_t available = ReadBufferUsage ();
+			uint8_t *end = reinterpret_cast<uint8_t*> (memchr (start, terminator, available));
+			size_t numToSkip = available;
+			if (end != NULL)
+			{
+				if (_debug >= 2)
+					cerr << "Port::" << __func__ << "() Got terminator character." << endl;
+				numToSkip = end - start + 1;
+				terminatorCount++;
+			}
+			_readBufferStart += numToSkip;
+			numRead += numToSkip;
+			_statistics._skipBytes += numToSkip;
+		}
+		if (_debug >= 2)
+			cerr << "Port::" << __func__ << "() All terminators found." << endl;
+		return numRead;
+	}
 	// Read bytes one at a time until either a timeout occurs or we hit the terminator byte
 	while (terminatorCount < count)
 	{
@@ -266,6 +469,7 @@ ssize_t Port::SkipUntil (uint8_t terminator, unsigned int count)
 			if (_debug >= 2)
 				cerr << "Port::" << __func__ << "() Read " << result << " bytes." << endl;
 			numRead++;
+			_statistics._skipBytes++;
 			if (byte == terminator)
 			{
 				if (_debug >= 2)
@@ -291,6 +495,32 @@ ssize_t Port::SkipUntil (uint8_t terminator, unsigned int count)
 // Write functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+ssize_t Port::WriteV (const struct iovec *iov, int iovcnt)
+{
+	// Ports that cannot gather data natively copy it into a temporary buffer, so that the port
+	// sees a single write
+	size_t count = IOVecLength (iov, iovcnt);
+	uint8_t *buffer = new uint8_t[count];
+	size_t offset = 0;
+	for (int ii = 0; ii < iovcnt; ii++)
+	{
+		memcpy (&buffer[offset], iov[ii].iov_base, iov[ii].iov_len);
+		offset += iov[ii].iov_len;
+	}
+	ssize_t result = 0;
+	try
+	{
+		result = Write (buffer, count);
+	}
+	catch (...)
+	{
+		delete[] buffer;
+		throw;
+	}
+	delete[] buffer;
+	return result;
+}
+
 ssize_t Port::WriteFull (const void * const buffer, size_t count)
 {
 	size_t totalWritten = 0;
@@ -328,6 +558,23 @@ ssize_t Port::WriteFull (const void * const buffer, size_t count)
 	return totalWritten;
 }
 
+ssize_t Port::WriteBatch (const struct iovec *messages, int count)
+{
+	for (int ii = 0; ii < count; ii++)
+	{
+		ssize_t numWritten = Write (messages[ii].iov_base, messages[ii].iov_len);
+		if (numWritten < 0)
+			return ii > 0 ? ii : -1; // Timed out
+		if (static_cast<size_t> (numWritten) < messages[ii].iov_len)
+		{
+			// Finish this message so that the next one starts at a message boundary
+			WriteFull (&(reinterpret_cast<const uint8_t*> (messages[ii].iov_base)[numWritten]),
+					messages[ii].iov_len - numWritten);
+		}
+	}
+	return count;
+}
+
 ssize_t Port::WriteString (const char * const buffer)
 {
 	ssize_t numWritten = 0, numToWrite = strlen (buffer);
@@ -345,6 +592,30 @@ ssize_t Port::WriteString (const char * const buffer)
 	return numWritten;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous API (implemented in asyncio.cpp when available)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if !defined (FLEXIPORT_HAVE_ASYNC)
+void Port::AsyncRead (void * const buffer, size_t count, AsyncCallback *callback,
+		AsyncQueue *queue)
+{
+	throw PortException (string ("Port::") + __func__ +
+			"() Asynchronous I/O is not supported on this system.");
+}
+
+void Port::AsyncWrite (const void * const buffer, size_t count, AsyncCallback *callback,
+		AsyncQueue *queue)
+{
+	throw PortException (string ("Port::") + __func__ +
+			"() Asynchronous I/O is not supported on this system.");
+}
+
+void Port::CancelAsync ()
+{
+}
+#endif // !defined (FLEXIPORT_HAVE_ASYNC)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Other public API functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -360,10 +631,44 @@ string Port::GetStatus () const
 	status << "Will block: " << IsBlocking ();
 	status << "\tPermissions: " << ((_canRead && _canWrite) ? "rw" :
 			(_canRead ? "r" : "w")) << endl;
+	if (_readBufferSize > 0)
+	{
+		status << "Read buffer: " << _readBufferEnd - _readBufferStart << "/" << _readBufferSize <<
+			" bytes used" << (_readBufferImplicit ? " (enabled by a view-based read)" : "") << endl;
+	}
+	status << GetStatistics ().AsString ();
 
 	return status.str ();
 }
 
+void Port::SetReadBufferSize (size_t size)
+{
+	size_t usage = _readBufferEnd - _readBufferStart;
+
+	if (usage > size)
+	{
+		stringstream ss;
+		ss << "Port::" << __func__ << "() Cannot shrink read buffer to " << size <<
+			" bytes; it contains " << usage << " bytes of unread data.";
+		throw PortException (ss.str ());
+	}
+
+	uint8_t *newBuffer = NULL;
+	if (size > 0)
+	{
+		newBuffer = new uint8_t[size];
+		if (usage > 0)
+			memcpy (newBuffer, &_readBuffer[_readBufferStart], usage);
+	}
+	if (_readBuffer != NULL)
+		delete[] _readBuffer;
+	_readBuffer = newBuffer;
+	_readBufferSize = size;
+	_readBufferStart = 0;
+	_readBufferEnd = usage;
+	_readBufferImplicit = false;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Internal functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -458,7 +763,125 @@ bool Port::ProcessOption (const string &option, const string &value)
 		return true;
 	}
 
+	else if (option == "readbuffer")
+	{
+		size_t size = 0;
+		istringstream is (value);
+		if (!(is >> size) || is.get (c))
+			throw PortException ("Bad read buffer size: " + value);
+		SetReadBufferSize (size);
+		return true;
+	}
+
 	return false;
 }
 
+size_t Port::TakeFromReadBufferV (const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int ii = 0; ii < iovcnt && ReadBufferUsage () > 0; ii++)
+		total += TakeFromReadBuffer (iov[ii].iov_base, iov[ii].iov_len);
+	return total;
+}
+
+size_t Port::TakeFromReadBuffer (void * const buffer, size_t count)
+{
+	size_t usage = _readBufferEnd - _readBufferStart;
+	if (count > usage)
+		count = usage;
+
+	memcpy (buffer, &_readBuffer[_readBufferStart], count);
+	_readBufferStart += count;
+	if (_readBufferStart == _readBufferEnd)
+		_readBufferStart = _readBufferEnd = 0;   // Empty, so start again from the front
+	return count;
+}
+
+void Port::CountWait (const Timestamp &start, bool timedOut)
+{
+	_statistics._waitTime += Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+		start.AsNanoseconds ();
+	if (timedOut)
+		_statistics._timeouts++;
+}
+
+void Port::CountLatency (const Timestamp &arrival)
+{
+	if (arrival._clock == Timestamp::NONE)
+		return;
+	_statistics.AddLatency (Timestamp::Now (arrival._clock).AsNanoseconds () -
+			arrival.AsNanoseconds ());
+}
+
+void Port::EnsureReadBuffer (size_t minSize)
+{
+	if (_readBufferSize == 0 || _readBufferSize < minSize)
+	{
+		// A buffer enabled here rather than by the readbuffer option stays marked as such, so
+		// GetStatus can show why a port that was never asked to buffer is doing so
+		bool implicit = _readBufferSize == 0 || _readBufferImplicit;
+		size_t size = _readBufferSize == 0 ? DEFAULT_READ_BUFFER_SIZE : _readBufferSize;
+		while (size < minSize)
+			size *= 2;
+		if (_debug >= 1)
+			cerr << "Port::" << __func__ << "() Setting read buffer size to " << size << endl;
+		SetReadBufferSize (size);
+		_readBufferImplicit = implicit;
+	}
+}
+
+ssize_t Port::FillReadBuffer ()
+{
+	ssize_t result = 0;
+
+	// Move any unread data to the front of the buffer to make room at the end
+	if (_readBufferStart > 0)
+	{
+		memmove (_readBuffer, &_readBuffer[_readBufferStart], _readBufferEnd - _readBufferStart);
+		_readBufferEnd -= _readBufferStart;
+		_readBufferStart = 0;
+	}
+	if (_readBufferEnd == _readBufferSize)
+	{
+		stringstream ss;
+		ss << "Port::" << __func__ << "() Read buffer is full (" << _readBufferSize << " bytes).";
+		throw PortException (ss.str ());
+	}
+
+	// While filling, ReadBufferUsage reports the buffer as empty so that the port's Read goes
+	// straight to the underlying device
+	_fillingReadBuffer = true;
+	Timestamp timestamp;
+	try
+	{
+		result = ReadTimestamped (&_readBuffer[_readBufferEnd], _readBufferSize - _readBufferEnd,
+				timestamp);
+	}
+	catch (...)
+	{
+		_fillingReadBuffer = false;
+		throw;
+	}
+	_fillingReadBuffer = false;
+
+	if (result > 0)
+	{
+		// Data left in the buffer arrived before this data, so keeps its timestamp
+		if (_readBufferEnd == 0)
+			_readBufferTimestamp = timestamp;
+		_readBufferEnd += result;
+	}
+	else if (result == 0 && IsBlocking ())
+	{
+		// No data received and didn't timeout
+		cerr << "Port::" << __func__ << "() Got no data when in blocking mode." << endl;
+	}
+	if (_debug >= 2)
+	{
+		cerr << "Port::" << __func__ << "() Read " << result << " bytes into buffer; " <<
+			_readBufferEnd - _readBufferStart << " bytes buffered." << endl;
+	}
+	return result;
+}
+
 } // namespace flexiport
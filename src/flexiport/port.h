@@ -45,6 +45,8 @@
 
 #include "flexiport_types.h"
 #include "timeout.h"
+#include "timestamp.h"
+#include "statistics.h"
 
 /** @ingroup gbx_library_flexiport
 @{
@@ -53,6 +55,18 @@
 namespace flexiport
 {
 
+class AsyncCallback;
+class AsyncQueue;
+
+/// @brief Get the total length of the buffers in a scatter/gather array.
+inline size_t IOVecLength (const struct iovec *iov, int iovcnt)
+{
+	size_t length = 0;
+	for (int ii = 0; ii < iovcnt; ii++)
+		length += iov[ii].iov_len;
+	return length;
+}
+
 /**
 @brief Base Port class.
 
@@ -74,7 +88,18 @@ All functions may throw exceptions of type @ref PortException.
  - alwaysopen
    - The port should be open for as long as the object exists. It will be opened when constructed
      and if it closes unexpectedly, an attempt will be made to reopen it.
-   - Default: off */
+   - Default: off
+ - readbuffer <integer>
+   - Size in bytes of an input buffer kept by the port. When set, @ref ReadUntil,
+     @ref ReadStringUntil, @ref Skip and @ref SkipUntil fill the buffer with large reads and scan
+     it for terminators, rather than reading one byte at a time. Data left in the buffer is
+     returned by subsequent reads. Set to 0 to disable.
+   - @ref ReadFrameView and @ref ReadExactView need the buffer, so the first call to either
+     enables it with a size of 4096 bytes (or more, to fit the requested data) if it is not set.
+     From then on, all reads from the port are buffered as if this option had been given. The
+     status returned by @ref GetStatus shows when this has happened. Set this option to choose the
+     size instead.
+   - Default: 0 */
 class FLEXIPORT_EXPORT Port
 {
 	public:
@@ -111,6 +136,31 @@ class FLEXIPORT_EXPORT Port
 		shouldn't happen). */
 		virtual ssize_t ReadFull (void * const buffer, size_t count) = 0;
 
+		/** @brief Read from the port into several buffers.
+
+		Behaves the same as @ref Read, but the data is scattered across the @ref iovcnt buffers
+		described by @ref iov, filling each in turn.
+
+		@return The total number of bytes read, or -1 if a timeout occured. If zero is returned,
+		this indicates that the port closed. */
+		virtual ssize_t ReadV (const struct iovec *iov, int iovcnt);
+
+		/** @brief Read from the port and get the time the data arrived.
+
+		Behaves the same as @ref Read, and also sets @ref timestamp to the best estimate of when
+		the first byte of the data arrived. Network ports use the time recorded by the kernel when
+		the packet was received (on the @ref Timestamp::REALTIME clock). Serial ports use the
+		@ref Timestamp::MONOTONIC clock, sampled as soon as the wait for data ends and corrected
+		for the time taken to transfer the data at the port's baud rate. Other ports sample the
+		@ref Timestamp::REALTIME clock after reading.
+
+		When the data comes from the input buffer (see the readbuffer option), the timestamp is
+		that of the read that filled the front of the buffer.
+
+		@return The number of bytes read, or -1 if a timeout occured. If zero is returned, this
+		indicates that the port closed. */
+		virtual ssize_t ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp);
+
 		/** @brief Read a string.
 
 		A convenience function that reads data from the port and returns it in a string. Behaves
@@ -127,6 +177,7 @@ class FLEXIPORT_EXPORT Port
 
 		@note This function makes many calls to Read, each of which has an individual timeout. The
 		maximum length of time this function make take may therefore be longer than one timeout.
+		If the readbuffer option is set, data is read in blocks rather than one byte at a time.
 
 		@note If the port is set to non-blocking mode (by setting the timeout to zero), this will
 		effectively timeout immediatly when there is no data available, returning -1 irrespective
@@ -193,6 +244,35 @@ class FLEXIPORT_EXPORT Port
 		@return The length of the string (including the new line), or -1 if a timeout occured. */
 		virtual ssize_t ReadLine (std::string &buffer) { return ReadStringUntil (buffer, '\n'); }
 
+		/** @brief Read data until a specified termination byte is received, without copying it.
+
+		Similar to @ref ReadUntil, but rather than copying the data into a caller-provided buffer,
+		@ref frame is set to point at the data in the port's input buffer. The data is valid until
+		the next read from the port (including calls to @ref BytesAvailable and @ref Flush) or the
+		next change to the buffer size.
+
+		If the input buffer has not been enabled with the readbuffer option, it will be enabled
+		with a default size and stays enabled for all later reads (see the readbuffer option).
+		A frame must fit in the input buffer; an exception is thrown if the
+		buffer fills without the terminator being received.
+
+		@note Unlike @ref ReadUntil, data received before a timeout is not lost. It will be
+		returned by the next read.
+
+		@return The length of the frame (including the terminator), -1 if a timeout occured, or
+		zero if no data was available and the port is non-blocking or closed. */
+		virtual ssize_t ReadFrameView (const uint8_t *&frame, uint8_t terminator);
+
+		/** @brief Read the requested quantity of data from the port, without copying it.
+
+		Similar to @ref ReadFrameView, but returns exactly @ref count bytes. The input buffer is
+		enlarged if it is smaller than @ref count. The data is valid until the next read from the
+		port. Unlike @ref ReadFull, this function obeys the timeout.
+
+		@return @ref count, -1 if a timeout occured, or zero if no data was available and the port
+		is non-blocking or closed. */
+		virtual ssize_t ReadExactView (const uint8_t *&data, size_t count);
+
 		/** @brief Dump data until the specified number of bytes have been read.
 
  		@return The number of bytes that were skipped, or -1 if a timeout occured. */
@@ -228,6 +308,16 @@ class FLEXIPORT_EXPORT Port
 		already full and a timeout occurs. */
 		virtual ssize_t Write (const void * const buffer, size_t count) = 0;
 
+		/** @brief Write data from several buffers to the port.
+
+		Behaves the same as @ref Write, but the data is gathered from the @ref iovcnt buffers
+		described by @ref iov, in order, and written in a single operation. Useful for sending a
+		message whose header, payload and checksum are in separate buffers without copying them
+		together first.
+
+		@return The total number of bytes actually written, or -1 if a timeout occured. */
+		virtual ssize_t WriteV (const struct iovec *iov, int iovcnt);
+
 		/** @brief Write all the data to the port.
 
 		Similar to @ref Write, but will keep trying until all data is written to the port rather
@@ -236,6 +326,17 @@ class FLEXIPORT_EXPORT Port
 		@return The number of bytes actually written. */
 		virtual ssize_t WriteFull (const void * const buffer, size_t count);
 
+		/** @brief Write several messages to the port.
+
+		Each of the @ref count buffers described by @ref messages is written in full as a separate
+		message. For datagram-oriented ports, each message is sent as its own datagram, and ports
+		that support it send the whole batch in a single system call. A message is never partially
+		written.
+
+		@return The number of messages written, which may be less than @ref count if a timeout
+		occurs part way through the batch, or -1 if a timeout occured before any were written. */
+		virtual ssize_t WriteBatch (const struct iovec *messages, int count);
+
 		/** @brief Write a string to the port.
 
 		A convenience function that writes a null-terminated string to the port. Behaves identically
@@ -257,8 +358,44 @@ class FLEXIPORT_EXPORT Port
 		Waits until timeout for the port to finish transmitting data in its output buffer. */
 		virtual void Drain () = 0;
 
-		/// @brief Get the status of the port (type, device, etc).
+		/** @brief Start an asynchronous read.
+
+		Returns immediately. Up to @ref count bytes will be read into @ref buffer by a shared
+		reactor thread when data arrives, behaving the same as @ref Read, after which @ref callback
+		is called with the result. If @ref queue is given, the callback is posted to it and run
+		by @ref AsyncQueue::Dispatch; otherwise it runs in the reactor thread and must not block.
+
+		Multiple reads (and writes) may be outstanding at once; they are performed in the order
+		they were started. If the port's timeout passes without the port becoming ready, all its
+		outstanding operations complete with a result of -1. @ref buffer must remain valid until
+		the operation completes. The port must not be used directly while operations are
+		outstanding, and @ref CancelAsync must be called before closing or destroying the port.
+
+		@note A timeout should be set on ports used asynchronously, so that their descriptors are
+		non-blocking. This is only available on systems that provide epoll and pthreads. */
+		void AsyncRead (void * const buffer, size_t count, AsyncCallback *callback,
+				AsyncQueue *queue = NULL);
+
+		/** @brief Start an asynchronous write.
+
+		Similar to @ref AsyncRead, but writes all @ref count bytes from @ref buffer, as
+		@ref WriteFull does, before completing. */
+		void AsyncWrite (const void * const buffer, size_t count, AsyncCallback *callback,
+				AsyncQueue *queue = NULL);
+
+		/** @brief Cancel all outstanding asynchronous operations on this port.
+
+		Their callbacks will not be called. Once this returns, the reactor will not use the port
+		again, although callbacks of operations that completed just before the call may still be
+		running or waiting in a queue. */
+		void CancelAsync ();
+
+		/// @brief Get the status of the port (type, device, statistics, etc).
 		virtual std::string GetStatus () const;
+		/// @brief Get the I/O counters and read latency histogram of the port.
+		virtual PortStatistics GetStatistics () const   { return _statistics; }
+		/// @brief Reset the I/O counters and read latency histogram of the port to zero.
+		virtual void ResetStatistics ()                 { _statistics.Reset (); }
 
 		// Accessor methods.
 		/// @brief Get the port type.
@@ -290,6 +427,27 @@ class FLEXIPORT_EXPORT Port
 		virtual bool CanWrite () const          { return _canWrite; }
 		/// @brief Check if the port is open
 		virtual bool IsOpen () const = 0;
+		/** @brief Set the size of the input buffer. Set to zero to disable buffering.
+
+		Any data already in the buffer is kept. An exception is thrown if it will not fit in the
+		new size. */
+		void SetReadBufferSize (size_t size);
+		/// @brief Get the size of the input buffer. Zero means buffering is disabled.
+		size_t GetReadBufferSize () const       { return _readBufferSize; }
+		/** @brief Get the number of bytes waiting in the input buffer, including any data queued
+		internally by the port implementation.
+
+		When waiting on the port's descriptor directly, check this first: buffered data will not
+		make the descriptor readable. */
+		virtual size_t GetReadBufferUsage () const
+			{ return ReadBufferUsage (); }
+		/** @brief Get the file descriptor that becomes readable when data arrives at the port, for
+		use with select (), poll () or a @ref PortSet. Returns -1 if there is no such descriptor
+		(e.g. the port is closed or is not backed by a file descriptor). */
+		virtual int GetReadDescriptor () const  { return -1; }
+		/** @brief Get the file descriptor that becomes writable when data can be sent, or -1 if
+		there is no such descriptor. */
+		virtual int GetWriteDescriptor () const { return -1; }
 
 	protected:
 		std::string _type;  // Port type string (e.g. "tcp" or "serial" or "usb")
@@ -299,6 +457,14 @@ class FLEXIPORT_EXPORT Port
 		bool _canWrite;     // If true, this port can be written to.
 		bool _alwaysOpen;   // If the port should be kept open for the life of the object (including
 		                    // reopening it if necessary).
+		uint8_t *_readBuffer;       // Input buffer used when the readbuffer option is set.
+		size_t _readBufferSize;     // Size of _readBuffer. Zero if buffering is disabled.
+		size_t _readBufferStart;    // Index of the first unread byte in _readBuffer.
+		size_t _readBufferEnd;      // Index one past the last unread byte in _readBuffer.
+		bool _fillingReadBuffer;    // True while FillReadBuffer is reading from the port.
+		bool _readBufferImplicit;   // True if a view-based read enabled the buffer.
+		Timestamp _readBufferTimestamp; // Arrival time of the data at the front of _readBuffer.
+		PortStatistics _statistics;
 
 		// Protected constructor to prevent direct creation of this class.
 		Port ();
@@ -309,7 +475,29 @@ class FLEXIPORT_EXPORT Port
 		virtual bool ProcessOption (const std::string &option, const std::string &value);
 		virtual void CheckPort (bool read) = 0;
 
+		// Input buffer management. Port implementations must call TakeFromReadBuffer at the start
+		// of Read (and ReadFull) when ReadBufferUsage is non-zero, include ReadBufferUsage in
+		// BytesAvailable, and call ClearReadBuffer when flushed or closed.
+		size_t ReadBufferUsage () const
+			{ return _fillingReadBuffer ? 0 : _readBufferEnd - _readBufferStart; }
+		size_t TakeFromReadBuffer (void * const buffer, size_t count);
+		size_t TakeFromReadBufferV (const struct iovec *iov, int iovcnt);
+		ssize_t FillReadBuffer ();
+		void ClearReadBuffer ()                 { _readBufferStart = _readBufferEnd = 0; }
+		void EnsureReadBuffer (size_t minSize);
+
+		// Statistics. Port implementations count each read and write of the device, each wait in
+		// select () (passing the time the wait started) and the arrival time of timestamped data.
+		void CountRead (ssize_t result)
+			{ _statistics._readCalls++; if (result > 0) _statistics._readBytes += result; }
+		void CountWrite (ssize_t result)
+			{ _statistics._writeCalls++; if (result > 0) _statistics._writeBytes += result; }
+		void CountWait (const Timestamp &start, bool timedOut);
+		void CountLatency (const Timestamp &arrival);
+
 	private:
+		bool _asyncUsed;    // Set once an asynchronous operation has been started
+
 		// Private copy constructor to prevent unintended copying.
 		Port (const Port&);
 		void operator= (const Port&);
@@ -0,0 +1,430 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "portset.h"
+#include "flexiport.h"
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+namespace flexiport
+{
+
+inline int ErrNo ()
+{
+	return errno;
+}
+
+inline string StrError (int errNo)
+{
+	return string (strerror (errNo));
+}
+
+// Monotonic clock in microseconds, used for port deadlines
+static int64_t GetTime ()
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return static_cast<int64_t> (now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t TimeoutToMicroseconds (const Timeout &timeout)
+{
+	return static_cast<int64_t> (timeout._sec) * 1000000 + timeout._usec;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Constructor/destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PortSet::PortSet ()
+	: _epollFD (-1)
+{
+	if ((_epollFD = epoll_create (16)) < 0)
+	{
+		stringstream ss;
+		ss << "PortSet::" << __func__ << "() epoll_create() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	fcntl (_epollFD, F_SETFD, FD_CLOEXEC);
+
+	// The interrupt pipe is registered with a NULL data pointer so it can be told apart from ports
+	if (pipe (_interruptPipe) < 0)
+	{
+		stringstream ss;
+		ss << "PortSet::" << __func__ << "() pipe() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		close (_epollFD);
+		throw PortException (ss.str ());
+	}
+	for (int ii = 0; ii < 2; ii++)
+	{
+		fcntl (_interruptPipe[ii], F_SETFL, fcntl (_interruptPipe[ii], F_GETFL) | O_NONBLOCK);
+		fcntl (_interruptPipe[ii], F_SETFD, FD_CLOEXEC);
+	}
+	struct epoll_event event;
+	memset (&event, 0, sizeof (event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl (_epollFD, EPOLL_CTL_ADD, _interruptPipe[0], &event) < 0)
+	{
+		stringstream ss;
+		ss << "PortSet::" << __func__ << "() epoll_ctl() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		close (_interruptPipe[0]);
+		close (_interruptPipe[1]);
+		close (_epollFD);
+		throw PortException (ss.str ());
+	}
+}
+
+PortSet::~PortSet ()
+{
+	for (map<Port*, Entry*>::iterator ii = _entries.begin (); ii != _entries.end (); ii++)
+		delete ii->second;
+	close (_interruptPipe[0]);
+	close (_interruptPipe[1]);
+	close (_epollFD);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Port management
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PortSet::Add (Port *port, unsigned int events)
+{
+	map<Port*, Entry*>::iterator entry = _entries.find (port);
+	if (entry != _entries.end ())
+	{
+		Modify (port, events);
+		return;
+	}
+
+	Entry *newEntry = new Entry;
+	newEntry->port = port;
+	newEntry->events = events & (READABLE | WRITABLE);
+	newEntry->readFD = newEntry->writeFD = -1;
+	newEntry->recheck = false;
+	ResetDeadline (newEntry, GetTime ());
+	try
+	{
+		Register (newEntry);
+	}
+	catch (...)
+	{
+		delete newEntry;
+		throw;
+	}
+	_entries[port] = newEntry;
+}
+
+void PortSet::Modify (Port *port, unsigned int events)
+{
+	map<Port*, Entry*>::iterator entry = _entries.find (port);
+	if (entry == _entries.end ())
+		throw PortException (string ("PortSet::") + __func__ + "() Port is not in the set.");
+
+	Unregister (entry->second);
+	entry->second->events = events & (READABLE | WRITABLE);
+	ResetDeadline (entry->second, GetTime ());
+	Register (entry->second);
+}
+
+void PortSet::Remove (Port *port)
+{
+	map<Port*, Entry*>::iterator entry = _entries.find (port);
+	if (entry == _entries.end ())
+		return;
+
+	Unregister (entry->second);
+	delete entry->second;
+	_entries.erase (entry);
+}
+
+void PortSet::Refresh (Port *port)
+{
+	map<Port*, Entry*>::iterator entry = _entries.find (port);
+	if (entry == _entries.end ())
+		return;
+
+	Unregister (entry->second);
+	entry->second->recheck = false;
+	if (port->IsOpen ())
+		Register (entry->second);
+	else
+		entry->second->recheck = true;  // Registered once it has been opened
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Waiting
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t PortSet::Wait (vector<Ready> &ready, Timeout timeout)
+{
+	const int MAX_EVENTS = 64;
+	struct epoll_event events[MAX_EVENTS];
+	map<Entry*, unsigned int> flags;
+	bool havePolledPorts = false;
+	int64_t now = GetTime ();
+	int64_t waitUntil = (timeout._sec < 0) ? -1 : now + TimeoutToMicroseconds (timeout);
+
+	ready.clear ();
+
+	// Check for ports that are ready without waiting, and for ports whose descriptors have changed
+	for (map<Port*, Entry*>::iterator ii = _entries.begin (); ii != _entries.end (); ii++)
+	{
+		Entry *entry = ii->second;
+		if (!entry->port->IsOpen ())
+		{
+			flags[entry] = CLOSED;
+			entry->recheck = true;
+			continue;
+		}
+		if (entry->recheck || DescriptorsChanged (entry))
+		{
+			// The port may have been closed and reopened (possibly getting the same descriptor
+			// numbers back) since it was last reported, so register it again
+			Unregister (entry);
+			Register (entry);
+			entry->recheck = false;
+		}
+
+		unsigned int entryFlags = 0;
+		if (entry->events & READABLE)
+		{
+			if (entry->port->GetReadBufferUsage () > 0)
+				entryFlags |= READABLE;
+			else if (entry->readFD < 0)
+			{
+				havePolledPorts = true;
+				if (entry->port->BytesAvailable () > 0)
+					entryFlags |= READABLE;
+			}
+		}
+		// Ports without a write descriptor are assumed to always be writable
+		if ((entry->events & WRITABLE) && entry->writeFD < 0)
+			entryFlags |= WRITABLE;
+		if (entryFlags != 0)
+			flags[entry] = entryFlags;
+	}
+
+	// Figure out how long to wait for: until the earliest deadline or the caller's timeout
+	int64_t waitFor = -1;
+	if (!flags.empty ())
+		waitFor = 0;
+	else
+	{
+		if (waitUntil >= 0)
+			waitFor = waitUntil - now;
+		for (map<Port*, Entry*>::iterator ii = _entries.begin (); ii != _entries.end (); ii++)
+		{
+			if (ii->second->deadline >= 0 &&
+					(waitFor < 0 || ii->second->deadline - now < waitFor))
+				waitFor = ii->second->deadline - now;
+		}
+		if (havePolledPorts && (waitFor < 0 || waitFor > POLL_INTERVAL_MS * 1000))
+			waitFor = POLL_INTERVAL_MS * 1000;
+		if (waitFor < -1)
+			waitFor = 0;
+	}
+	// Round up to whole milliseconds so deadlines have passed when epoll_wait returns
+	int waitMS = (waitFor < 0) ? -1 : static_cast<int> ((waitFor + 999) / 1000);
+
+	int numEvents = epoll_wait (_epollFD, events, MAX_EVENTS, waitMS);
+	if (numEvents < 0)
+	{
+		if (ErrNo () != EINTR)
+		{
+			stringstream ss;
+			ss << "PortSet::" << __func__ << "() epoll_wait() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			throw PortException (ss.str ());
+		}
+		numEvents = 0;  // Interrupted by a signal, treat as a spurious wake up
+	}
+
+	for (int ii = 0; ii < numEvents; ii++)
+	{
+		Entry *entry = reinterpret_cast<Entry*> (events[ii].data.ptr);
+		if (entry == NULL)
+		{
+			// Interrupted; empty the pipe
+			char dump[32];
+			while (read (_interruptPipe[0], dump, sizeof (dump)) > 0);
+			continue;
+		}
+		unsigned int entryFlags = 0;
+		if (events[ii].events & EPOLLIN)
+			entryFlags |= READABLE;
+		if (events[ii].events & EPOLLOUT)
+			entryFlags |= WRITABLE;
+		if (events[ii].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+		{
+			// Reading will show what happened (and reconnect if the port is set to always open)
+			entryFlags |= HANGUP | (entry->events & READABLE);
+			entry->recheck = true;
+		}
+		flags[entry] |= entryFlags;
+	}
+
+	// Check any polled ports again if nothing else happened
+	now = GetTime ();
+	if (havePolledPorts && flags.empty ())
+	{
+		for (map<Port*, Entry*>::iterator ii = _entries.begin (); ii != _entries.end (); ii++)
+		{
+			Entry *entry = ii->second;
+			if ((entry->events & READABLE) && entry->readFD < 0 &&
+					entry->port->BytesAvailable () > 0)
+				flags[entry] |= READABLE;
+		}
+	}
+
+	// Anything not ready whose deadline has passed has timed out
+	for (map<Port*, Entry*>::iterator ii = _entries.begin (); ii != _entries.end (); ii++)
+	{
+		Entry *entry = ii->second;
+		if (entry->deadline >= 0 && entry->deadline <= now && flags.find (entry) == flags.end ())
+			flags[entry] = TIMED_OUT;
+	}
+
+	for (map<Entry*, unsigned int>::iterator ii = flags.begin (); ii != flags.end (); ii++)
+	{
+		Ready result = {ii->first->port, ii->second};
+		ready.push_back (result);
+		ResetDeadline (ii->first, now);
+	}
+	return ready.size ();
+}
+
+void PortSet::Interrupt ()
+{
+	char c = 0;
+	// If the pipe is full, a wake up is already pending
+	if (write (_interruptPipe[1], &c, 1) < 0 && ErrNo () != EAGAIN)
+	{
+		stringstream ss;
+		ss << "PortSet::" << __func__ << "() write() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PortSet::Register (Entry *entry)
+{
+	entry->readFD = (entry->events & READABLE) ? entry->port->GetReadDescriptor () : -1;
+	entry->writeFD = (entry->events & WRITABLE) ? entry->port->GetWriteDescriptor () : -1;
+	entry->reconnects = entry->port->GetStatistics ()._reconnects;
+
+	try
+	{
+		if (entry->readFD >= 0 && entry->readFD == entry->writeFD)
+			AddDescriptor (entry, entry->readFD, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+		else
+		{
+			if (entry->readFD >= 0)
+				AddDescriptor (entry, entry->readFD, EPOLLIN | EPOLLRDHUP);
+			if (entry->writeFD >= 0)
+				AddDescriptor (entry, entry->writeFD, EPOLLOUT);
+		}
+	}
+	catch (...)
+	{
+		Unregister (entry);
+		throw;
+	}
+}
+
+void PortSet::AddDescriptor (Entry *entry, int fd, uint32_t events)
+{
+	struct epoll_event event;
+
+	memset (&event, 0, sizeof (event));
+	event.events = events;
+	event.data.ptr = entry;
+	int result = epoll_ctl (_epollFD, EPOLL_CTL_ADD, fd, &event);
+	// A descriptor number reused by a reopened port may still be registered under its old
+	// owner if that was never closed, so take it over
+	if (result < 0 && ErrNo () == EEXIST)
+		result = epoll_ctl (_epollFD, EPOLL_CTL_MOD, fd, &event);
+	if (result < 0)
+	{
+		stringstream ss;
+		ss << "PortSet::" << __func__ << "() epoll_ctl() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+}
+
+void PortSet::Unregister (Entry *entry)
+{
+	// Closing a descriptor removes it from the epoll set, so errors here are expected if the port
+	// has been closed. A descriptor the port no longer has was closed, and its number may now
+	// belong to another port in the set, so it must not be removed.
+	struct epoll_event event;
+	int readFD = entry->port->GetReadDescriptor ();
+	int writeFD = entry->port->GetWriteDescriptor ();
+	if (entry->readFD >= 0 && (entry->readFD == readFD || entry->readFD == writeFD))
+		epoll_ctl (_epollFD, EPOLL_CTL_DEL, entry->readFD, &event);
+	if (entry->writeFD >= 0 && entry->writeFD != entry->readFD &&
+			(entry->writeFD == readFD || entry->writeFD == writeFD))
+		epoll_ctl (_epollFD, EPOLL_CTL_DEL, entry->writeFD, &event);
+	entry->readFD = entry->writeFD = -1;
+}
+
+// Checks if a port has reconnected or been given new descriptors since it was registered
+bool PortSet::DescriptorsChanged (Entry *entry) const
+{
+	if ((entry->events & READABLE) && entry->port->GetReadDescriptor () != entry->readFD)
+		return true;
+	if ((entry->events & WRITABLE) && entry->port->GetWriteDescriptor () != entry->writeFD)
+		return true;
+	return entry->port->GetStatistics ()._reconnects != entry->reconnects;
+}
+
+void PortSet::ResetDeadline (Entry *entry, int64_t now)
+{
+	Timeout timeout = entry->port->GetTimeout ();
+	if (timeout._sec < 0 || (timeout._sec == 0 && timeout._usec == 0))
+		entry->deadline = -1;   // Blocking forever or non-blocking; never times out
+	else
+		entry->deadline = now + TimeoutToMicroseconds (timeout);
+}
+
+} // namespace flexiport
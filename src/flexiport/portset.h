@@ -0,0 +1,174 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PORTSET_H
+#define __PORTSET_H
+
+#include "port.h"
+
+#include <map>
+#include <vector>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief Waits on many ports at once from a single thread.
+
+A PortSet registers any number of ports and waits for them with a single epoll call, returning the
+ports that are ready along with why. This allows one thread to service many devices rather than
+having one thread blocked in each port's read.
+
+Each port's own timeout is honoured: if a port has a timeout set (see @ref Port::SetTimeout) and
+it has not become ready within that time since it was added or last reported, it is returned with
+the @ref TIMED_OUT flag. Ports with no timeout (-1) or in non-blocking mode (0) never time out.
+
+Ports that have data waiting in their input buffer (see the readbuffer option of @ref Port) are
+reported as readable without waiting. Ports without a file descriptor, such as @ref LogReaderPort,
+are checked with @ref Port::BytesAvailable at least every @ref POLL_INTERVAL_MS milliseconds while
+the set is waiting. Ports that have closed are reported with the @ref CLOSED flag and should be
+reopened or removed.
+
+A PortSet is not thread safe, except for @ref Interrupt, which may be called from any thread to
+wake a thread blocked in @ref Wait.
+
+Example:
+@code
+PortSet set;
+set.Add (laser);
+set.Add (gps);
+std::vector<PortSet::Ready> ready;
+while (set.Wait (ready) >= 0)
+{
+	for (unsigned int ii = 0; ii < ready.size (); ii++)
+	{
+		if (ready[ii].flags & PortSet::READABLE)
+			ready[ii].port->Read (buffer, sizeof (buffer));
+	}
+}
+@endcode
+
+@note This class is only available on systems that provide epoll (e.g. Linux). */
+class FLEXIPORT_EXPORT PortSet
+{
+	public:
+		/// Readiness flags. The READABLE and WRITABLE flags are also used to select the events
+		/// to wait for when adding a port.
+		typedef enum
+		{
+			READABLE = 0x01,    ///< Data can be read from the port without blocking.
+			WRITABLE = 0x02,    ///< Data can be written to the port without blocking.
+			TIMED_OUT = 0x04,   ///< The port's timeout passed without it becoming ready.
+			HANGUP = 0x08,      ///< The other end hung up or an error occurred on the descriptor.
+			CLOSED = 0x10       ///< The port is not open.
+		} Flags;
+
+		/// @brief A port that is ready, and the reasons it is ready.
+		typedef struct
+		{
+			Port *port;
+			unsigned int flags;
+		} Ready;
+
+		/// Longest time between checks of ports that have no file descriptor.
+		static const int POLL_INTERVAL_MS = 10;
+
+		PortSet ();
+		~PortSet ();
+
+		/** @brief Add a port to the set.
+
+		@ref events is a combination of @ref READABLE and @ref WRITABLE. Adding a port that is
+		already in the set changes the events waited for. The set does not take ownership of the
+		port. */
+		void Add (Port *port, unsigned int events = READABLE);
+		/// @brief Change the events waited for on a port in the set.
+		void Modify (Port *port, unsigned int events);
+		/// @brief Remove a port from the set. Does nothing if the port is not in the set.
+		void Remove (Port *port);
+		/** @brief Register a port's descriptors again.
+
+		Ports that reconnect by themselves (see the alwaysopen option of @ref Port) are noticed
+		by @ref Wait, but a port closed and reopened by the caller may get back the descriptor
+		numbers it had before, which cannot be told apart. Call this after reopening such a port.
+		Does nothing if the port is not in the set. */
+		void Refresh (Port *port);
+		/// @brief Check if a port is in the set.
+		bool Contains (Port *port) const        { return _entries.find (port) != _entries.end (); }
+		/// @brief Get the number of ports in the set.
+		size_t Size () const                    { return _entries.size (); }
+
+		/** @brief Wait for any port in the set to become ready or time out.
+
+		@ref ready is cleared and filled with the ports that are ready. In addition to the ports'
+		own timeouts, @ref timeout limits how long this call will wait. A timeout of -1 will wait
+		until a port is ready or times out.
+
+		@return The number of ports in @ref ready. Zero if @ref timeout passed or the wait was
+		interrupted. */
+		ssize_t Wait (std::vector<Ready> &ready, Timeout timeout = Timeout (-1, 0));
+
+		/// @brief Wake a thread blocked in @ref Wait. Safe to call from any thread.
+		void Interrupt ();
+
+	private:
+		typedef struct
+		{
+			Port *port;
+			unsigned int events;    // Events being waited for
+			int readFD;             // Descriptors registered with epoll, or -1
+			int writeFD;
+			int64_t deadline;       // Monotonic time (microseconds) at which the port times out,
+			                        // or -1 for none
+			bool recheck;           // The descriptors may have been closed and reopened since
+			                        // they were registered
+			uint64_t reconnects;    // The port's reconnect count when it was registered
+		} Entry;
+
+		std::map<Port*, Entry*> _entries;
+		int _epollFD;
+		int _interruptPipe[2];
+
+		void Register (Entry *entry);
+		void AddDescriptor (Entry *entry, int fd, uint32_t events);
+		void Unregister (Entry *entry);
+		bool DescriptorsChanged (Entry *entry) const;
+		void ResetDeadline (Entry *entry, int64_t now);
+
+		// Private copy constructor to prevent unintended copying.
+		PortSet (const PortSet&);
+		void operator= (const PortSet&);
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __PORTSET_H
@@ -0,0 +1,530 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flexiport.h"
+#include "ptyport.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+namespace flexiport
+{
+
+inline int ErrNo ()
+{
+	return errno;
+}
+
+inline string StrError (int errNo)
+{
+	return string (strerror (errNo));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Constructor/destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PTYPort::PTYPort (map<string, string> options)
+	: Port (), _fd (-1), _slaveFd (-1), _open (false)
+{
+	_type = "pty";
+	ProcessOptions (options);
+
+	if (_alwaysOpen)
+		Open ();
+}
+
+PTYPort::~PTYPort ()
+{
+	Close ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Port management
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PTYPort::Open ()
+{
+	if (_open)
+		throw PortException ("Attempt to open already-opened port.");
+
+	if ((_fd = posix_openpt (O_RDWR | O_NOCTTY)) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() posix_openpt() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	if (grantpt (_fd) < 0 || unlockpt (_fd) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() grantpt()/unlockpt() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Close ();
+		throw PortException (ss.str ());
+	}
+	const char *slaveName = ptsname (_fd);
+	if (slaveName == NULL)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() ptsname() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Close ();
+		throw PortException (ss.str ());
+	}
+	_slaveName = slaveName;
+
+	// Holding the serial side open stops reads of the master failing with EIO whenever the
+	// program using the serial side has it closed.
+	if ((_slaveFd = open (_slaveName.c_str (), O_RDWR | O_NOCTTY)) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() Failed to open " << _slaveName << " with error: (" <<
+			ErrNo () << ") " << StrError (ErrNo ());
+		Close ();
+		throw PortException (ss.str ());
+	}
+	// Pass bytes through untouched, as a serial device configured by SerialPort would
+	struct termios settings;
+	if (tcgetattr (_slaveFd, &settings) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() tcgetattr() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Close ();
+		throw PortException (ss.str ());
+	}
+	cfmakeraw (&settings);
+	if (tcsetattr (_slaveFd, TCSANOW, &settings) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() tcsetattr() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Close ();
+		throw PortException (ss.str ());
+	}
+
+	if (!_link.empty ())
+	{
+		unlink (_link.c_str ());
+		if (symlink (_slaveName.c_str (), _link.c_str ()) < 0)
+		{
+			stringstream ss;
+			ss << "PTYPort::" << __func__ << "() symlink() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			Close ();
+			throw PortException (ss.str ());
+		}
+	}
+
+	_open = true;
+	SetPortTimeout ();
+
+	if (_debug >= 1)
+	{
+		cerr << "PTYPort::" << __func__ << "() Opened pseudo-terminal, serial side is " <<
+			_slaveName;
+		if (!_link.empty ())
+			cerr << " (linked from " << _link << ")";
+		cerr << endl;
+	}
+}
+
+void PTYPort::Close ()
+{
+	if (_debug >= 2)
+		cerr << "PTYPort::" << __func__ << "() Closing port" << endl;
+
+	if (!_link.empty () && !_slaveName.empty ())
+		unlink (_link.c_str ());
+	if (_slaveFd >= 0)
+	{
+		close (_slaveFd);
+		_slaveFd = -1;
+	}
+	if (_fd >= 0)
+	{
+		close (_fd);
+		_fd = -1;
+	}
+	_slaveName.clear ();
+	_open = false;
+	ClearReadBuffer ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t PTYPort::Read (void * const buffer, size_t count)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+		cerr << "PTYPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
+
+	// Data already in the input buffer is returned before reading from the device
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
+	ssize_t receivedBytes = read (_fd, buffer, count);
+	if (receivedBytes < 0 && ErrNo () == EAGAIN && _timeout._sec != -1)
+	{
+		// No data was available, so wait for data or timeout, then read if data is available
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		receivedBytes = read (_fd, buffer, count);
+	}
+
+	if (_debug >= 2)
+		cerr << "PTYPort::" << __func__ << "() Read " << receivedBytes << " bytes" << endl;
+
+	if (receivedBytes < 0)
+	{
+		if (ErrNo () == EAGAIN)
+			return -1; // Timed out
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() read() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	CountRead (receivedBytes);
+	return receivedBytes;
+}
+
+ssize_t PTYPort::ReadFull (void * const buffer, size_t count)
+{
+	size_t receivedBytes = 0;
+	Timeout oldTimeout = _timeout;
+
+	CheckPort (true);
+
+	if (_debug >= 2)
+	{
+		cerr << "PTYPort::" << __func__ << "() Going to read until have " << count <<
+			" bytes" << endl;
+	}
+
+	// Set the port to infinite blocking
+	SetTimeout (Timeout (-1, 0));
+	while (receivedBytes < count)
+	{
+		ssize_t numReceived = Read (&(reinterpret_cast<uint8_t*> (buffer)[receivedBytes]),
+								count - receivedBytes);
+		if (numReceived < 0)
+		{
+			// Restore the timeout
+			SetTimeout (oldTimeout);
+			throw PortException (string ("PTYPort::") + __func__ +
+					string (" Read() timed out, probably shouldn't happen."));
+		}
+		receivedBytes += numReceived;
+	}
+
+	// Restore the timeout
+	SetTimeout (oldTimeout);
+	return receivedBytes;
+}
+
+ssize_t PTYPort::BytesAvailable ()
+{
+	int bytesAvailable = 0;
+
+	CheckPort (true);
+
+	if (ioctl (_fd, FIONREAD, &bytesAvailable) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() ioctl() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+	{
+		cerr << "PTYPort::" << __func__ << "() Found " << bytesAvailable + ReadBufferUsage () <<
+			" bytes available" << endl;
+	}
+	return bytesAvailable + ReadBufferUsage ();
+}
+
+ssize_t PTYPort::BytesAvailableWait ()
+{
+	CheckPort (true);
+
+	// Buffered data is available without waiting
+	if (ReadBufferUsage () > 0)
+		return BytesAvailable ();
+
+	if (WaitForDataOrTimeout () == TIMED_OUT)
+	{
+		if (_debug >= 2)
+		{
+			cerr << "PTYPort::" << __func__ <<
+				" Timed out waiting for data to check bytes available" << endl;
+		}
+		if (IsBlocking ())
+			return -1; // Timeout in blocking mode
+		else
+			return 0; // No data in non-blocking mode
+	}
+
+	return BytesAvailable ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t PTYPort::Write (const void * const buffer, size_t count)
+{
+	ssize_t numWritten = 0;
+
+	CheckPort (false);
+
+	if (_debug >= 2)
+		cerr << "PTYPort::" << __func__ << "() Writing " << count << " bytes" << endl;
+
+	if (_timeout._sec != -1)
+	{
+		if (WaitForWritableOrTimeout () == TIMED_OUT)
+		{
+			if (_debug >= 2)
+				cerr << "PTYPort::" << __func__ << "() Timed out waiting to write" << endl;
+			return -1;
+		}
+	}
+	if ((numWritten = write (_fd, buffer, count)) < 0)
+	{
+		if (ErrNo () == EAGAIN)
+		{
+			if (_debug >= 2)
+				cerr << "PTYPort::" << __func__ << "() Timed out while in write()" << endl;
+			return -1; // Timed out
+		}
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() write() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+		cerr << "PTYPort::" << __func__ << "() Wrote " << numWritten << " bytes" << endl;
+
+	CountWrite (numWritten);
+	return numWritten;
+}
+
+void PTYPort::Flush ()
+{
+	ClearReadBuffer ();
+	if (_open && tcflush (_fd, TCIOFLUSH) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() tcflush() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+}
+
+void PTYPort::Drain ()
+{
+	// The other side may never read, so waiting for the output to drain could block forever.
+	if (_debug >= 1)
+		cerr << "PTYPort::" << __func__ << "() Can't drain output buffer of PTY port." << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Other public API functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string PTYPort::GetStatus () const
+{
+	stringstream status;
+
+	status << "PTY-specific status:" << endl;
+	if (_open)
+		status << "Serial side: " << _slaveName << endl;
+	if (!_link.empty ())
+		status << "Link: " << _link << endl;
+	status << (_open ? "Port is open" : "Port is closed") << endl;
+
+	return Port::GetStatus () + status.str ();
+}
+
+void PTYPort::SetTimeout (Timeout timeout)
+{
+	_timeout = timeout;
+	if (_open)
+		SetPortTimeout ();
+}
+
+void PTYPort::SetCanRead (bool canRead)
+{
+	_canRead = canRead;
+}
+
+void PTYPort::SetCanWrite (bool canWrite)
+{
+	_canWrite = canWrite;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PTYPort::CheckPort (bool read)
+{
+	if (!_open)
+		throw PortException ("Port is not open.");
+
+	if (read && !_canRead)
+		throw PortException ("Cannot read from write-only port.");
+
+	if (!read && !_canWrite)
+		throw PortException ("Cannot write to read-only port.");
+}
+
+bool PTYPort::ProcessOption (const std::string &option, const std::string &value)
+{
+	// Check if the parent class can handle this option
+	if (Port::ProcessOption (option, value))
+		return true;
+
+	if (option == "link")
+	{
+		if (value.empty ())
+			throw PortException ("Bad link path: " + value);
+		_link = value;
+		return true;
+	}
+
+	return false;
+}
+
+PTYPort::WaitStatus PTYPort::WaitForDataOrTimeout ()
+{
+	fd_set fdSet;
+	struct timeval tv, *tvPtr = NULL;
+
+	FD_ZERO (&fdSet);
+	FD_SET (_fd, &fdSet);
+	tv.tv_sec = _timeout._sec;
+	tv.tv_usec = _timeout._usec;
+	if (tv.tv_sec >= 0)
+		tvPtr = &tv;
+
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
+	int result = select (_fd + 1, &fdSet, NULL, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
+
+	if (result < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() select() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	else if (result == 0)
+	{
+		if (_debug >= 3)
+			cerr << "PTYPort::" << __func__ << "() Timed out" << endl;
+		return TIMED_OUT;
+	}
+	return DATA_AVAILABLE;
+}
+
+PTYPort::WaitStatus PTYPort::WaitForWritableOrTimeout ()
+{
+	fd_set fdSet;
+	struct timeval tv, *tvPtr = NULL;
+
+	FD_ZERO (&fdSet);
+	FD_SET (_fd, &fdSet);
+	tv.tv_sec = _timeout._sec;
+	tv.tv_usec = _timeout._usec;
+	if (tv.tv_sec >= 0)
+		tvPtr = &tv;
+
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
+	int result = select (_fd + 1, NULL, &fdSet, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
+
+	if (result < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() select() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	else if (result == 0)
+	{
+		if (_debug >= 3)
+			cerr << "PTYPort::" << __func__ << "() Timed out" << endl;
+		return TIMED_OUT;
+	}
+	return CAN_WRITE;
+}
+
+// The master is non-blocking unless the timeout is infinite, in which case reads and writes
+// simply block.
+void PTYPort::SetPortTimeout ()
+{
+	int flags;
+	if ((flags = fcntl (_fd, F_GETFL)) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() fcntl(F_GETFL) error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	if (_timeout._sec == -1)
+		flags &= ~O_NONBLOCK;
+	else
+		flags |= O_NONBLOCK;
+	if (fcntl (_fd, F_SETFL, flags) < 0)
+	{
+		stringstream ss;
+		ss << "PTYPort::" << __func__ << "() fcntl(F_SETFL) error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+}
+
+} // namespace flexiport
@@ -0,0 +1,126 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PTYPORT_H
+#define __PTYPORT_H
+
+#include "port.h"
+
+#include <map>
+#include <string>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief Pseudo-terminal implementation of the @ref Port class. This class creates a new
+pseudo-terminal pair and talks to the master side, allowing code written for a serial device
+(such as a @ref SerialPort, or a driver using another serial library) to be connected to an
+emulator of the device in place of the real hardware.
+
+See the @ref Port class documentation for how to use the common API.
+
+The serial side of the pair is a terminal device created when the port is opened; its name is
+given by @ref GetSlaveName, or a fixed path can be linked to it using the link option. It is
+placed in raw mode, but it is a real terminal, so the program using it may apply its own
+settings. Baud rate settings are accepted but have no effect on the speed of the transfer, which
+makes this port useful for measuring the software overhead of serial code paths.
+
+The port holds the serial side open itself, so the program using it may open and close it
+without this port seeing the connection close.
+
+@par Options
+ - link <string>
+   - Path of a symbolic link to create pointing at the serial side of the pair. The link is
+     removed when the port is closed. An existing file at this path is replaced.
+   - Default: no link */
+class FLEXIPORT_EXPORT PTYPort : public Port
+{
+	public:
+		PTYPort (std::map<std::string, std::string> options);
+		~PTYPort ();
+
+		/// @brief Open the port, creating a new pseudo-terminal pair.
+		void Open ();
+		/// @brief Close the port, destroying the pseudo-terminal pair.
+		void Close ();
+		/// @brief Read from the port.
+		ssize_t Read (void * const buffer, size_t count);
+		/// @brief Read the requested quantity of data from the port.
+		ssize_t ReadFull (void * const buffer, size_t count);
+		/// @brief Get the number of bytes waiting to be read at the port. Returns immediatly.
+		ssize_t BytesAvailable ();
+		/// @brief Get the number of bytes waiting after blocking for the timeout.
+		ssize_t BytesAvailableWait ();
+		/// @brief Write data to the port.
+		ssize_t Write (const void * const buffer, size_t count);
+		/// @brief Flush the port's input and output buffers, discarding all data.
+		void Flush ();
+		/// @brief Drain the port's output buffer.
+		void Drain ();
+		/// @brief Get the status of the port (type, device, etc).
+		std::string GetStatus () const;
+		/// @brief Set the timeout value in milliseconds.
+		void SetTimeout (Timeout timeout);
+		/// @brief Set the read permissions of the port.
+		void SetCanRead (bool canRead);
+		/// @brief Set the write permissions of the port.
+		void SetCanWrite (bool canWrite);
+		/// @brief Check if the port is open.
+		bool IsOpen () const                        { return _open; }
+		/// @brief Get the file descriptor of the master side.
+		int GetReadDescriptor () const              { return _fd; }
+		/// @brief Get the file descriptor of the master side.
+		int GetWriteDescriptor () const             { return _fd; }
+
+		/// @brief Get the device name of the serial side of the pair. Empty if not open.
+		std::string GetSlaveName () const           { return _slaveName; }
+
+	private:
+		int _fd;                // Master side file descriptor
+		int _slaveFd;           // Serial side, held open to keep the pair connected
+		std::string _slaveName;
+		std::string _link;
+		bool _open;
+
+		void CheckPort (bool read);
+		bool ProcessOption (const std::string &option, const std::string &value);
+
+		typedef enum {TIMED_OUT, DATA_AVAILABLE, CAN_WRITE} WaitStatus;
+		WaitStatus WaitForDataOrTimeout ();
+		WaitStatus WaitForWritableOrTimeout ();
+		void SetPortTimeout ();
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __PTYPORT_H
@@ -397,6 +397,7 @@ void SerialPort::Close ()
 	}
 #endif
 	_open = false;
+	ClearReadBuffer ();
 
 	if (_debug >= 2)
 		cerr << "SerialPort::" << __func__ << "() Port closed" << endl;
@@ -413,6 +414,10 @@ ssize_t SerialPort::Read (void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "SerialPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
 
+	// Data already in the input buffer is returned before reading from the device
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
 #if defined (WIN32)
 	DWORD receivedBytes = 0;
 	if (!ReadFile (_fd, buffer, count, &receivedBytes, NULL))
@@ -479,14 +484,108 @@ ssize_t SerialPort::Read (void * const buffer, size_t count)
 		{
 			if (_debug >= 1)
 				cerr << "SerialPort::" << __func__ << "() Trying to reopen." << endl;
+			_statistics._reconnects++;
 			Open ();
 		}
 		return 0;
 	}
 #endif
 
+	CountRead (receivedBytes);
+	return receivedBytes;
+}
+
+#if !defined (WIN32)
+ssize_t SerialPort::ReadV (const struct iovec *iov, int iovcnt)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+	{
+		cerr << "SerialPort::" << __func__ << "() Going to read " << IOVecLength (iov, iovcnt) <<
+			" bytes into " << iovcnt << " buffers" << endl;
+	}
+
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBufferV (iov, iovcnt);
+
+	ssize_t receivedBytes = readv (_fd, iov, iovcnt);
+	if (receivedBytes < 0 && ErrNo () == EAGAIN && _timeout._sec != -1)
+	{
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		receivedBytes = readv (_fd, iov, iovcnt);
+	}
+
+	if (_debug >= 2)
+		cerr << "SerialPort::" << __func__ << "() Read " << receivedBytes << " bytes" << endl;
+
+	if (receivedBytes < 0)
+	{
+		if (ErrNo () == EAGAIN)
+			return -1; // Timed out
+		stringstream ss;
+		ss << "SerialPort::" << __func__ << "() readv() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	else if (receivedBytes == 0)
+	{
+		// Port has closed, do the same at this end
+		if (_debug >= 1)
+			cerr << "SerialPort::" << __func__ << "() Port has closed." << endl;
+		Close ();
+		if (_alwaysOpen)
+		{
+			if (_debug >= 1)
+				cerr << "SerialPort::" << __func__ << "() Trying to reopen." << endl;
+			_statistics._reconnects++;
+			Open ();
+		}
+	}
+
+	CountRead (receivedBytes);
+	return receivedBytes;
+}
+
+ssize_t SerialPort::ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp)
+{
+	CheckPort (true);
+
+	if (ReadBufferUsage () > 0)
+	{
+		timestamp = _readBufferTimestamp;
+		return TakeFromReadBuffer (buffer, count);
+	}
+
+	// Wait for data here rather than in Read so that the time the wait ends can be sampled. When
+	// woken by new data, the first byte finished arriving just before the wake up; otherwise the
+	// data was already waiting, and is assumed to have just finished arriving.
+	bool woken = false;
+	if (BytesAvailable () == 0)
+	{
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		timestamp = Timestamp::Now (Timestamp::MONOTONIC);
+		woken = true;
+	}
+	ssize_t receivedBytes = Read (buffer, count);
+	if (!woken)
+		timestamp = Timestamp::Now (Timestamp::MONOTONIC);
+
+	if (receivedBytes > 0)
+	{
+		// Move the timestamp back to the start of the first byte
+		int64_t bitsPerChar = 1 + _dataBits + (_parity == PAR_NONE ? 0 : 1) + _stopBits;
+		int64_t charTime = bitsPerChar * 1000000000LL / _baud;
+		timestamp.FromNanoseconds (timestamp.AsNanoseconds () -
+				charTime * (woken ? 1 : receivedBytes));
+		CountLatency (timestamp);
+	}
+
 	return receivedBytes;
 }
+#endif // !defined (WIN32)
 
 ssize_t SerialPort::ReadFull (void * const buffer, size_t count)
 {
@@ -572,6 +671,7 @@ ssize_t SerialPort::BytesAvailable ()
 		throw PortException (ss.str ());
 	}
 #endif
+	bytesAvailable += ReadBufferUsage ();
 
 	if (_debug >= 2)
 	{
@@ -587,6 +687,10 @@ ssize_t SerialPort::BytesAvailableWait ()
 
 	CheckPort (true);
 
+	// Buffered data is available without waiting
+	if (ReadBufferUsage () > 0)
+		return BytesAvailable ();
+
 #if defined (WIN32)
 	if ((bytesAvailable = BytesAvailable ()) <= 0)
 	{
@@ -695,11 +799,57 @@ ssize_t SerialPort::Write (const void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "SerialPort::" << __func__ << "() Wrote " << numWritten << " bytes" << endl;
 
+	CountWrite (numWritten);
+	return numWritten;
+}
+
+#if !defined (WIN32)
+ssize_t SerialPort::WriteV (const struct iovec *iov, int iovcnt)
+{
+	CheckPort (false);
+
+	if (_debug >= 2)
+	{
+		cerr << "SerialPort::" << __func__ << "() Writing " << IOVecLength (iov, iovcnt) <<
+			" bytes from " << iovcnt << " buffers" << endl;
+	}
+
+	if (_timeout._sec != -1)
+	{
+		if (WaitForWritableOrTimeout () == TIMED_OUT)
+		{
+			if (_debug >= 2)
+				cerr << "SerialPort::" << __func__ << "() Timed out waiting to write" << endl;
+			return -1;
+		}
+	}
+
+	ssize_t numWritten = writev (_fd, iov, iovcnt);
+	if (numWritten < 0)
+	{
+		if (ErrNo () == EAGAIN)
+		{
+			if (_debug >= 2)
+				cerr << "SerialPort::" << __func__ << "() Timed out while in writev()" << endl;
+			return -1; // Timed out
+		}
+		stringstream ss;
+		ss << "SerialPort::" << __func__ << "() writev() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+		cerr << "SerialPort::" << __func__ << "() Wrote " << numWritten << " bytes" << endl;
+
+	CountWrite (numWritten);
 	return numWritten;
 }
+#endif // !defined (WIN32)
 
 void SerialPort::Flush ()
 {
+	ClearReadBuffer ();
 #if defined (WIN32)
 	if (!PurgeComm (_fd, PURGE_RXCLEAR | PURGE_TXCLEAR))
 	{
@@ -942,7 +1092,9 @@ SerialPort::WaitStatus SerialPort::WaitForDataOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_fd + 1, &fdSet, NULL, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
@@ -976,7 +1128,9 @@ SerialPort::WaitStatus SerialPort::WaitForWritableOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_fd + 1, NULL, &fdSet, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
@@ -81,6 +81,12 @@ class FLEXIPORT_EXPORT SerialPort : public Port
 		void Close ();
 		/// @brief Read from the port.
 		ssize_t Read (void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Read from the port into several buffers.
+		ssize_t ReadV (const struct iovec *iov, int iovcnt);
+		/// @brief Read from the port and get the time the data arrived.
+		ssize_t ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp);
+#endif
 		/// @brief Read the requested quantity of data from the port.
 		ssize_t ReadFull (void * const buffer, size_t count);
 		/// @brief Get the number of bytes waiting to be read at the port. Returns immediatly.
@@ -93,6 +99,10 @@ class FLEXIPORT_EXPORT SerialPort : public Port
 		ssize_t BytesAvailableWait ();
 		/// @brief Write data to the port.
 		ssize_t Write (const void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Write data from several buffers to the port.
+		ssize_t WriteV (const struct iovec *iov, int iovcnt);
+#endif
 		/// @brief Flush the port's input and output buffers, discarding all data.
 		void Flush ();
 		/// @brief Drain the port's input and output buffers.
@@ -107,6 +117,12 @@ class FLEXIPORT_EXPORT SerialPort : public Port
 		void SetCanWrite (bool canWrite);
 		/// @brief Check if the port is open.
 		bool IsOpen () const                        { return _open; }
+#if !defined (WIN32)
+		/// @brief Get the file descriptor of the serial device.
+		int GetReadDescriptor () const              { return _fd; }
+		/// @brief Get the file descriptor of the serial device.
+		int GetWriteDescriptor () const             { return _fd; }
+#endif
 
 		/// @brief Change the baud rate.
 		void SetBaudRate (unsigned int baud);
@@ -0,0 +1,654 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flexiport.h"
+#include "shmport.h"
+#include "timestamp.h"
+#include "flexiport_config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+#if defined (FLEXIPORT_HAVE_FUTEX)
+	#include <linux/futex.h>
+	#include <sys/syscall.h>
+#endif
+
+namespace flexiport
+{
+
+inline int ErrNo ()
+{
+	return errno;
+}
+
+inline string StrError (int errNo)
+{
+	return string (strerror (errNo));
+}
+
+// Identifies a flexiport ring ("FPSH") and the layout version of the header.
+const uint32_t SHM_MAGIC = 0x48535046;
+const uint32_t SHM_VERSION = 1;
+// The ring data starts this far into the shared memory, keeping it away from the cache line
+// holding the header.
+const size_t SHM_HEADER_SIZE = 64;
+
+// Placed at the start of the shared memory. All positions are counts of bytes written since the
+// ring was created, so a reader can tell how far behind it is without any lock. The writer
+// advances reservePos before overwriting data and writePos once the data is in place; a reader
+// that copies data and then finds reservePos more than the ring size past the start of the copy
+// knows the copy was overwritten.
+struct ShmPort::Header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t reservePos;
+	uint64_t writePos;
+	uint32_t writeSeq;      // Incremented on every write; readers wait on it with a futex.
+	uint32_t waiters;       // Number of readers waiting on writeSeq.
+	uint32_t writerOpen;
+};
+
+#if defined (FLEXIPORT_HAVE_FUTEX)
+inline int FutexWait (uint32_t *address, uint32_t value, const struct timespec *timeout)
+{
+	return syscall (SYS_futex, address, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+inline void FutexWake (uint32_t *address)
+{
+	syscall (SYS_futex, address, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif // defined (FLEXIPORT_HAVE_FUTEX)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Constructor/destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ShmPort::ShmPort (map<string, string> options)
+	: Port (), _name ("/flexiport"), _size (1048576), _fd (-1), _header (NULL), _data (NULL),
+	_readPos (0), _lostBytes (0), _open (false)
+{
+	_type = "shm";
+	ProcessOptions (options);
+	CheckRole ();
+
+	if (_alwaysOpen)
+		Open ();
+}
+
+ShmPort::~ShmPort ()
+{
+	Close ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Port management
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void ShmPort::Open ()
+{
+	if (_open)
+		throw PortException ("Attempt to open already-opened port.");
+
+	if (_canWrite)
+		OpenWriter ();
+	else
+		OpenReader ();
+	_open = true;
+	ClearReadBuffer ();
+
+	if (_debug >= 1)
+	{
+		cerr << "ShmPort::" << __func__ << "() Opened " << _name << " as " <<
+			(_canWrite ? "writer" : "reader") << " of a " << _size << " byte ring" << endl;
+	}
+}
+
+void ShmPort::Close ()
+{
+	if (!_open)
+		return;
+
+	if (_canWrite)
+	{
+		__atomic_store_n (&_header->writerOpen, 0, __ATOMIC_RELEASE);
+		WakeReaders ();
+	}
+	Unmap ();
+	_open = false;
+	ClearReadBuffer ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t ShmPort::Read (void * const buffer, size_t count)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+		cerr << "ShmPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
+
+	// Data already in the input buffer is used first
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
+	return ReadFromRing (buffer, count, _timeout);
+}
+
+ssize_t ShmPort::ReadFull (void * const buffer, size_t count)
+{
+	size_t receivedBytes = 0;
+
+	CheckPort (true);
+
+	if (_debug >= 2)
+	{
+		cerr << "ShmPort::" << __func__ << "() Going to read until have " << count <<
+			" bytes" << endl;
+	}
+
+	// Data already in the input buffer is used first
+	if (ReadBufferUsage () > 0)
+		receivedBytes = TakeFromReadBuffer (buffer, count);
+
+	while (receivedBytes < count)
+	{
+		ssize_t numReceived = ReadFromRing (&(reinterpret_cast<uint8_t*> (buffer)[receivedBytes]),
+				count - receivedBytes, Timeout (-1, 0));
+		if (numReceived == 0)
+		{
+			throw PortException (string ("ShmPort::") + __func__ +
+					string ("() Writer closed during read operation."));
+		}
+		receivedBytes += numReceived;
+	}
+
+	return receivedBytes;
+}
+
+ssize_t ShmPort::BytesAvailable ()
+{
+	CheckPort (true);
+
+	ssize_t bytesAvailable = ReadableBytes () + ReadBufferUsage ();
+	if (_debug >= 2)
+	{
+		cerr << "ShmPort::" << __func__ << "() Found " << bytesAvailable <<
+			" bytes available" << endl;
+	}
+	return bytesAvailable;
+}
+
+ssize_t ShmPort::BytesAvailableWait ()
+{
+	CheckPort (true);
+
+	if (ReadBufferUsage () == 0 && !WaitForData (_timeout))
+	{
+		if (_debug >= 2)
+		{
+			cerr << "ShmPort::" << __func__ <<
+				" Timed out waiting for data to check bytes available" << endl;
+		}
+		if (IsBlocking ())
+			return -1; // Timeout in blocking mode
+		else
+			return 0; // No data in non-blocking mode
+	}
+
+	return BytesAvailable ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t ShmPort::Write (const void * const buffer, size_t count)
+{
+	CheckPort (false);
+
+	if (count > _size)
+		count = _size;
+	if (_debug >= 2)
+		cerr << "ShmPort::" << __func__ << "() Writing " << count << " bytes" << endl;
+	if (count == 0)
+		return 0;
+
+	// Claim the space before overwriting it so readers can detect a copy that raced this write
+	uint64_t writePos = _header->writePos;
+	__atomic_store_n (&_header->reservePos, writePos + count, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	size_t offset = writePos % _size;
+	size_t firstPart = _size - offset;
+	if (firstPart > count)
+		firstPart = count;
+	memcpy (&_data[offset], buffer, firstPart);
+	if (firstPart < count)
+		memcpy (_data, &reinterpret_cast<const uint8_t*> (buffer)[firstPart], count - firstPart);
+
+	__atomic_store_n (&_header->writePos, writePos + count, __ATOMIC_RELEASE);
+	WakeReaders ();
+
+	CountWrite (count);
+	return count;
+}
+
+void ShmPort::Flush ()
+{
+	ClearReadBuffer ();
+	if (_open && _canRead)
+		_readPos = __atomic_load_n (&_header->writePos, __ATOMIC_ACQUIRE);
+}
+
+void ShmPort::Drain ()
+{
+	// Readers see data as soon as Write() returns, so there is nothing to wait for.
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Other public API functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string ShmPort::GetStatus () const
+{
+	stringstream status;
+
+	status << "Shared memory-specific status:" << endl;
+	status << "Name: " << _name << endl;
+	status << "Ring size: " << _size << endl;
+	status << "Role: " << (_canWrite ? "writer" : "reader") << endl;
+	if (_canRead)
+		status << "Bytes lost to overruns: " << _lostBytes << endl;
+	if (_open)
+	{
+		status << "Readers waiting: " << __atomic_load_n (&_header->waiters, __ATOMIC_RELAXED) <<
+			endl;
+	}
+	status << (_open ? "Port is open" : "Port is closed") << endl;
+
+	return Port::GetStatus () + status.str ();
+}
+
+void ShmPort::SetTimeout (Timeout timeout)
+{
+	_timeout = timeout;
+}
+
+void ShmPort::SetCanRead (bool canRead)
+{
+	if (_open && canRead != _canRead)
+		throw PortException ("Cannot change the role of an open shared memory port.");
+	_canRead = canRead;
+}
+
+void ShmPort::SetCanWrite (bool canWrite)
+{
+	if (_open && canWrite != _canWrite)
+		throw PortException ("Cannot change the role of an open shared memory port.");
+	_canWrite = canWrite;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void ShmPort::CheckPort (bool read)
+{
+	if (!_open)
+		throw PortException ("Port is not open.");
+
+	if (read && !_canRead)
+		throw PortException ("Cannot read from write-only port.");
+
+	if (!read && !_canWrite)
+		throw PortException ("Cannot write to read-only port.");
+}
+
+bool ShmPort::ProcessOption (const std::string &option, const std::string &value)
+{
+	char c = '\0';
+
+	// Check if the parent class can handle this option
+	if (Port::ProcessOption (option, value))
+		return true;
+
+	if (option == "name")
+	{
+		if (value.empty () || value[0] != '/')
+			throw PortException ("Bad shared memory name (must begin with '/'): " + value);
+		_name = value;
+		return true;
+	}
+	else if (option == "size")
+	{
+		istringstream is (value);
+		if (!(is >> _size) || is.get (c) || _size == 0)
+			throw PortException ("Bad ring buffer size: " + value);
+		return true;
+	}
+
+	return false;
+}
+
+// A ring has one writer and any number of readers, so each port must be one or the other.
+void ShmPort::CheckRole ()
+{
+	if (_canRead == _canWrite)
+	{
+		throw PortException ("ShmPort must be either readonly (a reader) or writeonly "
+				"(the writer).");
+	}
+}
+
+void ShmPort::OpenWriter ()
+{
+	if ((_fd = shm_open (_name.c_str (), O_CREAT | O_RDWR, 0666)) < 0)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() shm_open() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	// Keep the stream position of an existing ring of the same size, so readers that are still
+	// attached carry on from where the previous writer stopped. An existing ring of another size
+	// cannot be resized: readers that have it mapped would crash on touching memory beyond the
+	// new end.
+	struct stat st;
+	bool reuse = false;
+	if (fstat (_fd, &st) < 0)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() fstat() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+	if (st.st_size != 0 && static_cast<size_t> (st.st_size) != SHM_HEADER_SIZE + _size)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() " << _name << " already exists with a different "
+			"size (" << st.st_size << " bytes rather than " << SHM_HEADER_SIZE + _size <<
+			"); remove it with shm_unlink () first.";
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+	if (st.st_size != 0)
+	{
+		Header existing;
+		if (pread (_fd, &existing, sizeof (existing), 0) == sizeof (existing) &&
+				existing.magic == SHM_MAGIC && existing.version == SHM_VERSION &&
+				existing.size == _size)
+		{
+			reuse = true;
+		}
+	}
+	if (st.st_size == 0 && ftruncate (_fd, SHM_HEADER_SIZE + _size) < 0)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() ftruncate() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+
+	void *mapping = mmap (NULL, SHM_HEADER_SIZE + _size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			_fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() mmap() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+	_header = reinterpret_cast<Header*> (mapping);
+	_data = reinterpret_cast<uint8_t*> (mapping) + SHM_HEADER_SIZE;
+
+	if (!reuse)
+	{
+		memset (_header, 0, sizeof (Header));
+		_header->size = _size;
+		_header->version = SHM_VERSION;
+		__atomic_store_n (&_header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	// A previous writer may have died part way through a write
+	__atomic_store_n (&_header->reservePos, _header->writePos, __ATOMIC_RELEASE);
+	__atomic_store_n (&_header->writerOpen, 1, __ATOMIC_RELEASE);
+}
+
+void ShmPort::OpenReader ()
+{
+	// Read-write so that the number of waiting readers can be updated
+	if ((_fd = shm_open (_name.c_str (), O_RDWR, 0)) < 0)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() shm_open() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	struct stat st;
+	if (fstat (_fd, &st) < 0)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() fstat() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+	if (static_cast<size_t> (st.st_size) <= SHM_HEADER_SIZE)
+	{
+		Unmap ();
+		throw PortException (string ("ShmPort::") + __func__ + "() " + _name +
+				" is not a shared memory ring.");
+	}
+
+	void *mapping = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		stringstream ss;
+		ss << "ShmPort::" << __func__ << "() mmap() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		Unmap ();
+		throw PortException (ss.str ());
+	}
+	_header = reinterpret_cast<Header*> (mapping);
+	_data = reinterpret_cast<uint8_t*> (mapping) + SHM_HEADER_SIZE;
+	_size = st.st_size - SHM_HEADER_SIZE;
+
+	if (__atomic_load_n (&_header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+			_header->version != SHM_VERSION || _header->size != _size)
+	{
+		Unmap ();
+		throw PortException (string ("ShmPort::") + __func__ + "() " + _name +
+				" is not a shared memory ring of a supported version.");
+	}
+
+	// Readers only see data written after they open
+	_readPos = __atomic_load_n (&_header->writePos, __ATOMIC_ACQUIRE);
+	_lostBytes = 0;
+}
+
+void ShmPort::Unmap ()
+{
+	if (_header != NULL)
+	{
+		munmap (_header, SHM_HEADER_SIZE + _size);
+		_header = NULL;
+		_data = NULL;
+	}
+	if (_fd >= 0)
+	{
+		close (_fd);
+		_fd = -1;
+	}
+}
+
+// Get the number of bytes this reader can read, first skipping any that have been overwritten.
+uint64_t ShmPort::ReadableBytes ()
+{
+	uint64_t writePos = __atomic_load_n (&_header->writePos, __ATOMIC_ACQUIRE);
+	uint64_t reservePos = __atomic_load_n (&_header->reservePos, __ATOMIC_ACQUIRE);
+
+	if (reservePos - _readPos > _size)
+	{
+		uint64_t oldest = reservePos - _size;
+		if (_debug >= 1)
+		{
+			cerr << "ShmPort::" << __func__ << "() Reader overrun, lost " << oldest - _readPos <<
+				" bytes" << endl;
+		}
+		_lostBytes += oldest - _readPos;
+		_readPos = oldest;
+	}
+	return writePos - _readPos;
+}
+
+// Wait until there is data to read or the writer has closed. Returns false on timeout.
+bool ShmPort::WaitForData (const Timeout &timeout)
+{
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
+	int64_t limit = -1;
+	if (timeout._sec >= 0)
+		limit = timeout._sec * 1000000000LL + timeout._usec * 1000LL;
+
+	while (true)
+	{
+		uint32_t seq = __atomic_load_n (&_header->writeSeq, __ATOMIC_ACQUIRE);
+		if (ReadableBytes () > 0 || __atomic_load_n (&_header->writerOpen, __ATOMIC_ACQUIRE) == 0)
+		{
+			CountWait (waitStart, false);
+			return true;
+		}
+
+		int64_t remaining = 0;
+		if (limit >= 0)
+		{
+			remaining = limit - (Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+					waitStart.AsNanoseconds ());
+			if (remaining <= 0)
+			{
+				CountWait (waitStart, true);
+				return false;
+			}
+		}
+
+#if defined (FLEXIPORT_HAVE_FUTEX)
+		struct timespec ts;
+		ts.tv_sec = remaining / 1000000000LL;
+		ts.tv_nsec = remaining % 1000000000LL;
+		__atomic_add_fetch (&_header->waiters, 1, __ATOMIC_SEQ_CST);
+		FutexWait (&_header->writeSeq, seq, limit >= 0 ? &ts : NULL);
+		__atomic_sub_fetch (&_header->waiters, 1, __ATOMIC_SEQ_CST);
+#else
+		// No way to sleep on the shared memory, so poll it
+		(void) seq;
+		struct timespec ts;
+		ts.tv_sec = 0;
+		ts.tv_nsec = (limit >= 0 && remaining < 1000000) ? remaining : 1000000;
+		nanosleep (&ts, NULL);
+#endif
+	}
+}
+
+void ShmPort::WakeReaders ()
+{
+	__atomic_add_fetch (&_header->writeSeq, 1, __ATOMIC_SEQ_CST);
+#if defined (FLEXIPORT_HAVE_FUTEX)
+	if (__atomic_load_n (&_header->waiters, __ATOMIC_SEQ_CST) > 0)
+		FutexWake (&_header->writeSeq);
+#endif
+}
+
+ssize_t ShmPort::ReadFromRing (void * const buffer, size_t count, const Timeout &timeout)
+{
+	if (count == 0)
+		return 0;
+
+	while (true)
+	{
+		if (!WaitForData (timeout))
+		{
+			// Zero means the writer has closed, so running out of time (immediately, in
+			// non-blocking mode) is a timeout as for the other ports
+			if (_debug >= 2)
+				cerr << "ShmPort::" << __func__ << "() Timed out waiting for data" << endl;
+			errno = EAGAIN;
+			return -1;
+		}
+
+		uint64_t available = ReadableBytes ();
+		if (available == 0)
+		{
+			// The writer has closed and everything it wrote has been read
+			if (_debug >= 2)
+				cerr << "ShmPort::" << __func__ << "() Writer has closed" << endl;
+			return 0;
+		}
+		if (count > available)
+			count = available;
+
+		size_t offset = _readPos % _size;
+		size_t firstPart = _size - offset;
+		if (firstPart > count)
+			firstPart = count;
+		memcpy (buffer, &_data[offset], firstPart);
+		if (firstPart < count)
+			memcpy (&reinterpret_cast<uint8_t*> (buffer)[firstPart], _data, count - firstPart);
+
+		// If the writer has claimed space over the start of what was copied, the copy may be
+		// corrupt; skip ahead and try again.
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&_header->reservePos, __ATOMIC_RELAXED) - _readPos > _size)
+			continue;
+
+		_readPos += count;
+		CountRead (count);
+		if (_debug >= 2)
+			cerr << "ShmPort::" << __func__ << "() Read " << count << " bytes" << endl;
+		return count;
+	}
+}
+
+} // namespace flexiport
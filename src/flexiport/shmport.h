@@ -0,0 +1,145 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHMPORT_H
+#define __SHMPORT_H
+
+#include "port.h"
+
+#include <map>
+#include <string>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief Shared memory implementation of the @ref Port class. This class passes a byte stream
+between processes on the same machine through a ring buffer in POSIX shared memory, avoiding the
+copies through the kernel made by a TCP connection over localhost.
+
+See the @ref Port class documentation for how to use the common API.
+
+A shared memory port is one-directional: it must be opened either writeonly, making it the single
+writer of the named ring, or readonly, making it one of any number of readers. Every reader sees
+the whole stream written after it opened, independently of the other readers. The writer never
+waits for readers: a reader that falls more than the ring size behind loses the oldest data and
+continues from the oldest data still in the ring (the number of bytes lost is shown by @ref
+GetStatus). Reads and writes do not use any locks.
+
+When the writer closes, readers get the data remaining in the ring, after which reads return zero
+to indicate the port has closed. The shared memory object is not removed when the ports close, so
+that the writer can restart without the readers reopening; it can be removed with shm_unlink ().
+
+Readers wait for data using a futex in the shared memory where available, and by polling
+otherwise. The number of readers waiting on the futex is shown by @ref GetStatus. Shared memory
+ports have no file descriptor, so a @ref PortSet checks them by polling.
+
+When no data arrives before the timeout, including immediately in non-blocking mode, reads return
+-1 with errno set to EAGAIN. Zero is only returned once the writer has closed.
+
+A writer opening an existing ring of a different size throws an exception rather than resizing it
+under readers that may still have it mapped.
+
+@par Options
+ - name <string>
+   - Name of the shared memory object, beginning with a '/'.
+   - Default: /flexiport
+ - size <integer>
+   - Size of the ring buffer in bytes. Only used by the writer; readers use the size of the
+     existing ring.
+   - Default: 1048576 */
+class FLEXIPORT_EXPORT ShmPort : public Port
+{
+	public:
+		ShmPort (std::map<std::string, std::string> options);
+		~ShmPort ();
+
+		/** @brief Open the port.
+
+		The writer creates the shared memory object if it does not exist. Readers throw an
+		exception if it does not exist. */
+		void Open ();
+		/// @brief Close the port.
+		void Close ();
+		/// @brief Read from the port.
+		ssize_t Read (void * const buffer, size_t count);
+		/// @brief Read the requested quantity of data from the port.
+		ssize_t ReadFull (void * const buffer, size_t count);
+		/// @brief Get the number of bytes waiting to be read at the port. Returns immediatly.
+		ssize_t BytesAvailable ();
+		/// @brief Get the number of bytes waiting after blocking for the timeout.
+		ssize_t BytesAvailableWait ();
+		/// @brief Write data to the port. At most the size of the ring is written at once.
+		ssize_t Write (const void * const buffer, size_t count);
+		/// @brief Discard all data waiting to be read.
+		void Flush ();
+		/// @brief Data is visible to readers as soon as it is written, so this does nothing.
+		void Drain ();
+		/// @brief Get the status of the port (type, device, etc).
+		std::string GetStatus () const;
+		/// @brief Set the timeout value in milliseconds.
+		void SetTimeout (Timeout timeout);
+		/// @brief Set the read permissions of the port.
+		void SetCanRead (bool canRead);
+		/// @brief Set the write permissions of the port.
+		void SetCanWrite (bool canWrite);
+		/// @brief Check if the port is open.
+		bool IsOpen () const                        { return _open; }
+
+	private:
+		struct Header;
+
+		std::string _name;
+		size_t _size;
+		int _fd;
+		Header *_header;        // Start of the mapped shared memory.
+		uint8_t *_data;         // Ring buffer, following the header.
+		uint64_t _readPos;      // Position in the stream of the next byte this reader will read.
+		uint64_t _lostBytes;    // Bytes overwritten before this reader could read them.
+		bool _open;
+
+		void CheckPort (bool read);
+		bool ProcessOption (const std::string &option, const std::string &value);
+		void CheckRole ();
+
+		void OpenWriter ();
+		void OpenReader ();
+		void Unmap ();
+		uint64_t ReadableBytes ();
+		bool WaitForData (const Timeout &timeout);
+		ssize_t ReadFromRing (void * const buffer, size_t count, const Timeout &timeout);
+		void WakeReaders ();
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __SHMPORT_H
@@ -0,0 +1,115 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "statistics.h"
+
+#include <cstring>
+#include <sstream>
+using namespace std;
+
+namespace flexiport
+{
+
+void PortStatistics::Reset ()
+{
+	_readCalls = _readBytes = 0;
+	_writeCalls = _writeBytes = 0;
+	_skipCalls = _skipBytes = 0;
+	_timeouts = _reconnects = 0;
+	_waitTime = 0;
+	memset (_latency, 0, sizeof (_latency));
+}
+
+void PortStatistics::Add (const PortStatistics &rhs)
+{
+	_readCalls += rhs._readCalls;
+	_readBytes += rhs._readBytes;
+	_writeCalls += rhs._writeCalls;
+	_writeBytes += rhs._writeBytes;
+	_skipCalls += rhs._skipCalls;
+	_skipBytes += rhs._skipBytes;
+	_timeouts += rhs._timeouts;
+	_reconnects += rhs._reconnects;
+	_waitTime += rhs._waitTime;
+	for (unsigned int ii = 0; ii < LATENCY_BUCKETS; ii++)
+		_latency[ii] += rhs._latency[ii];
+}
+
+void PortStatistics::AddLatency (int64_t nsec)
+{
+	unsigned int bucket = 0;
+	int64_t limit = 1000;
+	while (nsec >= limit && bucket < LATENCY_BUCKETS - 1)
+	{
+		bucket++;
+		limit <<= 1;
+	}
+	_latency[bucket]++;
+}
+
+int64_t PortStatistics::LatencyBucketLimit (unsigned int bucket)
+{
+	return static_cast<int64_t> (1000) << bucket;
+}
+
+int64_t PortStatistics::LatencyPercentile (double fraction) const
+{
+	uint64_t total = 0;
+	for (unsigned int ii = 0; ii < LATENCY_BUCKETS; ii++)
+		total += _latency[ii];
+	if (total == 0)
+		return 0;
+
+	uint64_t count = 0;
+	for (unsigned int ii = 0; ii < LATENCY_BUCKETS; ii++)
+	{
+		count += _latency[ii];
+		if (count >= fraction * total)
+			return LatencyBucketLimit (ii);
+	}
+	return LatencyBucketLimit (LATENCY_BUCKETS - 1);
+}
+
+string PortStatistics::AsString () const
+{
+	stringstream ss;
+
+	ss << "Reads: " << _readCalls << " calls, " << _readBytes << " bytes" << endl;
+	ss << "Writes: " << _writeCalls << " calls, " << _writeBytes << " bytes" << endl;
+	ss << "Skips: " << _skipCalls << " calls, " << _skipBytes << " bytes" << endl;
+	ss << "Timeouts: " << _timeouts << "\tReconnects: " << _reconnects << endl;
+	ss << "Time waiting: " << _waitTime / 1000 << " us" << endl;
+	if (LatencyPercentile (1) > 0)
+	{
+		ss << "Read latency (us) 50%: <" << LatencyPercentile (0.5) / 1000 << "\t99%: <" <<
+			LatencyPercentile (0.99) / 1000 << endl;
+	}
+
+	return ss.str ();
+}
+
+} // namespace flexiport
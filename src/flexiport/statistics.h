@@ -0,0 +1,93 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATISTICS_H
+#define __STATISTICS_H
+
+#include "timeout.h"
+#include "flexiport_types.h"
+
+#include <string>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief I/O counters kept by each port, returned by @ref Port::GetStatistics.
+
+The read and write counters count operations on the underlying device, so reads satisfied from a
+port's input buffer are not counted as calls. The skip counters count calls to @ref Port::Skip and
+@ref Port::SkipUntil and the bytes they discarded.
+
+The read latency histogram records, for each read whose data arrival time is known (see @ref
+Port::ReadTimestamped; UDP datagrams always have one), how long the data waited between arriving
+and being read. Bucket 0 holds latencies below 1 microsecond, bucket i holds latencies of at least
+2^(i - 1) microseconds and less than 2^i microseconds, and the last bucket also holds everything
+longer.
+
+The counters are not protected by a lock. Values read while another thread is using the port may
+be slightly out of date. */
+class FLEXIPORT_EXPORT PortStatistics
+{
+	public:
+		static const unsigned int LATENCY_BUCKETS = 32;
+
+		PortStatistics ()                       { Reset (); }
+
+		/// @brief Set all counters to zero.
+		void Reset ();
+		/// @brief Add the counters of another set of statistics to these.
+		void Add (const PortStatistics &rhs);
+		/// @brief Record a read latency, in nanoseconds, in the histogram.
+		void AddLatency (int64_t nsec);
+		/// @brief Get the upper bound, in nanoseconds, of a latency histogram bucket.
+		static int64_t LatencyBucketLimit (unsigned int bucket);
+		/// @brief Get the latency below which the given fraction (0 to 1) of reads fell.
+		int64_t LatencyPercentile (double fraction) const;
+		/// @brief Get a human-readable summary of the statistics.
+		std::string AsString () const;
+
+		uint64_t _readCalls;
+		uint64_t _readBytes;
+		uint64_t _writeCalls;
+		uint64_t _writeBytes;
+		uint64_t _skipCalls;
+		uint64_t _skipBytes;
+		uint64_t _timeouts;     // Waits for data or space to write that timed out.
+		uint64_t _reconnects;   // Times the port was reopened after closing.
+		int64_t _waitTime;      // Nanoseconds spent blocked waiting for data or space to write.
+		uint64_t _latency[LATENCY_BUCKETS];
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __STATISTICS_H
@@ -88,6 +88,44 @@ inline string StrError (int errNo)
 	const int ERRNO_EAGAIN = EAGAIN;
 #endif
 
+#if !defined (WIN32)
+// Ask the kernel to record the time each packet arrives, for ReadTimestamped ()
+inline void SetTimestampFlag (int sock, unsigned int debug)
+{
+#if defined (SO_TIMESTAMPNS)
+	int timestampFlag = 1;
+	if (setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestampFlag, sizeof (timestampFlag)) < 0 &&
+			debug >= 1)
+	{
+		cerr << __func__ << "() setsockopt() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ()) << "; packets will not be timestamped." << endl;
+	}
+#endif
+}
+
+// Get the kernel receive timestamp from the control messages of a received message. Returns false
+// if there is none.
+inline bool GetTimestampFromControl (struct msghdr *msg, Timestamp &timestamp)
+{
+#if defined (SO_TIMESTAMPNS)
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (msg); cmsg != NULL; cmsg = CMSG_NXTHDR (msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy (&ts, CMSG_DATA (cmsg), sizeof (ts));
+			timestamp = Timestamp (ts.tv_sec, ts.tv_nsec, Timestamp::REALTIME);
+			return true;
+		}
+	}
+#endif
+	return false;
+}
+
+// Enough space for the timestamp control message
+const size_t TIMESTAMP_CONTROL_SIZE = 64;
+#endif // !defined (WIN32)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Constructor/destructor
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -160,6 +198,9 @@ void TCPPort::Open ()
 		Connect ();
 	}
 	SetSocketBlockingFlag ();
+#if !defined (WIN32)
+	SetTimestampFlag (_sock, _debug);
+#endif
 	_open = true;
 	if (_debug >= 2)
 		cerr << "TCPPort::" << __func__ << "() Port is open" << endl;
@@ -171,6 +212,7 @@ void TCPPort::Close ()
 		cerr << "TCPPort::" << __func__ << "() Closing port" << endl;
 
 	_open = false;
+	ClearReadBuffer ();
 #if defined (WIN32)
 	if (_sock != INVALID_SOCKET)
 	{
@@ -212,6 +254,10 @@ ssize_t TCPPort::Read (void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "TCPPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
 
+	// Data already in the input buffer is returned before reading from the socket
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
 	if (_timeout._sec == -1)
 	{
 		// Socket is blocking, so just read
@@ -271,18 +317,148 @@ ssize_t TCPPort::Read (void * const buffer, size_t count)
 		{
 			if (_debug >= 1)
 				cerr << "TCPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
 			Open ();
 		}
 		return 0;
 	}
 
+	CountRead (receivedBytes);
+	return receivedBytes;
+}
+
+#if !defined (WIN32)
+ssize_t TCPPort::ReadV (const struct iovec *iov, int iovcnt)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+	{
+		cerr << "TCPPort::" << __func__ << "() Going to read " << IOVecLength (iov, iovcnt) <<
+			" bytes into " << iovcnt << " buffers" << endl;
+	}
+
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBufferV (iov, iovcnt);
+
+	ssize_t receivedBytes = readv (_sock, iov, iovcnt);
+	if (receivedBytes < 0 && ErrNo () == ERRNO_EAGAIN && _timeout._sec != -1)
+	{
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		receivedBytes = readv (_sock, iov, iovcnt);
+	}
+
+	if (_debug >= 2)
+		cerr << "TCPPort::" << __func__ << "() Read " << receivedBytes << " bytes" << endl;
+
+	if (receivedBytes < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+			return -1; // Timed out
+		stringstream ss;
+		ss << "TCPPort::" << __func__ << "() readv() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	else if (receivedBytes == 0)
+	{
+		// Peer disconnected cleanly, do the same at this end
+		if (_debug >= 1)
+			cerr << "TCPPort::" << __func__ << "() Peer disconnected cleanly." << endl;
+		Close ();
+		if (_alwaysOpen)
+		{
+			if (_debug >= 1)
+				cerr << "TCPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
+			Open ();
+		}
+	}
+
+	CountRead (receivedBytes);
 	return receivedBytes;
 }
 
+ssize_t TCPPort::ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+		cerr << "TCPPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
+
+	if (ReadBufferUsage () > 0)
+	{
+		timestamp = _readBufferTimestamp;
+		return TakeFromReadBuffer (buffer, count);
+	}
+
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = count;
+	union
+	{
+		struct cmsghdr header;          // For alignment
+		uint8_t buffer[TIMESTAMP_CONTROL_SIZE];
+	} control;
+	struct msghdr msg;
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof (control.buffer);
+
+	ssize_t receivedBytes = recvmsg (_sock, &msg, 0);
+	if (receivedBytes < 0 && ErrNo () == ERRNO_EAGAIN && _timeout._sec != -1)
+	{
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		msg.msg_controllen = sizeof (control.buffer);
+		receivedBytes = recvmsg (_sock, &msg, 0);
+	}
+
+	if (_debug >= 2)
+		cerr << "TCPPort::" << __func__ << "() Read " << receivedBytes << " bytes" << endl;
+
+	if (receivedBytes < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+			return -1; // Timed out
+		stringstream ss;
+		ss << "TCPPort::" << __func__ << "() recvmsg() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	else if (receivedBytes == 0)
+	{
+		// Peer disconnected cleanly, do the same at this end
+		if (_debug >= 1)
+			cerr << "TCPPort::" << __func__ << "() Peer disconnected cleanly." << endl;
+		Close ();
+		if (_alwaysOpen)
+		{
+			if (_debug >= 1)
+				cerr << "TCPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
+			Open ();
+		}
+	}
+	else
+	{
+		if (!GetTimestampFromControl (&msg, timestamp))
+			timestamp = Timestamp::Now (Timestamp::REALTIME);
+		CountLatency (timestamp);
+	}
+
+	CountRead (receivedBytes);
+	return receivedBytes;
+}
+#endif // !defined (WIN32)
+
 ssize_t TCPPort::ReadFull (void * const buffer, size_t count)
 {
 	ssize_t numReceived = 0;
-	size_t receivedBytes = 0;
+	size_t receivedBytes = 0, bufferedBytes = 0;
 
 	CheckPort (true);
 
@@ -292,6 +468,11 @@ ssize_t TCPPort::ReadFull (void * const buffer, size_t count)
 			count << " bytes" << endl;
 	}
 
+	// Data already in the input buffer is used first. It was counted when it was read into the
+	// buffer.
+	if (ReadBufferUsage () > 0)
+		receivedBytes = bufferedBytes = TakeFromReadBuffer (buffer, count);
+
 	while (receivedBytes < count)
 	{
 #if defined (WIN32)
@@ -330,6 +511,7 @@ ssize_t TCPPort::ReadFull (void * const buffer, size_t count)
 			{
 				if (_debug >= 1)
 					cerr << "TCPPort::" << __func__ << "() Trying to reconnect." << endl;
+				_statistics._reconnects++;
 				Open ();
 				// Can go around again after this - if it doesn't open successfully Open() will throw
 			}
@@ -343,6 +525,7 @@ ssize_t TCPPort::ReadFull (void * const buffer, size_t count)
 			receivedBytes += numReceived;
 	}
 
+	CountRead (receivedBytes - bufferedBytes);
 	return receivedBytes;
 }
 
@@ -368,6 +551,7 @@ ssize_t TCPPort::BytesAvailable ()
 			StrError (ErrNo ());
 		throw PortException (ss.str ());
 	}
+	bytesAvailable += ReadBufferUsage ();
 
 	if (_debug >= 2)
 	{
@@ -381,6 +565,10 @@ ssize_t TCPPort::BytesAvailableWait ()
 {
 	CheckPort (true);
 
+	// Buffered data is available without waiting
+	if (ReadBufferUsage () > 0)
+		return BytesAvailable ();
+
 	if (WaitForDataOrTimeout () == TIMED_OUT)
 	{
 		if (_debug >= 2)
@@ -466,14 +654,60 @@ ssize_t TCPPort::Write (const void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "TCPPort::" << __func__ << "() Wrote " << numSent << " bytes" << endl;
 
+	CountWrite (numSent);
 	return numSent;
 }
 
+#if !defined (WIN32)
+ssize_t TCPPort::WriteV (const struct iovec *iov, int iovcnt)
+{
+	CheckPort (false);
+
+	if (_debug >= 2)
+	{
+		cerr << "TCPPort::" << __func__ << "() Writing " << IOVecLength (iov, iovcnt) <<
+			" bytes from " << iovcnt << " buffers" << endl;
+	}
+	if (_timeout._sec != -1)
+	{
+		if (WaitForWritableOrTimeout () == TIMED_OUT)
+		{
+			if (_debug >= 2)
+				cerr << "TCPPort::" << __func__ << "() Timed out waiting to send" << endl;
+			return -1;
+		}
+	}
+
+	ssize_t numSent = writev (_sock, iov, iovcnt);
+	if (numSent < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+		{
+			if (_debug >= 2)
+				cerr << "TCPPort::" << __func__ << "() Timed out while in writev()" << endl;
+			return -1; // Timed out
+		}
+		stringstream ss;
+		ss << "TCPPort::" << __func__ << "() writev() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+		cerr << "TCPPort::" << __func__ << "() Wrote " << numSent << " bytes" << endl;
+
+	CountWrite (numSent);
+	return numSent;
+}
+#endif // !defined (WIN32)
+
 void TCPPort::Flush ()
 {
 	int numRead = 0;
 	char dump[128];
 
+	ClearReadBuffer ();
+
 	// Read data out of the socket into a dump until there's nothing left to read.
 	// Use MSG_DONTWAIT to avoid the timeout if one is set on Linux.
 	// It would be nice to use MSG_DONTWAIT on Windows, but MS didn't see fit to include that in
@@ -859,7 +1093,9 @@ TCPPort::WaitStatus TCPPort::WaitForDataOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_sock + 1, &fdSet, NULL, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
@@ -923,6 +1159,7 @@ bool TCPPort::IsDataAvailable ()
 		{
 			if (_debug >= 1)
 				cerr << "TCPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
 			Open ();
 		}
 		// Fall through to return no data
@@ -945,7 +1182,9 @@ TCPPort::WaitStatus TCPPort::WaitForWritableOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_sock + 1, NULL, &fdSet, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
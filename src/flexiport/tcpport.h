@@ -53,7 +53,8 @@ See the @ref Port class documentation for how to use the common API.
    - Default: 20000
  - listen
    - Listen on the specified port rather than connecting to it. Other network applications can
-     connect and send data, which will become available as normal.
+     connect and send data, which will become available as normal. Only one peer is accepted; to
+     serve many clients at once, use a @ref TCPServerPort (type=tcpserver).
    - Default: off */
 class FLEXIPORT_EXPORT TCPPort : public Port
 {
@@ -70,6 +71,12 @@ class FLEXIPORT_EXPORT TCPPort : public Port
 		void Close ();
 		/// @brief Read from the port.
 		ssize_t Read (void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Read from the port into several buffers.
+		ssize_t ReadV (const struct iovec *iov, int iovcnt);
+		/// @brief Read from the port and get the time the data arrived.
+		ssize_t ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp);
+#endif
 		/// @brief Read the requested quantity of data from the port.
 		ssize_t ReadFull (void * const buffer, size_t count);
 		/// @brief Get the number of bytes waiting to be read at the port. Returns immediatly.
@@ -78,6 +85,10 @@ class FLEXIPORT_EXPORT TCPPort : public Port
 		ssize_t BytesAvailableWait ();
 		/// @brief Write data to the port.
 		ssize_t Write (const void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Write data from several buffers to the port.
+		ssize_t WriteV (const struct iovec *iov, int iovcnt);
+#endif
 		/// @brief Flush the port's input and output buffers, discarding all data.
 		void Flush ();
 		/// @brief Drain the port's input and output buffers.
@@ -92,6 +103,10 @@ class FLEXIPORT_EXPORT TCPPort : public Port
 		void SetCanWrite (bool canWrite);
 		/// @brief Check if the port is open
 		bool IsOpen () const                        { return _open; }
+		/// @brief Get the connected socket.
+		int GetReadDescriptor () const              { return _sock; }
+		/// @brief Get the connected socket.
+		int GetWriteDescriptor () const             { return _sock; }
 
 	private:
 		int _sock;          // Socket connected to wherever the data is coming from.
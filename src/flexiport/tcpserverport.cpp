@@ -0,0 +1,755 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flexiport.h"
+#include "tcpserverport.h"
+#include "timestamp.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <deque>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+#if !defined (MSG_NOSIGNAL)
+	#define MSG_NOSIGNAL    0
+#endif
+
+namespace flexiport
+{
+
+inline int ErrNo ()
+{
+	return errno;
+}
+
+inline string StrError (int errNo)
+{
+	return string (strerror (errNo));
+}
+
+// Data written to the port, shared by the queues of all clients it hasn't been sent to yet.
+struct TCPServerPort::SharedChunk
+{
+	vector<uint8_t> data;
+	unsigned int refs;
+};
+
+struct TCPServerPort::Client
+{
+	int sock;
+	string address;
+	deque<SharedChunk*> queue;
+	size_t offset;      // Bytes of the first chunk already sent
+	size_t queued;      // Bytes waiting to be sent
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Constructor/destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TCPServerPort::TCPServerPort (map<string, string> options)
+	: Port (), _listenSock (-1), _nextClient (0), _ip ("*"), _port (20000), _maxClients (0),
+	_maxQueued (1048576), _mergeInput (true), _slowClients (0), _open (false)
+{
+	_type = "tcpserver";
+	ProcessOptions (options);
+
+	if (_alwaysOpen)
+		Open ();
+}
+
+TCPServerPort::~TCPServerPort ()
+{
+	Close ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Port management
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TCPServerPort::Open ()
+{
+	if (_open)
+		throw PortException ("Attempt to open already-opened port.");
+
+	Listen ();
+	_open = true;
+	if (_debug >= 1)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Listening on " << _ip << ":" << _port <<
+			endl;
+	}
+}
+
+void TCPServerPort::Close ()
+{
+	if (_debug >= 2)
+		cerr << "TCPServerPort::" << __func__ << "() Closing port" << endl;
+
+	_open = false;
+	ClearReadBuffer ();
+	while (!_clients.empty ())
+		DropClient (_clients.size () - 1, "port closed");
+	if (_listenSock >= 0)
+	{
+		close (_listenSock);
+		_listenSock = -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t TCPServerPort::Read (void * const buffer, size_t count)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+		cerr << "TCPServerPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
+
+	// Data already in the input buffer is returned before reading from the clients
+	if (ReadBufferUsage () > 0)
+		return TakeFromReadBuffer (buffer, count);
+
+	AcceptClients ();
+	SendQueued ();
+	if (!_mergeInput)
+	{
+		// Nothing sent by the clients will ever be returned, so there is no point waiting for it
+		DiscardInput ();
+		if (_debug >= 2)
+			cerr << "TCPServerPort::" << __func__ << "() Client input is discarded" << endl;
+		if (IsBlocking ())
+			return -1;
+		else
+			return 0;
+	}
+	while (true)
+	{
+		// Take whatever the next client with data has sent
+		for (unsigned int ii = 0; ii < _clients.size (); ii++)
+		{
+			unsigned int index = (_nextClient + ii) % _clients.size ();
+			ssize_t receivedBytes = recv (_clients[index]->sock, buffer, count, MSG_DONTWAIT);
+			if (receivedBytes > 0)
+			{
+				_nextClient = index + 1;
+				if (_debug >= 2)
+				{
+					cerr << "TCPServerPort::" << __func__ << "() Read " << receivedBytes <<
+						" bytes from " << _clients[index]->address << endl;
+				}
+				CountRead (receivedBytes);
+				return receivedBytes;
+			}
+			else if (receivedBytes == 0 || (ErrNo () != EAGAIN && ErrNo () != EWOULDBLOCK &&
+						ErrNo () != EINTR))
+			{
+				DropClient (index, receivedBytes == 0 ? "disconnected" : "read error");
+				ii--;
+			}
+		}
+
+		if (!WaitForClients (true, _timeout))
+		{
+			if (_debug >= 2)
+				cerr << "TCPServerPort::" << __func__ << "() Timed out" << endl;
+			if (IsBlocking ())
+				return -1; // Timeout in blocking mode
+			else
+				return 0; // No data in non-blocking mode
+		}
+	}
+}
+
+ssize_t TCPServerPort::ReadFull (void * const buffer, size_t count)
+{
+	size_t receivedBytes = 0;
+	Timeout oldTimeout = _timeout;
+
+	CheckPort (true);
+
+	if (_debug >= 2)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Going to read until have " << count <<
+			" bytes" << endl;
+	}
+
+	if (!_mergeInput && ReadBufferUsage () < count)
+	{
+		throw PortException (string ("TCPServerPort::") + __func__ +
+				string (" Client input is discarded, so there is nothing to read."));
+	}
+
+	// Set the port to infinite blocking
+	_timeout = Timeout (-1, 0);
+	while (receivedBytes < count)
+	{
+		ssize_t numReceived = Read (&(reinterpret_cast<uint8_t*> (buffer)[receivedBytes]),
+				count - receivedBytes);
+		if (numReceived < 0)
+		{
+			_timeout = oldTimeout;
+			throw PortException (string ("TCPServerPort::") + __func__ +
+					string (" Read() timed out, probably shouldn't happen."));
+		}
+		receivedBytes += numReceived;
+	}
+
+	_timeout = oldTimeout;
+	return receivedBytes;
+}
+
+ssize_t TCPServerPort::BytesAvailable ()
+{
+	ssize_t bytesAvailable = 0;
+
+	CheckPort (true);
+
+	AcceptClients ();
+	SendQueued ();
+	if (_mergeInput)
+	{
+		for (unsigned int ii = 0; ii < _clients.size (); ii++)
+		{
+			int clientBytes = 0;
+			if (ioctl (_clients[ii]->sock, FIONREAD, &clientBytes) < 0)
+			{
+				stringstream ss;
+				ss << "TCPServerPort::" << __func__ << "() ioctl() error: (" << ErrNo () << ") " <<
+					StrError (ErrNo ());
+				throw PortException (ss.str ());
+			}
+			bytesAvailable += clientBytes;
+		}
+	}
+	else
+		DiscardInput ();
+	bytesAvailable += ReadBufferUsage ();
+
+	if (_debug >= 2)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Found " << bytesAvailable <<
+			" bytes available" << endl;
+	}
+	return bytesAvailable;
+}
+
+ssize_t TCPServerPort::BytesAvailableWait ()
+{
+	CheckPort (true);
+
+	ssize_t bytesAvailable = BytesAvailable ();
+	if (bytesAvailable > 0 || !_mergeInput)
+		return bytesAvailable;
+
+	if (!WaitForClients (true, _timeout))
+	{
+		if (_debug >= 2)
+		{
+			cerr << "TCPServerPort::" << __func__ <<
+				" Timed out waiting for data to check bytes available" << endl;
+		}
+		if (IsBlocking ())
+			return -1; // Timeout in blocking mode
+		else
+			return 0; // No data in non-blocking mode
+	}
+
+	return BytesAvailable ();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Write functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ssize_t TCPServerPort::Write (const void * const buffer, size_t count)
+{
+	SharedChunk *chunk = NULL;
+
+	CheckPort (false);
+
+	if (_debug >= 2)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Writing " << count << " bytes to " <<
+			_clients.size () << " clients" << endl;
+	}
+
+	AcceptClients ();
+	SendQueued ();
+	for (int ii = _clients.size () - 1; ii >= 0; ii--)
+	{
+		Client *client = _clients[ii];
+		ssize_t numSent = 0;
+
+		// Clients that are keeping up are sent the data directly
+		if (client->queue.empty ())
+		{
+			numSent = send (client->sock, buffer, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (numSent < 0)
+			{
+				if (ErrNo () != EAGAIN && ErrNo () != EWOULDBLOCK && ErrNo () != EINTR)
+				{
+					DropClient (ii, "write error");
+					continue;
+				}
+				numSent = 0;
+			}
+			if (static_cast<size_t> (numSent) == count)
+				continue;
+		}
+
+		// The rest waits in the queue, copied only once for all clients. This function holds a
+		// reference until it is done, in case the clients queueing it are dropped.
+		if (chunk == NULL)
+		{
+			chunk = new SharedChunk;
+			chunk->data.assign (reinterpret_cast<const uint8_t*> (buffer),
+					reinterpret_cast<const uint8_t*> (buffer) + count);
+			chunk->refs = 1;
+		}
+		if (client->queue.empty ())
+			client->offset = numSent;
+		chunk->refs++;
+		client->queue.push_back (chunk);
+		client->queued += count - numSent;
+		if (client->queued > _maxQueued)
+		{
+			_slowClients++;
+			DropClient (ii, "fell too far behind");
+		}
+	}
+	if (chunk != NULL)
+		ReleaseChunk (chunk);
+
+	CountWrite (count);
+	return count;
+}
+
+void TCPServerPort::Flush ()
+{
+	ClearReadBuffer ();
+	if (!_open)
+		return;
+
+	DiscardInput ();
+	for (unsigned int ii = 0; ii < _clients.size (); ii++)
+	{
+		Client *client = _clients[ii];
+		while (!client->queue.empty ())
+		{
+			ReleaseChunk (client->queue.front ());
+			client->queue.pop_front ();
+		}
+		client->offset = client->queued = 0;
+	}
+}
+
+void TCPServerPort::Drain ()
+{
+	CheckPort (false);
+
+	if (!WaitForClients (false, _timeout) && _debug >= 1)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Timed out waiting for clients to receive " <<
+			"queued data" << endl;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Other public API functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string TCPServerPort::GetStatus () const
+{
+	stringstream status;
+
+	status << "TCP server-specific status:" << endl;
+	status << "Listening address: " << _ip << ":" << _port << endl;
+	status << "Client input: " << (_mergeInput ? "merged" : "discarded") << endl;
+	status << "Clients: " << _clients.size ();
+	if (_maxClients > 0)
+		status << " (maximum " << _maxClients << ")";
+	status << endl;
+	for (unsigned int ii = 0; ii < _clients.size (); ii++)
+	{
+		status << "\t" << _clients[ii]->address << "\t" << _clients[ii]->queued <<
+			" bytes queued" << endl;
+	}
+	status << "Clients disconnected for falling behind: " << _slowClients << endl;
+	status << (_open ? "Port is open" : "Port is closed") << endl;
+
+	return Port::GetStatus () + status.str ();
+}
+
+void TCPServerPort::SetTimeout (Timeout timeout)
+{
+	_timeout = timeout;
+}
+
+void TCPServerPort::SetCanRead (bool canRead)
+{
+	_canRead = canRead;
+}
+
+void TCPServerPort::SetCanWrite (bool canWrite)
+{
+	_canWrite = canWrite;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal functions
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TCPServerPort::ReleaseChunk (SharedChunk *chunk)
+{
+	if (--chunk->refs == 0)
+		delete chunk;
+}
+
+void TCPServerPort::CheckPort (bool read)
+{
+	if (!_open)
+		throw PortException ("Port is not open.");
+
+	if (read && !_canRead)
+		throw PortException ("Cannot read from write-only port.");
+
+	if (!read && !_canWrite)
+		throw PortException ("Cannot write to read-only port.");
+}
+
+bool TCPServerPort::ProcessOption (const std::string &option, const std::string &value)
+{
+	char c = '\0';
+
+	// Check if the parent class can handle this option
+	if (Port::ProcessOption (option, value))
+		return true;
+
+	if (option == "ip")
+	{
+		_ip = value;
+		return true;
+	}
+	else if (option == "port")
+	{
+		istringstream is (value);
+		if (!(is >> _port) || is.get (c) || _port == 0)
+			throw PortException ("Bad port number: " + value);
+		return true;
+	}
+	else if (option == "max_clients")
+	{
+		// Read into a signed value, because an unsigned read accepts "-1" and wraps it around
+		istringstream is (value);
+		long maxClients = 0;
+		if (!(is >> maxClients) || is.get (c) || maxClients < 0)
+			throw PortException ("Bad maximum number of clients: " + value);
+		_maxClients = static_cast<unsigned int> (maxClients);
+		return true;
+	}
+	else if (option == "max_queued")
+	{
+		istringstream is (value);
+		long maxQueued = 0;
+		if (!(is >> maxQueued) || is.get (c) || maxQueued <= 0)
+			throw PortException ("Bad maximum queued bytes: " + value);
+		_maxQueued = static_cast<size_t> (maxQueued);
+		return true;
+	}
+	else if (option == "client_input")
+	{
+		if (value == "merge")
+			_mergeInput = true;
+		else if (value == "discard")
+			_mergeInput = false;
+		else
+			throw PortException ("Bad client input policy (must be merge or discard): " + value);
+		return true;
+	}
+
+	return false;
+}
+
+void TCPServerPort::Listen ()
+{
+	struct addrinfo *res = NULL, *goodAI = NULL, hints;
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ostringstream portSS;
+	portSS << _port;
+	int errorCode;
+	if ((errorCode = getaddrinfo (_ip == "*" ? NULL : _ip.c_str (), portSS.str ().c_str (),
+					&hints, &res)) != 0)
+	{
+		stringstream ss;
+		ss << "TCPServerPort::" << __func__ << "() getaddrinfo() error: (" << errorCode << ") " <<
+			gai_strerror (errorCode);
+		throw PortException (ss.str ());
+	}
+
+	stringstream ss;
+	ss << "TCPServerPort::" << __func__ << "() Failed to listen on all interfaces:";
+	for (goodAI = res; goodAI != NULL; goodAI = goodAI->ai_next)
+	{
+		if ((_listenSock = socket (goodAI->ai_family, goodAI->ai_socktype,
+						goodAI->ai_protocol)) < 0)
+		{
+			ss << " (" << ErrNo () << ") " << StrError (ErrNo ());
+			continue;
+		}
+		int reuseAddr = 1;
+		setsockopt (_listenSock, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof (reuseAddr));
+		if (bind (_listenSock, goodAI->ai_addr, goodAI->ai_addrlen) < 0 ||
+				listen (_listenSock, 16) < 0)
+		{
+			ss << " (" << ErrNo () << ") " << StrError (ErrNo ());
+			close (_listenSock);
+			_listenSock = -1;
+			continue;
+		}
+		break;
+	}
+	freeaddrinfo (res);
+	if (_listenSock < 0)
+		throw PortException (ss.str ());
+
+	// Clients are accepted whenever the port is used, so accept() must never wait
+	fcntl (_listenSock, F_SETFL, fcntl (_listenSock, F_GETFL) | O_NONBLOCK);
+}
+
+void TCPServerPort::AcceptClients ()
+{
+	while (true)
+	{
+		struct sockaddr_storage address;
+		socklen_t addressLength = sizeof (address);
+		int sock = accept (_listenSock, reinterpret_cast<struct sockaddr*> (&address),
+				&addressLength);
+		if (sock < 0)
+		{
+			if (ErrNo () == EINTR || ErrNo () == ECONNABORTED)
+				continue;
+			if (ErrNo () == EAGAIN || ErrNo () == EWOULDBLOCK)
+				return;
+			stringstream ss;
+			ss << "TCPServerPort::" << __func__ << "() accept() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			throw PortException (ss.str ());
+		}
+
+		char host[NI_MAXHOST], service[NI_MAXSERV];
+		stringstream name;
+		if (getnameinfo (reinterpret_cast<struct sockaddr*> (&address), addressLength, host,
+					sizeof (host), service, sizeof (service), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+			name << host << ":" << service;
+		else
+			name << "unknown";
+
+		if (_maxClients > 0 && _clients.size () >= _maxClients)
+		{
+			if (_debug >= 1)
+			{
+				cerr << "TCPServerPort::" << __func__ << "() Refusing client " << name.str () <<
+					", already have " << _clients.size () << endl;
+			}
+			close (sock);
+			continue;
+		}
+
+		Client *client = new Client;
+		client->sock = sock;
+		client->address = name.str ();
+		client->offset = client->queued = 0;
+		_clients.push_back (client);
+		if (_debug >= 1)
+			cerr << "TCPServerPort::" << __func__ << "() Accepted client " << name.str () << endl;
+	}
+}
+
+void TCPServerPort::DropClient (unsigned int index, const char *reason)
+{
+	Client *client = _clients[index];
+	if (_debug >= 1)
+	{
+		cerr << "TCPServerPort::" << __func__ << "() Dropping client " << client->address <<
+			": " << reason << endl;
+	}
+
+	while (!client->queue.empty ())
+	{
+		ReleaseChunk (client->queue.front ());
+		client->queue.pop_front ();
+	}
+	close (client->sock);
+	delete client;
+	_clients.erase (_clients.begin () + index);
+}
+
+// Send as much queued data to each client as it will take without waiting.
+void TCPServerPort::SendQueued ()
+{
+	for (int ii = _clients.size () - 1; ii >= 0; ii--)
+	{
+		if (_clients[ii]->queued > 0 && !SendToClient (_clients[ii]))
+			DropClient (ii, "write error");
+	}
+}
+
+// Returns false if the client should be dropped.
+bool TCPServerPort::SendToClient (Client *client)
+{
+	while (!client->queue.empty ())
+	{
+		SharedChunk *chunk = client->queue.front ();
+		ssize_t numSent = send (client->sock, &chunk->data[client->offset],
+				chunk->data.size () - client->offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (numSent < 0)
+			return ErrNo () == EAGAIN || ErrNo () == EWOULDBLOCK || ErrNo () == EINTR;
+
+		client->offset += numSent;
+		client->queued -= numSent;
+		if (client->offset == chunk->data.size ())
+		{
+			ReleaseChunk (chunk);
+			client->queue.pop_front ();
+			client->offset = 0;
+		}
+	}
+	return true;
+}
+
+void TCPServerPort::DiscardInput ()
+{
+	char dump[1024];
+
+	for (int ii = _clients.size () - 1; ii >= 0; ii--)
+	{
+		ssize_t numRead;
+		while ((numRead = recv (_clients[ii]->sock, dump, sizeof (dump), MSG_DONTWAIT)) > 0);
+		if (numRead == 0 || (ErrNo () != EAGAIN && ErrNo () != EWOULDBLOCK && ErrNo () != EINTR))
+			DropClient (ii, numRead == 0 ? "disconnected" : "read error");
+	}
+}
+
+/* Wait for a client to send data (if forData is true) or for all queued data to be sent (if it is
+false), accepting new clients and sending queued data while waiting. If client input is being
+discarded, it is discarded here and never counts as data. Returns false if the timeout passed. */
+bool TCPServerPort::WaitForClients (bool forData, const Timeout &timeout)
+{
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
+	int64_t limit = -1;
+	if (timeout._sec >= 0)
+		limit = static_cast<int64_t> (timeout._sec) * 1000000 + timeout._usec;
+
+	while (true)
+	{
+		if (!forData)
+		{
+			bool queued = false;
+			for (unsigned int ii = 0; ii < _clients.size (); ii++)
+				queued = queued || _clients[ii]->queued > 0;
+			if (!queued)
+			{
+				CountWait (waitStart, false);
+				return true;
+			}
+		}
+
+		vector<struct pollfd> fds (_clients.size () + 1);
+		fds[0].fd = _listenSock;
+		fds[0].events = POLLIN;
+		for (unsigned int ii = 0; ii < _clients.size (); ii++)
+		{
+			fds[ii + 1].fd = _clients[ii]->sock;
+			fds[ii + 1].events = (forData ? POLLIN : 0) | (_clients[ii]->queued > 0 ? POLLOUT : 0);
+		}
+
+		int waitMs = -1;
+		if (limit >= 0)
+		{
+			int64_t remaining = limit - (Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+					waitStart.AsNanoseconds ()) / 1000;
+			waitMs = remaining > 0 ? (remaining + 999) / 1000 : 0;
+		}
+		int result = poll (&fds[0], fds.size (), waitMs);
+		if (result < 0)
+		{
+			if (ErrNo () == EINTR)
+				continue;
+			stringstream ss;
+			ss << "TCPServerPort::" << __func__ << "() poll() error: (" << ErrNo () << ") " <<
+				StrError (ErrNo ());
+			throw PortException (ss.str ());
+		}
+		else if (result == 0)
+		{
+			if (_debug >= 3)
+				cerr << "TCPServerPort::" << __func__ << "() Timed out" << endl;
+			CountWait (waitStart, true);
+			return false;
+		}
+
+		bool haveData = false;
+		for (int ii = _clients.size () - 1; ii >= 0; ii--)
+		{
+			short revents = fds[ii + 1].revents;
+			if ((revents & POLLOUT) && !SendToClient (_clients[ii]))
+				DropClient (ii, "write error");
+			else if (forData && (revents & (POLLIN | POLLHUP | POLLERR)))
+				haveData = true;
+		}
+		if (haveData && !_mergeInput)
+		{
+			DiscardInput ();
+			haveData = false;
+		}
+		if (fds[0].revents & POLLIN)
+			AcceptClients ();
+		if (haveData)
+		{
+			CountWait (waitStart, false);
+			return true;
+		}
+	}
+}
+
+} // namespace flexiport
@@ -0,0 +1,159 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TCPSERVERPORT_H
+#define __TCPSERVERPORT_H
+
+#include "port.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief TCP server implementation of the @ref Port class, publishing one stream to many clients.
+
+See the @ref Port class documentation for how to use the common API.
+
+Unlike a listening @ref TCPPort, which accepts a single peer, this port accepts any number of
+clients and broadcasts everything written to it to all of them. This allows one process that owns
+a device to serve its data to many local consumers. Opening the port starts listening and does not
+wait for a client; clients are accepted whenever the port is used, and data written while there
+are no clients is discarded.
+
+Written data is copied once into a shared, reference-counted buffer, and each client sends from
+that buffer at its own pace without the writer waiting. A client that falls more than max_queued
+bytes behind is disconnected so that it cannot hold up the others or use unlimited memory.
+
+Data sent by clients is either merged into the port's input, in whatever order it arrives, or
+discarded, depending on the client_input option. When it is discarded there is never anything to
+read, so reads return at once as if they had timed out, and ReadFull throws.
+
+Because it has many sockets, this port has no single descriptor; a @ref PortSet checks it by
+polling.
+
+@par Options
+ - ip <string>
+   - IP address of the interface to listen on. Set to "*" to listen on any interface.
+   - Default: *
+ - port <integer>
+   - TCP port to listen on.
+   - Default: 20000
+ - max_clients <integer>
+   - Maximum number of clients connected at once. Further clients are refused. 0 for no limit.
+     Must not be negative.
+   - Default: 0
+ - max_queued <integer>
+   - Maximum number of bytes waiting to be sent to a client before it is disconnected. Must be
+     positive.
+   - Default: 1048576
+ - client_input merge|discard
+   - What to do with data sent by clients: make it available to read from the port, or throw it
+     away.
+   - Default: merge */
+class FLEXIPORT_EXPORT TCPServerPort : public Port
+{
+	public:
+		TCPServerPort (std::map<std::string, std::string> options);
+		~TCPServerPort ();
+
+		/// @brief Open the port, listening for clients. Does not wait for a client.
+		void Open ();
+		/// @brief Close the port, disconnecting all clients.
+		void Close ();
+		/// @brief Read data sent by any client.
+		ssize_t Read (void * const buffer, size_t count);
+		/// @brief Read the requested quantity of data from the port.
+		ssize_t ReadFull (void * const buffer, size_t count);
+		/// @brief Get the number of bytes sent by clients waiting to be read. Returns immediatly.
+		ssize_t BytesAvailable ();
+		/// @brief Get the number of bytes waiting after blocking for the timeout.
+		ssize_t BytesAvailableWait ();
+		/** @brief Write data to all clients.
+
+		Never blocks. Data that can't be sent immediately is queued for each client.
+
+		@return @ref count, whether or not any clients are connected. */
+		ssize_t Write (const void * const buffer, size_t count);
+		/// @brief Discard all data waiting to be read or sent.
+		void Flush ();
+		/// @brief Wait until all queued data has been sent to the clients, or the timeout.
+		void Drain ();
+		/// @brief Get the status of the port (type, device, etc).
+		std::string GetStatus () const;
+		/// @brief Set the timeout value in milliseconds.
+		void SetTimeout (Timeout timeout);
+		/// @brief Set the read permissions of the port.
+		void SetCanRead (bool canRead);
+		/// @brief Set the write permissions of the port.
+		void SetCanWrite (bool canWrite);
+		/// @brief Check if the port is open
+		bool IsOpen () const                        { return _open; }
+
+		/// @brief Get the number of clients currently connected.
+		size_t GetNumClients () const               { return _clients.size (); }
+
+	private:
+		struct SharedChunk;
+		struct Client;
+
+		int _listenSock;
+		std::vector<Client*> _clients;
+		unsigned int _nextClient;   // Client to read from first, so that every client gets a turn.
+
+		std::string _ip;
+		unsigned int _port;
+		unsigned int _maxClients;
+		size_t _maxQueued;
+		bool _mergeInput;       // False to discard data sent by clients.
+		uint64_t _slowClients;  // Clients disconnected for falling behind.
+		bool _open;
+
+		void CheckPort (bool read);
+		bool ProcessOption (const std::string &option, const std::string &value);
+
+		void Listen ();
+		void AcceptClients ();
+		void DropClient (unsigned int index, const char *reason);
+		void SendQueued ();
+		bool SendToClient (Client *client);
+		void DiscardInput ();
+		static void ReleaseChunk (SharedChunk *chunk);
+		bool WaitForClients (bool forData, const Timeout &timeout);
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __TCPSERVERPORT_H
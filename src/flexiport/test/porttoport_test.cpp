@@ -0,0 +1,507 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs porttoport between TCP connections made by this test, and checks that the data it moves
+// arrives intact. Small receive buffers on the far side make the destination fall behind, so that
+// data spliced into a pipe is only partly written and must be finished later.
+//
+// Usage: porttoport_test <path to porttoport>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+const char *porttoport = NULL;
+int failures = 0;
+
+void Check (bool condition, const string &what)
+{
+	if (!condition)
+	{
+		cerr << "FAILED: " << what << endl;
+		failures++;
+	}
+}
+
+int64_t Now ()
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return static_cast<int64_t> (now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// The byte at a position in a test stream. Streams with different seeds are told apart.
+uint8_t Pattern (uint64_t position, unsigned int seed)
+{
+	return static_cast<uint8_t> (position * 131 + position / 251 + seed * 77);
+}
+
+// A connection from porttoport, and how much of its stream has been sent and checked.
+struct Peer
+{
+	int listener;
+	int sock;
+	int port;
+	unsigned int seed;      // Seed of the stream this peer sends
+	uint64_t sent;
+	uint64_t received;
+	bool corrupt;
+};
+
+// Listen on a free port. A small receive buffer makes porttoport's writes to this peer stall.
+void Listen (Peer &peer, unsigned int seed, int receiveBuffer)
+{
+	peer.listener = socket (AF_INET, SOCK_STREAM, 0);
+	peer.sock = -1;
+	peer.seed = seed;
+	peer.sent = peer.received = 0;
+	peer.corrupt = false;
+	if (receiveBuffer > 0)
+	{
+		setsockopt (peer.listener, SOL_SOCKET, SO_RCVBUF, &receiveBuffer,
+				sizeof (receiveBuffer));
+	}
+	struct sockaddr_in address;
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	address.sin_port = 0;
+	bind (peer.listener, reinterpret_cast<struct sockaddr*> (&address), sizeof (address));
+	listen (peer.listener, 1);
+	socklen_t length = sizeof (address);
+	getsockname (peer.listener, reinterpret_cast<struct sockaddr*> (&address), &length);
+	peer.port = ntohs (address.sin_port);
+}
+
+bool Accept (Peer &peer)
+{
+	struct pollfd pfd;
+	pfd.fd = peer.listener;
+	pfd.events = POLLIN;
+	if (poll (&pfd, 1, 5000) <= 0)
+		return false;
+	peer.sock = accept (peer.listener, NULL, NULL);
+	fcntl (peer.sock, F_SETFL, fcntl (peer.sock, F_GETFL) | O_NONBLOCK);
+	return peer.sock >= 0;
+}
+
+void Close (Peer &peer)
+{
+	if (peer.sock >= 0)
+		close (peer.sock);
+	close (peer.listener);
+	peer.sock = -1;
+}
+
+string PortOptions (const Peer &peer)
+{
+	stringstream options;
+	options << "type=tcp,ip=127.0.0.1,port=" << peer.port;
+	return options.str ();
+}
+
+// Send as much of the peer's stream, up to total bytes, as the connection will take.
+void SendSome (Peer &peer, uint64_t total)
+{
+	uint8_t buffer[16384];
+	while (peer.sent < total)
+	{
+		size_t count = total - peer.sent < sizeof (buffer) ? total - peer.sent : sizeof (buffer);
+		for (size_t ii = 0; ii < count; ii++)
+			buffer[ii] = Pattern (peer.sent + ii, peer.seed);
+		ssize_t numSent = send (peer.sock, buffer, count, MSG_NOSIGNAL);
+		if (numSent <= 0)
+			return;
+		peer.sent += numSent;
+	}
+}
+
+// Receive up to limit bytes, checking them against the stream sent by the peer with seed.
+ssize_t ReceiveSome (Peer &peer, unsigned int seed, size_t limit)
+{
+	uint8_t buffer[65536];
+	if (limit > sizeof (buffer))
+		limit = sizeof (buffer);
+	ssize_t numRead = recv (peer.sock, buffer, limit, 0);
+	for (ssize_t ii = 0; ii < numRead; ii++)
+	{
+		if (buffer[ii] != Pattern (peer.received + ii, seed))
+			peer.corrupt = true;
+	}
+	if (numRead > 0)
+		peer.received += numRead;
+	return numRead;
+}
+
+// Start porttoport with the given arguments, sending its error output to a file.
+pid_t Start (const vector<string> &args, const string &errorFile)
+{
+	pid_t pid = fork ();
+	if (pid == 0)
+	{
+		int fd = open (errorFile.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dup2 (fd, 2);
+		vector<char*> argv;
+		argv.push_back (const_cast<char*> (porttoport));
+		for (unsigned int ii = 0; ii < args.size (); ii++)
+			argv.push_back (const_cast<char*> (args[ii].c_str ()));
+		argv.push_back (NULL);
+		execv (porttoport, &argv[0]);
+		_exit (127);
+	}
+	return pid;
+}
+
+// Wait up to timeout milliseconds for porttoport to exit. Returns false if it is still running.
+bool WaitForExit (pid_t pid, int &status, int timeout)
+{
+	int64_t end = Now () + timeout;
+	while (Now () < end)
+	{
+		if (waitpid (pid, &status, WNOHANG) == pid)
+			return true;
+		usleep (10000);
+	}
+	return false;
+}
+
+bool ExitedCleanly (pid_t pid)
+{
+	int status = 0;
+	if (!WaitForExit (pid, status, 5000))
+	{
+		kill (pid, SIGKILL);
+		waitpid (pid, &status, 0);
+		return false;
+	}
+	return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+// Find the byte and call counts printed for a port by porttoport -S, e.g. "To right: 10 bytes in
+// 2 writes".
+bool GetCounts (const string &errorFile, const string &prefix, uint64_t &bytes, uint64_t &calls,
+		bool &spliced)
+{
+	ifstream in (errorFile.c_str ());
+	string line;
+	while (getline (in, line))
+	{
+		if (line.compare (0, prefix.size (), prefix) != 0)
+			continue;
+		string word;
+		istringstream is (line.substr (prefix.size ()));
+		is >> bytes >> word >> word >> calls;
+		spliced = line.find ("spliced") != string::npos;
+		return !is.fail ();
+	}
+	return false;
+}
+
+// Data flows both ways while the right side reads slowly, so data spliced from the left is
+// written to the right a little at a time.
+void TestRoundTrip ()
+{
+	const uint64_t FORWARD = 4 * 1048576, BACKWARD = 262144;
+	Peer left, right;
+	Listen (left, 1, 0);
+	Listen (right, 2, 4096);
+	vector<string> args;
+	args.push_back ("-S");
+	args.push_back ("-l");
+	args.push_back (PortOptions (left));
+	args.push_back ("-r");
+	args.push_back (PortOptions (right));
+	pid_t pid = Start (args, "porttoport_test_roundtrip.log");
+	if (!Accept (left) || !Accept (right))
+	{
+		Check (false, "Round trip: porttoport connects");
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+		return;
+	}
+
+	int64_t end = Now () + 30000;
+	while ((right.received < FORWARD || left.received < BACKWARD) && Now () < end)
+	{
+		SendSome (left, FORWARD);
+		SendSome (right, BACKWARD);
+		ReceiveSome (left, right.seed, 65536);
+		ReceiveSome (right, left.seed, 4096);
+		usleep (200);
+	}
+	Check (right.received == FORWARD && !right.corrupt, "Round trip: left to right intact");
+	Check (left.received == BACKWARD && !left.corrupt, "Round trip: right to left intact");
+
+	kill (pid, SIGINT);
+	Check (ExitedCleanly (pid), "Round trip: porttoport quits on SIGINT");
+	uint64_t readBytes = 0, reads = 0, writeBytes = 0, writes = 0;
+	bool spliced = false, unused = false;
+	Check (GetCounts ("porttoport_test_roundtrip.log", "From left: ", readBytes, reads, spliced) &&
+			GetCounts ("porttoport_test_roundtrip.log", "To right: ", writeBytes, writes, unused),
+			"Round trip: statistics printed");
+	Check (spliced, "Round trip: left to right is spliced");
+	Check (writeBytes == FORWARD, "Round trip: bytes written counted once");
+	// More writes than reads means spliced data was left in the pipe and finished later
+	Check (writes > reads, "Round trip: partial writes from the pipe");
+
+	Close (left);
+	Close (right);
+}
+
+// The records sent to the left port by the right and merge ports in the fan-in test. They are sent
+// in whole batches, so porttoport never reads part of one, and each must reach the left port whole.
+const size_t RECORD_SIZE = 64, RECORD_BATCH = 16;
+
+void MakeRecord (uint8_t *record, unsigned int sender, unsigned int sequence)
+{
+	record[0] = static_cast<uint8_t> (0xA0 | sender);
+	record[1] = static_cast<uint8_t> (sequence >> 8);
+	record[2] = static_cast<uint8_t> (sequence);
+	for (size_t ii = 3; ii < RECORD_SIZE; ii++)
+		record[ii] = Pattern (sequence * RECORD_SIZE + ii, sender);
+}
+
+// Send the next batch of records if the connection has room for all of it. Returns the number of
+// records sent.
+unsigned int SendRecords (Peer &peer, unsigned int sequence, unsigned int total)
+{
+	struct pollfd pfd;
+	pfd.fd = peer.sock;
+	pfd.events = POLLOUT;
+	if (sequence >= total || poll (&pfd, 1, 0) <= 0)
+		return 0;
+
+	uint8_t records[RECORD_SIZE * RECORD_BATCH];
+	unsigned int count = total - sequence < RECORD_BATCH ? total - sequence : RECORD_BATCH;
+	for (unsigned int ii = 0; ii < count; ii++)
+		MakeRecord (&records[ii * RECORD_SIZE], peer.seed, sequence + ii);
+	// A writable socket has far more room than one batch, so this is never a partial send
+	if (send (peer.sock, records, count * RECORD_SIZE, MSG_NOSIGNAL) !=
+			static_cast<ssize_t> (count * RECORD_SIZE))
+		return 0;
+	return count;
+}
+
+// The right port and two merge ports all send records to the left port as fast as they can, and
+// the left port reads more slowly, so that data spliced from one of them is often waiting in its
+// pipe when the others have data for the left port. Every record must arrive whole and in order
+// for its sender.
+void TestFanIn ()
+{
+	const unsigned int SENDERS = 3, RECORDS = 32768;
+	Peer left, senders[SENDERS];
+	Listen (left, 0, 4096);
+	for (unsigned int ii = 0; ii < SENDERS; ii++)
+		Listen (senders[ii], ii + 1, 0);
+	vector<string> args;
+	args.push_back ("-l");
+	args.push_back (PortOptions (left));
+	args.push_back ("-r");
+	args.push_back (PortOptions (senders[0]));
+	for (unsigned int ii = 1; ii < SENDERS; ii++)
+	{
+		args.push_back ("-m");
+		args.push_back (PortOptions (senders[ii]));
+	}
+	args.push_back ("-S");
+	pid_t pid = Start (args, "porttoport_test_fanin.log");
+	bool connected = Accept (left);
+	for (unsigned int ii = 0; ii < SENDERS; ii++)
+		connected = connected && Accept (senders[ii]);
+	if (!connected)
+	{
+		Check (false, "Fan in: porttoport connects");
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+		return;
+	}
+
+	vector<uint8_t> received;
+	unsigned int sequences[SENDERS] = {0, 0, 0};
+	int64_t end = Now () + 30000;
+	while (received.size () < SENDERS * RECORDS * RECORD_SIZE && Now () < end)
+	{
+		for (unsigned int ii = 0; ii < SENDERS; ii++)
+			sequences[ii] += SendRecords (senders[ii], sequences[ii], RECORDS);
+		for (unsigned int ii = 0; ii < 16; ii++)
+		{
+			uint8_t buffer[100];
+			ssize_t numRead = recv (left.sock, buffer, sizeof (buffer), 0);
+			if (numRead > 0)
+				received.insert (received.end (), buffer, buffer + numRead);
+		}
+		usleep (50);
+	}
+	Check (received.size () == SENDERS * RECORDS * RECORD_SIZE, "Fan in: all records received");
+
+	unsigned int expected[SENDERS + 1] = {0, 0, 0, 0};
+	bool intact = true;
+	for (size_t ii = 0; ii + RECORD_SIZE <= received.size () && intact; ii += RECORD_SIZE)
+	{
+		unsigned int sender = received[ii] & 0x0F;
+		uint8_t record[RECORD_SIZE];
+		if ((received[ii] & 0xF0) != 0xA0 || sender < 1 || sender > SENDERS)
+			intact = false;
+		else
+		{
+			MakeRecord (record, sender, expected[sender]++);
+			intact = memcmp (record, &received[ii], RECORD_SIZE) == 0;
+		}
+		if (!intact)
+			cerr << "Record at offset " << ii << " is not whole." << endl;
+	}
+	Check (intact, "Fan in: records from different ports are not mixed");
+
+	kill (pid, SIGINT);
+	Check (ExitedCleanly (pid), "Fan in: porttoport quits on SIGINT");
+	Close (left);
+	for (unsigned int ii = 0; ii < SENDERS; ii++)
+		Close (senders[ii]);
+}
+
+// A merge port sends its data and closes while the left side is not reading, leaving the data
+// in porttoport's pipe. It must still all arrive, and porttoport must carry on.
+void TestSourceClosesWithPipedData ()
+{
+	const uint64_t MERGED = 131072;
+	Peer left, right, merge;
+	Listen (left, 1, 4096);
+	Listen (right, 2, 0);
+	Listen (merge, 3, 0);
+	vector<string> args;
+	args.push_back ("-l");
+	args.push_back (PortOptions (left));
+	args.push_back ("-r");
+	args.push_back (PortOptions (right));
+	args.push_back ("-m");
+	args.push_back (PortOptions (merge));
+	pid_t pid = Start (args, "porttoport_test_sourceclose.log");
+	if (!Accept (left) || !Accept (right) || !Accept (merge))
+	{
+		Check (false, "Source close: porttoport connects");
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+		return;
+	}
+
+	int64_t end = Now () + 5000;
+	while (merge.sent < MERGED && Now () < end)
+	{
+		SendSome (merge, MERGED);
+		usleep (1000);
+	}
+	close (merge.sock);
+	merge.sock = -1;
+	usleep (200000);
+
+	end = Now () + 10000;
+	while (left.received < MERGED && Now () < end)
+	{
+		if (ReceiveSome (left, merge.seed, 65536) <= 0)
+			usleep (1000);
+	}
+	Check (left.received == MERGED && !left.corrupt, "Source close: merged data intact");
+	int status = 0;
+	Check (!WaitForExit (pid, status, 200), "Source close: porttoport keeps running");
+
+	kill (pid, SIGINT);
+	Check (ExitedCleanly (pid), "Source close: porttoport quits on SIGINT");
+	Close (left);
+	Close (right);
+	Close (merge);
+}
+
+// The right side stops reading and then closes its end while data for it is waiting in
+// porttoport's pipe. porttoport must notice and quit rather than fail writing to the closed port.
+void TestDestinationClosesWithPipedData ()
+{
+	Peer left, right;
+	Listen (left, 1, 0);
+	Listen (right, 2, 4096);
+	vector<string> args;
+	args.push_back ("-l");
+	args.push_back (PortOptions (left));
+	args.push_back ("-r");
+	args.push_back (PortOptions (right));
+	pid_t pid = Start (args, "porttoport_test_destclose.log");
+	if (!Accept (left) || !Accept (right))
+	{
+		Check (false, "Destination close: porttoport connects");
+		kill (pid, SIGKILL);
+		waitpid (pid, NULL, 0);
+		return;
+	}
+
+	int64_t end = Now () + 500;
+	while (Now () < end)
+	{
+		SendSome (left, 16 * 1048576);
+		usleep (1000);
+	}
+	// Only stop sending: closing the socket with unread data would reset the connection
+	shutdown (right.sock, SHUT_WR);
+
+	Check (ExitedCleanly (pid), "Destination close: porttoport quits cleanly");
+	Close (left);
+	Close (right);
+}
+
+int main (int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		cerr << "Usage: " << argv[0] << " <path to porttoport>" << endl;
+		return 1;
+	}
+	porttoport = argv[1];
+	signal (SIGPIPE, SIG_IGN);
+
+	TestRoundTrip ();
+	TestSourceClosesWithPipedData ();
+	TestFanIn ();
+	TestDestinationClosesWithPipedData ();
+
+	if (failures > 0)
+		return 1;
+	cout << "porttoport test passed." << endl;
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+#include <flexiport/flexiport.h>
+#include <flexiport/port.h>
+#include <flexiport/ptyport.h>
+#include <flexiport/timestamp.h>
+
+// The emulated device: a serial loopback, returning everything it receives. Replace this with an
+// emulation of a real device's protocol to exercise its driver without the hardware.
+void RunEmulator (flexiport::Port *device)
+{
+	char buffer[4096];
+
+	while (true)
+	{
+		ssize_t numRead = device->Read (buffer, sizeof (buffer));
+		if (numRead > 0)
+			device->WriteFull (buffer, numRead);
+	}
+}
+
+int64_t Elapsed (const flexiport::Timestamp &start)
+{
+	return flexiport::Timestamp::Now (flexiport::Timestamp::MONOTONIC).AsNanoseconds () -
+		start.AsNanoseconds ();
+}
+
+int MeasureLatency (flexiport::Port *port, unsigned int count, unsigned int size)
+{
+	vector<char> message (size), reply (size);
+	vector<int64_t> times;
+
+	for (unsigned int ii = 0; ii < size; ii++)
+		message[ii] = ii;
+
+	cout << "Measuring round trip time of " << count << " " << size << "-byte messages" << endl;
+	for (unsigned int ii = 0; ii < count; ii++)
+	{
+		flexiport::Timestamp start = flexiport::Timestamp::Now (flexiport::Timestamp::MONOTONIC);
+		port->WriteFull (&message[0], size);
+		port->ReadFull (&reply[0], size);
+		times.push_back (Elapsed (start));
+		if (message != reply)
+		{
+			cout << "Test failed: reply " << ii << " does not match the message." << endl;
+			return -1;
+		}
+	}
+
+	sort (times.begin (), times.end ());
+	cout << "Round trip time (us): min " << times.front () / 1000 << ", median " <<
+		times[times.size () / 2] / 1000 << ", 99% " << times[times.size () * 99 / 100] / 1000 <<
+		", max " << times.back () / 1000 << endl;
+	return 0;
+}
+
+int MeasureThroughput (flexiport::Port *port, unsigned int total, unsigned int chunk)
+{
+	vector<char> message (chunk), reply (chunk);
+	unsigned int sent = 0;
+
+	cout << "Measuring throughput of " << total << " bytes in " << chunk << "-byte chunks" << endl;
+	flexiport::Timestamp start = flexiport::Timestamp::Now (flexiport::Timestamp::MONOTONIC);
+	while (sent < total)
+	{
+		for (unsigned int ii = 0; ii < chunk; ii++)
+			message[ii] = sent + ii;
+		port->WriteFull (&message[0], chunk);
+		port->ReadFull (&reply[0], chunk);
+		if (message != reply)
+		{
+			cout << "Test failed: data at offset " << sent << " was corrupted." << endl;
+			return -1;
+		}
+		sent += chunk;
+	}
+	int64_t elapsed = Elapsed (start);
+	cout << "Echoed " << sent << " bytes in " << elapsed / 1000 << " us (" <<
+		(sent / 1048576.0) / (elapsed / 1e9) << " MiB/s)" << endl;
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	string portOptions;
+	unsigned int count = 1000, size = 16, total = 16777216, chunk = 4096;
+
+	int opt;
+	// Get some options from the command line
+	while ((opt = getopt (argc, argv, "o:n:s:t:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o':
+				portOptions = optarg;
+				break;
+			case 'n':
+				count = atoi (optarg);
+				break;
+			case 's':
+				size = atoi (optarg);
+				break;
+			case 't':
+				total = atoi (optarg);
+				break;
+			case 'c':
+				chunk = atoi (optarg);
+				break;
+			default:
+				cout << "Usage: " << argv[0] << " [-o portoptions] [-n count] [-s size] "
+					"[-t total] [-c chunk]" << endl << endl;
+				cout << "-o options\tString of extra options for the serial port." << endl;
+				cout << "-n count\tNumber of round trips to time." << endl;
+				cout << "-s size\t\tSize of each round trip message." << endl;
+				cout << "-t total\tNumber of bytes to echo when measuring throughput." << endl;
+				cout << "-c chunk\tSize of each write when measuring throughput." << endl;
+				return 1;
+		}
+	}
+	if (count == 0 || size == 0 || chunk == 0)
+	{
+		cerr << "Count, size and chunk must be greater than zero." << endl;
+		return 1;
+	}
+
+	pid_t emulator = -1;
+	int result = 0;
+	try
+	{
+		cout << "Creating emulated device" << endl;
+		flexiport::PTYPort *device = dynamic_cast<flexiport::PTYPort*> (
+				flexiport::CreatePort ("type=pty"));
+		device->Open ();
+		cout << device->GetStatus ();
+
+		emulator = fork ();
+		if (emulator < 0)
+		{
+			cerr << "Failed to fork: (" << errno << ") " << strerror (errno) << endl;
+			return 1;
+		}
+		else if (emulator == 0)
+		{
+			RunEmulator (device);
+			return 0;
+		}
+
+		cout << "Creating serial port connected to " << device->GetSlaveName () << endl;
+		flexiport::Port *port = flexiport::CreatePort ("type=serial,device=" +
+				device->GetSlaveName () + (portOptions.empty () ? "" : "," + portOptions));
+		port->Open ();
+		port->Flush ();
+
+		if (MeasureLatency (port, count, size) < 0 || MeasureThroughput (port, total, chunk) < 0)
+			result = 1;
+		cout << port->GetStatus ();
+
+		delete port;
+		kill (emulator, SIGTERM);
+		waitpid (emulator, NULL, 0);
+		delete device;
+	}
+	catch (flexiport::PortException e)
+	{
+		cerr << "Caught exception: " << e.what () << endl;
+		if (emulator > 0)
+			kill (emulator, SIGTERM);
+		return 1;
+	}
+
+	return result;
+}
@@ -0,0 +1,146 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests the shared memory port: readers sleeping on the futex, reads in non-blocking mode and
+// after the writer closes, and opening a ring of the wrong size.
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+#include <iostream>
+using namespace std;
+
+#include <flexiport/flexiport.h>
+#include <flexiport/port.h>
+#include "flexiport_config.h"
+
+int failures = 0;
+
+void Check (bool condition, const string &what)
+{
+	if (!condition)
+	{
+		cerr << "FAILED: " << what << endl;
+		failures++;
+	}
+}
+
+struct BlockedRead
+{
+	flexiport::Port *port;
+	char buffer[16];
+	ssize_t result;
+};
+
+void* ReadThread (void *arg)
+{
+	BlockedRead *read = reinterpret_cast<BlockedRead*> (arg);
+	read->result = read->port->Read (read->buffer, sizeof (read->buffer));
+	return NULL;
+}
+
+int main ()
+{
+	stringstream name;
+	name << "/flexiport_shmport_test_" << getpid ();
+	string options = "type=shm,name=" + name.str () + ",size=4096";
+
+	flexiport::Port *writer = NULL, *reader = NULL, *nonBlocking = NULL;
+	try
+	{
+		writer = flexiport::CreatePort (options + ",writeonly,alwaysopen");
+		reader = flexiport::CreatePort (options + ",readonly,alwaysopen,timeout=5");
+		nonBlocking = flexiport::CreatePort (options + ",readonly,alwaysopen,timeout=0");
+
+		// Nothing has been written: a non-blocking read times out rather than reporting a close
+		char buffer[16];
+		errno = 0;
+		ssize_t result = nonBlocking->Read (buffer, sizeof (buffer));
+		Check (result == -1 && errno == EAGAIN, "Non-blocking read with no data times out");
+
+		// A blocked reader should be asleep on the futex, which the writer can see
+		BlockedRead blocked;
+		blocked.port = reader;
+		blocked.result = -2;
+		pthread_t thread;
+		pthread_create (&thread, NULL, ReadThread, &blocked);
+		bool sawWaiter = false;
+		for (int ii = 0; ii < 200 && !sawWaiter; ii++)
+		{
+			sawWaiter = writer->GetStatus ().find ("Readers waiting: 1") != string::npos;
+			if (!sawWaiter)
+				usleep (5000);
+		}
+#if defined (FLEXIPORT_HAVE_FUTEX)
+		Check (sawWaiter, "Blocked reader waits on the futex");
+#else
+		cout << "No futex support; readers poll." << endl;
+#endif
+		Check (writer->Write ("hello", 5) == 5, "Write to the ring");
+		pthread_join (thread, NULL);
+		Check (blocked.result == 5 && memcmp (blocked.buffer, "hello", 5) == 0,
+				"Blocked reader receives the data");
+		Check (nonBlocking->Read (buffer, sizeof (buffer)) == 5, "Non-blocking read with data");
+
+		// A writer may not resize the ring while readers have it mapped
+		bool threw = false;
+		try
+		{
+			flexiport::Port *resizer = flexiport::CreatePort ("type=shm,name=" + name.str () +
+					",size=8192,writeonly,alwaysopen");
+			delete resizer;
+		}
+		catch (flexiport::PortException &)
+		{
+			threw = true;
+		}
+		Check (threw, "Opening a ring with a different size is refused");
+
+		// Once the writer has closed and the data is used up, reads return zero
+		writer->Close ();
+		Check (reader->Read (buffer, sizeof (buffer)) == 0, "Read after the writer closed");
+	}
+	catch (flexiport::PortException &e)
+	{
+		cerr << "FAILED: " << e.what () << endl;
+		failures++;
+	}
+
+	delete nonBlocking;
+	delete reader;
+	delete writer;
+	shm_unlink (name.str ().c_str ());
+
+	if (failures > 0)
+		return 1;
+	cout << "ShmPort test passed." << endl;
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests the TCP server port: option checking, reads when client input is discarded, sending the
+// same data to several clients, and dropping a client that falls behind.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+#include <flexiport/flexiport.h>
+#include <flexiport/port.h>
+#include <flexiport/tcpserverport.h>
+
+int failures = 0;
+
+void Check (bool condition, const string &what)
+{
+	if (!condition)
+	{
+		cerr << "FAILED: " << what << endl;
+		failures++;
+	}
+}
+
+int64_t Now ()
+{
+	struct timeval now;
+	gettimeofday (&now, NULL);
+	return static_cast<int64_t> (now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+uint8_t Pattern (size_t offset)
+{
+	return static_cast<uint8_t> ((offset * 7) ^ (offset >> 9));
+}
+
+// Find a local TCP port that nothing is listening on.
+unsigned int FreePort ()
+{
+	int sock = socket (AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	socklen_t length = sizeof (address);
+	bind (sock, reinterpret_cast<struct sockaddr*> (&address), sizeof (address));
+	getsockname (sock, reinterpret_cast<struct sockaddr*> (&address), &length);
+	close (sock);
+	return ntohs (address.sin_port);
+}
+
+// Connect a client to the server, optionally with a small receive buffer so that it fills quickly.
+int Connect (unsigned int port, int receiveBuffer)
+{
+	int sock = socket (AF_INET, SOCK_STREAM, 0);
+	if (receiveBuffer > 0)
+		setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof (receiveBuffer));
+	struct sockaddr_in address;
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	address.sin_port = htons (port);
+	if (connect (sock, reinterpret_cast<struct sockaddr*> (&address), sizeof (address)) < 0)
+	{
+		close (sock);
+		return -1;
+	}
+	return sock;
+}
+
+// The server accepts clients whenever it is used, so use it until it has them all.
+bool WaitForClients (flexiport::TCPServerPort *server, size_t count)
+{
+	int64_t end = Now () + 5000;
+	while (server->GetNumClients () < count && Now () < end)
+	{
+		server->BytesAvailable ();
+		usleep (1000);
+	}
+	return server->GetNumClients () == count;
+}
+
+// Read everything waiting at a client without blocking, checking it against the pattern.
+void Receive (flexiport::TCPServerPort *server, int sock, size_t &received, bool &corrupt)
+{
+	uint8_t buffer[16384];
+	ssize_t numRead;
+	while ((numRead = recv (sock, buffer, sizeof (buffer), MSG_DONTWAIT)) > 0)
+	{
+		for (ssize_t ii = 0; ii < numRead; ii++)
+			corrupt = corrupt || buffer[ii] != Pattern (received + ii);
+		received += numRead;
+	}
+	// Give the server a chance to send the data it has queued for this client
+	server->BytesAvailable ();
+}
+
+void TestOptions (unsigned int port)
+{
+	const char *bad[] = {"max_clients=-1", "max_clients=two", "max_queued=-1", "max_queued=0"};
+	for (unsigned int ii = 0; ii < sizeof (bad) / sizeof (bad[0]); ii++)
+	{
+		stringstream options;
+		options << "type=tcpserver,ip=127.0.0.1,port=" << port << "," << bad[ii];
+		bool threw = false;
+		try
+		{
+			delete flexiport::CreatePort (options.str ());
+		}
+		catch (flexiport::PortException &)
+		{
+			threw = true;
+		}
+		Check (threw, string ("Bad option is refused: ") + bad[ii]);
+	}
+}
+
+// With client input discarded, there is never anything to read, so reads must not wait.
+void TestDiscardedInput (unsigned int port)
+{
+	stringstream options;
+	options << "type=tcpserver,ip=127.0.0.1,port=" << port <<
+		",client_input=discard,timeout=2,alwaysopen";
+	flexiport::Port *server = flexiport::CreatePort (options.str ());
+	int client = Connect (port, 0);
+	Check (client >= 0, "Discard: client connects");
+	Check (send (client, "ignored", 7, 0) == 7, "Discard: client sends");
+
+	char buffer[16];
+	int64_t start = Now ();
+	Check (server->Read (buffer, sizeof (buffer)) == -1, "Discard: blocking read times out");
+	Check (server->BytesAvailableWait () == 0, "Discard: no bytes available");
+	Check (Now () - start < 1000, "Discard: reads don't wait for the timeout");
+	server->SetTimeout (flexiport::Timeout (0, 0));
+	Check (server->Read (buffer, sizeof (buffer)) == 0, "Discard: non-blocking read is empty");
+
+	close (client);
+	delete server;
+}
+
+// Everything written must reach every client that keeps up, while a client that stops reading is
+// disconnected once max_queued bytes are waiting for it.
+void TestFanOut (unsigned int port)
+{
+	const size_t CHUNK = 4096, TOTAL = 8 * 1048576;
+	stringstream options;
+	options << "type=tcpserver,ip=127.0.0.1,port=" << port << ",max_queued=65536,alwaysopen";
+	flexiport::TCPServerPort *server =
+		dynamic_cast<flexiport::TCPServerPort*> (flexiport::CreatePort (options.str ()));
+	int fast[2] = {Connect (port, 0), Connect (port, 0)};
+	int slow = Connect (port, 4096);
+	Check (fast[0] >= 0 && fast[1] >= 0 && slow >= 0, "Fan out: clients connect");
+	Check (WaitForClients (server, 3), "Fan out: server accepts all clients");
+
+	size_t written = 0, received[2] = {0, 0};
+	bool corrupt[2] = {false, false};
+	int64_t end = Now () + 20000;
+	while (written < TOTAL && Now () < end)
+	{
+		uint8_t buffer[CHUNK];
+		for (size_t ii = 0; ii < CHUNK; ii++)
+			buffer[ii] = Pattern (written + ii);
+		Check (server->Write (buffer, CHUNK) == static_cast<ssize_t> (CHUNK),
+				"Fan out: write accepts all data");
+		written += CHUNK;
+		for (unsigned int ii = 0; ii < 2; ii++)
+			Receive (server, fast[ii], received[ii], corrupt[ii]);
+	}
+	while ((received[0] < written || received[1] < written) && Now () < end)
+	{
+		for (unsigned int ii = 0; ii < 2; ii++)
+			Receive (server, fast[ii], received[ii], corrupt[ii]);
+		usleep (1000);
+	}
+
+	for (unsigned int ii = 0; ii < 2; ii++)
+	{
+		Check (received[ii] == TOTAL && !corrupt[ii],
+				"Fan out: client that keeps up receives all data intact");
+	}
+	Check (server->GetNumClients () == 2, "Fan out: slow client is disconnected");
+	Check (server->GetStatus ().find ("Clients disconnected for falling behind: 1") !=
+			string::npos, "Fan out: slow client is reported");
+
+	close (fast[0]);
+	close (fast[1]);
+	close (slow);
+	delete server;
+}
+
+int main ()
+{
+	unsigned int port = FreePort ();
+	try
+	{
+		TestOptions (port);
+		TestDiscardedInput (port);
+		TestFanOut (port);
+	}
+	catch (flexiport::PortException &e)
+	{
+		cerr << "FAILED: " << e.what () << endl;
+		failures++;
+	}
+
+	if (failures > 0)
+		return 1;
+	cout << "TCPServerPort test passed." << endl;
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (WIN32)
+	#include <time.h>
+	// timeval is only in WinSock (stupidity)
+	#include <winsock2.h>
+	#include <windows.h>
+#else
+	#include <sys/time.h>
+	#include <time.h>
+#endif
+
+#include "timestamp.h"
+
+namespace flexiport
+{
+
+Timestamp Timestamp::Now (Clock clock)
+{
+	Timestamp result;
+	result._clock = clock;
+#if defined (WIN32)
+	if (clock == MONOTONIC)
+	{
+		LARGE_INTEGER frequency, count;
+		QueryPerformanceFrequency (&frequency);
+		QueryPerformanceCounter (&count);
+		result._sec = count.QuadPart / frequency.QuadPart;
+		result._nsec = static_cast<int32_t> ((count.QuadPart % frequency.QuadPart) * 1000000000LL /
+				frequency.QuadPart);
+	}
+	else
+	{
+		// FILETIME counts 100 ns intervals since 1601
+		FILETIME fileTime;
+		GetSystemTimeAsFileTime (&fileTime);
+		int64_t ticks = (static_cast<int64_t> (fileTime.dwHighDateTime) << 32 |
+				fileTime.dwLowDateTime) - 116444736000000000LL;
+		result._sec = ticks / 10000000;
+		result._nsec = static_cast<int32_t> ((ticks % 10000000) * 100);
+	}
+#else
+	struct timespec now;
+	clock_gettime (clock == MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+	result._sec = now.tv_sec;
+	result._nsec = now.tv_nsec;
+#endif
+	return result;
+}
+
+void Timestamp::AsTimeval (struct timeval &dest) const
+{
+	dest.tv_sec = _sec;
+	dest.tv_usec = _nsec / 1000;
+}
+
+void Timestamp::AsTimespec (struct timespec &dest) const
+{
+	dest.tv_sec = _sec;
+	dest.tv_nsec = _nsec;
+}
+
+void Timestamp::FromNanoseconds (int64_t nsec)
+{
+	_sec = nsec / 1000000000LL;
+	_nsec = static_cast<int32_t> (nsec % 1000000000LL);
+	if (_nsec < 0)
+	{
+		_sec -= 1;
+		_nsec += 1000000000;
+	}
+}
+
+} // namespace flexiport
@@ -0,0 +1,77 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMESTAMP_H
+#define __TIMESTAMP_H
+
+#include "timeout.h"
+#include "flexiport_types.h"
+
+/** @ingroup gbx_library_flexiport
+@{
+*/
+
+namespace flexiport
+{
+
+/** @brief A point in time, as recorded by @ref Port::ReadTimestamped.
+
+The clock the time was taken from is recorded with it. Times from different clocks cannot be
+compared: @ref REALTIME is the wall clock (the same clock as gettimeofday ()) and @ref MONOTONIC
+counts from an unspecified point, usually system boot, but is not affected by changes to the system
+time. */
+class FLEXIPORT_EXPORT Timestamp
+{
+	public:
+		typedef enum {NONE, REALTIME, MONOTONIC} Clock;
+
+		Timestamp () : _sec (0), _nsec (0), _clock (NONE) {}
+		Timestamp (int64_t sec, int32_t nsec, Clock clock)
+			: _sec (sec), _nsec (nsec), _clock (clock) {}
+
+		/// @brief Get the current time from the given clock.
+		static Timestamp Now (Clock clock);
+
+		void AsTimeval (struct timeval &dest) const;
+		void AsTimespec (struct timespec &dest) const;
+		/// @brief Get the time as a number of seconds.
+		double AsSeconds () const               { return _sec + _nsec / 1e9; }
+		/// @brief Get the time as a number of nanoseconds.
+		int64_t AsNanoseconds () const          { return _sec * 1000000000LL + _nsec; }
+		/// @brief Set the time from a number of nanoseconds. The clock is not changed.
+		void FromNanoseconds (int64_t nsec);
+
+		int64_t _sec;
+		int32_t _nsec;
+		Clock _clock;
+};
+
+} // namespace flexiport
+
+/** @} */
+
+#endif // __TIMESTAMP_H
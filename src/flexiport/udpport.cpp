@@ -37,6 +37,7 @@
 #include <string.h>
 #include <sstream>
 #include <iostream>
+#include <vector>
 using namespace std;
 
 #if defined (WIN32)
@@ -97,6 +98,44 @@ inline void* GetInAddr (struct sockaddr *sa)
 	const int ERRNO_EAGAIN = EAGAIN;
 #endif
 
+#if !defined (WIN32)
+// Ask the kernel to record the time each packet arrives, for ReadTimestamped ()
+inline void SetTimestampFlag (int sock, unsigned int debug)
+{
+#if defined (SO_TIMESTAMPNS)
+	int timestampFlag = 1;
+	if (setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestampFlag, sizeof (timestampFlag)) < 0 &&
+			debug >= 1)
+	{
+		cerr << __func__ << "() setsockopt() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ()) << "; packets will not be timestamped." << endl;
+	}
+#endif
+}
+
+// Get the kernel receive timestamp from the control messages of a received message. Returns false
+// if there is none.
+inline bool GetTimestampFromControl (struct msghdr *msg, Timestamp &timestamp)
+{
+#if defined (SO_TIMESTAMPNS)
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (msg); cmsg != NULL; cmsg = CMSG_NXTHDR (msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy (&ts, CMSG_DATA (cmsg), sizeof (ts));
+			timestamp = Timestamp (ts.tv_sec, ts.tv_nsec, Timestamp::REALTIME);
+			return true;
+		}
+	}
+#endif
+	return false;
+}
+
+// Enough space for the timestamp control message
+const size_t TIMESTAMP_CONTROL_SIZE = 64;
+#endif // !defined (WIN32)
+
 #if defined (WIN32)
 	// Unfortunately, Windows has a fit if these are made class variables due to the inclusion
 	// of winsock2.h in udpport.h. No idea why, but it somehow drags in winsock.h, which really
@@ -136,10 +175,17 @@ UDPPort::UDPPort (map<string, string> options)
 #else
 	: Port (), _sendSock (-1), _recvSock (-1),
 #endif
-	_destIP ("127.0.0.1"), _destPort (20000), _recvIP ("*"), _recvPort (20000),	_open (false)
+	_destIP ("127.0.0.1"), _destPort (20000), _recvIP ("*"), _recvPort (20000),	_open (false),
+	_recvBatch (8), _maxDatagram (65507), _dgramData (NULL), _dgramLengths (NULL),
+	_dgramSources (NULL), _dgramTimestamps (NULL),
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+	_dgramHeaders (NULL), _dgramIOVs (NULL), _dgramControl (NULL),
+#endif
+	_dgramCount (0), _dgramFront (0), _dgramOffset (0)
 {
 	_type = "udp";
 	ProcessOptions (options);
+	AllocateDatagramQueue ();
 
 #if defined (WIN32)
 	// First instance, initialise Windows sockets API
@@ -160,6 +206,7 @@ UDPPort::UDPPort (map<string, string> options)
 UDPPort::~UDPPort ()
 {
 	Close ();
+	FreeDatagramQueue ();
 
 #if defined (WIN32)
 	// Clean up the Windows sockets API
@@ -196,6 +243,7 @@ void UDPPort::Close ()
 		cerr << "UDPPort::" << __func__ << "() Closing port" << endl;
 
 	_open = false;
+	ClearReadBuffer ();
 	CloseSender ();
 	CloseReceiver ();
 
@@ -209,108 +257,47 @@ void UDPPort::Close ()
 
 ssize_t UDPPort::Read (void * const buffer, size_t count)
 {
-	ssize_t receivedBytes = 0;
-	struct sockaddr_storage from;
-#if defined (WIN32)
-	int fromLen = sizeof (from);
-#else
-	socklen_t fromLen = sizeof (from);
-#endif
-
 	CheckPort (true);
 
 	if (_debug >= 2)
 		cerr << "UDPPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
 
-	if (_timeout._sec == -1)
-	{
-		// Socket is blocking, so just read
-#if defined (WIN32)
-		receivedBytes = recvfrom (_recvSock, reinterpret_cast<char*> (buffer), count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#else
-		receivedBytes = recvfrom (_recvSock, buffer, count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#endif
-	}
-	else
-	{
-		// Socket is non-blocking, so try to read, see if we get any data (if there is none, this
-		// will return immediately, and is much faster than ioctl() and select() calls)
-#if defined (WIN32)
-		receivedBytes = recvfrom (_recvSock, reinterpret_cast<char*> (buffer), count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#else
-		receivedBytes = recvfrom (_recvSock, buffer, count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#endif
-		// Check if that call "timed out"
-		if (receivedBytes < 0 && ErrNo () == ERRNO_EAGAIN)
-		{
-			// No data was available, so wait for data or timeout, then read if data is available
-			if (WaitForDataOrTimeout () == TIMED_OUT)
-				return -1;
-#if defined (WIN32)
-			receivedBytes = recvfrom (_recvSock, reinterpret_cast<char*> (buffer), count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#else
-			receivedBytes = recvfrom (_recvSock, buffer, count, 0,
-									reinterpret_cast<struct sockaddr*> (&from), &fromLen);
-#endif
-		}
-		// If first call doesn't return a timeout, fall through to the result/error checking below
-	}
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = count;
+	return ReadFromDatagramQueue (&iov, 1, NULL);
+}
+
+#if !defined (WIN32)
+ssize_t UDPPort::ReadV (const struct iovec *iov, int iovcnt)
+{
+	CheckPort (true);
 
 	if (_debug >= 2)
 	{
-#if defined (WIN32)
-		// This will probably go boom and print a weird source IP if IPv6 is used on Windows,
-		// but since there's no inet_ntop() on Windows, we have no choice but to use inet_ntoa().
-		cerr << "UDPPort::" << __func__ << "() Read " << receivedBytes << " bytes from " <<
-			inet_ntoa (reinterpret_cast<struct sockaddr_in*>(&from)->sin_addr) << endl;
-#else
-		char s[INET6_ADDRSTRLEN];
-		cerr << "UDPPort::" << __func__ << "() Read " << receivedBytes << " bytes from " <<
-			inet_ntop (from.ss_family, GetInAddr (reinterpret_cast<struct sockaddr*> (&from)),
-						s, sizeof (s))
-			<< endl;
-#endif
+		cerr << "UDPPort::" << __func__ << "() Going to read " << IOVecLength (iov, iovcnt) <<
+			" bytes into " << iovcnt << " buffers" << endl;
 	}
 
-	if (receivedBytes < 0)
-	{
-		if (ErrNo () == ERRNO_EAGAIN)
-			return -1; // Timed out
-		else
-		{
-			// General error
-			stringstream ss;
-			ss << "UDPPort::" << __func__ << "() recvfrom() error: (" << ErrNo () << ") " <<
-				StrError (ErrNo ());
-			throw PortException (ss.str ());
-		}
-	}
-	else if (receivedBytes == 0)
-	{
-		// Peer disconnected cleanly, do the same at this end
-		if (_debug >= 1)
-			cerr << "UDPPort::" << __func__ << "() Peer disconnected cleanly." << endl;
-		Close ();
-		if (_alwaysOpen)
-		{
-			if (_debug >= 1)
-				cerr << "UDPPort::" << __func__ << "() Trying to reconnect." << endl;
-			Open ();
-		}
-		return 0;
-	}
+	return ReadFromDatagramQueue (iov, iovcnt, NULL);
+}
 
-	return receivedBytes;
+ssize_t UDPPort::ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp)
+{
+	CheckPort (true);
+
+	if (_debug >= 2)
+		cerr << "UDPPort::" << __func__ << "() Going to read " << count << " bytes" << endl;
+
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = count;
+	return ReadFromDatagramQueue (&iov, 1, &timestamp);
 }
+#endif // !defined (WIN32)
 
 ssize_t UDPPort::ReadFull (void * const buffer, size_t count)
 {
-	ssize_t numReceived = 0;
 	size_t receivedBytes = 0;
 
 	CheckPort (true);
@@ -323,143 +310,27 @@ ssize_t UDPPort::ReadFull (void * const buffer, size_t count)
 
 	while (receivedBytes < count)
 	{
-#if defined (WIN32)
-		numReceived = recvfrom (_recvSock, &(reinterpret_cast<char*> (buffer)[receivedBytes]),
-				count - receivedBytes, 0, NULL, 0); // No MSG_WAITALL on older versions of visual c, it seems
-#else
-		numReceived = recvfrom (_recvSock, &(reinterpret_cast<char*> (buffer)[receivedBytes]),
-				count - receivedBytes, MSG_WAITALL, NULL, 0);
-#endif
+		ssize_t numReceived = Read (&(reinterpret_cast<uint8_t*> (buffer)[receivedBytes]),
+				count - receivedBytes);
 		if (_debug >= 2)
 			cerr << "UDPPort::" << __func__ << "() Received " << numReceived << " bytes" << endl;
-		if (numReceived < 0)
-		{
-			if (ErrNo () == ERRNO_EAGAIN)
-			{
-				// Timed out (which probably shouldn't happen)
-				throw PortException (string ("UDPPort::") + __func__ +
-						string ("() recvfrom() timed out, probably shouldn't happen."));
-			}
-			else
-			{
-				// General error
-				stringstream ss;
-				ss << "UDPPort::" << __func__ << "() recvfrom() error: (" << ErrNo () << ") " <<
-					StrError (ErrNo ());
-				throw PortException (ss.str ());
-			}
-		}
-		else if (numReceived == 0)
+		if (numReceived == 0)
 		{
-			// Peer disconnected cleanly, do the same at this end
-			if (_debug >= 1)
-				cerr << "UDPPort::" << __func__ << "() Peer disconnected cleanly." << endl;
-			Close ();
-			if (_alwaysOpen)
-			{
-				if (_debug >= 1)
-					cerr << "UDPPort::" << __func__ << "() Trying to reconnect." << endl;
-				Open ();
-				// Can go around again after this - if it doesn't open successfully Open() will throw
-			}
-			else
+			// Read() has already reopened the port if it is set to do so
+			if (!_open)
 			{
 				throw PortException (string ("UDPPort::") + __func__ +
 						string ("() Port closed during read operation."));
 			}
 		}
-		else
+		else if (numReceived > 0)
 			receivedBytes += numReceived;
+		// Ignore timeouts, just go around again
 	}
 
 	return receivedBytes;
 }
 
-ssize_t UDPPort::ReadUntil (void * const buffer, size_t count, uint8_t terminator)
-{
-	// For a datagram protocol, any read will remove the entire datagram from the socket buffer, no
-	// matter how much we actually ask for (although we will still get the amount we asked for in
-	// out buffer). This means we cannot read 1 byte at a time, because we would only get the first
-	// byte of each datagram. However, since reading any of a datagram removes the whole lot, we
-	// can just keep reading as much as possible until we see the terminator somewhere in a received
-	// chunk of data.
-	// This will be fixed if static buffers are introduced.
-
-	size_t numRead = 0;
-
-	CheckPort (true);
-
-	if (_debug >= 2)
-	{
-		cerr << "UDPPort::" << __func__ << "() Reading until '" << terminator << "' or " <<
-			count << " bytes." << endl;
-	}
-	while (numRead < count)
-	{
-		ssize_t result = 0;
-		if ((result = Read (reinterpret_cast<void*> (&reinterpret_cast<char*> (buffer)[numRead]), count - numRead)) < 0)
-			return -1; // Timeout
-		else if (result == 0)
-		{
-			// No data received and didn't timeout, so must be in non-blocking mode
-			if (IsBlocking ())
-				cerr << "UDPPort::" << __func__ << "() Got no data when in blocking mode." << endl;
-			return 0;
-		}
-		else
-		{
-			// Got data
-			if (_debug >= 2)
-				cerr << "UDPPort::" << __func__ << "() Read " << result << " bytes." << endl;
-			// Go through the data just received and check if any bytes match the terminator
-			bool foundTerminator = false;
-			// numKeep starts at 1 because we will keep at least one byte if the first is terminal
-			size_t numKeep = 1;
-			for (size_t ii = numRead; ii < numRead + result; ii++, numKeep++)
-			{
-				if (reinterpret_cast<uint8_t*>(buffer)[ii] == terminator)
-				{
-					if (_debug >= 2)
-						cerr << "UDPPort::" << __func__ << "() Got terminator character." << endl;
-					foundTerminator = true;
-					// We don't care about any data passed this point - as far as the application
-					// knows, it's as much garbage as real data, so don't waste time clearing it
-					break;
-				}
-			}
-			numRead += numKeep;
-			if (foundTerminator)
-			{
-				// Got the terminator so stop reading now
-				break;
-			}
-		}
-	}
-
-	return numRead;
-}
-
-ssize_t UDPPort::ReadStringUntil (std::string &buffer, char terminator)
-{
-	throw PortException (string ("UDPPort::") + __func__ +
-			string ("() This function does not work for datagram protocols."));
-	return 0;
-}
-
-ssize_t UDPPort::Skip (size_t count)
-{
-	throw PortException (string ("UDPPort::") + __func__ +
-			string ("() This function does not work for datagram protocols."));
-	return 0;
-}
-
-ssize_t UDPPort::SkipUntil (uint8_t terminator, unsigned int count)
-{
-	throw PortException (string ("UDPPort::") + __func__ +
-			string ("() This function does not work for datagram protocols."));
-	return 0;
-}
-
 ssize_t UDPPort::BytesAvailable ()
 {
 	// TODO:
@@ -481,6 +352,7 @@ ssize_t UDPPort::BytesAvailable ()
 			StrError (ErrNo ());
 		throw PortException (ss.str ());
 	}
+	bytesAvailable += GetReadBufferUsage ();
 
 	if (_debug >= 2)
 	{
@@ -494,6 +366,10 @@ ssize_t UDPPort::BytesAvailableWait ()
 {
 	CheckPort (true);
 
+	// Buffered and queued data is available without waiting
+	if (GetReadBufferUsage () > 0)
+		return BytesAvailable ();
+
 	if (WaitForDataOrTimeout () == TIMED_OUT)
 	{
 		if (_debug >= 2)
@@ -583,14 +459,125 @@ ssize_t UDPPort::Write (const void * const buffer, size_t count)
 	if (_debug >= 2)
 		cerr << "UDPPort::" << __func__ << "() Wrote " << numSent << " bytes" << endl;
 
+	CountWrite (numSent);
 	return numSent;
 }
 
+#if !defined (WIN32)
+ssize_t UDPPort::WriteV (const struct iovec *iov, int iovcnt)
+{
+	// The buffers are sent as a single datagram
+	struct msghdr msg;
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_name = &_destSockAddr;
+	msg.msg_namelen = sizeof (_destSockAddr);
+	msg.msg_iov = const_cast<struct iovec*> (iov);
+	msg.msg_iovlen = iovcnt;
+
+	CheckPort (false);
+
+	if (_debug >= 2)
+	{
+		cerr << "UDPPort::" << __func__ << "() Writing " << IOVecLength (iov, iovcnt) <<
+			" bytes from " << iovcnt << " buffers" << endl;
+	}
+	if (_timeout._sec != -1)
+	{
+		if (WaitForWritableOrTimeout () == TIMED_OUT)
+		{
+			if (_debug >= 2)
+				cerr << "UDPPort::" << __func__ << "() Timed out waiting to send" << endl;
+			return -1;
+		}
+	}
+
+	ssize_t numSent = sendmsg (_sendSock, &msg, 0);
+	if (numSent < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+		{
+			if (_debug >= 2)
+				cerr << "UDPPort::" << __func__ << "() Timed out while in sendmsg()" << endl;
+			return -1; // Timed out
+		}
+		stringstream ss;
+		ss << "UDPPort::" << __func__ << "() sendmsg() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+		cerr << "UDPPort::" << __func__ << "() Wrote " << numSent << " bytes" << endl;
+
+	CountWrite (numSent);
+	return numSent;
+}
+#endif // !defined (WIN32)
+
+#if defined (FLEXIPORT_HAVE_SENDMMSG)
+ssize_t UDPPort::WriteBatch (const struct iovec *messages, int count)
+{
+	CheckPort (false);
+
+	if (_debug >= 2)
+		cerr << "UDPPort::" << __func__ << "() Writing " << count << " datagrams" << endl;
+	if (count == 0)
+		return 0;
+	if (_timeout._sec != -1)
+	{
+		if (WaitForWritableOrTimeout () == TIMED_OUT)
+		{
+			if (_debug >= 2)
+				cerr << "UDPPort::" << __func__ << "() Timed out waiting to send" << endl;
+			return -1;
+		}
+	}
+
+	vector<struct mmsghdr> headers (count);
+	memset (&headers[0], 0, sizeof (struct mmsghdr) * count);
+	for (int ii = 0; ii < count; ii++)
+	{
+		headers[ii].msg_hdr.msg_name = &_destSockAddr;
+		headers[ii].msg_hdr.msg_namelen = sizeof (_destSockAddr);
+		headers[ii].msg_hdr.msg_iov = const_cast<struct iovec*> (&messages[ii]);
+		headers[ii].msg_hdr.msg_iovlen = 1;
+	}
+
+	int numSent = sendmmsg (_sendSock, &headers[0], count, 0);
+	if (numSent < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+		{
+			if (_debug >= 2)
+				cerr << "UDPPort::" << __func__ << "() Timed out while in sendmmsg()" << endl;
+			return -1; // Timed out
+		}
+		stringstream ss;
+		ss << "UDPPort::" << __func__ << "() sendmmsg() error: (" << ErrNo () << ") " <<
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+
+	if (_debug >= 2)
+		cerr << "UDPPort::" << __func__ << "() Wrote " << numSent << " datagrams" << endl;
+
+	size_t sentBytes = 0;
+	for (int ii = 0; ii < numSent; ii++)
+		sentBytes += headers[ii].msg_len;
+	CountWrite (sentBytes);
+	return numSent;
+}
+#endif // defined (FLEXIPORT_HAVE_SENDMMSG)
+
 void UDPPort::Flush ()
 {
 	int numRead = 0;
 	char dump[128];
 
+	ClearReadBuffer ();
+	_dgramCount = _dgramFront = 0;
+	_dgramOffset = 0;
+
 	// Read data out of the socket into a dump until there's nothing left to read.
 	// Use MSG_DONTWAIT to avoid the timeout if one is set on Linux.
 	// It would be nice to use MSG_DONTWAIT on Windows, but MS didn't see fit to include that in
@@ -601,9 +588,9 @@ void UDPPort::Flush ()
 #if defined (WIN32)
 		if (!IsDataAvailable ())
 			break;
-		numRead = recvfrom (_sendSock, dump, 128, 0, NULL, 0);
+		numRead = recvfrom (_recvSock, dump, 128, 0, NULL, 0);
 #else
-		numRead = recvfrom (_sendSock, dump, 128, MSG_DONTWAIT, NULL, 0);
+		numRead = recvfrom (_recvSock, dump, 128, MSG_DONTWAIT, NULL, 0);
 #endif
 		if (numRead < 0 && ErrNo () != ERRNO_EAGAIN)
 		{
@@ -628,6 +615,11 @@ void UDPPort::Drain ()
 // Other public API functions
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+size_t UDPPort::GetReadBufferUsage () const
+{
+	return ReadBufferUsage () + DatagramQueueUsage ();
+}
+
 std::string UDPPort::GetStatus () const
 {
 	stringstream status;
@@ -707,6 +699,20 @@ bool UDPPort::ProcessOption (const std::string &option, const std::string &value
 			throw PortException ("Bad receive port number: " + value);
 		return true;
 	}
+	else if (option == "recv_batch")
+	{
+		istringstream is (value);
+		if (!(is >> _recvBatch) || is.get (c) || _recvBatch == 0)
+			throw PortException ("Bad receive batch size: " + value);
+		return true;
+	}
+	else if (option == "max_datagram")
+	{
+		istringstream is (value);
+		if (!(is >> _maxDatagram) || is.get (c) || _maxDatagram == 0)
+			throw PortException ("Bad maximum datagram size: " + value);
+		return true;
+	}
 
 	return false;
 }
@@ -975,6 +981,9 @@ void UDPPort::OpenReceiver ()
 
 	SetBroadcastFlag (_recvSock);
 #endif // defined (FLEXIPORT_HAVE_GETADDRINFO)
+#if !defined (WIN32)
+	SetTimestampFlag (_recvSock, _debug);
+#endif
 
 	if (_debug >= 1)
 		cerr << "UDPPort::" << __func__ << "() Waiting for data." << endl;
@@ -996,6 +1005,223 @@ void UDPPort::CloseReceiver ()
 		_recvSock = -1;
 	}
 #endif
+	// Queued datagrams go with the socket
+	_dgramCount = _dgramFront = 0;
+	_dgramOffset = 0;
+}
+
+void UDPPort::AllocateDatagramQueue ()
+{
+	_dgramData = new uint8_t[_recvBatch * _maxDatagram];
+	_dgramLengths = new size_t[_recvBatch];
+	_dgramSources = new struct sockaddr_storage[_recvBatch];
+	_dgramTimestamps = new Timestamp[_recvBatch];
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+	_dgramHeaders = new struct mmsghdr[_recvBatch];
+	_dgramIOVs = new struct iovec[_recvBatch];
+	_dgramControl = new uint8_t[_recvBatch * TIMESTAMP_CONTROL_SIZE];
+	memset (_dgramHeaders, 0, sizeof (struct mmsghdr) * _recvBatch);
+	for (unsigned int ii = 0; ii < _recvBatch; ii++)
+	{
+		_dgramIOVs[ii].iov_base = &_dgramData[ii * _maxDatagram];
+		_dgramIOVs[ii].iov_len = _maxDatagram;
+		_dgramHeaders[ii].msg_hdr.msg_iov = &_dgramIOVs[ii];
+		_dgramHeaders[ii].msg_hdr.msg_iovlen = 1;
+		_dgramHeaders[ii].msg_hdr.msg_name = &_dgramSources[ii];
+		_dgramHeaders[ii].msg_hdr.msg_control = &_dgramControl[ii * TIMESTAMP_CONTROL_SIZE];
+	}
+#endif
+}
+
+void UDPPort::FreeDatagramQueue ()
+{
+	delete[] _dgramData;
+	_dgramData = NULL;
+	delete[] _dgramLengths;
+	_dgramLengths = NULL;
+	delete[] _dgramSources;
+	_dgramSources = NULL;
+	delete[] _dgramTimestamps;
+	_dgramTimestamps = NULL;
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+	delete[] _dgramHeaders;
+	_dgramHeaders = NULL;
+	delete[] _dgramIOVs;
+	_dgramIOVs = NULL;
+	delete[] _dgramControl;
+	_dgramControl = NULL;
+#endif
+}
+
+size_t UDPPort::DatagramQueueUsage () const
+{
+	size_t usage = 0;
+	for (unsigned int ii = _dgramFront; ii < _dgramCount; ii++)
+		usage += _dgramLengths[ii];
+	return usage - _dgramOffset;
+}
+
+// Receive as many datagrams as are waiting, up to _recvBatch, into the (empty) queue. Returns the
+// number received or -1 with the error in ErrNo ().
+ssize_t UDPPort::ReceiveDatagrams ()
+{
+	ssize_t numReceived = 0;
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+	for (unsigned int ii = 0; ii < _recvBatch; ii++)
+	{
+		_dgramHeaders[ii].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		_dgramHeaders[ii].msg_hdr.msg_controllen = TIMESTAMP_CONTROL_SIZE;
+	}
+	// MSG_WAITFORONE makes a blocking socket only wait for the first datagram
+	if ((numReceived = recvmmsg (_recvSock, _dgramHeaders, _recvBatch, MSG_WAITFORONE, NULL)) < 0)
+		return -1;
+	Timestamp now = Timestamp::Now (Timestamp::REALTIME);
+	for (ssize_t ii = 0; ii < numReceived; ii++)
+	{
+		_dgramLengths[ii] = _dgramHeaders[ii].msg_len;
+		if (!GetTimestampFromControl (&_dgramHeaders[ii].msg_hdr, _dgramTimestamps[ii]))
+			_dgramTimestamps[ii] = now;
+		if (_debug >= 1 && (_dgramHeaders[ii].msg_hdr.msg_flags & MSG_TRUNC))
+		{
+			cerr << "UDPPort::" << __func__ << "() Datagram truncated to " << _maxDatagram <<
+				" bytes." << endl;
+		}
+	}
+#else
+	#if defined (WIN32)
+	int fromLen = sizeof (struct sockaddr_storage);
+	ssize_t receivedBytes = recvfrom (_recvSock, reinterpret_cast<char*> (_dgramData),
+			_maxDatagram, 0, reinterpret_cast<struct sockaddr*> (_dgramSources), &fromLen);
+	#else
+	socklen_t fromLen = sizeof (struct sockaddr_storage);
+	ssize_t receivedBytes = recvfrom (_recvSock, _dgramData, _maxDatagram, 0,
+			reinterpret_cast<struct sockaddr*> (_dgramSources), &fromLen);
+	#endif
+	if (receivedBytes < 0)
+		return -1;
+	_dgramLengths[0] = receivedBytes;
+	_dgramTimestamps[0] = Timestamp::Now (Timestamp::REALTIME);
+	numReceived = 1;
+#endif
+
+	if (_debug >= 2)
+	{
+		for (ssize_t ii = 0; ii < numReceived; ii++)
+		{
+			struct sockaddr *from = reinterpret_cast<struct sockaddr*> (&_dgramSources[ii]);
+#if defined (WIN32)
+			// This will probably go boom and print a weird source IP if IPv6 is used on Windows,
+			// but since there's no inet_ntop() on Windows, we have no choice but to use
+			// inet_ntoa().
+			cerr << "UDPPort::" << __func__ << "() Received " << _dgramLengths[ii] <<
+				" bytes from " << inet_ntoa (reinterpret_cast<struct sockaddr_in*>(from)->sin_addr) <<
+				endl;
+#else
+			char s[INET6_ADDRSTRLEN];
+			cerr << "UDPPort::" << __func__ << "() Received " << _dgramLengths[ii] <<
+				" bytes from " << inet_ntop (from->sa_family, GetInAddr (from), s, sizeof (s)) <<
+				endl;
+#endif
+		}
+	}
+	return numReceived;
+}
+
+// Fill the datagram queue, waiting for the timeout if no datagrams are waiting. Returns the number
+// of datagrams received, or -1 if timed out.
+ssize_t UDPPort::FillDatagramQueue ()
+{
+	_dgramCount = _dgramFront = 0;
+	_dgramOffset = 0;
+
+	ssize_t numReceived = ReceiveDatagrams ();
+	// If the socket is non-blocking and there was nothing waiting, wait for data or the timeout
+	if (numReceived < 0 && ErrNo () == ERRNO_EAGAIN && _timeout._sec != -1)
+	{
+		if (WaitForDataOrTimeout () == TIMED_OUT)
+			return -1;
+		numReceived = ReceiveDatagrams ();
+	}
+
+	if (numReceived < 0)
+	{
+		if (ErrNo () == ERRNO_EAGAIN)
+			return -1; // Timed out
+		stringstream ss;
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+		ss << "UDPPort::" << __func__ << "() recvmmsg() error: (" << ErrNo () << ") " <<
+#else
+		ss << "UDPPort::" << __func__ << "() recvfrom() error: (" << ErrNo () << ") " <<
+#endif
+			StrError (ErrNo ());
+		throw PortException (ss.str ());
+	}
+	_dgramCount = numReceived;
+	size_t receivedBytes = 0;
+	for (ssize_t ii = 0; ii < numReceived; ii++)
+		receivedBytes += _dgramLengths[ii];
+	CountRead (receivedBytes);
+	return numReceived;
+}
+
+// Read from the datagram at the front of the queue, refilling the queue first if it is empty.
+// Datagrams are never merged; what is not read of the front datagram is kept for the next read.
+ssize_t UDPPort::ReadFromDatagramQueue (const struct iovec *iov, int iovcnt,
+		Timestamp *timestamp)
+{
+	// Data already in the input buffer is returned before reading from the queue
+	if (ReadBufferUsage () > 0)
+	{
+		if (timestamp != NULL)
+			*timestamp = _readBufferTimestamp;
+		return TakeFromReadBufferV (iov, iovcnt);
+	}
+
+	if (_dgramFront == _dgramCount && FillDatagramQueue () < 0)
+		return -1;
+
+	size_t length = _dgramLengths[_dgramFront];
+	if (length == 0)
+	{
+		// Peer disconnected cleanly, do the same at this end
+		if (_debug >= 1)
+			cerr << "UDPPort::" << __func__ << "() Peer disconnected cleanly." << endl;
+		Close ();
+		if (_alwaysOpen)
+		{
+			if (_debug >= 1)
+				cerr << "UDPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
+			Open ();
+		}
+		return 0;
+	}
+
+	if (_dgramOffset == 0)
+		CountLatency (_dgramTimestamps[_dgramFront]);
+	if (timestamp != NULL)
+		*timestamp = _dgramTimestamps[_dgramFront];
+	uint8_t *data = &_dgramData[_dgramFront * _maxDatagram];
+	size_t numRead = 0;
+	for (int ii = 0; ii < iovcnt && _dgramOffset < length; ii++)
+	{
+		size_t numToCopy = length - _dgramOffset;
+		if (numToCopy > iov[ii].iov_len)
+			numToCopy = iov[ii].iov_len;
+		memcpy (iov[ii].iov_base, &data[_dgramOffset], numToCopy);
+		_dgramOffset += numToCopy;
+		numRead += numToCopy;
+	}
+	if (_dgramOffset == length)
+	{
+		_dgramFront++;
+		_dgramOffset = 0;
+	}
+
+	if (_debug >= 2)
+		cerr << "UDPPort::" << __func__ << "() Read " << numRead << " bytes" << endl;
+
+	return numRead;
 }
 
 // Checks if data is available, waiting for the timeout if none is available immediatly
@@ -1020,7 +1246,9 @@ UDPPort::WaitStatus UDPPort::WaitForDataOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_recvSock + 1, &fdSet, NULL, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
@@ -1083,6 +1311,7 @@ bool UDPPort::IsDataAvailable ()
 		{
 			if (_debug >= 1)
 				cerr << "UDPPort::" << __func__ << "() Trying to reconnect." << endl;
+			_statistics._reconnects++;
 			Open ();
 		}
 		// Fall through to return no data
@@ -1105,7 +1334,9 @@ UDPPort::WaitStatus UDPPort::WaitForWritableOrTimeout ()
 	if (tv.tv_sec >= 0)
 		tvPtr = &tv;
 
+	Timestamp waitStart = Timestamp::Now (Timestamp::MONOTONIC);
 	int result = select (_sendSock + 1, NULL, &fdSet, NULL, tvPtr);
+	CountWait (waitStart, result == 0);
 
 	if (result < 0)
 	{
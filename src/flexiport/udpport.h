@@ -34,6 +34,7 @@
 #include <map>
 #include <string>
 #if !defined (WIN32)
+	#include <sys/socket.h>
 	#include <netinet/in.h>
 #endif
 
@@ -47,19 +48,20 @@ namespace flexiport
 /** @brief UDP implementation of the @ref Port class. This class provides UDP communication between
 two known end points. It cannot send to any address other than the configured address.
 
-See the @ref Port class documentation for how to use the common API. Note that some parts of the API
-do not apply due to the nature of the datagram-oriented protocol. Because each datagram is
-individual and no merging is typically performed between datagrams, several flexiport functions do
-not work (they were designed for stream-oriented communications). These are @ref ReadStringUntil,
-@ref ReadLine (std::string version), @ref Skip, and @ref SkipUntil. This will be (hopefully) be
-fixed soon.
+See the @ref Port class documentation for how to use the common API.
+
+Received datagrams are held in a queue, which is filled with as many waiting datagrams as possible
+(up to recv_batch) in a single system call where recvmmsg() is available. A read returns data from
+the datagram at the front of the queue only, never merging datagrams; any part of the datagram
+not read is kept for the next read. This means that the stream-oriented functions such as @ref
+ReadUntil and @ref SkipUntil treat the received datagrams as a continuous stream of data. A datagram
+larger than max_datagram is truncated.
+
+@ref WriteBatch sends each message as a separate datagram, using a single sendmmsg() call where it
+is available.
 
 TODO: Add support for configuring the destination address based on the first data received, to allow
 destination auto-configuration.
-TODO: Add an option to turn buffering on, making the UDP protocol function like a stream-based
-protocol and so enabling the use of those parts of the API that do not function correctly for a
-datagram-based protocol. Alternatively, fix the functions that don't work yet so they read more than
-a byte at a time.
 
 @par Options
  - dest_ip <string>
@@ -73,7 +75,15 @@ a byte at a time.
    - Default: *
  - recv_port <integer>
    - UDP port to receive data on.
-   - Default: 20000 */
+   - Default: 20000
+ - recv_batch <integer>
+   - Maximum number of datagrams to receive into the queue in one go. Increase this for devices
+     that send a high rate of small datagrams.
+   - Default: 8
+ - max_datagram <integer>
+   - Size in bytes of the largest datagram that can be received. Memory for recv_batch datagrams
+     of this size is allocated, so reduce this when the size of the datagrams is known.
+   - Default: 65507 */
 class FLEXIPORT_EXPORT UDPPort : public Port
 {
 	public:
@@ -88,23 +98,28 @@ class FLEXIPORT_EXPORT UDPPort : public Port
 		void Close ();
 		/// @brief Read from the port.
 		ssize_t Read (void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Read from the port into several buffers.
+		ssize_t ReadV (const struct iovec *iov, int iovcnt);
+		/// @brief Read from the port and get the time the data arrived.
+		ssize_t ReadTimestamped (void * const buffer, size_t count, Timestamp &timestamp);
+#endif
 		/// @brief Read the requested quantity of data from the port.
 		ssize_t ReadFull (void * const buffer, size_t count);
-		/// @brief Read data until a specified termination byte is received.
-		ssize_t ReadUntil (void * const buffer, size_t count, uint8_t terminator);
-		/// @brief Read a string until the specified termination character is received.
-		ssize_t ReadStringUntil (std::string &buffer, char terminator);
-		/// @brief Dump data until the specified number of bytes have been read.
-		ssize_t Skip (size_t count);
-		/** @brief Read and dump data until the specified termination character has been seen @ref
-		count times. */
-		ssize_t SkipUntil (uint8_t terminator, unsigned int count);
 		/// @brief Get the number of bytes waiting to be read at the port. Returns immediatly.
 		ssize_t BytesAvailable ();
 		/// @brief Get the number of bytes waiting after blocking for the timeout.
 		ssize_t BytesAvailableWait ();
 		/// @brief Write data to the port.
 		ssize_t Write (const void * const buffer, size_t count);
+#if !defined (WIN32)
+		/// @brief Write data from several buffers to the port.
+		ssize_t WriteV (const struct iovec *iov, int iovcnt);
+#endif
+#if defined (FLEXIPORT_HAVE_SENDMMSG)
+		/// @brief Write several messages to the port, one datagram each.
+		ssize_t WriteBatch (const struct iovec *messages, int count);
+#endif
 		/// @brief Flush the port's input and output buffers, discarding all data.
 		void Flush ();
 		/// @brief Drain the port's input and output buffers.
@@ -119,6 +134,12 @@ class FLEXIPORT_EXPORT UDPPort : public Port
 		void SetCanWrite (bool canWrite);
 		/// @brief Check if the port is open
 		bool IsOpen () const                        { return _open; }
+		/// @brief Get the number of bytes waiting in the input buffer and the datagram queue.
+		size_t GetReadBufferUsage () const;
+		/// @brief Get the receiving socket.
+		int GetReadDescriptor () const              { return _recvSock; }
+		/// @brief Get the sending socket.
+		int GetWriteDescriptor () const             { return _sendSock; }
 
 	private:
 #if !defined (WIN32)
@@ -137,6 +158,23 @@ class FLEXIPORT_EXPORT UDPPort : public Port
 		unsigned int _recvPort;
 		bool _open;
 
+		// Queue of received datagrams. _dgramFront is the datagram currently being read, from which
+		// _dgramOffset bytes have been read so far. The queue is only refilled once it is empty.
+		unsigned int _recvBatch;
+		size_t _maxDatagram;
+		uint8_t *_dgramData;                        // _recvBatch slots of _maxDatagram bytes.
+		size_t *_dgramLengths;
+		struct sockaddr_storage *_dgramSources;
+		Timestamp *_dgramTimestamps;
+#if defined (FLEXIPORT_HAVE_RECVMMSG)
+		struct mmsghdr *_dgramHeaders;
+		struct iovec *_dgramIOVs;
+		uint8_t *_dgramControl;                     // Control message space for each datagram.
+#endif
+		unsigned int _dgramCount;
+		unsigned int _dgramFront;
+		size_t _dgramOffset;
+
 		void CheckPort (bool read);
 
 		bool ProcessOption (const std::string &option, const std::string &value);
@@ -145,6 +183,12 @@ class FLEXIPORT_EXPORT UDPPort : public Port
 		void CloseSender ();
 		void OpenReceiver ();
 		void CloseReceiver ();
+		void AllocateDatagramQueue ();
+		void FreeDatagramQueue ();
+		size_t DatagramQueueUsage () const;
+		ssize_t FillDatagramQueue ();
+		ssize_t ReceiveDatagrams ();
+		ssize_t ReadFromDatagramQueue (const struct iovec *iov, int iovcnt, Timestamp *timestamp);
 		typedef enum {TIMED_OUT, DATA_AVAILABLE, CAN_WRITE} WaitStatus;
 		WaitStatus WaitForDataOrTimeout ();
 		bool IsDataAvailable ();
@@ -0,0 +1,649 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * flexiport flexible hardware data communications library.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H20PRO-881
+ *
+ * This file is part of flexiport.
+ *
+ * flexiport is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * Lesser General Public License as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * flexiport is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License along with flexiport.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+using namespace std;
+
+#include <flexiport/flexiport.h>
+#include <flexiport/logfile.h>
+using namespace flexiport;
+
+// Command line settings shared by the commands.
+typedef struct
+{
+	double start, end;      // Range of chunk times to use, in seconds
+	unsigned int debug;
+	// stats
+	double interval;        // Length of the throughput intervals
+	unsigned int numGaps;   // Number of largest gaps to list
+	// chunks
+	size_t showData;        // Bytes of each chunk to print
+	// convert
+	bool compress;
+	uint64_t segmentSize;
+	size_t maxChunkSize;    // Larger chunks are split
+	double mergeGap;        // Chunks closer together than this are merged
+	bool keepTimes;         // Don't move the converted range to start at 0
+	// index, verify
+	unsigned int threads;   // 0 for one per processor
+} Settings;
+
+// A gap between two chunks in one file.
+typedef struct
+{
+	double length;
+	double time;            // Time of the chunk after the gap
+	size_t chunk;
+} Gap;
+
+bool GapIsLonger (const Gap &first, const Gap &second)
+{
+	return first.length > second.length;
+}
+
+void Usage (char *progName)
+{
+	cout << "Usage: " << progName << " [options] command log [output log]" << endl;
+	cout << "       " << progName << " [options] index|verify log|directory..." << endl << endl;
+	cout << "Logs are given by the name used to write them, without the 'r' or 'w'." << endl;
+	cout << "Commands:" << endl;
+	cout << "stats\t\tPrint the log's throughput, chunk sizes and gaps between chunks." << endl;
+	cout << "chunks\t\tList every chunk in the log, in time order." << endl;
+	cout << "convert\t\tCopy the log to the output log, with the changes given by the" << endl;
+	cout << "\t\toptions. A log written in segments is joined into one unless -g" << endl;
+	cout << "\t\tis given." << endl;
+	cout << "index\t\tCheck every segment of the logs and write an index file next to" << endl;
+	cout << "\t\teach, which is used instead of reading the whole segment when the" << endl;
+	cout << "\t\tlog is replayed. Logs are searched for in directories." << endl;
+	cout << "verify\t\tCheck the logs without writing index files." << endl << endl;
+	cout << "Options:" << endl;
+	cout << "-c\t\tconvert: Compress the output log." << endl;
+	cout << "-e time\t\tOnly use chunks before this time, in seconds from the start." << endl;
+	cout << "-g size\t\tconvert: Split the output log into segments of this many bytes." << endl;
+	cout << "-i time\t\tstats: Length of each throughput interval in seconds. Default: 1." << endl;
+	cout << "-j number\tindex, verify: Number of threads to use. Default: one per" << endl;
+	cout << "\t\tprocessor." << endl;
+	cout << "-k size\t\tconvert: Split chunks larger than this many bytes." << endl;
+	cout << "-m time\t\tconvert: Merge chunks less than this many seconds apart (up to the" << endl;
+	cout << "\t\t-k size). Merged chunks take the time of their last chunk." << endl;
+	cout << "-n number\tstats: Number of largest gaps to list. Default: 10." << endl;
+	cout << "-s time\t\tOnly use chunks from this time, in seconds from the start." << endl;
+	cout << "-t\t\tconvert: Keep the original times when using -s, instead of moving" << endl;
+	cout << "\t\tthe output to start at 0." << endl;
+	cout << "-x size\t\tchunks: Print up to this many bytes of each chunk's data." << endl;
+	cout << "-v\t\tVerbose mode. Give more than once for more." << endl;
+}
+
+double ToSeconds (const struct timeval &time)
+{
+	return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+struct timeval ToTimeval (double seconds)
+{
+	struct timeval result;
+	result.tv_sec = static_cast<long> (floor (seconds));
+	result.tv_usec = static_cast<long> ((seconds - result.tv_sec) * 1000000.0 + 0.5);
+	if (result.tv_usec >= 1000000)
+	{
+		result.tv_sec++;
+		result.tv_usec -= 1000000;
+	}
+	return result;
+}
+
+size_t NumChunks (LogFile &log, bool writeFile)
+{
+	return writeFile ? log.GetNumWriteChunks () : log.GetNumChunks ();
+}
+
+const uint8_t* GetChunk (LogFile &log, bool writeFile, size_t chunk, double &time, size_t &size)
+{
+	struct timeval timeStamp;
+	const uint8_t *data;
+	if (writeFile)
+		data = log.GetWriteChunk (chunk, timeStamp, size);
+	else
+		data = log.GetReadChunk (chunk, timeStamp, size);
+	time = ToSeconds (timeStamp);
+	return data;
+}
+
+bool InRange (const Settings &settings, double time)
+{
+	return time >= settings.start && time < settings.end;
+}
+
+// Counts the segments of one file of a log and the space they take on the disk.
+unsigned int GetSegments (const string &fileName, uint64_t &diskSize)
+{
+	unsigned int segments = 0;
+	struct stat st;
+	diskSize = 0;
+	while (stat (LogFile::GetSegmentName (fileName, segments).c_str (), &st) == 0)
+	{
+		diskSize += st.st_size;
+		segments++;
+	}
+	return segments;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// stats
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Per-interval totals for both files.
+typedef struct
+{
+	uint64_t bytes[2];
+	size_t chunks[2];
+} Interval;
+
+void PrintFileStats (LogFile &log, const string &fileName, bool writeFile,
+					const Settings &settings, map<long, Interval> &intervals)
+{
+	const char *name = writeFile ? "Write" : "Read";
+	size_t numChunks = 0;
+	uint64_t totalBytes = 0;
+	double first = 0.0, last = 0.0;
+	vector<size_t> histogram;
+	vector<Gap> gaps;
+	double gapTotal = 0.0, gapSquares = 0.0;
+
+	for (size_t ii = 0; ii < NumChunks (log, writeFile); ii++)
+	{
+		double time;
+		size_t size;
+		GetChunk (log, writeFile, ii, time, size);
+		if (!InRange (settings, time))
+			continue;
+
+		if (numChunks == 0)
+			first = time;
+		else
+		{
+			Gap gap;
+			gap.length = time - last;
+			gap.time = time;
+			gap.chunk = ii;
+			gaps.push_back (gap);
+			gapTotal += gap.length;
+			gapSquares += gap.length * gap.length;
+		}
+		last = time;
+		numChunks++;
+		totalBytes += size;
+
+		// Sizes are counted in powers of two: 0, 1, 2-3, 4-7, ...
+		size_t bucket = 0;
+		for (size_t remaining = size; remaining > 0; remaining >>= 1)
+			bucket++;
+		if (bucket >= histogram.size ())
+			histogram.resize (bucket + 1, 0);
+		histogram[bucket]++;
+
+		Interval &interval = intervals[static_cast<long> (floor (time / settings.interval))];
+		interval.bytes[writeFile ? 1 : 0] += size;
+		interval.chunks[writeFile ? 1 : 0]++;
+	}
+
+	uint64_t diskSize;
+	unsigned int segments = GetSegments (fileName, diskSize);
+	cout << name << " file: " << numChunks << " chunks, " << totalBytes << " bytes";
+	if (numChunks > 0)
+		cout << ", from " << fixed << setprecision (6) << first << "s to " << last << "s";
+	cout << endl << "\t" << segments << (segments == 1 ? " segment, " : " segments, ") <<
+		diskSize << " bytes on disk" << endl;
+	if (numChunks == 0)
+		return;
+
+	cout << "Chunk sizes:" << endl;
+	size_t largest = *max_element (histogram.begin (), histogram.end ());
+	for (size_t ii = 0; ii < histogram.size (); ii++)
+	{
+		if (histogram[ii] == 0)
+			continue;
+		stringstream range;
+		if (ii == 0)
+			range << "0";
+		else
+			range << (static_cast<uint64_t> (1) << (ii - 1)) << "-" <<
+				(static_cast<uint64_t> (1) << ii) - 1;
+		cout << "\t" << setw (21) << left << range.str () << right << setw (10) <<
+			histogram[ii] << " " << string ((histogram[ii] * 40 + largest - 1) / largest, '#') <<
+			endl;
+	}
+
+	if (gaps.empty ())
+		return;
+	double mean = gapTotal / gaps.size ();
+	double variance = gapSquares / gaps.size () - mean * mean;
+	cout << "Gaps between chunks: min " <<
+		max_element (gaps.begin (), gaps.end (), GapIsLonger)->length << "s, mean " << mean <<
+		"s, max " << min_element (gaps.begin (), gaps.end (), GapIsLonger)->length <<
+		"s, std dev " << sqrt (variance > 0.0 ? variance : 0.0) << "s" << endl;
+
+	unsigned int numGaps = min (static_cast<size_t> (settings.numGaps), gaps.size ());
+	partial_sort (gaps.begin (), gaps.begin () + numGaps, gaps.end (), GapIsLonger);
+	cout << "Largest gaps:" << endl;
+	for (unsigned int ii = 0; ii < numGaps; ii++)
+	{
+		cout << "\t" << gaps[ii].length << "s before chunk " << gaps[ii].chunk << " at " <<
+			gaps[ii].time << "s" << endl;
+	}
+}
+
+void PrintStats (LogFile &log, const string &logName, const Settings &settings)
+{
+	map<long, Interval> intervals;
+
+	cout << "Log: " << logName << endl;
+	PrintFileStats (log, logName + "r", false, settings, intervals);
+	cout << endl;
+	PrintFileStats (log, logName + "w", true, settings, intervals);
+	if (intervals.empty ())
+		return;
+
+	// Intervals with no chunks are left out
+	cout.unsetf (ios_base::floatfield);
+	cout << endl << "Throughput (per " << settings.interval << "s):" << endl << fixed;
+	cout << setw (14) << "Time" << setw (14) << "Read bytes" << setw (8) << "chunks" <<
+		setw (14) << "Write bytes" << setw (8) << "chunks" << endl;
+	for (map<long, Interval>::const_iterator ii = intervals.begin (); ii != intervals.end (); ii++)
+	{
+		cout << setw (14) << setprecision (3) << ii->first * settings.interval <<
+			setw (14) << ii->second.bytes[0] << setw (8) << ii->second.chunks[0] <<
+			setw (14) << ii->second.bytes[1] << setw (8) << ii->second.chunks[1] << endl;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// chunks
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PrintChunks (LogFile &log, const Settings &settings)
+{
+	// Merge the two files by time, reads first when the times are equal
+	size_t next[2] = {0, 0};
+	while (true)
+	{
+		double times[2] = {0.0, 0.0};
+		size_t sizes[2] = {0, 0};
+		bool have[2] = {false, false};
+		for (int ii = 0; ii < 2; ii++)
+		{
+			if (next[ii] < NumChunks (log, ii == 1))
+			{
+				GetChunk (log, ii == 1, next[ii], times[ii], sizes[ii]);
+				have[ii] = true;
+			}
+		}
+		if (!have[0] && !have[1])
+			break;
+		int file = (have[0] && (!have[1] || times[0] <= times[1])) ? 0 : 1;
+		size_t chunk = next[file]++;
+		if (times[file] >= settings.end)
+		{
+			// Nothing after this in this file is in range
+			next[file] = NumChunks (log, file == 1);
+			continue;
+		}
+		if (times[file] < settings.start)
+			continue;
+
+		cout << fixed << setprecision (6) << setw (16) << times[file] <<
+			(file == 0 ? " read  " : " write ") << setw (8) << chunk << setw (10) <<
+			sizes[file] << " bytes";
+		if (settings.showData > 0)
+		{
+			double time;
+			size_t size;
+			const uint8_t *data = GetChunk (log, file == 1, chunk, time, size);
+			cout << "  ";
+			for (size_t jj = 0; jj < size && jj < settings.showData; jj++)
+			{
+				if (data[jj] >= 0x20 && data[jj] < 0x7F && data[jj] != '\\')
+					cout << static_cast<char> (data[jj]);
+				else
+				{
+					cout << "\\x" << hex << setw (2) << setfill ('0') <<
+						static_cast<unsigned int> (data[jj]) << dec << setfill (' ');
+				}
+			}
+			if (size > settings.showData)
+				cout << "...";
+		}
+		cout << endl;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// convert
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void WriteChunk (LogFile &output, bool writeFile, const uint8_t *data, size_t size, double time,
+				const Settings &settings)
+{
+	struct timeval timeStamp = ToTimeval (time);
+	// Chunks of 0 bytes (e.g. a timed-out read) are kept as they are
+	do
+	{
+		size_t piece = size;
+		if (settings.maxChunkSize > 0 && piece > settings.maxChunkSize)
+			piece = settings.maxChunkSize;
+		if (writeFile)
+			output.WriteWrite (data, piece, &timeStamp);
+		else
+			output.WriteRead (data, piece, &timeStamp);
+		data += piece;
+		size -= piece;
+	}
+	while (size > 0);
+}
+
+void ConvertFile (LogFile &input, LogFile &output, bool writeFile, const Settings &settings,
+				double offset, size_t &numIn, size_t &numOut)
+{
+	// Chunks waiting to be merged into one
+	vector<uint8_t> pending;
+	double pendingTime = 0.0;
+	bool havePending = false;
+
+	numIn = numOut = 0;
+	for (size_t ii = 0; ii < NumChunks (input, writeFile); ii++)
+	{
+		double time;
+		size_t size;
+		const uint8_t *data = GetChunk (input, writeFile, ii, time, size);
+		if (time >= settings.end)
+			break;
+		if (time < settings.start)
+			continue;
+		time -= offset;
+		numIn++;
+
+		if (havePending && (time - pendingTime >= settings.mergeGap ||
+				(settings.maxChunkSize > 0 && pending.size () + size > settings.maxChunkSize)))
+		{
+			WriteChunk (output, writeFile, pending.empty () ? NULL : &pending[0], pending.size (),
+					pendingTime, settings);
+			numOut++;
+			pending.clear ();
+		}
+		pending.insert (pending.end (), data, data + size);
+		pendingTime = time;
+		havePending = true;
+	}
+	if (havePending)
+	{
+		WriteChunk (output, writeFile, pending.empty () ? NULL : &pending[0], pending.size (),
+				pendingTime, settings);
+		numOut++;
+	}
+}
+
+// The input log is mapped into memory while it is converted, so opening one of its files as the
+// output would truncate it underneath the mapping and crash. Compares the files themselves rather
+// than their names, to catch links and different paths to the same file.
+void CheckOutputIsNotInput (const string &inputName, const string &outputName)
+{
+	const char *suffixes[] = {"r", "w"};
+	vector<pair<dev_t, ino_t> > inputFiles;
+	struct stat st;
+	for (unsigned int ii = 0; ii < 2; ii++)
+	{
+		for (unsigned int jj = 0; stat (LogFile::GetSegmentName (inputName + suffixes[ii],
+						jj).c_str (), &st) == 0; jj++)
+			inputFiles.push_back (make_pair (st.st_dev, st.st_ino));
+	}
+
+	for (unsigned int ii = 0; ii < 2; ii++)
+	{
+		for (unsigned int jj = 0; ; jj++)
+		{
+			string name = LogFile::GetSegmentName (outputName + suffixes[ii], jj);
+			if (stat (name.c_str (), &st) != 0)
+				break;
+			if (find (inputFiles.begin (), inputFiles.end (), make_pair (st.st_dev, st.st_ino)) !=
+					inputFiles.end ())
+			{
+				throw PortException ("The output log would overwrite the input log: " + name +
+						" is one of its files.");
+			}
+		}
+	}
+}
+
+void Convert (LogFile &input, const string &inputName, const string &outputName,
+		const Settings &settings)
+{
+	CheckOutputIsNotInput (inputName, outputName);
+
+	LogFile output (settings.debug);
+	output.SetCompression (settings.compress);
+	output.SetSegmentSize (settings.segmentSize);
+	output.Open (outputName, false);
+
+	double offset = (settings.keepTimes || settings.start <= 0.0) ? 0.0 : settings.start;
+	size_t readIn, readOut, writeIn, writeOut;
+	ConvertFile (input, output, false, settings, offset, readIn, readOut);
+	ConvertFile (input, output, true, settings, offset, writeIn, writeOut);
+	output.Close ();
+
+	cout << "Read file: " << readIn << " chunks copied as " << readOut << " chunks" << endl;
+	cout << "Write file: " << writeIn << " chunks copied as " << writeOut << " chunks" << endl;
+	if (offset > 0.0)
+		cout << "Times moved back by " << fixed << setprecision (6) << offset << "s" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// index, verify
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Adds the logs in a directory: every file ending in 'r' that has a matching 'w' file.
+void FindLogs (const string &directory, vector<string> &logNames)
+{
+	DIR *dir;
+	if ((dir = opendir (directory.c_str ())) == NULL)
+	{
+		cerr << "Failed to open directory " << directory << endl;
+		return;
+	}
+	vector<string> found;
+	struct dirent *entry;
+	while ((entry = readdir (dir)) != NULL)
+	{
+		string name = entry->d_name;
+		if (name.empty () || name[name.size () - 1] != 'r')
+			continue;
+		string logName = directory + "/" + name.substr (0, name.size () - 1);
+		struct stat st;
+		if (stat ((logName + "w").c_str (), &st) == 0 && S_ISREG (st.st_mode))
+			found.push_back (logName);
+	}
+	closedir (dir);
+	sort (found.begin (), found.end ());
+	logNames.insert (logNames.end (), found.begin (), found.end ());
+}
+
+int IndexLogs (char **names, int numNames, bool writeIndexes, const Settings &settings)
+{
+	vector<string> logNames;
+	for (int ii = 0; ii < numNames; ii++)
+	{
+		struct stat st;
+		if (stat (names[ii], &st) == 0 && S_ISDIR (st.st_mode))
+			FindLogs (names[ii], logNames);
+		else
+			logNames.push_back (names[ii]);
+	}
+
+	vector<string> problems;
+	bool good = LogFile::IndexLogs (logNames, writeIndexes, problems, settings.threads,
+			settings.debug);
+	for (size_t ii = 0; ii < problems.size (); ii++)
+		cout << problems[ii] << endl;
+	cout << (writeIndexes ? "Indexed " : "Checked ") << logNames.size () <<
+		(logNames.size () == 1 ? " log: " : " logs: ");
+	if (good)
+		cout << "no problems found." << endl;
+	else
+		cout << problems.size () << (problems.size () == 1 ? " problem." : " problems.") << endl;
+	return good ? 0 : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main (int argc, char **argv)
+{
+	int opt;
+	char c;
+	Settings settings;
+	istringstream is;
+
+	settings.start = 0.0;
+	settings.end = HUGE_VAL;
+	settings.debug = 0;
+	settings.interval = 1.0;
+	settings.numGaps = 10;
+	settings.showData = 0;
+	settings.compress = false;
+	settings.segmentSize = 0;
+	settings.maxChunkSize = 0;
+	settings.mergeGap = 0.0;
+	settings.keepTimes = false;
+	settings.threads = 0;
+
+	// Get some options from the command line
+	while ((opt = getopt (argc, argv, "ce:g:hi:j:k:m:n:s:tvx:")) != -1)
+	{
+		is.clear ();
+		if (optarg != NULL)
+			is.str (optarg);
+		bool good = true;
+		switch (opt)
+		{
+			case 'c':
+				settings.compress = true;
+				break;
+			case 'e':
+				good = (is >> settings.end) && !is.get (c);
+				break;
+			case 'g':
+				good = (is >> settings.segmentSize) && !is.get (c);
+				break;
+			case 'i':
+				good = (is >> settings.interval) && !is.get (c) && settings.interval > 0.0;
+				break;
+			case 'j':
+				good = (is >> settings.threads) && !is.get (c);
+				break;
+			case 'k':
+				good = (is >> settings.maxChunkSize) && !is.get (c);
+				break;
+			case 'm':
+				good = (is >> settings.mergeGap) && !is.get (c);
+				break;
+			case 'n':
+				good = (is >> settings.numGaps) && !is.get (c);
+				break;
+			case 's':
+				good = (is >> settings.start) && !is.get (c);
+				break;
+			case 't':
+				settings.keepTimes = true;
+				break;
+			case 'v':
+				settings.debug++;
+				break;
+			case 'x':
+				good = (is >> settings.showData) && !is.get (c);
+				break;
+			case 'h':
+			default:
+				Usage (argv[0]);
+				exit (1);
+		}
+		if (!good)
+		{
+			cerr << "Bad value for -" << static_cast<char> (opt) << ": " << optarg << endl;
+			Usage (argv[0]);
+			exit (1);
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		Usage (argv[0]);
+		exit (1);
+	}
+	string command = argv[optind];
+	string logName = argv[optind + 1];
+	if (command == "index" || command == "verify")
+		return IndexLogs (&argv[optind + 1], argc - optind - 1, command == "index", settings);
+	if ((command == "convert") != (argc - optind == 3) || argc - optind > 3)
+	{
+		Usage (argv[0]);
+		exit (1);
+	}
+
+	try
+	{
+		LogFile log (settings.debug);
+		log.Open (logName, true, true);
+		if (command == "stats")
+			PrintStats (log, logName, settings);
+		else if (command == "chunks")
+			PrintChunks (log, settings);
+		else if (command == "convert")
+			Convert (log, logName, argv[optind + 2], settings);
+		else
+		{
+			cerr << "Unknown command: " << command << endl;
+			Usage (argv[0]);
+			exit (1);
+		}
+		log.Close ();
+	}
+	catch (PortException &e)
+	{
+		cerr << "Caught exception: " << e.what () << endl;
+		return 1;
+	}
+
+	return 0;
+}
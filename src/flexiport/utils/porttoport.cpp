@@ -27,44 +27,423 @@
 
 #include <cstdlib>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <sstream>
+#include <vector>
 using namespace std;
 
 #include <flexiport/flexiport.h>
 #include <flexiport/port.h>
+#include <flexiport/portset.h>
+#include <flexiport/statistics.h>
+#include <flexiport/timestamp.h>
 using namespace flexiport;
 
+// Data read from a source, waiting to be written to a destination.
+typedef struct
+{
+	vector<uint8_t> data;
+	Timestamp arrival;
+} Chunk;
+
+struct Source;
+
+// A port that data is written to, with its own bounded queue. When the queue of a lossy
+// destination is full, its oldest data is dropped so that it doesn't hold up the other
+// destinations. When the queue of any other destination is full, its sources stop being read.
+// While a source's pipe holds data for the destination, nothing else is written to it, so that
+// data from several sources is never mixed within a chunk.
+typedef struct
+{
+	string name;
+	Port *port;
+	bool lossy;
+	deque<Chunk> queue;
+	size_t queued;          // Bytes waiting in the queue
+	size_t offset;          // Bytes of the first chunk already written
+	uint64_t dropped;       // Bytes dropped because the queue was full
+	Source *piping;         // Source whose pipe holds data not yet written here, or NULL
+	PortStatistics stats;   // Bytes written, and the time from data being read to written
+} Destination;
+
+// A port that data is read from, and the destinations it is copied to.
+struct Source
+{
+	string name;
+	Port *port;
+	vector<Destination*> destinations;
+	bool splice;            // Move data with splice() when there is a single destination
+	int pipe[2];            // Pipe that spliced data passes through
+	size_t piped;           // Bytes in the pipe that the destination hasn't taken yet
+	Timestamp pipedArrival; // When the data in the pipe was read
+	PortStatistics stats;   // Bytes read
+};
+
+volatile sig_atomic_t reportRequested = 0;
+volatile sig_atomic_t quitRequested = 0;
+
+void HandleSignal (int signal)
+{
+	if (signal == SIGUSR1)
+		reportRequested = 1;
+	else
+		quitRequested = 1;
+}
+
 void Usage (char *progName)
 {
 	cout << "Usage: " << progName << " [options]" << endl << endl;
 	cout << "-b size\t\tBuffer size. The maximum quantity of data that can be moved at once." << endl;
-	cout << "\t\tIf set to 0, the buffer will shrink and grow as necessary based on" << endl;
-	cout << "\t\tthe data waiting, but this will introduce delays." << endl;
+	cout << "\t\tIf set to 0, the default of 65536 bytes is used." << endl;
+	cout << "-c\t\tAlways copy data through the buffer, never with splice()." << endl;
 	cout << "-l options\tString of extra options for the left-side port." << endl;
+	cout << "-m options\tOptions for an extra port whose data is merged into the data sent to" << endl;
+	cout << "\t\tthe left port. May be given more than once." << endl;
+	cout << "-q size\t\tMaximum bytes queued for each port. When a tee port can't keep up," << endl;
+	cout << "\t\tthe oldest data queued for it is dropped; when the left or right port" << endl;
+	cout << "\t\tcan't, reading from the ports sending to it stops. Default: 1048576." << endl;
 	cout << "-r options\tString of extra options for the right-side port." << endl;
-	cout << "-s time\t\tSleep time between port checks (in microseconds)." << endl;
-	cout << "\t\tSet to 0 for no sleep (the default)." << endl;
+	cout << "-s time\t\tIgnored. Accepted so that older command lines still work; the ports" <<
+		endl;
+	cout << "\t\tare no longer polled." << endl;
+	cout << "-S\t\tPrint per-port statistics on exit. They are also printed" << endl;
+	cout << "\t\twhenever SIGUSR1 is received." << endl;
+	cout << "-t options\tOptions for an extra port that receives a copy of the data read from" << endl;
+	cout << "\t\tthe left port. May be given more than once." << endl;
 	cout << "-v\t\tVerbose mode." << endl;
 }
 
+Port* OpenPort (const string &name, const string &options, bool verbose)
+{
+	if (verbose)
+		cerr << "Creating " << name << " port." << endl;
+	Port *port = CreatePort (options);
+	if (!port->IsOpen ())
+	{
+		if (verbose)
+			cerr << "Opening " << name << " port." << endl;
+		port->Open ();
+	}
+	// Reads happen only once a port is readable and writes only once it is writable, so no call
+	// should wait; one slow port must not hold up the others.
+	port->SetTimeout (Timeout (0, 0));
+	return port;
+}
+
+// Data can be spliced between ports whose descriptors are the device itself, and only when there
+// is nothing left in the source port's input buffer. Other ports (such as logging ports, which
+// share their wrapped port's descriptors) must see the data pass through them.
+bool CanSplice (Port *source, Port *destination)
+{
+#if defined (SPLICE_F_MOVE)
+	string sourceType = source->GetPortType ();
+	string destType = destination->GetPortType ();
+	return (sourceType == "serial" || sourceType == "tcp" || sourceType == "pty") &&
+		(destType == "serial" || destType == "tcp" || destType == "pty") &&
+		source->GetReadDescriptor () >= 0 && destination->GetWriteDescriptor () >= 0;
+#else
+	return false;
+#endif
+}
+
+#if defined (SPLICE_F_MOVE)
+// Throw away the data waiting in a source's pipe because its destination has closed.
+void DiscardPipe (Source &source, bool verbose)
+{
+	if (verbose)
+	{
+		cerr << source.name << ": destination closed, dropped " << source.piped << " bytes." <<
+			endl;
+	}
+	char dump[4096];
+	while (source.piped > 0)
+	{
+		ssize_t numRead = read (source.pipe[0], dump,
+				source.piped < sizeof (dump) ? source.piped : sizeof (dump));
+		if (numRead <= 0)
+			break;
+		source.piped -= numRead;
+	}
+	source.piped = 0;
+	source.destinations[0]->piping = NULL;
+}
+
+// Move as much of the data waiting in a source's pipe to its destination as it will take without
+// waiting. Whatever is left is moved once the destination is writable again; until then, the
+// source is not read.
+void DrainPipe (Source &source, bool verbose)
+{
+	Destination &dest = *source.destinations[0];
+	if (dest.port == NULL || !dest.port->IsOpen ())
+	{
+		DiscardPipe (source, verbose);
+		return;
+	}
+	int destFD = dest.port->GetWriteDescriptor ();
+
+	while (source.piped > 0)
+	{
+		ssize_t numWritten = splice (source.pipe[0], NULL, destFD, NULL, source.piped,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (numWritten == 0)
+			return;
+		else if (numWritten < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			if (errno == EPIPE || errno == ECONNRESET)
+			{
+				// Reading from the destination will show that it has closed
+				DiscardPipe (source, verbose);
+				return;
+			}
+			stringstream ss;
+			ss << source.name << ": splice() to destination error: (" << errno << ") " <<
+				strerror (errno);
+			throw PortException (ss.str ());
+		}
+		if (verbose)
+			cerr << dest.name << ": spliced " << numWritten << " bytes." << endl;
+		dest.stats._writeCalls++;
+		dest.stats._writeBytes += numWritten;
+		source.piped -= numWritten;
+	}
+	dest.piping = NULL;
+	dest.stats.AddLatency (Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+			source.pipedArrival.AsNanoseconds ());
+}
+
+// Move up to count bytes from the source into its pipe, and from there to its destination.
+// Returns the number of bytes read, 0 if there was nothing to read, or -1 if the source reached
+// end of file or the descriptors do not support splice().
+ssize_t SpliceData (Source &source, size_t count, const Timestamp &arrival, bool verbose)
+{
+	int sourceFD = source.port->GetReadDescriptor ();
+
+	ssize_t numRead = splice (sourceFD, NULL, source.pipe[1], NULL, count,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (numRead < 0)
+	{
+		if (errno == EAGAIN)
+			return 0;
+		if (errno == ECONNRESET)
+			return -1;  // Reading through the port handles the error as copying would
+		if (errno == EINVAL)
+		{
+			if (verbose)
+				cerr << source.name << ": splice() not supported, copying instead." << endl;
+			source.splice = false;
+			return -1;
+		}
+		stringstream ss;
+		ss << source.name << ": splice() from source error: (" << errno << ") " <<
+			strerror (errno);
+		throw PortException (ss.str ());
+	}
+	else if (numRead == 0)
+		return -1;
+
+	source.piped = numRead;
+	source.pipedArrival = arrival;
+	source.destinations[0]->piping = &source;
+	DrainPipe (source, verbose);
+	return numRead;
+}
+#endif // defined (SPLICE_F_MOVE)
+
+// Write as much of a destination's queue as it will take without waiting.
+// Queued data was read after any data waiting in a pipe, so it must wait for the pipe to empty.
+void WriteQueue (Destination &dest, bool verbose)
+{
+	if (dest.port == NULL || !dest.port->IsOpen () || dest.piping != NULL)
+		return;
+	while (!dest.queue.empty ())
+	{
+		Chunk &chunk = dest.queue.front ();
+		ssize_t numWritten = dest.port->Write (&chunk.data[dest.offset],
+				chunk.data.size () - dest.offset);
+		if (numWritten <= 0)
+			break;  // Full, or closed
+		if (verbose)
+			cerr << dest.name << ": wrote " << numWritten << " bytes." << endl;
+
+		dest.stats._writeCalls++;
+		dest.stats._writeBytes += numWritten;
+		dest.offset += numWritten;
+		dest.queued -= numWritten;
+		if (dest.offset == chunk.data.size ())
+		{
+			dest.stats.AddLatency (Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+					chunk.arrival.AsNanoseconds ());
+			dest.queue.pop_front ();
+			dest.offset = 0;
+		}
+	}
+}
+
+// Add data to a destination's queue. Lossy destinations drop their oldest queued data to keep
+// within the limit.
+void QueueData (Destination &dest, const uint8_t *data, size_t count, const Timestamp &arrival,
+		size_t maxQueued, bool verbose)
+{
+	dest.queue.push_back (Chunk ());
+	dest.queue.back ().data.assign (data, data + count);
+	dest.queue.back ().arrival = arrival;
+	dest.queued += count;
+
+	while (dest.lossy && dest.queued > maxQueued && dest.queue.size () > 1)
+	{
+		size_t numDropped = dest.queue.front ().data.size () - dest.offset;
+		if (verbose)
+			cerr << dest.name << ": queue full, dropped " << numDropped << " bytes." << endl;
+		dest.dropped += numDropped;
+		dest.queued -= numDropped;
+		dest.queue.pop_front ();
+		dest.offset = 0;
+	}
+}
+
+// Move the data waiting at a source to its destinations.
+void ReadSource (Source &source, uint8_t *buffer, size_t bufferSize, size_t maxQueued,
+		bool verbose)
+{
+	Timestamp arrival = Timestamp::Now (Timestamp::MONOTONIC);
+	ssize_t numRead;
+
+	// Data still in the pipe must reach the destination before anything else is read
+	if (source.piped > 0)
+		return;
+
+#if defined (SPLICE_F_MOVE)
+	if (source.splice && source.destinations.size () == 1 &&
+			source.destinations[0]->queue.empty () && source.destinations[0]->piping == NULL &&
+			source.port->GetReadBufferUsage () == 0)
+	{
+		numRead = SpliceData (source, bufferSize, arrival, verbose);
+		if (numRead > 0)
+		{
+			if (verbose)
+				cerr << source.name << ": spliced " << numRead << " bytes." << endl;
+			source.stats._readCalls++;
+			source.stats._readBytes += numRead;
+		}
+		if (numRead >= 0)
+			return;
+	}
+#endif
+
+	// Reading through the port also lets it see and handle the other end closing
+	numRead = source.port->Read (buffer, bufferSize);
+	if (numRead <= 0)
+		return;
+	if (verbose)
+		cerr << source.name << ": read " << numRead << " bytes." << endl;
+	source.stats._readCalls++;
+	source.stats._readBytes += numRead;
+
+	for (unsigned int ii = 0; ii < source.destinations.size (); ii++)
+	{
+		Destination &dest = *source.destinations[ii];
+		QueueData (dest, buffer, numRead, arrival, maxQueued, verbose);
+		WriteQueue (dest, verbose);
+	}
+}
+
+void PrintStatistics (const vector<Source*> &sources, const vector<Destination*> &destinations,
+		const Timestamp &startTime)
+{
+	double elapsed = (Timestamp::Now (Timestamp::MONOTONIC).AsNanoseconds () -
+			startTime.AsNanoseconds ()) / 1e9;
+
+	for (unsigned int ii = 0; ii < sources.size (); ii++)
+	{
+		const PortStatistics &stats = sources[ii]->stats;
+		cerr << "From " << sources[ii]->name << ": " << stats._readBytes << " bytes in " <<
+			stats._readCalls << " reads (" <<
+			static_cast<uint64_t> (elapsed > 0 ? stats._readBytes / elapsed : 0) << " bytes/s), " <<
+			(sources[ii]->splice ? "spliced" : "copied") << endl;
+	}
+	for (unsigned int ii = 0; ii < destinations.size (); ii++)
+	{
+		const PortStatistics &stats = destinations[ii]->stats;
+		cerr << "To " << destinations[ii]->name << ": " << stats._writeBytes << " bytes in " <<
+			stats._writeCalls << " writes (" <<
+			static_cast<uint64_t> (elapsed > 0 ? stats._writeBytes / elapsed : 0) <<
+			" bytes/s), " << destinations[ii]->dropped << " bytes dropped, " <<
+			destinations[ii]->queued << " bytes queued" << endl;
+		if (stats._writeCalls > 0)
+		{
+			cerr << "\tLatency (us) 50%: <" << stats.LatencyPercentile (0.5) / 1000 <<
+				"\t99%: <" << stats.LatencyPercentile (0.99) / 1000 << "\tmax: <" <<
+				stats.LatencyPercentile (1) / 1000 << endl;
+		}
+	}
+}
+
+// Stop using an extra port that has closed, so that it doesn't stop the bridge.
+void RemovePort (Port *port, vector<Source*> &sources, vector<Destination*> &destinations,
+		PortSet &set)
+{
+	set.Remove (port);
+	for (unsigned int ii = 0; ii < sources.size (); ii++)
+	{
+		vector<Destination*> &dests = sources[ii]->destinations;
+		for (unsigned int jj = 0; jj < dests.size (); jj++)
+		{
+			if (dests[jj]->port == port)
+			{
+				dests.erase (dests.begin () + jj);
+				break;
+			}
+		}
+	}
+	for (unsigned int ii = 0; ii < sources.size (); ii++)
+	{
+		if (sources[ii]->port == port)
+		{
+			// Data already in the source's pipe is still sent to its destination
+			sources[ii]->port = NULL;
+			if (sources[ii]->piped == 0)
+				sources[ii]->destinations.clear ();
+		}
+	}
+	for (unsigned int ii = 0; ii < destinations.size (); ii++)
+	{
+		if (destinations[ii]->port == port)
+		{
+			destinations[ii]->port = NULL;
+			destinations[ii]->queue.clear ();
+			destinations[ii]->queued = 0;
+		}
+	}
+	delete port;
+}
+
 int main (int argc, char **argv)
 {
 	Port *leftPort = NULL, *rightPort = NULL;
 	int opt;
 	char c;
 	string leftPortOptions, rightPortOptions;
-	bool verbose = false;
-	unsigned int bufferSize = 0, sleepTime = 0;
+	vector<string> teePortOptions, mergePortOptions;
+	bool verbose = false, allowSplice = true, printStats = false;
+	unsigned int bufferSize = 0, maxQueued = 1048576;
 	uint8_t *buffer = NULL;
 	istringstream is;
 
 	// Get some options from the command line
-	while ((opt = getopt (argc, argv, "b:hl:r:s:v")) != -1)
+	while ((opt = getopt (argc, argv, "b:chl:m:q:r:s:St:v")) != -1)
 	{
 		switch (opt)
 		{
 			case 'b':
+				is.clear ();
 				is.str (optarg);
 				if (!(is >> bufferSize) || is.get (c) || bufferSize < 0)
 				{
@@ -73,6 +452,9 @@ int main (int argc, char **argv)
 					exit (1);
 				}
 				break;
+			case 'c':
+				allowSplice = false;
+				break;
 			case 'h':
 				Usage (argv[0]);
 				exit (1);
@@ -80,18 +462,31 @@ int main (int argc, char **argv)
 			case 'l':
 				leftPortOptions = optarg;
 				break;
-			case 'r':
-				rightPortOptions = optarg;
+			case 'm':
+				mergePortOptions.push_back (optarg);
 				break;
-			case 's':
+			case 'q':
+				is.clear ();
 				is.str (optarg);
-				if (!(is >> sleepTime) || is.get (c) || sleepTime < 0)
+				if (!(is >> maxQueued) || is.get (c) || maxQueued == 0)
 				{
-					cerr << "Bad sleep time: " << optarg << endl;
+					cerr << "Bad queue size: " << optarg << endl;
 					Usage (argv[0]);
 					exit (1);
 				}
 				break;
+			case 'r':
+				rightPortOptions = optarg;
+				break;
+			case 's':
+				// No longer used
+				break;
+			case 'S':
+				printStats = true;
+				break;
+			case 't':
+				teePortOptions.push_back (optarg);
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -100,155 +495,231 @@ int main (int argc, char **argv)
 				exit (1);
 		}
 	}
-	
+	if (bufferSize == 0)
+		bufferSize = 65536;
+
+	signal (SIGUSR1, HandleSignal);
+	signal (SIGINT, HandleSignal);
+	signal (SIGTERM, HandleSignal);
+	// A destination closing shows up as an error from writing to it rather than killing the
+	// program
+	signal (SIGPIPE, SIG_IGN);
+
+	vector<Source*> sources;
+	vector<Destination*> destinations;
 	try
 	{
+		leftPort = OpenPort ("left", leftPortOptions, verbose);
+		rightPort = OpenPort ("right", rightPortOptions, verbose);
+
 		if (verbose)
-			cerr << "Creating ports." << endl;
-		leftPort = CreatePort (leftPortOptions);
-		rightPort = CreatePort (rightPortOptions);
+			cerr << "Allocating buffer of size " << bufferSize << " bytes." << endl;
+		if ((buffer = reinterpret_cast<uint8_t*> (malloc (sizeof (uint8_t) *
+				bufferSize))) == NULL)
+		{
+			cerr << "Failed to allocate memory for buffer." << endl;
+			exit (1);
+		}
+
+		// The left port's data goes to the right port and each tee port; the right port's and
+		// each merge port's data goes to the left port
+		Destination *toLeft = new Destination;
+		toLeft->name = "left";
+		toLeft->port = leftPort;
+		toLeft->lossy = false;
+		destinations.push_back (toLeft);
+		Destination *toRight = new Destination;
+		toRight->name = "right";
+		toRight->port = rightPort;
+		toRight->lossy = false;
+		destinations.push_back (toRight);
+
+		Source *fromLeft = new Source;
+		fromLeft->name = "left";
+		fromLeft->port = leftPort;
+		fromLeft->destinations.push_back (toRight);
+		sources.push_back (fromLeft);
+		Source *fromRight = new Source;
+		fromRight->name = "right";
+		fromRight->port = rightPort;
+		fromRight->destinations.push_back (toLeft);
+		sources.push_back (fromRight);
 
-		if (!leftPort->IsOpen ())
+		for (unsigned int ii = 0; ii < teePortOptions.size (); ii++)
 		{
-			if (verbose)
-				cerr << "Opening left port." << endl;
-			leftPort->Open ();
+			stringstream name;
+			name << "tee " << ii + 1;
+			Destination *dest = new Destination;
+			dest->name = name.str ();
+			dest->port = OpenPort (dest->name, teePortOptions[ii], verbose);
+			dest->lossy = true;
+			destinations.push_back (dest);
+			fromLeft->destinations.push_back (dest);
 		}
-		if (!rightPort->IsOpen ())
+		for (unsigned int ii = 0; ii < mergePortOptions.size (); ii++)
 		{
-			if (verbose)
-				cerr << "Opening right port." << endl;
-			rightPort->Open ();
+			stringstream name;
+			name << "merge " << ii + 1;
+			Source *source = new Source;
+			source->name = name.str ();
+			source->port = OpenPort (source->name, mergePortOptions[ii], verbose);
+			source->destinations.push_back (toLeft);
+			sources.push_back (source);
 		}
 
-		if (verbose)
+		for (unsigned int ii = 0; ii < destinations.size (); ii++)
 		{
-			if (bufferSize > 0)
-				cerr << "Allocating buffer of size " << bufferSize << " bytes." << endl;
-			else
-				cerr << "Using dynamic buffer." << endl;
+			destinations[ii]->queued = destinations[ii]->offset = 0;
+			destinations[ii]->dropped = 0;
+			destinations[ii]->piping = NULL;
 		}
-		if (bufferSize > 0)
+		for (unsigned int ii = 0; ii < sources.size (); ii++)
 		{
-			if ((buffer = reinterpret_cast<uint8_t*> (malloc (sizeof (uint8_t) *
-					bufferSize))) == NULL)
+			Source *source = sources[ii];
+			source->pipe[0] = source->pipe[1] = -1;
+			source->piped = 0;
+			source->splice = allowSplice && source->destinations.size () == 1 &&
+				CanSplice (source->port, source->destinations[0]->port) && pipe (source->pipe) == 0;
+			if (verbose)
 			{
-				cerr << "Failed to allocate memory for buffer." << endl;
-				exit (1);
+				cerr << source->name << ": " << (source->splice ? "splicing" : "copying") <<
+					" data." << endl;
 			}
 		}
-		else
-			buffer = NULL;
 
-		// Begin an infinite loop, checking each port for data and then sleeping a little while
-		while (true)
+		// Wait for data on the sources, and for space on destinations with data queued
+		PortSet set;
+		map<Port*, unsigned int> events;
+		for (unsigned int ii = 0; ii < sources.size (); ii++)
+			events[sources[ii]->port] = PortSet::READABLE;
+		for (unsigned int ii = 0; ii < destinations.size (); ii++)
 		{
-			int bytesWaiting = 0, bytesToRead = 0, bytesRead = 0, bytesWritten = 0;
+			if (events.find (destinations[ii]->port) == events.end ())
+				events[destinations[ii]->port] = 0;
+		}
+		for (map<Port*, unsigned int>::iterator ii = events.begin (); ii != events.end (); ii++)
+			set.Add (ii->first, ii->second);
 
-			// Check the left port for waiting data
-			if (verbose)
-				cerr << "Checking left port for data." << endl;
-			bytesWaiting = leftPort->BytesAvailableWait ();
-			if (bytesWaiting > 0)
+		vector<PortSet::Ready> ready;
+		Timestamp startTime = Timestamp::Now (Timestamp::MONOTONIC);
+		while (!quitRequested)
+		{
+			set.Wait (ready);
+			for (unsigned int ii = 0; ii < ready.size () && !quitRequested; ii++)
 			{
-				if (verbose)
-				{
-					cerr << "There are " << bytesWaiting << 
-						" bytes waiting on the left." << endl;
-				}
-				if (bufferSize == 0)
+				Port *port = ready[ii].port;
+				if (ready[ii].flags & PortSet::CLOSED)
 				{
-					// Allocate space
-					if ((buffer = reinterpret_cast<uint8_t*> (realloc (buffer,
-							sizeof (uint8_t) * bytesWaiting + 1))) == NULL)
+					if (port == leftPort || port == rightPort)
 					{
-						cerr << "Failed to reallocate memory for buffer." << endl;
-						exit (1);
+						if (verbose)
+							cerr << "The " << (port == leftPort ? "left" : "right") <<
+								" port has closed." << endl;
+						quitRequested = 1;
 					}
-					bytesToRead = bytesWaiting;
+					else
+					{
+						if (verbose)
+							cerr << "An extra port has closed, no longer using it." << endl;
+						events.erase (port);
+						RemovePort (port, sources, destinations, set);
+					}
+					continue;
 				}
-				else
-					bytesToRead = bufferSize;   // Read up to as much as we can fit
-				// Read data from the left
-				bytesRead = leftPort->Read (buffer, bytesToRead);
-				buffer[bytesRead] = '\0';
-				if (verbose)
-					cerr << "Read " << bytesRead << " bytes from the left: |" << buffer << "|." << endl;
-				if (bytesRead <= 0)
+				if (ready[ii].flags & (PortSet::READABLE | PortSet::HANGUP))
 				{
-					cerr << "Expected " << bytesToRead << 
-						" bytes from the left, didn't get any." << endl;
+					for (unsigned int jj = 0; jj < sources.size (); jj++)
+					{
+						if (sources[jj]->port == port)
+							ReadSource (*sources[jj], buffer, bufferSize, maxQueued, verbose);
+					}
 				}
-				else
+				if (ready[ii].flags & PortSet::WRITABLE)
 				{
-					// Write the data to the right port
-					bytesWritten = rightPort->WriteFull (buffer, bytesRead);
-					if (verbose)
-						cerr << "Wrote " << bytesWritten << " bytes to the right." << endl;
+					for (unsigned int jj = 0; jj < destinations.size (); jj++)
+					{
+						if (destinations[jj]->port != port)
+							continue;
+#if defined (SPLICE_F_MOVE)
+						if (destinations[jj]->piping != NULL)
+							DrainPipe (*destinations[jj]->piping, verbose);
+#endif
+						WriteQueue (*destinations[jj], verbose);
+					}
 				}
 			}
 
-			// Repeat the process with the right port
-			if (verbose)
-				cerr << "Checking right port for data." << endl;
-			bytesWaiting = rightPort->BytesAvailableWait ();
-			if (bytesWaiting > 0)
+			// Wait for data only on the sources whose lossless destinations have room and whose
+			// pipes are empty, and for space only on the destinations that have data queued or
+			// waiting in a pipe
+			map<Port*, unsigned int> newEvents;
+			for (unsigned int ii = 0; ii < sources.size (); ii++)
 			{
-				if (verbose)
-				{
-					cerr << "There are " << bytesWaiting << 
-						" bytes waiting on the right." << endl;
-				}
-				if (bufferSize == 0)
-				{
-					// Allocate space
-					if ((buffer = reinterpret_cast<uint8_t*> (realloc (buffer,
-							sizeof (uint8_t) * bytesWaiting + 1))) == NULL)
-					{
-						cerr << "Failed to reallocate memory for buffer." << endl;
-						exit (1);
-					}
-					bytesToRead = bytesWaiting;
-				}
-				else
-					bytesToRead = bufferSize;   // Read up to as much as we can fit
-				// Read data from the right
-				bytesRead = rightPort->Read (buffer, bytesToRead);
-				buffer[bytesRead] = '\0';
-				if (verbose)
-					cerr << "Read " << bytesRead << " bytes from the right: |" << buffer << "|." << endl;
-				if (bytesRead <= 0)
+				if (sources[ii]->port == NULL)
+					continue;
+				bool full = sources[ii]->piped > 0;
+				for (unsigned int jj = 0; jj < sources[ii]->destinations.size (); jj++)
 				{
-					cerr << "Expected " << bytesToRead << 
-						" bytes from the right, didn't get any." << endl;
+					Destination *dest = sources[ii]->destinations[jj];
+					if (!dest->lossy && dest->queued >= maxQueued)
+						full = true;
 				}
-				else
+				newEvents[sources[ii]->port] |= full ? 0 : PortSet::READABLE;
+			}
+			for (unsigned int ii = 0; ii < destinations.size (); ii++)
+			{
+				if (destinations[ii]->port == NULL)
+					continue;
+				newEvents[destinations[ii]->port] |=
+					(destinations[ii]->queued > 0 || destinations[ii]->piping != NULL) ?
+					PortSet::WRITABLE : 0;
+			}
+			for (map<Port*, unsigned int>::iterator jj = newEvents.begin ();
+					jj != newEvents.end (); jj++)
+			{
+				if (jj->second != events[jj->first])
 				{
-					// Write the data to the left port
-					bytesWritten = leftPort->WriteFull (buffer, bytesRead);
-					if (verbose)
-						cerr << "Wrote " << bytesWritten << " bytes to the left." << endl;
+					events[jj->first] = jj->second;
+					set.Modify (jj->first, jj->second);
 				}
 			}
 
-			// Sleep if set to do so
-			if (sleepTime > 0)
+			if (reportRequested)
 			{
-				if (verbose)
-					cerr << "Sleeping for " << sleepTime << " microseconds." << endl;
-				usleep (sleepTime);
+				PrintStatistics (sources, destinations, startTime);
+				reportRequested = 0;
 			}
 		}
 
-		free (buffer);
-		delete leftPort;
-		delete rightPort;
+		if (printStats)
+			PrintStatistics (sources, destinations, startTime);
 	}
 	catch (flexiport::PortException e)
 	{
 		cerr << "Caught exception: " << e.what () << endl;
 		return -1;
 	}
-	
+
+	for (unsigned int ii = 0; ii < sources.size (); ii++)
+	{
+		if (sources[ii]->pipe[0] >= 0)
+		{
+			close (sources[ii]->pipe[0]);
+			close (sources[ii]->pipe[1]);
+		}
+		if (sources[ii]->port != leftPort && sources[ii]->port != rightPort)
+			delete sources[ii]->port;
+		delete sources[ii];
+	}
+	for (unsigned int ii = 0; ii < destinations.size (); ii++)
+	{
+		if (destinations[ii]->port != leftPort && destinations[ii]->port != rightPort)
+			delete destinations[ii]->port;
+		delete destinations[ii];
+	}
+	free (buffer);
+	delete leftPort;
+	delete rightPort;
+
 	return 0;
 }
@@ -18,13 +18,16 @@
  */
 
 #include "hokuyo_aist.h"
+#include "scip_decode.h"
 using namespace hokuyo_aist;
 
 #include <flexiport/flexiport.h>
 #include <flexiport/port.h>
 #include <flexiport/serialport.h>
 
+#include <algorithm>
 #include <cstring>
+#include <vector>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -35,6 +38,10 @@ using namespace hokuyo_aist;
 using namespace std;
 using namespace flexiport;
 
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	#include <pthread.h>
+#endif
+
 #if defined (WIN32)
 	#define __func__    __FUNCTION__
 #endif
@@ -64,6 +71,10 @@ namespace hokuyo_aist
 const unsigned int SCIP1_LINE_LENGTH        = 66;
 // SCIP2: 67 bytes (64 bytes of data + checksum byte + line feed + NULL)
 const unsigned int SCIP2_LINE_LENGTH        = 67;
+// Data blocks are sent in lines of up to 64 bytes of data
+const unsigned int DATA_LINE_LENGTH         = 64;
+// Mx command parameters: Start(4) + End(4) + Cluster(2) + Interval(1) + Number(2)
+const unsigned int MX_PARAMS_LENGTH         = 13;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // SCIP protocol version 1 notes
@@ -398,27 +409,6 @@ string SCIP2ErrorToString (const char *error, const char *cmd)
 	return ss.str ();
 }
 
-unsigned int Decode2ByteValue (char *data)
-{
-	unsigned int byte1, byte2;
-
-	byte1 = data[0] - 0x30;
-	byte2 = data[1] - 0x30;
-
-	return (byte1 << 6) + (byte2);
-}
-
-unsigned int Decode3ByteValue (char *data)
-{
-	unsigned int byte1, byte2, byte3;
-
-	byte1 = data[0] - 0x30;
-	byte2 = data[1] - 0x30;
-	byte3 = data[2] - 0x30;
-
-	return (byte1 << 12) + (byte2 << 6) + (byte3);
-}
-
 unsigned int Decode4ByteValue (char *data)
 {
 	unsigned int byte1, byte2, byte3, byte4;
@@ -894,17 +884,58 @@ void HokuyoData::AllocateData (unsigned int length, bool includeIntensities)
 // Public API
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// State of continuous scanning, shared with the acquisition thread. Each scan is read into spare,
+// which is then swapped into the queue, so scans are never copied on their way to the caller.
+struct HokuyoLaser::ContinuousState
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t scanQueued;
+#endif
+	char command[3];
+	char params[MX_PARAMS_LENGTH + 1];
+	unsigned int numSteps;
+	HokuyoScanCallback callback;
+	void *userData;
+	vector<HokuyoData*> queue;      // Ring of scans waiting to be fetched
+	size_t first, count;
+	HokuyoData *spare;
+	unsigned int dropped;
+	bool running;
+	bool stopRequested;             // Set by StopContinuous; the thread then sends QT itself
+	// Why the acquisition thread stopped, if it failed
+	unsigned int errorCode;
+	string error;
+};
+
 HokuyoLaser::HokuyoLaser ()
 	: _port (NULL), _scipVersion (2), _verbose (false), _sensorIsUTM30LX (false),
 	_enableCheckSumWorkaround (false), _ignoreUnknowns (false), _minAngle (0.0), _maxAngle (0.0),
-	_resolution (0.0), _firstStep (0), _lastStep (0), _frontStep (0)
+	_resolution (0.0), _firstStep (0), _lastStep (0), _frontStep (0), _continuous (NULL),
+	_dataBuffer (NULL), _dataBufferSize (0)
 {
 }
 
 HokuyoLaser::~HokuyoLaser ()
 {
+	if (_continuous != NULL)
+	{
+		try
+		{
+			StopContinuous ();
+		}
+		catch (HokuyoError &e)
+		{
+		}
+		catch (PortException &e)
+		{
+		}
+	}
 	if (_port != NULL)
 		delete _port;
+	if (_dataBuffer != NULL)
+		delete[] _dataBuffer;
 }
 
 void HokuyoLaser::Open (string portOptions)
@@ -1023,6 +1054,8 @@ void HokuyoLaser::Close ()
 		throw HokuyoError (HOKUYO_ERR_CLOSE_FAILED, "Port is not open.");
 	if (_verbose)
 		cerr << "HokuyoLaser::" << __func__ << "() Closing connection." << endl;
+	if (_continuous != NULL)
+		StopContinuous ();
 	delete _port;
 	_port = NULL;
 }
@@ -1705,6 +1738,188 @@ unsigned int HokuyoLaser::GetNewRangesAndIntensitiesByAngle (HokuyoData *data, d
 	return GetNewRangesAndIntensities (data, startStep, endStep, clusterCount);
 }
 
+void HokuyoLaser::StartContinuous (int startStep, int endStep, unsigned int clusterCount,
+								unsigned int interval, bool intensities, unsigned int queueLength,
+								HokuyoScanCallback callback, void *userData)
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	if (_continuous != NULL)
+		throw HokuyoError (HOKUYO_ERR_BUSY, "Continuous scanning is already running.");
+	if (_scipVersion == 1)
+	{
+		throw HokuyoError (HOKUYO_ERR_UNSUPPORTED,
+				"SCIP version 1 does not support continuous scanning.");
+	}
+	else if (_scipVersion != 2)
+		throw HokuyoError (HOKUYO_ERR_SCIPVERSION, "Unknown SCIP version.");
+	if (clusterCount < 1 || clusterCount > 99)
+		throw HokuyoError (HOKUYO_ERR_BADARG, "Cluster count must be between 1 and 99.");
+	if (interval > 9)
+		throw HokuyoError (HOKUYO_ERR_BADARG, "Scan interval must be between 0 and 9.");
+	if (queueLength == 0 && callback == NULL)
+		throw HokuyoError (HOKUYO_ERR_BADARG, "No queue or callback for continuous scans.");
+	// The acquisition thread only sees a stop request between reads, so every read must end
+	Timeout timeout = _port->GetTimeout ();
+	if (timeout._sec < 0 || !_port->IsBlocking ())
+	{
+		throw HokuyoError (HOKUYO_ERR_BADARG,
+				"Continuous scanning needs a port with a finite, non-zero timeout.");
+	}
+
+	if (startStep < 0)
+		startStep = _firstStep;
+	if (endStep < 0)
+		endStep = _lastStep;
+
+	const char *command = intensities ? "ME" : "MD";
+	char buffer[MX_PARAMS_LENGTH + 1];
+	memset (buffer, 0, sizeof (buffer));
+	NumberToString (startStep, buffer, 4);
+	NumberToString (endStep, &buffer[4], 4);
+	NumberToString (clusterCount, &buffer[8], 2);
+	NumberToString (interval, &buffer[10], 1);
+	// A scan count of 0 means scan until told to stop
+	NumberToString (0, &buffer[11], 2);
+	unsigned int numSteps = (endStep - startStep + 1) / clusterCount;
+	if (_verbose)
+	{
+		cerr << "HokuyoLaser::" << __func__ << "() Starting continuous scanning of " << numSteps <<
+			" ranges between " << startStep << " and " << endStep << " with a cluster count of " <<
+			clusterCount << " and an interval of " << interval << endl;
+	}
+
+	// The scanner acknowledges the command (status 00), then sends each scan as it is taken
+	SendCommand (command, buffer, MX_PARAMS_LENGTH, NULL);
+	SkipLines (1); // End of the acknowledgement
+
+	ContinuousState *state = new ContinuousState;
+	memcpy (state->command, command, 3);
+	memcpy (state->params, buffer, sizeof (buffer));
+	state->numSteps = numSteps;
+	state->callback = callback;
+	state->userData = userData;
+	state->queue.resize (callback == NULL ? queueLength : 0, NULL);
+	for (size_t ii = 0; ii < state->queue.size (); ii++)
+		state->queue[ii] = new HokuyoData;
+	state->first = state->count = 0;
+	state->spare = new HokuyoData;
+	state->dropped = 0;
+	state->running = true;
+	state->stopRequested = false;
+	state->errorCode = HOKUYO_ERR_NODATA;
+	pthread_mutex_init (&state->mutex, NULL);
+	pthread_cond_init (&state->scanQueued, NULL);
+	_continuous = state;
+
+	if (pthread_create (&state->thread, NULL, ContinuousMain, this) != 0)
+	{
+		DeleteContinuousState ();
+		// Stop the scanner again
+		_port->Write ("QT\n", 3);
+		ClearReadBuffer ();
+		throw HokuyoError (HOKUYO_ERR_MEMORY, "Failed to start the acquisition thread.");
+	}
+#else
+	throw HokuyoError (HOKUYO_ERR_UNSUPPORTED,
+			"Continuous scanning is not supported without thread support.");
+#endif
+}
+
+void HokuyoLaser::StopContinuous ()
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	if (_continuous == NULL)
+		return;
+	if (_verbose)
+		cerr << "HokuyoLaser::" << __func__ << "() Stopping continuous scanning." << endl;
+
+	// The acquisition thread owns the port, so it sends QT and reads the reply itself. Each of its
+	// reads ends within the port's timeout, so the join can't wait forever.
+	pthread_mutex_lock (&_continuous->mutex);
+	_continuous->stopRequested = true;
+	pthread_mutex_unlock (&_continuous->mutex);
+	pthread_join (_continuous->thread, NULL);
+
+	// If the thread stopped because of an error, the scanner may still be sending scans. The
+	// thread is gone, so it is now safe to stop the scanner from here and clear them out.
+	bool failed = !_continuous->error.empty ();
+	DeleteContinuousState ();
+	if (failed)
+	{
+		try
+		{
+			_port->Write ("QT\n", 3);
+		}
+		catch (PortException &e)
+		{
+		}
+		ClearReadBuffer ();
+	}
+#endif
+}
+
+bool HokuyoLaser::IsContinuous () const
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	if (_continuous == NULL)
+		return false;
+	pthread_mutex_lock (&_continuous->mutex);
+	bool running = _continuous->running;
+	pthread_mutex_unlock (&_continuous->mutex);
+	return running;
+#else
+	return false;
+#endif
+}
+
+unsigned int HokuyoLaser::GetContinuousRanges (HokuyoData *data)
+{
+	if (data == NULL)
+		throw HokuyoError (HOKUYO_ERR_NODESTINATION, "No data destination provided.");
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	if (_continuous == NULL)
+		throw HokuyoError (HOKUYO_ERR_NODATA, "Continuous scanning is not running.");
+	ContinuousState &state = *_continuous;
+	if (state.callback != NULL)
+		throw HokuyoError (HOKUYO_ERR_BADARG, "Continuous scans are being given to a callback.");
+
+	pthread_mutex_lock (&state.mutex);
+	while (state.count == 0 && state.running)
+		pthread_cond_wait (&state.scanQueued, &state.mutex);
+	if (state.count == 0)
+	{
+		HokuyoError error (state.errorCode,
+				state.error.empty () ? "Continuous scanning has stopped." : state.error);
+		pthread_mutex_unlock (&state.mutex);
+		throw error;
+	}
+	// The caller's data takes the scan's place in the queue, to be reused for a later scan
+	SwapData (*data, *state.queue[state.first]);
+	state.first = (state.first + 1) % state.queue.size ();
+	state.count--;
+	pthread_mutex_unlock (&state.mutex);
+
+	return data->_length;
+#else
+	throw HokuyoError (HOKUYO_ERR_UNSUPPORTED,
+			"Continuous scanning is not supported without thread support.");
+#endif
+}
+
+unsigned int HokuyoLaser::GetDroppedScans () const
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	if (_continuous == NULL)
+		return 0;
+	pthread_mutex_lock (&_continuous->mutex);
+	unsigned int dropped = _continuous->dropped;
+	pthread_mutex_unlock (&_continuous->mutex);
+	return dropped;
+#else
+	return 0;
+#endif
+}
+
 double HokuyoLaser::StepToAngle (unsigned int step)
 {
 	return (static_cast<int> (step) - static_cast<int> (_frontStep)) * _resolution;
@@ -1909,6 +2124,13 @@ int HokuyoLaser::SendCommand (const char *cmd, const char *param,
 	int statusCode = -1;
 	char response[17];
 
+	// The acquisition thread is reading everything the scanner sends
+	if (_continuous != NULL)
+	{
+		throw HokuyoError (HOKUYO_ERR_BUSY,
+				"Cannot send commands while continuous scanning is running.");
+	}
+
 	// Flush first to clear out the dregs of any previous commands
 	_port->Flush ();
 
@@ -2333,6 +2555,65 @@ void HokuyoLaser::ProcessIILine (const char *buffer, HokuyoSensorInfo *info)
 	}
 }
 
+// Reads a block of encoded data of the given length. The data is sent in lines of up to 64 bytes,
+// each followed by a checksum (SCIP2 only) and a line feed, and ends with an empty line. Because
+// the size of the block is known, it is read from the port all at once rather than a line at a
+// time. The checksums are then checked while the data is copied out of the lines into
+// _dataBuffer, which is returned.
+char* HokuyoLaser::ReadDataBlock (unsigned int numBytes)
+{
+	unsigned int checkSumLength = (_scipVersion == 1) ? 0 : 1;
+	unsigned int numLines = (numBytes + DATA_LINE_LENGTH - 1) / DATA_LINE_LENGTH;
+	unsigned int blockSize = numBytes + numLines * (checkSumLength + 1) + 1;
+	if (_verbose)
+	{
+		cerr << "HokuyoLaser::" << __func__ << "() Reading " << numBytes << " bytes of data in " <<
+			numLines << " lines (" << blockSize << " bytes)." << endl;
+	}
+
+	const uint8_t *block = NULL;
+	ssize_t numRead = _port->ReadExactView (block, blockSize);
+	if (numRead < 0)
+		throw HokuyoError (HOKUYO_ERR_READ, "Timed out trying to read a data block.");
+	else if (numRead == 0)
+		throw HokuyoError (HOKUYO_ERR_READ, "No data received when trying to read a data block.");
+
+	if (_dataBufferSize < numBytes)
+	{
+		if (_dataBuffer != NULL)
+			delete[] _dataBuffer;
+		_dataBuffer = NULL;
+		_dataBufferSize = 0;
+		_dataBuffer = new char[numBytes];
+		_dataBufferSize = numBytes;
+	}
+
+	const char *line = reinterpret_cast<const char*> (block);
+	for (unsigned int ii = 0; ii < numBytes; ii += DATA_LINE_LENGTH)
+	{
+		unsigned int lineLength = min (DATA_LINE_LENGTH, numBytes - ii);
+		// A line feed anywhere else means the scanner sent a different amount of data than the
+		// number of readings asked for would need
+		if (line[lineLength + checkSumLength] != '\n' ||
+			memchr (line, '\n', lineLength + checkSumLength) != NULL)
+		{
+			throw HokuyoError (HOKUYO_ERR_PROTOCOL,
+				"Data block does not contain the number of readings asked for.");
+		}
+		if (checkSumLength != 0)
+			ConfirmCheckSum (line, lineLength, static_cast<int> (line[lineLength]));
+		memcpy (&_dataBuffer[ii], line, lineLength);
+		line += lineLength + checkSumLength + 1;
+	}
+	if (*line != '\n')
+	{
+		throw HokuyoError (HOKUYO_ERR_PROTOCOL,
+			"Data block contains more readings than were asked for.");
+	}
+
+	return _dataBuffer;
+}
+
 void HokuyoLaser::Read2ByteRangeData (HokuyoData *data, unsigned int numSteps)
 {
 	if (_verbose)
@@ -2343,36 +2624,16 @@ void HokuyoLaser::Read2ByteRangeData (HokuyoData *data, unsigned int numSteps)
 	data->_sensorIsUTM30LX = _sensorIsUTM30LX;
 	data->_error = false;
 
-	// 2 byte data is easy since it fits neatly in a 64-byte block
-	char buffer[SCIP2_LINE_LENGTH];
-	unsigned int currentStep = 0;
-	int numBytesInLine = 0;
-	while (true)
-	{
-		// Read a line of data
-		numBytesInLine = ReadLineWithCheck (buffer);
-		// Check if we've reached the end of the data
-		if (numBytesInLine == 0)
-			break;
-		// Process pairs of bytes until we encounter the end of the line
-		for (int ii = 0; ii < numBytesInLine; ii += 2, currentStep++)
-		{
-			if (buffer[ii] == '\n' || buffer[ii + 1] == '\n')
-			{
-				// Line feed in the middle of a data block? Why?
-				throw HokuyoError (HOKUYO_ERR_PROTOCOL, "Found line feed in a data block.");
-			}
-			data->_ranges[currentStep] = Decode2ByteValue (&buffer[ii]);
-			if (data->_ranges[currentStep] < 20)
-				data->_error = true;
-		}
-		// End of this line. Go around again.
+	char *buffer = ReadDataBlock (numSteps * 2);
+	GetSCIPDecoder ().Decode2Byte (buffer, numSteps, data->_ranges);
+	for (unsigned int ii = 0; ii < numSteps; ii++)
+	{
+		if (data->_ranges[ii] < 20)
+			data->_error = true;
 	}
 
 	if (_verbose)
-		cerr << "HokuyoLaser::" << __func__ << "() Read " << currentStep << " ranges." << endl;
-	if (currentStep != numSteps)
-		throw HokuyoError (HOKUYO_ERR_PROTOCOL, "Read less range readings than were asked for.");
+		cerr << "HokuyoLaser::" << __func__ << "() Read " << numSteps << " ranges." << endl;
 }
 
 void HokuyoLaser::Read3ByteRangeData (HokuyoData *data, unsigned int numSteps)
@@ -2385,83 +2646,23 @@ void HokuyoLaser::Read3ByteRangeData (HokuyoData *data, unsigned int numSteps)
 	data->_sensorIsUTM30LX = _sensorIsUTM30LX;
 	data->_error = false;
 
-	// 3 byte data is a pain because it crosses the line boundary, it may overlap by 0, 1 or 2 bytes
-	char buffer[SCIP2_LINE_LENGTH];
-	unsigned int currentStep = 0;
-	int numBytesInLine = 0, splitCount = 0;
-	char splitValue[3];
-	while (true)
-	{
-		// Read a line of data
-		numBytesInLine = ReadLineWithCheck (buffer);
-		// Check if we've reached the end of the data
-		if (numBytesInLine == 0)
-			break;
-		// Process triplets of bytes until we encounter or overrun the end of the line
-		for (int ii = 0; ii < numBytesInLine;)
-		{
-			if (buffer[ii] == '\n' || buffer[ii + 1] == '\n')
-			{
-				// Line feed in the middle of a line? Why?
-				throw HokuyoError (HOKUYO_ERR_PROTOCOL, "Found line feed in a data block.");
-			}
-			if (ii == numBytesInLine - 2)       // Short 1 byte
-			{
-				splitValue[0] = buffer[ii];
-				splitValue[1] = buffer[ii + 1];
-				splitCount = 1;     // Will be reset on the next iteration, after it's used
-				ii += 2;
-			}
-			else if (ii == numBytesInLine - 1)  // Short 2 bytes
-			{
-				splitValue[0] = buffer[ii];
-				splitCount = 2;     // Will be reset on the next iteration, after it's used
-				ii += 1;
-			}
-			else
-			{
-				if (splitCount == 1)
-				{
-					splitValue[2] = buffer[ii++];
-					data->_ranges[currentStep] = Decode3ByteValue (splitValue);
-				}
-				else if (splitCount == 2)
-				{
-					splitValue[1] = buffer[ii++];
-					splitValue[2] = buffer[ii++];
-					data->_ranges[currentStep] = Decode3ByteValue (splitValue);
-				}
-				else
-				{
-					data->_ranges[currentStep] = Decode3ByteValue (&buffer[ii]);
-					ii += 3;
-				}
-				if (data->_ranges[currentStep] > _maxRange)
-				{
-					cerr << "WARNING: HokuyoLaser::" << __func__ <<
-						"() Value at step " << currentStep << " beyond maximum range: " <<
-						data->_ranges[currentStep] << " (raw bytes: ";
-					if (splitCount != 0)
-						cerr << splitValue[0] << splitValue[1] << splitValue[2] << ")" << endl;
-					else
-						cerr << buffer[0] << buffer[1] << buffer[2] << ")" << endl;
-				}
-				else if (data->_ranges[currentStep] < 20)
-					data->_error = true;
-				currentStep++;
-				splitCount = 0;     // Reset this here now that it's been used
-			}
+	// With the line breaks removed, values that crossed a line boundary are in one piece
+	char *buffer = ReadDataBlock (numSteps * 3);
+	GetSCIPDecoder ().Decode3Byte (buffer, numSteps, data->_ranges);
+	for (unsigned int ii = 0; ii < numSteps; ii++)
+	{
+		if (data->_ranges[ii] > _maxRange)
+		{
+			cerr << "WARNING: HokuyoLaser::" << __func__ << "() Value at step " << ii <<
+				" beyond maximum range: " << data->_ranges[ii] << " (raw bytes: " <<
+				buffer[ii * 3] << buffer[ii * 3 + 1] << buffer[ii * 3 + 2] << ")" << endl;
 		}
-		// End of this line. Go around again.
+		else if (data->_ranges[ii] < 20)
+			data->_error = true;
 	}
 
 	if (_verbose)
-		cerr << "HokuyoLaser::" << __func__ << "() Read " << currentStep << " ranges." << endl;
-	if (currentStep != numSteps)
-	{
-		throw HokuyoError (HOKUYO_ERR_PROTOCOL,
-			"Read a different number of range readings than were asked for.");
-	}
+		cerr << "HokuyoLaser::" << __func__ << "() Read " << numSteps << " ranges." << endl;
 }
 
 void HokuyoLaser::Read3ByteRangeAndIntensityData (HokuyoData *data, unsigned int numSteps)
@@ -2475,113 +2676,192 @@ void HokuyoLaser::Read3ByteRangeAndIntensityData (HokuyoData *data, unsigned int
 	// This will automatically take care of whether it actually needs to (re)allocate or not.
 	data->AllocateData (numSteps, true);
 	data->_sensorIsUTM30LX = _sensorIsUTM30LX;
+	data->_error = false;
 
-	// 3 byte data is a pain because it crosses the line boundary, it may overlap by 0, 1 or 2 bytes
-	char buffer[SCIP2_LINE_LENGTH];
-	unsigned int currentRange = 0, currentIntensity = 0;
-	int numBytesInLine = 0, splitCount = 0;
-	char splitValue[3];
-	bool nextIsIntensity = false;
-	while (true)
-	{
-		// Read a line of data
-		numBytesInLine = ReadLineWithCheck (buffer);
-		// Check if we've reached the end of the data
-		if (numBytesInLine == 0)
-			break;
-		// Process triplets of bytes until we encounter or overrun the end of the line
-		for (int ii = 0; ii < numBytesInLine;)
-		{
-			if (buffer[ii] == '\n' || buffer[ii + 1] == '\n')
-			{
-				// Line feed in the middle of a line? Why?
-				throw HokuyoError (HOKUYO_ERR_PROTOCOL, "Found line feed in a data block.");
-			}
-			if (ii == numBytesInLine - 2)       // Short 1 byte
+	// Each step is a range value followed by an intensity value
+	char *buffer = ReadDataBlock (numSteps * 6);
+	GetSCIPDecoder ().Decode3BytePairs (buffer, numSteps, data->_ranges, data->_intensities);
+	for (unsigned int ii = 0; ii < numSteps; ii++)
+	{
+		if (data->_ranges[ii] > _maxRange)
+		{
+			cerr << "WARNING: HokuyoLaser::" << __func__ << "() Value at step " << ii <<
+				" beyond maximum range: " << data->_ranges[ii] << " (raw bytes: " <<
+				buffer[ii * 6] << buffer[ii * 6 + 1] << buffer[ii * 6 + 2] << ")" << endl;
+		}
+		else if (data->_ranges[ii] < 20)
+			data->_error = true;
+	}
+
+	if (_verbose)
+	{
+		cerr << "HokuyoLaser::" << __func__ << "() Read " << numSteps <<
+			" ranges and intensities." << endl;
+	}
+}
+
+void* HokuyoLaser::ContinuousMain (void *laser)
+{
+	reinterpret_cast<HokuyoLaser*> (laser)->RunContinuous ();
+	return NULL;
+}
+
+// Reads scans in continuous mode until the scanner is stopped or an error occurs.
+void HokuyoLaser::RunContinuous ()
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	ContinuousState &state = *_continuous;
+	unsigned int errorCode = 0;
+	string error;
+	bool stopSent = false;
+
+	try
+	{
+		while (true)
+		{
+			if (!stopSent)
 			{
-				splitValue[0] = buffer[ii];
-				splitValue[1] = buffer[ii + 1];
-				splitCount = 1;     // Will be reset on the next iteration, after it's used
-				ii += 2;
+				pthread_mutex_lock (&state.mutex);
+				stopSent = state.stopRequested;
+				pthread_mutex_unlock (&state.mutex);
+				if (stopSent)
+					_port->Write ("QT\n", 3);
 			}
-			else if (ii == numBytesInLine - 1)  // Short 2 bytes
+			if (!ReadContinuousScan (state.spare))
+				break;
+			// Scans already on their way when QT was sent are not passed on
+			if (stopSent)
+				continue;
+
+			if (state.callback != NULL)
 			{
-				splitValue[0] = buffer[ii];
-				splitCount = 2;     // Will be reset on the next iteration, after it's used
-				ii += 1;
+				state.callback (*state.spare, state.userData);
+				continue;
 			}
-			else
+
+			pthread_mutex_lock (&state.mutex);
+			if (state.count == state.queue.size ())
 			{
-				if (splitCount == 1)
-				{
-					splitValue[2] = buffer[ii++];
-					if (nextIsIntensity)
-						data->_intensities[currentIntensity] = Decode3ByteValue (splitValue);
-					else
-						data->_ranges[currentRange] = Decode3ByteValue (splitValue);
-				}
-				else if (splitCount == 2)
-				{
-					splitValue[1] = buffer[ii++];
-					splitValue[2] = buffer[ii++];
-					if (nextIsIntensity)
-						data->_intensities[currentIntensity] = Decode3ByteValue (splitValue);
-					else
-						data->_ranges[currentRange] = Decode3ByteValue (splitValue);
-				}
-				else
-				{
-					if (nextIsIntensity)
-						data->_intensities[currentIntensity] = Decode3ByteValue (&buffer[ii]);
-					else
-						data->_ranges[currentRange] = Decode3ByteValue (&buffer[ii]);
-					ii += 3;
-				}
-				if (data->_ranges[currentRange] > _maxRange && !nextIsIntensity)
-				{
-					cerr << "WARNING: HokuyoLaser::" << __func__ <<
-						"() Value at step " << currentRange << " beyond maximum range: " <<
-						data->_ranges[currentRange] << " (raw bytes: ";
-					if (splitCount != 0)
-						cerr << splitValue[0] << splitValue[1] << splitValue[2] << ")" << endl;
-					else
-						cerr << buffer[0] << buffer[1] << buffer[2] << ")" << endl;
-				}
-				else if (data->_ranges[currentRange] < 20)
-					data->_error = true;
-				if (nextIsIntensity)
-					currentIntensity++;
-				else
-					currentRange++;
-				splitCount = 0;     // Reset this here now that it's been used
-				nextIsIntensity = !nextIsIntensity; // Alternate between range and intensity values
+				// Drop the oldest scan; its space is used for the next one
+				state.first = (state.first + 1) % state.queue.size ();
+				state.count--;
+				state.dropped++;
 			}
+			swap (state.queue[(state.first + state.count) % state.queue.size ()], state.spare);
+			state.count++;
+			pthread_cond_signal (&state.scanQueued);
+			pthread_mutex_unlock (&state.mutex);
 		}
-		// End of this line. Go around again.
+	}
+	catch (HokuyoError &e)
+	{
+		errorCode = e.Code ();
+		error = e.what ();
+	}
+	catch (PortException &e)
+	{
+		errorCode = HOKUYO_ERR_READ;
+		error = e.what ();
+	}
+	catch (std::bad_alloc &e)
+	{
+		errorCode = HOKUYO_ERR_MEMORY;
+		error = "Failed to allocate memory for a scan.";
 	}
 
 	if (_verbose)
 	{
-		cerr << "HokuyoLaser::" << __func__ << "() Read " << currentRange << " ranges and "
-			<< currentIntensity << " intensities (expected " << numSteps << ")." << endl;
+		cerr << "HokuyoLaser::" << __func__ << "() Continuous scanning stopped" <<
+			(error.empty () ? "." : ": ") << error << endl;
 	}
-	if (currentRange != numSteps || currentIntensity != numSteps)
+	pthread_mutex_lock (&state.mutex);
+	state.running = false;
+	if (errorCode != 0)
+	{
+		state.errorCode = errorCode;
+		state.error = error;
+	}
+	pthread_cond_broadcast (&state.scanQueued);
+	pthread_mutex_unlock (&state.mutex);
+#endif
+}
+
+// Reads one scan sent in continuous mode. Returns false if the reply to QT was read instead, which
+// means the scanner has stopped sending scans.
+bool HokuyoLaser::ReadContinuousScan (HokuyoData *data)
+{
+	const ContinuousState &state = *_continuous;
+	char buffer[SCIP2_LINE_LENGTH];
+
+	ReadLine (buffer);
+	if (buffer[0] == 'Q' && buffer[1] == 'T')
+	{
+		// Status line and end of message
+		ReadLineWithCheck (buffer, 4);
+		SkipLines (1);
+		return false;
+	}
+	// Each scan is prefixed with the command echo. The number of scans remaining stays at 0.
+	if (buffer[0] != state.command[0] || buffer[1] != state.command[1])
+	{
+		stringstream ss;
+		ss << "Incorrect data prefix: " << state.command << " != " << buffer[0] << buffer[1];
+		throw HokuyoError (HOKUYO_ERR_PROTOCOL, ss.str ());
+	}
+	if (memcmp (&buffer[2], state.params, MX_PARAMS_LENGTH) != 0)
 	{
 		throw HokuyoError (HOKUYO_ERR_PROTOCOL,
-			"Read a different number of range or intensity readings than were asked for.");
+				string ("Incorrect paramaters prefix for ") + state.command + " data.");
+	}
+	// The status should be 99
+	ReadLineWithCheck (buffer, 4);
+	if (buffer[0] != '9' || buffer[1] != '9')
+	{
+		// There is an extra line feed after an error status (signalling end of message)
+		SkipLines (1);
+		stringstream ss;
+		ss << "Bad status for " << state.command << " data: " << buffer[0] << buffer[1] << " " <<
+			SCIP2ErrorToString (buffer, state.command);
+		throw HokuyoError (HOKUYO_ERR_PROTOCOL, ss.str ());
 	}
+
+	if (ReadLineWithCheck (buffer) == 0)
+		throw HokuyoError (HOKUYO_ERR_NODATA, "No data received. Check data error code.");
+	data->_time = Decode4ByteValue (buffer);
+	if (state.command[1] == 'E')
+		Read3ByteRangeAndIntensityData (data, state.numSteps);
+	else
+		Read3ByteRangeData (data, state.numSteps);
+	return true;
+}
+
+void HokuyoLaser::DeleteContinuousState ()
+{
+#if defined (HOKUYO_AIST_HAVE_PTHREADS)
+	pthread_mutex_destroy (&_continuous->mutex);
+	pthread_cond_destroy (&_continuous->scanQueued);
+#endif
+	for (size_t ii = 0; ii < _continuous->queue.size (); ii++)
+		delete _continuous->queue[ii];
+	delete _continuous->spare;
+	delete _continuous;
+	_continuous = NULL;
+}
+
+void HokuyoLaser::SwapData (HokuyoData &first, HokuyoData &second)
+{
+	swap (first._ranges, second._ranges);
+	swap (first._intensities, second._intensities);
+	swap (first._length, second._length);
+	swap (first._error, second._error);
+	swap (first._time, second._time);
+	swap (first._sensorIsUTM30LX, second._sensorIsUTM30LX);
 }
 
 int HokuyoLaser::ConfirmCheckSum (const char *buffer, int length, int expectedSum)
 {
-	int checkSum = 0;
-	// Start by adding the byte values
-	for (int ii = 0; ii < length; ii++)
-		checkSum += buffer[ii];
-	// Take the lowest 6 bits
-	checkSum &= 0x3F;
-	// Add 0x30
-	checkSum += 0x30;
+	// The lowest 6 bits of the sum of the bytes, plus 0x30
+	int checkSum = GetSCIPDecoder ().CheckSum (buffer, length);
 
 	if (_verbose)
 	{
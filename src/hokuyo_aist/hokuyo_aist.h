@@ -107,6 +107,8 @@ class HOKUYO_AIST_EXPORT HokuyoError : public std::exception
 #define HOKUYO_ERR_NODATA          13
 /// Not a serial connection error
 #define HOKUYO_ERR_NOTSERIAL       14
+/// Continuous scanning is running error
+#define HOKUYO_ERR_BUSY            15
 #else
 /// Read error while reading from the laser.
 const unsigned int HOKUYO_ERR_READ            = 1;
@@ -136,6 +138,8 @@ const unsigned int HOKUYO_ERR_BADARG          = 12;
 const unsigned int HOKUYO_ERR_NODATA          = 13;
 /// Not a serial connection error
 const unsigned int HOKUYO_ERR_NOTSERIAL       = 14;
+/// Continuous scanning is running error
+const unsigned int HOKUYO_ERR_BUSY            = 15;
 #endif // defined (WIN32)
 
 /** @brief Sensor information.
@@ -278,6 +282,15 @@ class HOKUYO_AIST_EXPORT HokuyoData
 		void AllocateData (unsigned int length, bool includeIntensities = false);
 };
 
+/** @brief Function called with each scan received in continuous scanning mode.
+
+It is called from the acquisition thread, which doesn't read the next scan until it returns. The
+data is only valid until it returns.
+
+@param data The scan.
+@param userData The pointer given to @ref HokuyoLaser::StartContinuous. */
+typedef void (*HokuyoScanCallback) (const HokuyoData &data, void *userData);
+
 /** @brief Hokuyo laser scanner class.
 
 Provides an interface for interacting with a Hokuyo laser scanner using SCIP protocol version 1
@@ -394,7 +407,7 @@ class HOKUYO_AIST_EXPORT HokuyoLaser
 		Not available with the SCIP v1 protocol.
 
 		@note The command used to retrieve a fresh scan is also used for the continuous scanning
-		mode (not yet supported by this library). After completing a scan, it will turn the laser
+		mode (see @ref StartContinuous). After completing a scan, it will turn the laser
 		off (in anticipation of another continuous scan command being sent, which will automatically
 		turn the laser back on again). If you want to mix @ref GetNewRanges and @ref GetRanges, you
 		will need to turn the laser on after each call to @ref GetNewRanges.
@@ -432,7 +445,7 @@ class HOKUYO_AIST_EXPORT HokuyoLaser
 		Not available with the SCIP v1 protocol.
 
 		@note The command used to retrieve a fresh scan is also used for the continuous scanning
-		mode (not yet supported by this library). After completing a scan, it will turn the laser
+		mode (see @ref StartContinuous). After completing a scan, it will turn the laser
 		off (in anticipation of another continuous scan command being sent, which will automatically
 		turn the laser back on again). If you want to mix @ref GetNewRanges and @ref GetRanges, you
 		will need to turn the laser on after each call to @ref GetNewRanges.
@@ -461,6 +474,58 @@ class HOKUYO_AIST_EXPORT HokuyoLaser
 		unsigned int GetNewRangesAndIntensitiesByAngle (HokuyoData *data, double startAngle,
 												double endAngle, unsigned int clusterCount = 1);
 
+		/** @brief Start continuous scanning.
+
+		The scanner sends every scan it takes (or one in every interval + 1) until
+		@ref StopContinuous is called, rather than waiting for a command for each. The scans are
+		read and decoded by a background thread. If a callback is given, it is called with each
+		scan. Otherwise the scans are queued until fetched with @ref GetContinuousRanges; when the
+		queue is full, the oldest scan in it is dropped.
+
+		While continuous scanning is running, other commands fail with HOKUYO_ERR_BUSY. The port's
+		timeout must be finite and not zero (HOKUYO_ERR_BADARG is thrown otherwise), so that
+		@ref StopContinuous can't wait forever. It must also be longer than the time between
+		scans, or the acquisition thread will stop with a read error.
+
+		Not available with the SCIP v1 protocol, or if the library was built without threads.
+
+		@param startStep The first step to get ranges from. Set to -1 for the first scannable step.
+		@param endStep The last step to get ranges from. Set to -1 for the last scannable step.
+		@param clusterCount The number of readings to cluster together into a single reading. The
+		minimum value from a cluster is returned as the range for that cluster.
+		@param interval The number of scans to skip after each scan sent (0 to 9).
+		@param intensities Get intensity data as well as ranges.
+		@param queueLength The number of scans to hold for @ref GetContinuousRanges.
+		@param callback Function to call with each scan instead of queueing it.
+		@param userData Pointer passed to the callback. */
+		void StartContinuous (int startStep = -1, int endStep = -1, unsigned int clusterCount = 1,
+							unsigned int interval = 0, bool intensities = false,
+							unsigned int queueLength = 10, HokuyoScanCallback callback = NULL,
+							void *userData = NULL);
+
+		/** @brief Stop continuous scanning.
+
+		The acquisition thread sends the stop command and reads the reply, and this waits for it
+		to finish; if the scanner has gone quiet, that takes up to the port's timeout. As with
+		@ref GetNewRanges, this leaves the laser turned off. */
+		void StopContinuous ();
+
+		/// @brief Checks if continuous scanning is running.
+		bool IsContinuous () const;
+
+		/** @brief Get the oldest queued scan from continuous scanning.
+
+		Waits for a scan if none are queued. If the acquisition thread has stopped because of an
+		error, that error is thrown once the queue is empty.
+
+		@param data Pointer to a @ref HokuyoData object to store the range readings in. Its space
+		is reused for later scans, as with @ref GetRanges.
+		@return The number of range readings read into @ref data. */
+		unsigned int GetContinuousRanges (HokuyoData *data);
+
+		/// @brief Get the number of scans dropped from the continuous scanning queue.
+		unsigned int GetDroppedScans () const;
+
 		/// @brief Return the major version of the SCIP protocol in use.
 		uint8_t SCIPVersion () const            { return _scipVersion; }
 
@@ -485,6 +550,12 @@ class HOKUYO_AIST_EXPORT HokuyoLaser
 		double _minAngle, _maxAngle, _resolution;
 		int _firstStep, _lastStep, _frontStep;
 		unsigned int _maxRange;
+		// Continuous scanning, including the acquisition thread
+		struct ContinuousState;
+		ContinuousState *_continuous;
+		// Encoded range data, with the checksums and line feeds removed
+		char *_dataBuffer;
+		unsigned int _dataBufferSize;
 
 		void ClearReadBuffer ();
 		int ReadLine (char *buffer, int expectedLength = -1);
@@ -497,10 +568,17 @@ class HOKUYO_AIST_EXPORT HokuyoLaser
 		void ProcessVVLine (const char *buffer, HokuyoSensorInfo *info);
 		void ProcessPPLine (const char *buffer, HokuyoSensorInfo *info);
 		void ProcessIILine (const char *buffer, HokuyoSensorInfo *info);
+		char* ReadDataBlock (unsigned int numBytes);
 		void Read2ByteRangeData (HokuyoData *data, unsigned int numSteps);
 		void Read3ByteRangeData (HokuyoData *data, unsigned int numSteps);
 		void Read3ByteRangeAndIntensityData (HokuyoData *data, unsigned int numSteps);
 
+		static void* ContinuousMain (void *laser);
+		void RunContinuous ();
+		bool ReadContinuousScan (HokuyoData *data);
+		void DeleteContinuousState ();
+		static void SwapData (HokuyoData &first, HokuyoData &second);
+
 		int ConfirmCheckSum (const char *buffer, int length, int expectedSum);
 };
 
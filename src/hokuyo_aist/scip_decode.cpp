@@ -0,0 +1,315 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * hokuyo_aist Hokuyo laser scanner driver.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H22PRO-1086.
+ *
+ * This file is part of hokuyo_aist.
+ *
+ * This software is licensed under the Eclipse Public License -v 1.0 (EPL). See
+ * http://www.opensource.org/licenses/eclipse-1.0.txt
+ */
+
+#include "scip_decode.h"
+
+#if defined (HOKUYO_AIST_HAVE_X86_SIMD)
+	#include <immintrin.h>
+	// Each function is compiled for its own instruction set, and only called if the CPU has it
+	#define SCIP_TARGET(isa)     __attribute__ ((target (isa)))
+#endif
+
+namespace hokuyo_aist
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Portable decoder
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Only the lowest 6 bits of the sum are used, so it does not matter if char is signed
+static inline unsigned int AddBytes (const char *data, unsigned int length)
+{
+	unsigned int sum = 0;
+	for (unsigned int ii = 0; ii < length; ii++)
+		sum += data[ii];
+	return sum;
+}
+
+static inline uint32_t Decode3Chars (const char *data)
+{
+	uint32_t byte1 = data[0] - 0x30, byte2 = data[1] - 0x30, byte3 = data[2] - 0x30;
+	return (byte1 << 12) + (byte2 << 6) + byte3;
+}
+
+static unsigned int CheckSumPortable (const char *data, unsigned int length)
+{
+	return (AddBytes (data, length) & 0x3F) + 0x30;
+}
+
+static void Decode2BytePortable (const char *data, unsigned int count, uint32_t *values)
+{
+	for (unsigned int ii = 0; ii < count; ii++, data += 2)
+	{
+		uint32_t byte1 = data[0] - 0x30, byte2 = data[1] - 0x30;
+		values[ii] = (byte1 << 6) + byte2;
+	}
+}
+
+static void Decode3BytePortable (const char *data, unsigned int count, uint32_t *values)
+{
+	for (unsigned int ii = 0; ii < count; ii++, data += 3)
+		values[ii] = Decode3Chars (data);
+}
+
+static void Decode3BytePairsPortable (const char *data, unsigned int count, uint32_t *first,
+		uint32_t *second)
+{
+	for (unsigned int ii = 0; ii < count; ii++, data += 6)
+	{
+		first[ii] = Decode3Chars (data);
+		second[ii] = Decode3Chars (&data[3]);
+	}
+}
+
+#if defined (HOKUYO_AIST_HAVE_X86_SIMD)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// SSE2 and SSSE3 decoders
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The checksum uses psadbw, which adds each group of 8 bytes into a 64-bit lane.
+SCIP_TARGET ("sse2")
+static unsigned int CheckSumSSE2 (const char *data, unsigned int length)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i sums = zero;
+	unsigned int ii = 0;
+	for (; ii + 16 <= length; ii += 16)
+	{
+		__m128i chars = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (&data[ii]));
+		sums = _mm_add_epi64 (sums, _mm_sad_epu8 (chars, zero));
+	}
+	unsigned int sum = _mm_cvtsi128_si32 (sums) + _mm_cvtsi128_si32 (_mm_srli_si128 (sums, 8));
+	return ((sum + AddBytes (&data[ii], length - ii)) & 0x3F) + 0x30;
+}
+
+// A 2-character value fits in a 16-bit lane, with its first character in the low byte.
+SCIP_TARGET ("sse2")
+static void Decode2ByteSSE2 (const char *data, unsigned int count, uint32_t *values)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i offset = _mm_set1_epi8 (0x30);
+	const __m128i lowByte = _mm_set1_epi16 (0x00FF);
+	unsigned int ii = 0;
+	for (; ii + 8 <= count; ii += 8)
+	{
+		__m128i chars = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (&data[ii * 2]));
+		chars = _mm_sub_epi8 (chars, offset);
+		__m128i decoded = _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (chars, lowByte), 6),
+				_mm_srli_epi16 (chars, 8));
+		_mm_storeu_si128 (reinterpret_cast<__m128i*> (&values[ii]),
+				_mm_unpacklo_epi16 (decoded, zero));
+		_mm_storeu_si128 (reinterpret_cast<__m128i*> (&values[ii + 4]),
+				_mm_unpackhi_epi16 (decoded, zero));
+	}
+	Decode2BytePortable (&data[ii * 2], count - ii, &values[ii]);
+}
+
+// Spreading 3-character values into 32-bit lanes needs pshufb, which arrived with SSSE3. Each
+// lane gets its value's characters in reverse order, so the last character is in the low byte.
+// 16 bytes are loaded for every 12 used, so the loops stop while there are at least 4 to spare.
+SCIP_TARGET ("ssse3")
+static __m128i Decode3ByteLanesSSSE3 (const char *data)
+{
+	const __m128i offset = _mm_set1_epi8 (0x30);
+	const __m128i spread = _mm_setr_epi8 (2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m128i byte0 = _mm_set1_epi32 (0x0000FF);
+	const __m128i byte1 = _mm_set1_epi32 (0x00FF00);
+	const __m128i byte2 = _mm_set1_epi32 (0xFF0000);
+
+	__m128i chars = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (data));
+	chars = _mm_shuffle_epi8 (_mm_sub_epi8 (chars, offset), spread);
+	// Close up the 2 unused bits above each 6-bit character
+	return _mm_or_si128 (_mm_and_si128 (chars, byte0),
+			_mm_or_si128 (_mm_srli_epi32 (_mm_and_si128 (chars, byte1), 2),
+				_mm_srli_epi32 (_mm_and_si128 (chars, byte2), 4)));
+}
+
+SCIP_TARGET ("ssse3")
+static void Decode3ByteSSSE3 (const char *data, unsigned int count, uint32_t *values)
+{
+	unsigned int ii = 0;
+	for (; (ii + 4) * 3 + 4 <= count * 3; ii += 4)
+	{
+		_mm_storeu_si128 (reinterpret_cast<__m128i*> (&values[ii]),
+				Decode3ByteLanesSSSE3 (&data[ii * 3]));
+	}
+	Decode3BytePortable (&data[ii * 3], count - ii, &values[ii]);
+}
+
+SCIP_TARGET ("ssse3")
+static void Decode3BytePairsSSSE3 (const char *data, unsigned int count, uint32_t *first,
+		uint32_t *second)
+{
+	unsigned int ii = 0;
+	for (; (ii + 2) * 6 + 4 <= count * 6; ii += 2)
+	{
+		// Put the two first values in the low half and the two second values in the high half
+		__m128i decoded = _mm_shuffle_epi32 (Decode3ByteLanesSSSE3 (&data[ii * 6]),
+				_MM_SHUFFLE (3, 1, 2, 0));
+		_mm_storel_epi64 (reinterpret_cast<__m128i*> (&first[ii]), decoded);
+		_mm_storel_epi64 (reinterpret_cast<__m128i*> (&second[ii]),
+				_mm_unpackhi_epi64 (decoded, decoded));
+	}
+	Decode3BytePairsPortable (&data[ii * 6], count - ii, &first[ii], &second[ii]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// AVX2 decoder
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+SCIP_TARGET ("avx2")
+static unsigned int CheckSumAVX2 (const char *data, unsigned int length)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	__m256i sums = zero;
+	unsigned int ii = 0;
+	for (; ii + 32 <= length; ii += 32)
+	{
+		__m256i chars = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (&data[ii]));
+		sums = _mm256_add_epi64 (sums, _mm256_sad_epu8 (chars, zero));
+	}
+	__m128i halves = _mm_add_epi64 (_mm256_castsi256_si128 (sums),
+			_mm256_extracti128_si256 (sums, 1));
+	unsigned int sum = _mm_cvtsi128_si32 (halves) + _mm_cvtsi128_si32 (_mm_srli_si128 (halves, 8));
+	return ((sum + AddBytes (&data[ii], length - ii)) & 0x3F) + 0x30;
+}
+
+SCIP_TARGET ("avx2")
+static void Decode2ByteAVX2 (const char *data, unsigned int count, uint32_t *values)
+{
+	const __m256i offset = _mm256_set1_epi8 (0x30);
+	const __m256i lowByte = _mm256_set1_epi16 (0x00FF);
+	unsigned int ii = 0;
+	for (; ii + 16 <= count; ii += 16)
+	{
+		__m256i chars = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (&data[ii * 2]));
+		chars = _mm256_sub_epi8 (chars, offset);
+		__m256i decoded = _mm256_or_si256 (
+				_mm256_slli_epi16 (_mm256_and_si256 (chars, lowByte), 6),
+				_mm256_srli_epi16 (chars, 8));
+		_mm256_storeu_si256 (reinterpret_cast<__m256i*> (&values[ii]),
+				_mm256_cvtepu16_epi32 (_mm256_castsi256_si128 (decoded)));
+		_mm256_storeu_si256 (reinterpret_cast<__m256i*> (&values[ii + 8]),
+				_mm256_cvtepu16_epi32 (_mm256_extracti128_si256 (decoded, 1)));
+	}
+	Decode2BytePortable (&data[ii * 2], count - ii, &values[ii]);
+}
+
+// As for SSSE3, but with 4 values in each 128-bit half. vpshufb does not cross between the
+// halves, so the high half is loaded separately, 12 bytes on from the low half.
+SCIP_TARGET ("avx2")
+static __m256i Decode3ByteLanesAVX2 (const char *data)
+{
+	const __m256i offset = _mm256_set1_epi8 (0x30);
+	const __m256i spread = _mm256_setr_epi8 (2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+			2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m256i byte0 = _mm256_set1_epi32 (0x0000FF);
+	const __m256i byte1 = _mm256_set1_epi32 (0x00FF00);
+	const __m256i byte2 = _mm256_set1_epi32 (0xFF0000);
+
+	__m256i chars = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+				_mm_loadu_si128 (reinterpret_cast<const __m128i*> (data))),
+			_mm_loadu_si128 (reinterpret_cast<const __m128i*> (&data[12])), 1);
+	chars = _mm256_shuffle_epi8 (_mm256_sub_epi8 (chars, offset), spread);
+	return _mm256_or_si256 (_mm256_and_si256 (chars, byte0),
+			_mm256_or_si256 (_mm256_srli_epi32 (_mm256_and_si256 (chars, byte1), 2),
+				_mm256_srli_epi32 (_mm256_and_si256 (chars, byte2), 4)));
+}
+
+SCIP_TARGET ("avx2")
+static void Decode3ByteAVX2 (const char *data, unsigned int count, uint32_t *values)
+{
+	unsigned int ii = 0;
+	for (; (ii + 8) * 3 + 4 <= count * 3; ii += 8)
+	{
+		_mm256_storeu_si256 (reinterpret_cast<__m256i*> (&values[ii]),
+				Decode3ByteLanesAVX2 (&data[ii * 3]));
+	}
+	Decode3ByteSSSE3 (&data[ii * 3], count - ii, &values[ii]);
+}
+
+SCIP_TARGET ("avx2")
+static void Decode3BytePairsAVX2 (const char *data, unsigned int count, uint32_t *first,
+		uint32_t *second)
+{
+	const __m256i separate = _mm256_setr_epi32 (0, 2, 4, 6, 1, 3, 5, 7);
+	unsigned int ii = 0;
+	for (; (ii + 4) * 6 + 4 <= count * 6; ii += 4)
+	{
+		__m256i decoded = _mm256_permutevar8x32_epi32 (Decode3ByteLanesAVX2 (&data[ii * 6]),
+				separate);
+		_mm_storeu_si128 (reinterpret_cast<__m128i*> (&first[ii]),
+				_mm256_castsi256_si128 (decoded));
+		_mm_storeu_si128 (reinterpret_cast<__m128i*> (&second[ii]),
+				_mm256_extracti128_si256 (decoded, 1));
+	}
+	Decode3BytePairsSSSE3 (&data[ii * 6], count - ii, &first[ii], &second[ii]);
+}
+
+#endif // defined (HOKUYO_AIST_HAVE_X86_SIMD)
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decoder selection
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Each decoder needs a CPU that supports all those before it
+static const SCIPDecoder DECODERS[] =
+{
+	{"portable", CheckSumPortable, Decode2BytePortable, Decode3BytePortable,
+		Decode3BytePairsPortable},
+#if defined (HOKUYO_AIST_HAVE_X86_SIMD)
+	// SSE2 alone cannot spread 3-character values, so that is left to the portable code
+	{"SSE2", CheckSumSSE2, Decode2ByteSSE2, Decode3BytePortable, Decode3BytePairsPortable},
+	{"SSSE3", CheckSumSSE2, Decode2ByteSSE2, Decode3ByteSSSE3, Decode3BytePairsSSSE3},
+	{"AVX2", CheckSumAVX2, Decode2ByteAVX2, Decode3ByteAVX2, Decode3BytePairsAVX2},
+#endif
+};
+
+static unsigned int CountSupportedDecoders ()
+{
+#if defined (HOKUYO_AIST_HAVE_X86_SIMD)
+	__builtin_cpu_init ();
+	if (!__builtin_cpu_supports ("sse2"))
+		return 1;
+	else if (!__builtin_cpu_supports ("ssse3"))
+		return 2;
+	else if (!__builtin_cpu_supports ("avx2"))
+		return 3;
+	return 4;
+#else
+	return 1;
+#endif
+}
+
+const SCIPDecoder* GetSCIPDecoders (unsigned int &count)
+{
+	static const unsigned int numSupported = CountSupportedDecoders ();
+	count = numSupported;
+	return DECODERS;
+}
+
+const SCIPDecoder& GetSCIPDecoder ()
+{
+	unsigned int count;
+	const SCIPDecoder *decoders = GetSCIPDecoders (count);
+	return decoders[count - 1];
+}
+
+} // namespace hokuyo_aist
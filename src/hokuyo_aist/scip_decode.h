@@ -0,0 +1,62 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * hokuyo_aist Hokuyo laser scanner driver.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H22PRO-1086.
+ *
+ * This file is part of hokuyo_aist.
+ *
+ * This software is licensed under the Eclipse Public License -v 1.0 (EPL). See
+ * http://www.opensource.org/licenses/eclipse-1.0.txt
+ */
+
+#ifndef __SCIP_DECODE_H
+#define __SCIP_DECODE_H
+
+#if defined (WIN32)
+	typedef unsigned int            uint32_t;
+#else
+	#include <stdint.h>
+#endif
+
+// Batch decoding of SCIP data. This header is internal to hokuyo_aist and is not installed.
+
+namespace hokuyo_aist
+{
+
+/* Kernels for decoding blocks of SCIP characters. Each character carries 6 bits, offset by 0x30.
+All implementations give the same results for valid characters (0x30 to 0x6F); what they give
+for other characters is undefined. */
+struct SCIPDecoder
+{
+	// Name of the instruction set used, for printing
+	const char *name;
+	// Calculates the SCIP checksum of length bytes: the lowest 6 bits of their sum, plus 0x30.
+	unsigned int (*CheckSum) (const char *data, unsigned int length);
+	// Decodes count 2-character values.
+	void (*Decode2Byte) (const char *data, unsigned int count, uint32_t *values);
+	// Decodes count 3-character values.
+	void (*Decode3Byte) (const char *data, unsigned int count, uint32_t *values);
+	// Decodes count pairs of 3-character values, such as a range followed by an intensity.
+	void (*Decode3BytePairs) (const char *data, unsigned int count, uint32_t *first,
+			uint32_t *second);
+};
+
+// Returns the fastest decoder the CPU supports. It is chosen the first time this is called.
+const SCIPDecoder& GetSCIPDecoder ();
+
+// Returns the decoders the CPU supports, with their number in count. The portable decoder is
+// first, followed by faster ones in order. Used for testing and benchmarking them against each
+// other.
+const SCIPDecoder* GetSCIPDecoders (unsigned int &count);
+
+} // namespace hokuyo_aist
+
+#endif // __SCIP_DECODE_H
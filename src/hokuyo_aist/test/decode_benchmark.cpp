@@ -0,0 +1,183 @@
+/*
+ * GearBox Project: Peer-Reviewed Open-Source Libraries for Robotics
+ *               http://gearbox.sf.net/
+ * Copyright (c) 2008 Geoffrey Biggs
+ *
+ * hokuyo_aist Hokuyo laser scanner driver.
+ *
+ * This distribution is licensed to you under the terms described in the LICENSE file included in
+ * this distribution.
+ *
+ * This work is a product of the National Institute of Advanced Industrial Science and Technology,
+ * Japan. Registration number: H22PRO-1086.
+ *
+ * This file is part of hokuyo_aist.
+ *
+ * This software is licensed under the Eclipse Public License -v 1.0 (EPL). See
+ * http://www.opensource.org/licenses/eclipse-1.0.txt
+ */
+
+// Times the SCIP data decoders against each other on a synthetic scan, and checks that they all
+// give the same results as the portable decoder.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "../scip_decode.h"
+using namespace hokuyo_aist;
+
+// Encodes a value as SCIP characters
+void EncodeValue (unsigned int value, unsigned int width, string &data)
+{
+	for (int ii = width - 1; ii >= 0; ii--)
+		data += static_cast<char> (((value >> (ii * 6)) & 0x3F) + 0x30);
+}
+
+// Splits data into lines with checksums, as the scanner sends it
+string MakeBlock (const string &data, const SCIPDecoder &decoder)
+{
+	string block;
+	for (size_t ii = 0; ii < data.size (); ii += 64)
+	{
+		string line = data.substr (ii, 64);
+		block += line;
+		block += static_cast<char> (decoder.CheckSum (line.data (), line.size ()));
+		block += '\n';
+	}
+	return block + '\n';
+}
+
+// Checks and joins the lines of a block, then decodes them, as HokuyoLaser does for each scan.
+// Returns false if a checksum is wrong.
+bool DecodeBlock (const SCIPDecoder &decoder, const string &block, unsigned int numSteps,
+		unsigned int width, bool intensities, char *joined, uint32_t *ranges,
+		uint32_t *others)
+{
+	unsigned int numBytes = numSteps * width * (intensities ? 2 : 1);
+	const char *line = block.data ();
+	for (unsigned int ii = 0; ii < numBytes; ii += 64)
+	{
+		unsigned int lineLength = numBytes - ii < 64 ? numBytes - ii : 64;
+		if (decoder.CheckSum (line, lineLength) != static_cast<unsigned int> (line[lineLength]))
+			return false;
+		memcpy (&joined[ii], line, lineLength);
+		line += lineLength + 2;
+	}
+
+	if (intensities)
+		decoder.Decode3BytePairs (joined, numSteps, ranges, others);
+	else if (width == 2)
+		decoder.Decode2Byte (joined, numSteps, ranges);
+	else
+		decoder.Decode3Byte (joined, numSteps, ranges);
+	return true;
+}
+
+double Now ()
+{
+	timeval now;
+	gettimeofday (&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+int main (int argc, char **argv)
+{
+	unsigned int numSteps = 1081, numScans = 20000, width = 3;
+	bool intensities = false;
+
+	int opt;
+	while ((opt = getopt (argc, argv, "2in:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case '2':
+				width = 2;
+				break;
+			case 'i':
+				intensities = true;
+				break;
+			case 'n':
+				sscanf (optarg, "%u", &numScans);
+				break;
+			case 's':
+				sscanf (optarg, "%u", &numSteps);
+				break;
+			case '?':
+			case 'h':
+			default:
+				cout << "Usage: " << argv[0] << " [options]" << endl << endl;
+				cout << "-2\t\tUse 2-byte (SCIP1) values instead of 3-byte values." << endl;
+				cout << "-i\t\tDecode intensities along with ranges." << endl;
+				cout << "-n scans\tNumber of scans to decode with each decoder." << endl;
+				cout << "-s steps\tNumber of steps in a scan (default is a UTM-30LX scan)." << endl;
+				return 1;
+		}
+	}
+	if (intensities && width == 2)
+	{
+		cerr << "Intensities are only sent as 3-byte values." << endl;
+		return 1;
+	}
+
+	unsigned int count;
+	const SCIPDecoder *decoders = GetSCIPDecoders (count);
+
+	// Ranges up to the largest value the encoding can carry, and intensities to go with them
+	string data;
+	srand (1);
+	for (unsigned int ii = 0; ii < numSteps; ii++)
+	{
+		EncodeValue (rand () % (1 << (width * 6)), width, data);
+		if (intensities)
+			EncodeValue (rand () % (1 << 18), 3, data);
+	}
+	string block = MakeBlock (data, decoders[0]);
+	cout << "Decoding " << numScans << " scans of " << numSteps << " steps (" << block.size () <<
+		" bytes each)." << endl;
+
+	vector<char> joined (data.size ());
+	vector<uint32_t> expectedRanges (numSteps), expectedOthers (numSteps);
+	vector<uint32_t> ranges (numSteps), others (numSteps);
+	DecodeBlock (decoders[0], block, numSteps, width, intensities, &joined[0],
+			&expectedRanges[0], &expectedOthers[0]);
+
+	double portableTime = 0.0;
+	int result = 0;
+	for (unsigned int ii = 0; ii < count; ii++)
+	{
+		const SCIPDecoder &decoder = decoders[ii];
+		ranges.assign (numSteps, 0);
+		others.assign (numSteps, 0);
+		if (!DecodeBlock (decoder, block, numSteps, width, intensities, &joined[0], &ranges[0],
+					&others[0]) ||
+			ranges != expectedRanges || (intensities && others != expectedOthers))
+		{
+			cout << decoder.name << ": results differ from the portable decoder." << endl;
+			result = 1;
+			continue;
+		}
+
+		double start = Now ();
+		for (unsigned int jj = 0; jj < numScans; jj++)
+		{
+			DecodeBlock (decoder, block, numSteps, width, intensities, &joined[0], &ranges[0],
+					&others[0]);
+		}
+		double time = Now () - start;
+		if (ii == 0)
+			portableTime = time;
+
+		printf ("%-10s %8.2f us/scan %8.1f MB/s %6.2fx\n", decoder.name,
+				time * 1000000.0 / numScans, block.size () * numScans / time / 1000000.0,
+				portableTime / time);
+	}
+
+	return result;
+}
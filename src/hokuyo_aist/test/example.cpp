@@ -22,6 +22,10 @@
 #include <iostream>
 using namespace std;
 
+#if !defined (WIN32)
+	#include <unistd.h>
+#endif
+
 #include <hokuyo_aist/hokuyo_aist.h>
 
 int main(int argc, char **argv)
@@ -29,7 +33,7 @@ int main(int argc, char **argv)
 	string portOptions = "type=serial,device=/dev/ttyACM0,timeout=1";
 	double startAngle = 0.0, endAngle = 0.0;
 	int firstStep = -1, lastStep = -1;
-	unsigned int baud = 19200, speed = 0, clusterCount = 1;
+	unsigned int baud = 19200, speed = 0, clusterCount = 1, numScans = 0;
 	bool getIntensities = false, getNew = false, verbose = false;
 
 #if defined (WIN32)
@@ -37,7 +41,7 @@ int main(int argc, char **argv)
 #else
 	int opt;
 	// Get some options from the command line
-	while ((opt = getopt(argc, argv, "b:c:e:f:il:m:no:s:vh")) != -1)
+	while ((opt = getopt(argc, argv, "b:c:e:f:il:m:no:s:t:vh")) != -1)
 	{
 		switch (opt)
 		{
@@ -71,6 +75,9 @@ int main(int argc, char **argv)
 			case 's':
 				sscanf (optarg, "%lf", &startAngle);
 				break;
+			case 't':
+				sscanf (optarg, "%d", &numScans);
+				break;
 			case 'v':
 				verbose = true;
 				break;
@@ -88,6 +95,7 @@ int main(int argc, char **argv)
 				cout << "-n\t\tGet new ranges instead of latest ranges." << endl;
 				cout << "-o options\tPort options (see flexiport library)." << endl;
 				cout << "-s angle\tStart angle to get ranges from." << endl;
+				cout << "-t scans\tGet this many scans using continuous scanning." << endl;
 				cout << "-v\t\tPut the hokuyo_aist library into verbose mode." << endl;
 				return 1;
 		}
@@ -132,7 +140,20 @@ int main(int argc, char **argv)
 
 		// Get range data
 		hokuyo_aist::HokuyoData data;
-		if ((firstStep == -1 && lastStep == -1) &&
+		if (numScans > 0)
+		{
+			// Let the laser send scans as it takes them
+			laser.StartContinuous (firstStep, lastStep, clusterCount, 0, getIntensities);
+			for (unsigned int ii = 0; ii < numScans; ii++)
+			{
+				laser.GetContinuousRanges (&data);
+				cout << "Scan " << ii << " at " << data.TimeStamp () << ": " << data.Length () <<
+					" ranges" << endl;
+			}
+			cout << "Dropped " << laser.GetDroppedScans () << " scans." << endl;
+			laser.StopContinuous ();
+		}
+		else if ((firstStep == -1 && lastStep == -1) &&
 			(startAngle == 0.0 && endAngle == 0.0))
 		{
 			// Get all ranges